@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include "formulaValue.h"
+
+enum class CellKind : unsigned char {
+    EMPTY,
+    NUMBER,
+    STRING,
+    BOOLEAN,
+    ERROR,
+    BLANK
+};
+
+// One cell as seen by the evaluator. Views point into the source and stay
+// valid until the next call on it.
+struct CellData {
+    CellKind kind = CellKind::EMPTY;
+    bool isFormula = false;
+    double number = 0.0;         // NUMBER, BOOLEAN (0/1), last calculated value of a formula
+    std::wstring_view text;      // STRING
+    ErrorCode error = ErrorCode::NA;     // ERROR
+};
+
+// Where the evaluator gets its cells from. Sheets are addressed by index,
+// rows and columns are 0-based.
+class CellSource {
+public:
+    virtual ~CellSource() {}
+
+    virtual int sheetCount() const = 0;
+
+    virtual std::string sheetName(int sheet) const = 0;
+
+    // Everything about a cell but its formula text, in one call
+    virtual bool readCell(int sheet, int row, int col, CellData& cell) = 0;
+
+    // Formula text (the leading = is optional), empty if the cell has none.
+    // The view may only last until the next call.
+    virtual std::wstring_view readFormula(int sheet, int row, int col) = 0;
+
+    // Half-open bounds of the cells in use; all 0 for an empty sheet
+    virtual void usedRange(int sheet, int& firstRow, int& lastRow, int& firstCol, int& lastCol) const = 0;
+
+    // Heap held by the source itself, 0 if it cannot tell
+    virtual size_t memoryBytes() const { return 0; }
+};
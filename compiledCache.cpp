@@ -0,0 +1,339 @@
+#include "stdafx.h"
+#include "compiledCache.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include "contentHash.h"
+#include "mappedFile.h"
+
+namespace {
+
+const char MAGIC[8] = { 'X', 'L', 'F', 'C', 'A', 'C', 'H', 'E' };
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;            // catches caches of other builds and byte orders
+    uint64_t contentHash;
+    uint64_t payloadSize;
+    uint64_t payloadHash;
+};
+
+uint32_t layoutTag() {
+    const uint32_t byteOrder = 0x01020304;
+    unsigned char first;
+    memcpy(&first, &byteOrder, 1);
+    return (uint32_t)first << 24 | (uint32_t)sizeof(Instruction) << 18 | (uint32_t)sizeof(CallArg) << 12 |
+        (uint32_t)sizeof(RangeRef) << 6 | (uint32_t)sizeof(CellKey);
+}
+
+class Writer {
+public:
+    template <typename T>
+    void put(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "raw copy");
+        bytes.append((const char*)&value, sizeof(value));
+    }
+
+    template <typename T>
+    void putArray(const std::vector<T>& values) {
+        static_assert(std::is_trivially_copyable<T>::value, "raw copy");
+        put((uint32_t)values.size());
+        bytes.append((const char*)values.data(), values.size() * sizeof(T));
+    }
+
+    void putString(const std::string& text) {
+        put((uint32_t)text.size());
+        bytes.append(text);
+    }
+
+    void putProgram(const Program& program) {
+        putArray(program.code);
+        putArray(program.constants);
+        putArray(program.cells);
+        putArray(program.ranges);
+        putArray(program.args);
+        putArray(program.cellAbsolute);
+        putArray(program.rangeAbsolute);
+        putArray(program.shared);
+        put((uint64_t)program.maxStack);
+    }
+
+    std::string bytes;
+};
+
+// Reads from the mapped payload; every read is bounds checked and a
+// failed one leaves ok false for good
+class Reader {
+public:
+    Reader(const unsigned char* data, size_t size) : data(data), size(size) {}
+
+    template <typename T>
+    void get(T& value) {
+        if (!take(sizeof(T))) return;
+        memcpy(&value, data + pos - sizeof(T), sizeof(T));
+    }
+
+    template <typename T>
+    void getArray(std::vector<T>& values) {
+        uint32_t count = 0;
+        get(count);
+        if (!ok || (uint64_t)count * sizeof(T) > size - pos) {
+            ok = false;
+            return;
+        }
+        values.resize(count);
+        if (count > 0) memcpy(values.data(), data + pos, count * sizeof(T));
+        pos += count * sizeof(T);
+    }
+
+    void getString(std::string& text) {
+        uint32_t length = 0;
+        get(length);
+        if (!ok || !take(length)) return;
+        text.assign((const char*)data + pos - length, length);
+    }
+
+    void getProgram(Program& program) {
+        getArray(program.code);
+        getArray(program.constants);
+        getArray(program.cells);
+        getArray(program.ranges);
+        getArray(program.args);
+        getArray(program.cellAbsolute);
+        getArray(program.rangeAbsolute);
+        getArray(program.shared);
+        uint64_t maxStack = 0;
+        get(maxStack);
+        program.maxStack = (size_t)maxStack;
+    }
+
+    // A count of items that each take at least minBytes; rejects counts
+    // the remaining bytes cannot hold before anything is allocated
+    uint32_t getCount(size_t minBytes) {
+        uint32_t count = 0;
+        get(count);
+        if (ok && (uint64_t)count * minBytes > size - pos) ok = false;
+        return ok ? count : 0;
+    }
+
+    bool done() const { return ok && pos == size; }
+
+    bool ok = true;
+
+private:
+    bool take(size_t bytes) {
+        if (!ok || bytes > size - pos) {
+            ok = false;
+            return false;
+        }
+        pos += bytes;
+        return true;
+    }
+
+    const unsigned char* data;
+    size_t size;
+    size_t pos = 0;
+};
+
+// Indexes taken from the file must stay inside what they index
+bool programInBounds(const Program& program, size_t sharedLimit) {
+    for (const Instruction& ins : program.code) {
+        switch (ins.op) {
+        case OpCode::PushConst:
+            if (ins.operand >= program.constants.size()) return false;
+            break;
+        case OpCode::LoadCell:
+            if (ins.operand >= program.cells.size()) return false;
+            break;
+        case OpCode::LoadShared:
+            if (ins.operand >= program.shared.size()) return false;
+            break;
+        case OpCode::Call:
+            if ((uint64_t)ins.operand + ins.argc > program.args.size()) return false;
+            break;
+        default:
+            break;
+        }
+    }
+    for (const CallArg& arg : program.args) {
+        if (arg.kind == CallArg::RANGE && arg.range >= program.ranges.size()) return false;
+    }
+    for (uint32_t id : program.shared) {
+        if (id >= sharedLimit) return false;
+    }
+    return program.cellAbsolute.size() == program.cells.size() &&
+        program.rangeAbsolute.size() == program.ranges.size();
+}
+
+}
+
+bool saveCompiledWorkbook(const std::string& path, uint64_t contentHash, const CompiledWorkbook& workbook) {
+    Writer payload;
+
+    payload.put((uint32_t)workbook.subexpressions.size());
+    for (const Program& program : workbook.subexpressions) {
+        payload.putProgram(program);
+    }
+
+    payload.put((uint32_t)workbook.formulas.size());
+    for (const auto& formula : workbook.formulas) {
+        payload.putString(formula->text);
+        payload.put((uint8_t)(formula->parsed ? 1 : 0));
+        payload.put((uint32_t)formula->errors.size());
+        for (const auto& error : formula->errors) {
+            payload.putString(error);
+        }
+        payload.putProgram(formula->program);
+    }
+
+    payload.put((uint32_t)workbook.cellFormulas.size());
+    for (const auto& entry : workbook.cellFormulas) {
+        payload.put(entry.first);
+        payload.put(entry.second);
+    }
+
+    payload.put((uint32_t)workbook.dependencies.size());
+    for (const auto& node : workbook.dependencies) {
+        payload.put(node.cell);
+        payload.putArray(node.cells);
+        payload.putArray(node.ranges);
+    }
+
+    payload.put((uint32_t)workbook.results.size());
+    for (const auto& entry : workbook.results) {
+        payload.put(entry.first);
+        payload.put(entry.second.raw());
+    }
+
+    Header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = COMPILED_CACHE_VERSION;
+    header.layout = layoutTag();
+    header.contentHash = contentHash;
+    header.payloadSize = payload.bytes.size();
+    ContentHasher hasher;
+    hasher.add(payload.bytes.data(), payload.bytes.size());
+    header.payloadHash = hasher.finish();
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out.write((const char*)&header, sizeof(header));
+        out.write(payload.bytes.data(), payload.bytes.size());
+        if (!out) {
+            out.close();
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+
+    // rename does not replace an existing file everywhere
+    std::remove(path.c_str());
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool loadCompiledWorkbook(const std::string& path, uint64_t contentHash, CompiledWorkbook& workbook,
+    std::string& reason) {
+    MappedFile file;
+    if (!file.open(path)) {
+        reason = "no cache file";
+        return false;
+    }
+
+    Header header;
+    if (file.size() < sizeof(header)) {
+        reason = "truncated header";
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        reason = "not a compiled workbook cache";
+        return false;
+    }
+    if (header.version != COMPILED_CACHE_VERSION || header.layout != layoutTag()) {
+        reason = "cache written by another format version or build";
+        return false;
+    }
+    if (header.contentHash != contentHash) {
+        reason = "workbook content changed";
+        return false;
+    }
+    if (header.payloadSize != file.size() - sizeof(header)) {
+        reason = "truncated payload";
+        return false;
+    }
+
+    const unsigned char* payload = file.data() + sizeof(header);
+    ContentHasher hasher;
+    hasher.add(payload, (size_t)header.payloadSize);
+    if (hasher.finish() != header.payloadHash) {
+        reason = "payload checksum mismatch";
+        return false;
+    }
+
+    Reader in(payload, (size_t)header.payloadSize);
+    workbook = CompiledWorkbook();
+
+    uint32_t count = in.getCount(9 * sizeof(uint32_t));
+    workbook.subexpressions.resize(count);
+    for (uint32_t i = 0; i < count && in.ok; ++i) {
+        in.getProgram(workbook.subexpressions[i]);
+        if (in.ok && !programInBounds(workbook.subexpressions[i], i)) in.ok = false;
+    }
+
+    count = in.getCount(10 * sizeof(uint32_t));
+    workbook.formulas.reserve(count);
+    for (uint32_t i = 0; i < count && in.ok; ++i) {
+        auto formula = std::make_shared<CompiledFormula>();
+        in.getString(formula->text);
+        uint8_t parsed = 0;
+        in.get(parsed);
+        formula->parsed = parsed != 0;
+        uint32_t errors = in.getCount(sizeof(uint32_t));
+        formula->errors.resize(errors);
+        for (uint32_t e = 0; e < errors && in.ok; ++e) {
+            in.getString(formula->errors[e]);
+        }
+        in.getProgram(formula->program);
+        if (in.ok && !programInBounds(formula->program, workbook.subexpressions.size())) in.ok = false;
+        workbook.formulas.push_back(formula);
+    }
+
+    count = in.getCount(sizeof(CellKey) + sizeof(uint32_t));
+    workbook.cellFormulas.resize(count);
+    for (uint32_t i = 0; i < count && in.ok; ++i) {
+        in.get(workbook.cellFormulas[i].first);
+        in.get(workbook.cellFormulas[i].second);
+        if (in.ok && workbook.cellFormulas[i].second >= workbook.formulas.size()) in.ok = false;
+    }
+
+    count = in.getCount(sizeof(CellKey) + 2 * sizeof(uint32_t));
+    workbook.dependencies.resize(count);
+    for (uint32_t i = 0; i < count && in.ok; ++i) {
+        in.get(workbook.dependencies[i].cell);
+        in.getArray(workbook.dependencies[i].cells);
+        in.getArray(workbook.dependencies[i].ranges);
+    }
+
+    count = in.getCount(sizeof(CellKey) + sizeof(uint64_t));
+    workbook.results.resize(count);
+    for (uint32_t i = 0; i < count && in.ok; ++i) {
+        uint64_t bits = 0;
+        in.get(workbook.results[i].first);
+        in.get(bits);
+        workbook.results[i].second = Value::fromBits(bits);
+    }
+
+    if (!in.done()) {
+        reason = "malformed payload";
+        return false;
+    }
+    return true;
+}
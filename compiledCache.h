@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "formulaBytecode.h"
+#include "formulaCache.h"
+#include "formulaTypes.h"
+#include "formulaValue.h"
+
+// Everything compiling a workbook produces, in a form that can be written
+// out and read back without parsing a single formula
+struct CompiledWorkbook {
+    struct Precedents {
+        CellKey cell;
+        std::vector<CellKey> cells;
+        std::vector<RangeRef> ranges;
+    };
+
+    // SubexpressionTable entries by id; shared ids inside refer to earlier ones
+    std::vector<Program> subexpressions;
+    std::vector<std::shared_ptr<CompiledFormula>> formulas;
+    std::vector<std::pair<CellKey, uint32_t>> cellFormulas;     // cell, index into formulas
+    std::vector<Precedents> dependencies;
+    std::vector<std::pair<CellKey, Value>> results;             // last computed values
+};
+
+// Binary cache file of a CompiledWorkbook, tied to the content hash of the
+// workbook it was compiled from. Layout: a fixed header (magic, format
+// version, build layout, content hash, payload size and checksum) followed
+// by the sections of CompiledWorkbook in order, arrays as a count and raw
+// elements. The file is only meant for the machine and build that wrote it.
+const uint32_t COMPILED_CACHE_VERSION = 1;
+
+// Written to a temporary file first, so a crash never leaves half a cache
+bool saveCompiledWorkbook(const std::string& path, uint64_t contentHash, const CompiledWorkbook& workbook);
+
+// The file is memory-mapped and checked before anything is taken from it.
+// False if it is missing, damaged, of another format version or build, or
+// compiled from other content; reason says which, and workbook is left
+// unspecified.
+bool loadCompiledWorkbook(const std::string& path, uint64_t contentHash, CompiledWorkbook& workbook,
+    std::string& reason);
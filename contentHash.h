@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Fast 64-bit hash of a byte stream, fed in pieces. Meant to notice that
+// content changed, not to resist anyone forging a collision.
+class ContentHasher {
+public:
+    void add(const void* data, size_t size) {
+        const unsigned char* bytes = (const unsigned char*)data;
+        length += size;
+        while (size >= 8) {
+            uint64_t word;
+            memcpy(&word, bytes, 8);
+            mix(word);
+            bytes += 8;
+            size -= 8;
+        }
+        if (size > 0) {
+            uint64_t word = 0;
+            memcpy(&word, bytes, size);
+            mix(word ^ ((uint64_t)size << 56));
+        }
+    }
+
+    template <typename T>
+    void addValue(const T& value) {
+        add(&value, sizeof(value));
+    }
+
+    uint64_t finish() const {
+        uint64_t h = state ^ length;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+    void mix(uint64_t word) {
+        word *= 0x87C37B91114253D5ull;
+        word = (word << 31) | (word >> 33);
+        state ^= word * 0x4CF5AD432745937Full;
+        state = ((state << 27) | (state >> 37)) * 5 + 0x52DCE729;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    uint64_t length = 0;
+};
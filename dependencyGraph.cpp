@@ -0,0 +1,136 @@
+#include "stdafx.h"
+#include "dependencyGraph.h"
+#include <algorithm>
+
+void DependencyGraph::setPrecedents(const CellKey& cell, const std::vector<CellKey>& cells, const std::vector<RangeRef>& ranges) {
+    auto existing = nodes.find(cell);
+    if (existing != nodes.end()) {
+        unlink(cell, existing->second);
+    }
+
+    Node& node = nodes[cell];
+    node.cells = cells;
+    node.ranges = ranges;
+
+    for (const auto& precedent : cells) {
+        cellDependents[precedent].push_back(cell);
+    }
+    for (const auto& range : ranges) {
+        for (int col = range.firstCol; col <= range.lastCol; ++col) {
+            ColumnIntervals& column = rangeDependents[columnKey(range.sheet, col)];
+            column.intervals.push_back({ range.firstRow, range.lastRow, cell });
+            column.indexed = false;
+        }
+    }
+}
+
+void DependencyGraph::removeCell(const CellKey& cell) {
+    auto it = nodes.find(cell);
+    if (it == nodes.end()) return;
+
+    unlink(cell, it->second);
+    nodes.erase(it);
+}
+
+void DependencyGraph::clear() {
+    nodes.clear();
+    cellDependents.clear();
+    rangeDependents.clear();
+}
+
+void DependencyGraph::unlink(const CellKey& cell, const Node& node) {
+    for (const auto& precedent : node.cells) {
+        auto it = cellDependents.find(precedent);
+        if (it == cellDependents.end()) continue;
+        auto& list = it->second;
+        list.erase(std::remove(list.begin(), list.end(), cell), list.end());
+        if (list.empty()) cellDependents.erase(it);
+    }
+    for (const auto& range : node.ranges) {
+        for (int col = range.firstCol; col <= range.lastCol; ++col) {
+            auto it = rangeDependents.find(columnKey(range.sheet, col));
+            if (it == rangeDependents.end()) continue;
+            auto& list = it->second.intervals;
+            list.erase(std::remove_if(list.begin(), list.end(),
+                [&](const Interval& interval) { return interval.dependent == cell; }), list.end());
+            it->second.indexed = false;
+            if (list.empty()) rangeDependents.erase(it);
+        }
+    }
+}
+
+void DependencyGraph::directDependents(const CellKey& cell, std::vector<CellKey>& out) const {
+    auto direct = cellDependents.find(cell);
+    if (direct != cellDependents.end()) {
+        out.insert(out.end(), direct->second.begin(), direct->second.end());
+    }
+
+    auto column = rangeDependents.find(columnKey(cell.sheet, cell.col));
+    if (column != rangeDependents.end()) {
+        column->second.stab(cell.row, out);
+    }
+}
+
+void DependencyGraph::ColumnIntervals::index() const {
+    std::sort(intervals.begin(), intervals.end(),
+        [](const Interval& a, const Interval& b) { return a.firstRow < b.firstRow; });
+
+    leafCount = 1;
+    while (leafCount < intervals.size()) leafCount *= 2;
+    maxLastRow.assign(2 * leafCount, -1);
+    for (size_t i = 0; i < intervals.size(); ++i) {
+        maxLastRow[leafCount + i] = intervals[i].lastRow;
+    }
+    for (size_t node = leafCount - 1; node >= 1; --node) {
+        maxLastRow[node] = std::max(maxLastRow[2 * node], maxLastRow[2 * node + 1]);
+    }
+    indexed = true;
+}
+
+void DependencyGraph::ColumnIntervals::stab(int row, std::vector<CellKey>& out) const {
+    if (!indexed) index();
+
+    // Intervals [0, end) start at or above row; of those, the tree finds
+    // the ones that reach it
+    size_t end = std::upper_bound(intervals.begin(), intervals.end(), row,
+        [](int r, const Interval& interval) { return r < interval.firstRow; }) - intervals.begin();
+    collect(1, 0, leafCount, end, row, out);
+}
+
+void DependencyGraph::ColumnIntervals::collect(size_t node, size_t first, size_t last, size_t end, int row,
+    std::vector<CellKey>& out) const {
+    if (first >= end || maxLastRow[node] < row) return;
+    if (last - first == 1) {
+        out.push_back(intervals[first].dependent);
+        return;
+    }
+    size_t middle = (first + last) / 2;
+    collect(2 * node, first, middle, end, row, out);
+    collect(2 * node + 1, middle, last, end, row, out);
+}
+
+void DependencyGraph::collectDependents(const CellKey& cell, CellSet& out, std::vector<CellKey>* added) const {
+    std::vector<CellKey> pending;
+    directDependents(cell, pending);
+
+    while (!pending.empty()) {
+        CellKey next = pending.back();
+        pending.pop_back();
+        if (out.insert(next).second) {
+            if (added) added->push_back(next);
+            directDependents(next, pending);
+        }
+    }
+}
+
+const std::vector<CellKey>& DependencyGraph::cellPrecedents(const CellKey& cell) const {
+    static const std::vector<CellKey> none;
+    auto it = nodes.find(cell);
+    return (it != nodes.end()) ? it->second.cells : none;
+}
+
+const std::vector<RangeRef>& DependencyGraph::rangePrecedents(const CellKey& cell) const {
+    static const std::vector<RangeRef> none;
+    auto it = nodes.find(cell);
+    return (it != nodes.end()) ? it->second.ranges : none;
+}
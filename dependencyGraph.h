@@ -0,0 +1,86 @@
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "formulaTypes.h"
+#include "formulaBytecode.h"
+
+typedef std::unordered_set<CellKey, CellKeyHash> CellSet;
+
+// Precedent/dependent links between formula cells. Single-cell precedents
+// are indexed per cell; range precedents are kept as row intervals per
+// column, so a 100k-row SUM costs one entry per column, not per cell. A
+// column's intervals are indexed on the first lookup after a change, and a
+// lookup only visits intervals that may hold the row.
+class DependencyGraph {
+public:
+    // Replace what a formula cell depends on
+    void setPrecedents(const CellKey& cell, const std::vector<CellKey>& cells, const std::vector<RangeRef>& ranges);
+
+    // Forget a cell that no longer holds a formula
+    void removeCell(const CellKey& cell);
+
+    void clear();
+
+    bool contains(const CellKey& cell) const { return nodes.count(cell) != 0; }
+
+    size_t formulaCount() const { return nodes.size(); }
+
+    // Formula cells reading cell directly (appended to out)
+    void directDependents(const CellKey& cell, std::vector<CellKey>& out) const;
+
+    // Every formula cell whose value can change when cell changes. Cells
+    // already in out are not walked again; newly found ones are also
+    // appended to added when given.
+    void collectDependents(const CellKey& cell, CellSet& out, std::vector<CellKey>* added = nullptr) const;
+
+    const std::vector<CellKey>& cellPrecedents(const CellKey& cell) const;
+
+    const std::vector<RangeRef>& rangePrecedents(const CellKey& cell) const;
+
+    // Visit every formula cell of the graph
+    template <typename Visitor>
+    void forEachFormula(Visitor visit) const {
+        for (const auto& entry : nodes) visit(entry.first);
+    }
+
+private:
+    struct Node {
+        std::vector<CellKey> cells;
+        std::vector<RangeRef> ranges;
+    };
+
+    struct Interval {
+        int firstRow;
+        int lastRow;
+        CellKey dependent;
+    };
+
+    // Range intervals over one column. Indexing sorts them by firstRow and
+    // builds a tree of the largest lastRow under each node, so a lookup
+    // enters only subtrees holding an interval that reaches its row.
+    struct ColumnIntervals {
+        mutable std::vector<Interval> intervals;
+        mutable std::vector<int> maxLastRow;   // node 1 the root, leaves from leafCount
+        mutable size_t leafCount = 0;
+        mutable bool indexed = true;
+
+        void index() const;
+
+        // Dependents of the intervals holding row (appended to out)
+        void stab(int row, std::vector<CellKey>& out) const;
+
+        void collect(size_t node, size_t first, size_t last, size_t end, int row, std::vector<CellKey>& out) const;
+    };
+
+    static uint64_t columnKey(int sheet, int col) {
+        return ((uint64_t)(uint32_t)sheet << 32) | (uint32_t)col;
+    }
+
+    void unlink(const CellKey& cell, const Node& node);
+
+    std::unordered_map<CellKey, Node, CellKeyHash> nodes;
+    std::unordered_map<CellKey, std::vector<CellKey>, CellKeyHash> cellDependents;
+    std::unordered_map<uint64_t, ColumnIntervals> rangeDependents;   // by sheet and column
+};
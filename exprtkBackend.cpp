@@ -0,0 +1,521 @@
+#include "stdafx.h"
+#include "exprtkBackend.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include "formulaTrace.h"
+
+namespace {
+
+const uint64_t EMPTY_CELL_BITS = 0x7FF8000000000E00ull;
+
+// An error value carried through exprtk in its NaN payload
+bool isErrorNumber(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return Value::fromBits(bits).isError();
+}
+
+// exprtk function of a built-in; null for those called back into the VM
+const char* functionName(FunctionId function) {
+    switch (function) {
+    case FunctionId::Sum: return "xl_sum";
+    case FunctionId::Average: return "xl_average";
+    case FunctionId::Min: return "xl_min";
+    case FunctionId::Max: return "xl_max";
+    case FunctionId::Count: return "xl_count";
+    case FunctionId::CountA: return "xl_counta";
+    case FunctionId::SumProduct: return "xl_sumproduct";
+    default: break;
+    }
+    return nullptr;
+}
+
+// exprtk has no literals for infinities or NaN; folding can produce them
+std::string numberText(double value) {
+    if (std::isnan(value)) return "(0/0)";
+    if (std::isinf(value)) return (value > 0) ? "(1/0)" : "(-1/0)";
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.17g", value);
+    return (value < 0) ? "(" + std::string(buffer) + ")" : std::string(buffer);
+}
+
+} // namespace
+
+double ExprtkBackend::emptyCell() {
+    double value;
+    memcpy(&value, &EMPTY_CELL_BITS, sizeof(value));
+    return value;
+}
+
+bool ExprtkBackend::isEmptyCell(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits == EMPTY_CELL_BITS;
+}
+
+ExprtkBackend::Divide::Divide() : exprtk::ifunction<double>(2) {
+    exprtk::disable_has_side_effects(*this);
+}
+
+double ExprtkBackend::Divide::operator()(const double& a, const double& b) {
+    // Errors in either operand win over the division by 0
+    if (std::isnan(a)) return a;
+    if (std::isnan(b)) return b;
+    return (b != 0) ? a / b : Value::error(ErrorCode::Div0).asNumber();
+}
+
+ExprtkBackend::Function::Function(FunctionId function) : function(function) {
+}
+
+double ExprtkBackend::Function::operator()(parameter_list_t parameters) {
+    typedef generic_type::scalar_view scalar_t;
+    typedef generic_type::vector_view vector_t;
+
+    if (function == FunctionId::SumProduct) {
+        // The translation only passes all scalars or equally sized arrays
+        if (parameters[0].type == generic_type::e_scalar) {
+            double product = 1.0;
+            for (size_t i = 0; i < parameters.size(); ++i) {
+                double value = scalar_t(parameters[i])();
+                if (std::isnan(value)) return value;
+                product *= value;
+            }
+            return product;
+        }
+
+        vector_t first(parameters[0]);
+        double result = 0.0;
+        for (size_t j = 0; j < first.size(); ++j) {
+            double product = 1.0;
+            for (size_t i = 0; i < parameters.size(); ++i) {
+                double value = vector_t(parameters[i])[j];
+                if (isErrorNumber(value)) return value;
+                product *= value;
+            }
+            if (!std::isnan(product)) result += product;
+        }
+        return result;
+    }
+
+    AggregateState state;
+    for (size_t i = 0; i < parameters.size(); ++i) {
+        if (parameters[i].type == generic_type::e_scalar) {
+            // Scalars are numbers or errors, which COUNT and COUNTA skip
+            double value = scalar_t(parameters[i])();
+            if (!std::isnan(value)) {
+                state.addNumber(value);
+            }
+            else if (function == FunctionId::CountA) {
+                state.counta += 1.0;
+            }
+            else if (function != FunctionId::Count) {
+                return value;
+            }
+            continue;
+        }
+
+        vector_t cells(parameters[i]);
+        for (size_t j = 0; j < cells.size(); ++j) {
+            double value = cells[j];
+            if (!std::isnan(value)) {
+                state.addNumber(value);
+            }
+            else if (isErrorNumber(value)) {
+                state.addError(Value::unbox(value).asError());
+            }
+            else if (!isEmptyCell(value)) {
+                state.counta += 1.0;
+            }
+        }
+    }
+    if (state.error.isError() && function != FunctionId::Count && function != FunctionId::CountA) {
+        return state.error.asNumber();
+    }
+
+    switch (function) {
+    case FunctionId::Sum: return state.sum;
+    case FunctionId::Average:
+        return (state.count > 0) ? state.sum / state.count : Value::error(ErrorCode::Div0).asNumber();
+    case FunctionId::Min: return (state.count > 0) ? state.min : 0.0;
+    case FunctionId::Max: return (state.count > 0) ? state.max : 0.0;
+    case FunctionId::Count: return state.count;
+    default: return state.counta;
+    }
+}
+
+ExprtkBackend::Callback::Callback(ExprtkBackend& backend) : backend(backend) {
+}
+
+double ExprtkBackend::Callback::operator()(parameter_list_t parameters) {
+    typedef generic_type::scalar_view scalar_t;
+
+    const Call& call = backend.activeFormula->calls[(size_t)scalar_t(parameters[0])()];
+    std::vector<Value> values;
+    for (size_t i = 1; i < parameters.size(); ++i) {
+        values.push_back(Value::unbox(scalar_t(parameters[i])()));
+    }
+    CellValueReader& reader = *backend.activeReader;
+    Value result = callFunction(*call.program, call.instruction, values.data(), call.program->ranges.data(), reader);
+    return numericValue(result, reader.strings()).asNumber();
+}
+
+ExprtkBackend::ExprtkBackend(const WorkbookSnapshot& snapshot, const SubexpressionTable& subexpressions)
+    : snapshot(snapshot), subexpressions(subexpressions), callback(*this) {
+    for (FunctionId function : { FunctionId::Sum, FunctionId::Average, FunctionId::Min, FunctionId::Max,
+             FunctionId::Count, FunctionId::CountA, FunctionId::SumProduct }) {
+        functions.push_back(std::make_unique<Function>(function));
+    }
+    registerFunctions();
+}
+
+void ExprtkBackend::registerFunctions() {
+    symbols.add_function("xl_div", divide);
+    symbols.add_function("xl_call", callback);
+    for (int code = (int)ErrorCode::Null; code <= (int)ErrorCode::NA; ++code) {
+        errorValues[code] = Value::error((ErrorCode)code).asNumber();
+        symbols.add_variable("xl_e" + std::to_string(code), errorValues[code]);
+    }
+    for (const auto& function : functions) {
+        symbols.add_function(functionName(function->function), *function);
+    }
+}
+
+Value ExprtkBackend::evaluate(const std::shared_ptr<CompiledFormula>& compiled, CellValueReader& reader) {
+    Formula& formula = formulaOf(compiled);
+    if (!formula.compiled) return Value::number(0.0);
+
+    // Reading a cell can evaluate other formulas, which refresh their own
+    // inputs; shared slots always receive the same value
+    for (uint32_t slot : formula.cells) {
+        slots[slot] = numericValue(reader.cellValue(slotCells[slot]), reader.strings()).asNumber();
+    }
+    for (uint32_t array : formula.arrays) {
+        fillArray(array, reader);
+    }
+
+    stats.evaluations++;
+    CellValueReader* outer = activeReader;
+    Formula* outerFormula = activeFormula;
+    activeReader = &reader;
+    activeFormula = &formula;
+    double value = formula.expression.value();
+    activeReader = outer;
+    activeFormula = outerFormula;
+    return Value::unbox(value);
+}
+
+ExprtkBackend::Formula& ExprtkBackend::formulaOf(const std::shared_ptr<CompiledFormula>& compiled) {
+    auto it = formulas.find(compiled.get());
+    if (it != formulas.end() && it->second->source.lock() == compiled) {
+        return *it->second;
+    }
+
+    // Expressions of evicted formulas are dropped once the map has doubled
+    if (formulas.size() >= pruneAt) {
+        for (auto entry = formulas.begin(); entry != formulas.end();) {
+            if (entry->second->source.expired()) {
+                stats.calls -= entry->second->calls.size();
+                entry = formulas.erase(entry);
+            }
+            else {
+                ++entry;
+            }
+        }
+        pruneAt = std::max<size_t>(1024, formulas.size() * 2);
+    }
+
+    auto formula = std::make_unique<Formula>();
+    formula->source = compiled;
+    formula->expression.register_symbol_table(symbols);
+
+    std::string text;
+    if (compiled->parsed && translateProgram(compiled->program, *formula, text)) {
+        formula->compiled = parser.compile(text, formula->expression);
+        if (!formula->compiled) {
+            TRACE_WARNING(TraceKind::BackendError, std::string_view(parser.error() + " in " + text));
+        }
+    }
+    stats.calls += formula->calls.size();
+    if (formula->compiled) {
+        stats.compiled++;
+    }
+    else {
+        stats.failed++;
+    }
+
+    // A stale entry at the same address belongs to an evicted formula
+    Formula& result = *formula;
+    std::unique_ptr<Formula>& entry = formulas[compiled.get()];
+    if (entry) stats.calls -= entry->calls.size();
+    entry = std::move(formula);
+    return result;
+}
+
+bool ExprtkBackend::translate(const Program& program, std::string& text) {
+    Formula scratch;
+    return translateProgram(program, scratch, text);
+}
+
+// Postfix bytecode back to an infix expression
+bool ExprtkBackend::translateProgram(const Program& program, Formula& formula, std::string& text) {
+    std::vector<std::string> stack;
+
+    for (const Instruction& ins : program.code) {
+        switch (ins.op) {
+        case OpCode::PushConst: {
+            Value constant = program.constants[ins.operand];
+            if (constant.isNumber()) {
+                stack.push_back(numberText(constant.asNumber()));
+            }
+            else if (constant.type() == ValueType::Boolean) {
+                stack.push_back(constant.asBoolean() ? "1" : "0");
+            }
+            else if (constant.isError()) {
+                stack.push_back("xl_e" + std::to_string((int)constant.asError()));
+            }
+            else {
+                return false;
+            }
+            break;
+        }
+
+        case OpCode::LoadCell:
+            stack.push_back(cellVariable(program.cells[ins.operand], formula));
+            break;
+
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        case OpCode::Div: {
+            if (stack.size() < 2) return false;
+            std::string b = std::move(stack.back());
+            stack.pop_back();
+            std::string& a = stack.back();
+            if (ins.op == OpCode::Div) {
+                a = "xl_div(" + a + ", " + b + ")";
+            }
+            else {
+                const char* op = (ins.op == OpCode::Add) ? " + " : (ins.op == OpCode::Sub) ? " - " : " * ";
+                a = "(" + a + op + b + ")";
+            }
+            break;
+        }
+
+        case OpCode::AddN:
+        case OpCode::MulN: {
+            if (stack.size() < ins.argc || ins.argc == 0) return false;
+            size_t first = stack.size() - ins.argc;
+            std::string joined = "(" + stack[first];
+            for (size_t i = first + 1; i < stack.size(); ++i) {
+                joined += (ins.op == OpCode::AddN) ? " + " : " * ";
+                joined += stack[i];
+            }
+            joined += ")";
+            stack.resize(first);
+            stack.push_back(std::move(joined));
+            break;
+        }
+
+        case OpCode::Call: {
+            const CallArg* args = &program.args[ins.operand];
+            FunctionId function = (FunctionId)args[0].function;
+
+            size_t stackArgs = 0;
+            for (uint16_t i = 0; i < ins.argc; ++i) {
+                if (args[i].kind == CallArg::STACK) stackArgs++;
+            }
+            if (stack.size() < stackArgs) return false;
+            size_t firstScalar = stack.size() - stackArgs;
+
+            // Calls the VM rejects give the same error here
+            std::string call;
+            std::string nameError = "xl_e" + std::to_string((int)ErrorCode::Name);
+            std::string valueError = "xl_e" + std::to_string((int)ErrorCode::Value);
+            if (function == FunctionId::Unknown) {
+                call = nameError;
+            }
+            else if (ins.argc == 0) {
+                call = "0";
+            }
+            else if (!functionName(function)) {
+                call = "xl_call(" + std::to_string(formula.calls.size());
+                formula.calls.push_back(Call{ &program, ins });
+                for (size_t i = 0; i < stackArgs; ++i) {
+                    call += ", " + stack[firstScalar + i];
+                }
+                call += ")";
+            }
+            else if (function == FunctionId::SumProduct && stackArgs != 0) {
+                // Scalars are 1x1 arrays, which only match each other
+                call = (stackArgs == ins.argc) ? functionName(function) : valueError;
+                for (size_t i = 0; i < stackArgs && stackArgs == ins.argc; ++i) {
+                    call += (i == 0) ? "(" : ", ";
+                    call += stack[firstScalar + i];
+                }
+                if (stackArgs == ins.argc) call += ")";
+            }
+            else if (function == FunctionId::SumProduct) {
+                // Equal shapes, bound over the same rows and columns
+                const RangeRef& shape = program.ranges[args[0].range];
+                int rows = 1, cols = 1;
+                bool same = true;
+                for (uint16_t i = 0; i < ins.argc; ++i) {
+                    const RangeRef& range = program.ranges[args[i].range];
+                    same = same && range.lastRow - range.firstRow == shape.lastRow - shape.firstRow &&
+                        range.lastCol - range.firstCol == shape.lastCol - shape.firstCol;
+                    int r, c;
+                    storedExtent(range, r, c);
+                    rows = std::max(rows, r);
+                    cols = std::max(cols, c);
+                }
+                if (same) {
+                    call = functionName(function);
+                    for (uint16_t i = 0; i < ins.argc; ++i) {
+                        call += (i == 0) ? "(" : ", ";
+                        call += rangeVector(program.ranges[args[i].range], rows, cols, formula);
+                    }
+                    call += ")";
+                }
+                else {
+                    call = valueError;
+                }
+            }
+            else {
+                call = functionName(function);
+                size_t slot = firstScalar;
+                for (uint16_t i = 0; i < ins.argc; ++i) {
+                    call += (i == 0) ? "(" : ", ";
+                    if (args[i].kind == CallArg::RANGE) {
+                        const RangeRef& range = program.ranges[args[i].range];
+                        int rows, cols;
+                        storedExtent(range, rows, cols);
+                        call += rangeVector(range, rows, cols, formula);
+                    }
+                    else {
+                        call += stack[slot++];
+                    }
+                }
+                call += ")";
+            }
+
+            stack.resize(firstScalar);
+            stack.push_back(std::move(call));
+            break;
+        }
+
+        case OpCode::LoadShared: {
+            std::string shared;
+            if (!translateProgram(subexpressions.program(program.shared[ins.operand]), formula, shared)) {
+                return false;
+            }
+            stack.push_back(std::move(shared));
+            break;
+        }
+        }
+    }
+
+    text = stack.empty() ? "0" : stack.back();
+    return true;
+}
+
+std::string ExprtkBackend::cellVariable(const CellKey& cell, Formula& formula) {
+    auto it = slotIndex.find(cell);
+    uint32_t slot;
+    if (it != slotIndex.end()) {
+        slot = it->second;
+    }
+    else {
+        slot = (uint32_t)slots.size();
+        slots.push_back(0.0);
+        slotCells.push_back(cell);
+        slotIndex.emplace(cell, slot);
+        symbols.add_variable("c" + std::to_string(slot), slots.back());
+        stats.variables++;
+    }
+
+    if (std::find(formula.cells.begin(), formula.cells.end(), slot) == formula.cells.end()) {
+        formula.cells.push_back(slot);
+    }
+    return "c" + std::to_string(slot);
+}
+
+std::string ExprtkBackend::rangeVector(const RangeRef& range, int rows, int cols, Formula& formula) {
+    auto key = std::make_tuple(range.sheet, range.firstRow, range.firstCol, rows, cols);
+    auto it = arrayIndex.find(key);
+    uint32_t array;
+    if (it != arrayIndex.end()) {
+        array = it->second;
+    }
+    else {
+        array = (uint32_t)arrays.size();
+        arrays.emplace_back((size_t)rows * cols, emptyCell());
+        arrayRanges.push_back(RangeRef{ range.sheet, range.firstRow, range.firstCol,
+            range.firstRow + rows - 1, range.firstCol + cols - 1 });
+        arrayIndex.emplace(key, array);
+        symbols.add_vector("r" + std::to_string(array), arrays.back());
+        stats.arrays++;
+    }
+
+    if (std::find(formula.arrays.begin(), formula.arrays.end(), array) == formula.arrays.end()) {
+        formula.arrays.push_back(array);
+    }
+    return "r" + std::to_string(array);
+}
+
+void ExprtkBackend::storedExtent(const RangeRef& range, int& rows, int& cols) const {
+    const SheetColumns& columns = snapshot.sheet(range.sheet);
+    rows = std::max(1, std::min(range.lastRow, columns.lastRow - 1) - range.firstRow + 1);
+    cols = std::max(1, std::min(range.lastCol, columns.lastCol - 1) - range.firstCol + 1);
+}
+
+// Column after column; formula cells through the reader, which evaluates
+// them on demand
+void ExprtkBackend::fillArray(uint32_t array, CellValueReader& reader) {
+    const RangeRef& range = arrayRanges[array];
+    std::vector<double>& values = arrays[array];
+    size_t i = 0;
+    for (int col = range.firstCol; col <= range.lastCol; ++col) {
+        for (int row = range.firstRow; row <= range.lastRow; ++row, ++i) {
+            uint8_t flags = snapshot.flags(range.sheet, row, col);
+            CellKind kind = (CellKind)(flags & KIND_MASK);
+            if (flags & FORMULA) {
+                Value value = reader.cellValue(CellKey{ range.sheet, row, col });
+                values[i] = (value.isNumber() || value.isError()) ? value.asNumber() : std::numeric_limits<double>::quiet_NaN();
+            }
+            else if (kind == CellKind::ERROR) {
+                values[i] = snapshot.value(range.sheet, row, col).asNumber();
+            }
+            else if (kind == CellKind::NUMBER) {
+                values[i] = snapshot.number(range.sheet, row, col);
+            }
+            else if (kind == CellKind::EMPTY || kind == CellKind::BLANK) {
+                values[i] = emptyCell();
+            }
+            else {
+                values[i] = std::numeric_limits<double>::quiet_NaN();
+            }
+        }
+    }
+}
+
+void ExprtkBackend::clear() {
+    formulas.clear();
+    pruneAt = 1024;
+    stats.calls = 0;
+    symbols.clear();
+    slots.clear();
+    slotCells.clear();
+    slotIndex.clear();
+    arrays.clear();
+    arrayRanges.clear();
+    arrayIndex.clear();
+    registerFunctions();
+}
+
+ExprtkStats ExprtkBackend::getStats() const {
+    return stats;
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "exprtk.hpp"
+#include "formulaBytecode.h"
+#include "formulaCache.h"
+#include "sheetSnapshot.h"
+#include "subexpressionTable.h"
+
+struct ExprtkStats {
+    size_t compiled = 0;      // formulas turned into expressions
+    size_t failed = 0;        // formulas exprtk rejected, evaluating to 0
+    size_t evaluations = 0;
+    size_t variables = 0;     // cell slots bound
+    size_t arrays = 0;        // range arrays bound
+    size_t calls = 0;         // VM calls held by live expressions
+};
+
+// Evaluation backend running formulas as exprtk expressions, kept to
+// benchmark against the VM. Each compiled formula is translated from its
+// bytecode once; its cells become variables bound to per-cell double slots
+// and its ranges vectors bound to per-range arrays, and the spreadsheet
+// functions are registered as exprtk functions. Evaluating refreshes the
+// slots and arrays the formula reads and calls the expression.
+//
+// Expressions compute doubles only. Cells enter converted as for
+// arithmetic, errors as their NaN-boxed Value, which arithmetic carries
+// along in the NaN payload; a result NaN without one becomes #NUM!. Unlike
+// the VM, a text cell given directly to SUM and the like counts as #VALUE!
+// instead of being skipped, and text results of lookups come back as
+// #VALUE! as well.
+//
+// Ranges are bound over the rows the snapshot stores, so call clear()
+// whenever the used area of a sheet may change.
+class ExprtkBackend {
+public:
+    ExprtkBackend(const WorkbookSnapshot& snapshot, const SubexpressionTable& subexpressions);
+
+    Value evaluate(const std::shared_ptr<CompiledFormula>& formula, CellValueReader& reader);
+
+    // exprtk source of a program, binding its references; false if it
+    // uses something the translation does not cover
+    bool translate(const Program& program, std::string& text);
+
+    void clear();
+
+    ExprtkStats getStats() const;
+
+private:
+    // Array cells that are not numbers hold NaN; empty ones this payload
+    static double emptyCell();
+
+    static bool isEmptyCell(double value);
+
+    // x / 0 is #DIV/0!, as in the VM
+    struct Divide : public exprtk::ifunction<double> {
+        Divide();
+
+        double operator()(const double& a, const double& b) override;
+    };
+
+    // SUM, AVERAGE, ... over scalars and range arrays
+    struct Function : public exprtk::igeneric_function<double> {
+        explicit Function(FunctionId function);
+
+        double operator()(parameter_list_t parameters) override;
+
+        FunctionId function;
+    };
+
+    // Calls without an exprtk counterpart, such as lookups, go back to
+    // the VM's callFunction: index into the evaluating formula's calls,
+    // then the stack arguments
+    struct Callback : public exprtk::igeneric_function<double> {
+        explicit Callback(ExprtkBackend& backend);
+
+        double operator()(parameter_list_t parameters) override;
+
+        ExprtkBackend& backend;
+    };
+
+    // The program is the compiled formula's own or a shared subexpression,
+    // both alive as long as the formula is
+    struct Call {
+        const Program* program;
+        Instruction instruction;
+    };
+
+    struct Formula {
+        std::weak_ptr<CompiledFormula> source;
+        exprtk::expression<double> expression;
+        std::vector<uint32_t> cells;      // slots refreshed before each evaluation
+        std::vector<uint32_t> arrays;     // arrays refreshed before each evaluation
+        std::vector<Call> calls;          // xl_call targets
+        bool compiled = false;
+    };
+
+    Formula& formulaOf(const std::shared_ptr<CompiledFormula>& compiled);
+
+    bool translateProgram(const Program& program, Formula& formula, std::string& text);
+
+    std::string cellVariable(const CellKey& cell, Formula& formula);
+
+    // Array of the first rows x cols cells of range
+    std::string rangeVector(const RangeRef& range, int rows, int cols, Formula& formula);
+
+    // Rows and columns of range inside the area the snapshot stores, at
+    // least one each since exprtk vectors cannot be empty
+    void storedExtent(const RangeRef& range, int& rows, int& cols) const;
+
+    void fillArray(uint32_t array, CellValueReader& reader);
+
+    void registerFunctions();
+
+    const WorkbookSnapshot& snapshot;
+    const SubexpressionTable& subexpressions;
+
+    exprtk::symbol_table<double> symbols;
+    exprtk::parser<double> parser;
+    Divide divide;
+    double errorValues[(int)ErrorCode::NA + 1];   // boxed errors, bound as xl_e<code>
+    std::vector<std::unique_ptr<Function>> functions;
+    Callback callback;
+    CellValueReader* activeReader = nullptr;     // of the evaluation in progress
+    Formula* activeFormula = nullptr;
+
+    // deques: the symbol table holds references into them
+    std::deque<double> slots;
+    std::vector<CellKey> slotCells;
+    std::unordered_map<CellKey, uint32_t, CellKeyHash> slotIndex;
+
+    std::deque<std::vector<double>> arrays;
+    std::vector<RangeRef> arrayRanges;
+    std::map<std::tuple<int, int, int, int, int>, uint32_t> arrayIndex;
+
+    std::unordered_map<const CompiledFormula*, std::unique_ptr<Formula>> formulas;
+    size_t pruneAt = 1024;
+
+    ExprtkStats stats;
+};
@@ -0,0 +1,101 @@
+#include "stdafx.h"
+#include "formulaArena.h"
+#include <sstream>
+
+SymbolId SymbolTable::intern(std::string_view name) {
+    auto it = index.find(name);
+    if (it != index.end()) return it->second;
+
+    SymbolId id = (SymbolId)names.size();
+    names.emplace_back(name);
+    index.emplace(std::string_view(names.back()), id);
+    return id;
+}
+
+SymbolId SymbolTable::find(std::string_view name) const {
+    auto it = index.find(name);
+    return (it != index.end()) ? it->second : NO_SYMBOL;
+}
+
+const std::string& SymbolTable::name(SymbolId id) const {
+    static const std::string empty;
+    return (id < names.size()) ? names[id] : empty;
+}
+
+NodeIndex AstArena::add(AstKind kind) {
+    AstNode node;
+    node.kind = kind;
+    node.op = 0;
+    node.absolute = 0;
+    node.childCount = 0;
+    node.symbol = NO_SYMBOL;
+    node.sheet = NO_SYMBOL;
+    node.firstChild = NO_NODE;
+    node.nextSibling = NO_NODE;
+    node.number = 0.0;
+    node.row = node.col = node.lastRow = node.lastCol = -1;
+    node.sheetIndex = -1;
+    nodes.push_back(node);
+    return (NodeIndex)nodes.size() - 1;
+}
+
+void AstArena::addChild(NodeIndex parent, NodeIndex child) {
+    AstNode& p = nodes[parent];
+    if (p.firstChild == NO_NODE) {
+        p.firstChild = child;
+    }
+    else {
+        NodeIndex last = p.firstChild;
+        while (nodes[last].nextSibling != NO_NODE) last = nodes[last].nextSibling;
+        nodes[last].nextSibling = child;
+    }
+    p.childCount++;
+}
+
+std::shared_ptr<FormulaNode> toFormulaTree(const AstArena& arena, const SymbolTable& symbols, NodeIndex root) {
+    if (root == NO_NODE) return nullptr;
+
+    const AstNode& n = arena[root];
+    std::string sheetName = (n.sheet != NO_SYMBOL) ? symbols.name(n.sheet) : "";
+    std::shared_ptr<FormulaNode> node;
+
+    switch (n.kind) {
+    case AstKind::CONSTANT: {
+        std::ostringstream text;
+        text << n.number;
+        node = std::make_shared<FormulaNode>(FormulaNode::CONSTANT, text.str());
+        break;
+    }
+
+    case AstKind::BOOLEAN:
+        node = std::make_shared<FormulaNode>(FormulaNode::CONSTANT, n.number != 0 ? "TRUE" : "FALSE");
+        break;
+
+    case AstKind::OPERATOR:
+        node = std::make_shared<FormulaNode>(FormulaNode::OPERATOR, std::string(1, n.op));
+        break;
+
+    case AstKind::FUNCTION:
+        node = std::make_shared<FormulaNode>(FormulaNode::FUNCTION, symbols.name(n.symbol));
+        break;
+
+    case AstKind::CELL_REF:
+    case AstKind::RANGE: {
+        auto address = [](int row, int col) {
+            std::string letters;
+            for (int c = col; c >= 0; c = c / 26 - 1) letters.insert(letters.begin(), char('A' + c % 26));
+            return letters + std::to_string(row + 1);
+        };
+        std::string text = (n.row < 0) ? "#REF!" : address(n.row, n.col);
+        if (n.kind == AstKind::RANGE && n.row >= 0) text += ":" + address(n.lastRow, n.lastCol);
+        node = std::make_shared<FormulaNode>(
+            n.kind == AstKind::RANGE ? FormulaNode::RANGE : FormulaNode::CELL_REF, text, sheetName);
+        break;
+    }
+    }
+
+    for (NodeIndex child = n.firstChild; child != NO_NODE; child = arena[child].nextSibling) {
+        node->addChild(toFormulaTree(arena, symbols, child));
+    }
+    return node;
+}
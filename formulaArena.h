@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "formulaTypes.h"
+
+typedef uint32_t NodeIndex;
+typedef uint32_t SymbolId;
+
+const NodeIndex NO_NODE = UINT32_MAX;
+const SymbolId NO_SYMBOL = UINT32_MAX;
+
+// Interned names (functions, sheets). Ids are stable for the table's lifetime.
+class SymbolTable {
+public:
+    SymbolId intern(std::string_view name);
+
+    // NO_SYMBOL if the name was never interned
+    SymbolId find(std::string_view name) const;
+
+    const std::string& name(SymbolId id) const;
+
+    size_t size() const { return names.size(); }
+
+private:
+    std::deque<std::string> names;   // deque: views in index stay valid
+    std::unordered_map<std::string_view, SymbolId> index;
+};
+
+enum class AstKind : uint8_t {
+    CELL_REF,
+    FUNCTION,
+    OPERATOR,
+    CONSTANT,
+    RANGE,
+    BOOLEAN                  // TRUE or FALSE, number is 1 or 0
+};
+
+// Parse tree node living in an AstArena. Children are linked by index
+// (firstChild, then nextSibling), so nodes carry no pointers or refcounts.
+struct AstNode {
+    AstKind kind;
+    char op;                 // '+', '-', '*', '/' for OPERATOR
+    uint8_t absolute;        // AbsoluteFlags of a reference
+    uint16_t childCount;
+    SymbolId symbol;         // function name
+    SymbolId sheet;          // sheet of a reference, NO_SYMBOL for the host sheet
+    NodeIndex firstChild;
+    NodeIndex nextSibling;
+    double number;           // CONSTANT or BOOLEAN value
+    int32_t row;             // reference, -1 if the address is invalid
+    int32_t col;
+    int32_t lastRow;         // end of a RANGE, equal to row/col for a single cell
+    int32_t lastCol;
+    int32_t sheetIndex;      // set by ReferenceBinder, -1 if unbound
+};
+
+// Contiguous node storage for parse trees. clear() releases a whole tree at
+// once and keeps the capacity, so parsing in a loop stops allocating.
+class AstArena {
+public:
+    NodeIndex add(AstKind kind);
+
+    AstNode& operator[](NodeIndex index) { return nodes[index]; }
+    const AstNode& operator[](NodeIndex index) const { return nodes[index]; }
+
+    // Append child as the last child of parent
+    void addChild(NodeIndex parent, NodeIndex child);
+
+    size_t size() const { return nodes.size(); }
+
+    size_t memoryBytes() const { return nodes.capacity() * sizeof(AstNode); }
+
+    void clear() { nodes.clear(); }
+
+private:
+    std::vector<AstNode> nodes;
+};
+
+// Rebuild a shared_ptr tree from arena nodes, for printTree and debugging
+std::shared_ptr<FormulaNode> toFormulaTree(const AstArena& arena, const SymbolTable& symbols, NodeIndex root);
@@ -0,0 +1,751 @@
+#include "stdafx.h"
+#include "formulaBytecode.h"
+#include "subexpressionTable.h"
+#include <algorithm>
+#include <cstring>
+
+FunctionId lookupFunction(const std::string& name) {
+    if (name == "SUM") return FunctionId::Sum;
+    if (name == "AVERAGE") return FunctionId::Average;
+    if (name == "MIN") return FunctionId::Min;
+    if (name == "MAX") return FunctionId::Max;
+    if (name == "COUNT") return FunctionId::Count;
+    if (name == "COUNTA") return FunctionId::CountA;
+    if (name == "SUMPRODUCT") return FunctionId::SumProduct;
+    if (name == "VLOOKUP") return FunctionId::VLookup;
+    if (name == "HLOOKUP") return FunctionId::HLookup;
+    if (name == "MATCH") return FunctionId::Match;
+    if (name == "INDEX") return FunctionId::Index;
+    if (name == "XLOOKUP") return FunctionId::XLookup;
+    return FunctionId::Unknown;
+}
+
+size_t Program::memoryBytes() const {
+    return sizeof(Program) +
+        code.capacity() * sizeof(Instruction) +
+        constants.capacity() * sizeof(Value) +
+        cells.capacity() * sizeof(CellKey) +
+        ranges.capacity() * sizeof(RangeRef) +
+        args.capacity() * sizeof(CallArg) +
+        cellAbsolute.capacity() + rangeAbsolute.capacity() +
+        shared.capacity() * sizeof(uint32_t);
+}
+
+bool shiftProgram(const Program& from, int dRow, int dCol, Program& to) {
+    to = from;
+    auto move = [](int& value, int delta, int limit) {
+        value += delta;
+        return value >= 0 && value < limit;
+    };
+
+    for (size_t i = 0; i < to.cells.size(); ++i) {
+        uint8_t absolute = to.cellAbsolute[i];
+        CellKey& cell = to.cells[i];
+        if (!(absolute & ABS_ROW) && !move(cell.row, dRow, MAX_SHEET_ROWS)) return false;
+        if (!(absolute & ABS_COL) && !move(cell.col, dCol, MAX_SHEET_COLS)) return false;
+    }
+    for (size_t i = 0; i < to.ranges.size(); ++i) {
+        uint8_t absolute = to.rangeAbsolute[i];
+        RangeRef& range = to.ranges[i];
+        if (!(absolute & ABS_ROW) && !move(range.firstRow, dRow, MAX_SHEET_ROWS)) return false;
+        if (!(absolute & ABS_COL) && !move(range.firstCol, dCol, MAX_SHEET_COLS)) return false;
+        if (!(absolute & ABS_LAST_ROW) && !move(range.lastRow, dRow, MAX_SHEET_ROWS)) return false;
+        if (!(absolute & ABS_LAST_COL) && !move(range.lastCol, dCol, MAX_SHEET_COLS)) return false;
+        if (range.lastRow < range.firstRow || range.lastCol < range.firstCol) return false;
+    }
+    return true;
+}
+
+ProgramBuilder::ProgramBuilder(Program& program) : program(program) {
+}
+
+void ProgramBuilder::emitConstant(Value value) {
+    program.code.push_back({ OpCode::PushConst, 0, (uint32_t)program.constants.size() });
+    program.constants.push_back(value);
+    push();
+}
+
+void ProgramBuilder::emitCell(const CellKey& cell, uint8_t absolute) {
+    program.code.push_back({ OpCode::LoadCell, 0, (uint32_t)program.cells.size() });
+    program.cells.push_back(cell);
+    program.cellAbsolute.push_back(absolute);
+    push();
+}
+
+void ProgramBuilder::emitShared(uint32_t id, const Program& subexpression) {
+    program.code.push_back({ OpCode::LoadShared, 0, (uint32_t)program.shared.size() });
+    program.shared.push_back(id);
+    program.cells.insert(program.cells.end(), subexpression.cells.begin(), subexpression.cells.end());
+    program.cellAbsolute.insert(program.cellAbsolute.end(), subexpression.cellAbsolute.begin(), subexpression.cellAbsolute.end());
+    program.ranges.insert(program.ranges.end(), subexpression.ranges.begin(), subexpression.ranges.end());
+    program.rangeAbsolute.insert(program.rangeAbsolute.end(), subexpression.rangeAbsolute.begin(), subexpression.rangeAbsolute.end());
+    push();
+}
+
+void ProgramBuilder::emitOperator(OpCode op, uint16_t argc) {
+    program.code.push_back({ op, argc, 0 });
+    pop(argc);
+    push();
+}
+
+uint32_t ProgramBuilder::addRange(const RangeRef& range, uint8_t absolute) {
+    program.ranges.push_back(range);
+    program.rangeAbsolute.push_back(absolute);
+    return (uint32_t)program.ranges.size() - 1;
+}
+
+void ProgramBuilder::emitCall(FunctionId function, const std::vector<CallArg>& arguments) {
+    uint32_t first = (uint32_t)program.args.size();
+    size_t stackArgs = 0;
+    for (auto arg : arguments) {
+        arg.function = (uint16_t)function;
+        if (arg.kind == CallArg::STACK) stackArgs++;
+        program.args.push_back(arg);
+    }
+    if (arguments.empty()) {
+        // Keep the function id reachable for zero-argument calls
+        program.args.push_back({ CallArg::STACK, (uint16_t)function, 0 });
+    }
+
+    program.code.push_back({ OpCode::Call, (uint16_t)arguments.size(), first });
+    pop(stackArgs);
+    push();
+}
+
+void ProgramBuilder::push() {
+    depth++;
+    if (depth > program.maxStack) program.maxStack = depth;
+}
+
+void ProgramBuilder::pop(size_t count) {
+    depth = (count > depth) ? 0 : depth - count;
+}
+
+Value numericValue(Value value, const StringPool& strings) {
+    switch (value.type()) {
+    case ValueType::Boolean:
+        return Value::number(value.asBoolean() ? 1.0 : 0.0);
+
+    case ValueType::String: {
+        double number = strings.number(value.asString());
+        return (number == number) ? Value::number(number) : Value::error(ErrorCode::Value);
+    }
+
+    case ValueType::Empty:
+        return Value::number(0.0);
+
+    default:
+        return value;
+    }
+}
+
+// Operator on two numbers; folds to one case when op is a constant
+static inline Value combine(OpCode op, double x, double y) {
+    switch (op) {
+    case OpCode::Add: return Value::number(x + y);
+    case OpCode::Sub: return Value::number(x - y);
+    case OpCode::Mul: return Value::number(x * y);
+    default: return (y != 0) ? Value::number(x / y) : Value::error(ErrorCode::Div0);
+    }
+}
+
+Value arithmetic(OpCode op, Value left, Value right, const StringPool& strings) {
+    left = numericValue(left, strings);
+    if (left.isError()) return left;
+    right = numericValue(right, strings);
+    if (right.isError()) return right;
+    return combine(op, left.asNumber(), right.asNumber());
+}
+
+// Two numbers take the inline path, anything else goes through arithmetic
+static inline Value binary(OpCode op, Value left, Value right, const StringPool& strings) {
+    if (left.isNumber() && right.isNumber()) return combine(op, left.asNumber(), right.asNumber());
+    return arithmetic(op, left, right, strings);
+}
+
+Value FormulaVM::run(const Program& program, CellValueReader& reader) {
+    if (program.code.empty()) return Value::number(0.0);
+
+    // Releases this run's stack frame, also when a cell read throws
+    struct Frame {
+        size_t& top;
+        size_t base;
+        ~Frame() { top = base; }
+    } frame{ top, top };
+
+    size_t base = frame.base;
+    if (stack.size() < base + program.maxStack) {
+        stack.resize(base + program.maxStack);
+    }
+    top = base + program.maxStack;
+
+    const StringPool& strings = reader.strings();
+
+    // Stack slots are addressed by index: a nested run may grow the vector
+    size_t sp = base;
+    for (const Instruction& ins : program.code) {
+        switch (ins.op) {
+        case OpCode::PushConst:
+            stack[sp++] = program.constants[ins.operand];
+            break;
+
+        case OpCode::LoadCell: {
+            Value value = reader.cellValue(program.cells[ins.operand]);
+            stack[sp++] = value;
+            break;
+        }
+
+        case OpCode::Add:
+            sp--;
+            stack[sp - 1] = binary(OpCode::Add, stack[sp - 1], stack[sp], strings);
+            break;
+
+        case OpCode::Sub:
+            sp--;
+            stack[sp - 1] = binary(OpCode::Sub, stack[sp - 1], stack[sp], strings);
+            break;
+
+        case OpCode::Mul:
+            sp--;
+            stack[sp - 1] = binary(OpCode::Mul, stack[sp - 1], stack[sp], strings);
+            break;
+
+        case OpCode::Div:
+            sp--;
+            stack[sp - 1] = binary(OpCode::Div, stack[sp - 1], stack[sp], strings);
+            break;
+
+        case OpCode::AddN: {
+            sp -= ins.argc;
+            Value value = stack[sp];
+            for (uint16_t i = 1; i < ins.argc; ++i) value = binary(OpCode::Add, value, stack[sp + i], strings);
+            stack[sp++] = value;
+            break;
+        }
+
+        case OpCode::MulN: {
+            sp -= ins.argc;
+            Value value = stack[sp];
+            for (uint16_t i = 1; i < ins.argc; ++i) value = binary(OpCode::Mul, value, stack[sp + i], strings);
+            stack[sp++] = value;
+            break;
+        }
+
+        case OpCode::Call: {
+            Value value = call(program, ins, sp, reader);
+            stack[sp++] = value;
+            break;
+        }
+
+        case OpCode::LoadShared: {
+            Value value = reader.sharedValue(program.shared[ins.operand]);
+            stack[sp++] = value;
+            break;
+        }
+        }
+    }
+
+    Value result = (sp > base) ? stack[sp - 1] : Value::number(0.0);
+    return (result.type() == ValueType::Empty) ? Value::number(0.0) : result;
+}
+
+// Pops the call's stack arguments and returns the function result
+Value FormulaVM::call(const Program& program, const Instruction& ins, size_t& sp, CellValueReader& reader) {
+    const CallArg* args = &program.args[ins.operand];
+
+    size_t stackArgs = 0;
+    for (uint16_t i = 0; i < ins.argc; ++i) {
+        if (args[i].kind == CallArg::STACK) stackArgs++;
+    }
+    sp -= stackArgs;
+
+    // Copied out: range reads may evaluate formulas and grow the stack
+    Value local[8];
+    std::vector<Value> many;
+    Value* values = local;
+    if (stackArgs > 8) {
+        many.resize(stackArgs);
+        values = many.data();
+    }
+    std::copy(stack.begin() + sp, stack.begin() + sp + stackArgs, values);
+
+    return callFunction(program, ins, values, program.ranges.data(), reader);
+}
+
+// Whether the arguments of a call are of the given kinds, S a stack value
+// and R a range; only the first required ones are mandatory
+static bool argumentsMatch(const CallArg* args, uint16_t argc, const char* kinds, uint16_t required) {
+    if (argc < required || argc > strlen(kinds)) return false;
+    for (uint16_t i = 0; i < argc; ++i) {
+        if ((kinds[i] == 'R') != (args[i].kind == CallArg::RANGE)) return false;
+    }
+    return true;
+}
+
+static bool isLine(const RangeRef& range) {
+    return range.firstRow == range.lastRow || range.firstCol == range.lastCol;
+}
+
+// Scalar argument as a number; false, with the error to return, if it is not one
+static bool numberArgument(Value value, const StringPool& strings, double& number, Value& error) {
+    Value converted = numericValue(value, strings);
+    if (converted.isError()) {
+        error = converted;
+        return false;
+    }
+    number = converted.asNumber();
+    return true;
+}
+
+Value callFunction(const Program& program, const Instruction& ins, const Value* values,
+    const RangeRef* ranges, CellValueReader& reader) {
+    const CallArg* args = &program.args[ins.operand];
+    FunctionId function = (FunctionId)args[0].function;
+    const StringPool& strings = reader.strings();
+    Value error;
+
+    size_t stackArgs = 0;
+    for (uint16_t i = 0; i < ins.argc; ++i) {
+        if (args[i].kind == CallArg::STACK) stackArgs++;
+    }
+
+    switch (function) {
+    case FunctionId::Sum:
+    case FunctionId::Average:
+    case FunctionId::Min:
+    case FunctionId::Max:
+    case FunctionId::Count:
+    case FunctionId::CountA: {
+        AggregateState state;
+        size_t slot = 0;
+        for (uint16_t i = 0; i < ins.argc; ++i) {
+            if (args[i].kind == CallArg::RANGE && (function == FunctionId::Min || function == FunctionId::Max)) {
+                reader.rangeAggregate(ranges[args[i].range], state);
+                continue;
+            }
+            if (args[i].kind == CallArg::RANGE) {
+                reader.rangeTotals(ranges[args[i].range], state);
+                continue;
+            }
+
+            // Scalars: text that is not a number is skipped like in a range,
+            // COUNT and COUNTA skip errors as well
+            Value value = values[slot++];
+            ValueType type = value.type();
+            if (type == ValueType::Empty) continue;
+            if (function == FunctionId::CountA) {
+                state.counta += 1.0;
+                continue;
+            }
+            if (type == ValueType::Error) {
+                if (function == FunctionId::Count) continue;
+                return value;
+            }
+            Value number = numericValue(value, strings);
+            if (number.isNumber()) state.addNumber(number.asNumber());
+        }
+
+        if (state.error.isError() && function != FunctionId::Count && function != FunctionId::CountA) {
+            return state.error;
+        }
+        switch (function) {
+        case FunctionId::Sum: return Value::number(state.sum);
+        case FunctionId::Average:
+            return (state.count > 0) ? Value::number(state.sum / state.count) : Value::error(ErrorCode::Div0);
+        case FunctionId::Min: return Value::number((state.count > 0) ? state.min : 0.0);
+        case FunctionId::Max: return Value::number((state.count > 0) ? state.max : 0.0);
+        case FunctionId::Count: return Value::number(state.count);
+        default: return Value::number(state.counta);
+        }
+    }
+
+    case FunctionId::SumProduct: {
+        if (stackArgs == ins.argc) {
+            // Scalars are 1x1 arrays
+            double product = 1.0;
+            for (size_t i = 0; i < stackArgs; ++i) {
+                double number;
+                if (!numberArgument(values[i], strings, number, error)) return error;
+                product *= number;
+            }
+            return Value::number((stackArgs > 0) ? product : 0.0);
+        }
+        if (stackArgs > 0) return Value::error(ErrorCode::Value);
+
+        RangeRef local[8];
+        std::vector<RangeRef> many;
+        RangeRef* operands = local;
+        if (ins.argc > 8) {
+            many.resize(ins.argc);
+            operands = many.data();
+        }
+        for (uint16_t i = 0; i < ins.argc; ++i) {
+            operands[i] = ranges[args[i].range];
+        }
+
+        Value result;
+        return reader.rangeSumProduct(operands, ins.argc, result) ? result : Value::error(ErrorCode::Value);
+    }
+
+    // Lookups that find nothing give #N/A, or XLOOKUP's if-not-found value.
+    // An error as the key is the result.
+    case FunctionId::VLookup:
+    case FunctionId::HLookup: {
+        // key, table, index [, approximate]
+        if (!argumentsMatch(args, ins.argc, "SRSS", 3)) return Value::error(ErrorCode::Value);
+        if (values[0].isError()) return values[0];
+        const RangeRef& table = ranges[args[1].range];
+        bool vertical = function == FunctionId::VLookup;
+        double column, approximate = 1.0;
+        if (!numberArgument(values[1], strings, column, error)) return error;
+        if (ins.argc > 3 && !numberArgument(values[2], strings, approximate, error)) return error;
+        int index = (int)column;
+        int width = vertical ? table.lastCol - table.firstCol + 1 : table.lastRow - table.firstRow + 1;
+        if (index < 1) return Value::error(ErrorCode::Value);
+        if (index > width) return Value::error(ErrorCode::Ref);
+
+        // Approximate matching assumes sorted keys and takes the last of
+        // equal ones, like a binary search over them would
+        RangeRef line = table;
+        if (vertical) {
+            line.lastCol = line.firstCol;
+        }
+        else {
+            line.lastRow = line.firstRow;
+        }
+        int position = reader.lookupPosition(line, values[0],
+            approximate != 0 ? LookupMatch::Floor : LookupMatch::Exact, approximate != 0);
+        if (position < 0) return Value::error(ErrorCode::NA);
+
+        return vertical ?
+            reader.cellValue(CellKey{ table.sheet, table.firstRow + position, table.firstCol + index - 1 }) :
+            reader.cellValue(CellKey{ table.sheet, table.firstRow + index - 1, table.firstCol + position });
+    }
+
+    case FunctionId::Match: {
+        // key, line [, type]: 1 largest not above, 0 exact, -1 smallest not below
+        if (!argumentsMatch(args, ins.argc, "SRS", 2)) return Value::error(ErrorCode::Value);
+        if (values[0].isError()) return values[0];
+        const RangeRef& line = ranges[args[1].range];
+        if (!isLine(line)) return Value::error(ErrorCode::NA);
+
+        double type = 1.0;
+        if (ins.argc > 2 && !numberArgument(values[1], strings, type, error)) return error;
+        LookupMatch match = (type > 0) ? LookupMatch::Floor : (type < 0) ? LookupMatch::Ceiling : LookupMatch::Exact;
+        int position = reader.lookupPosition(line, values[0], match, type != 0);
+        return (position < 0) ? Value::error(ErrorCode::NA) : Value::number(position + 1.0);
+    }
+
+    case FunctionId::Index: {
+        // range, row [, column]; a one-row range takes the column alone
+        if (!argumentsMatch(args, ins.argc, "RSS", 2)) return Value::error(ErrorCode::Value);
+        const RangeRef& range = ranges[args[0].range];
+        double rowNumber, colNumber = 1.0;
+        if (!numberArgument(values[0], strings, rowNumber, error)) return error;
+        if (ins.argc > 2 && !numberArgument(values[1], strings, colNumber, error)) return error;
+        int row = (int)rowNumber;
+        int col = (int)colNumber;
+        if (ins.argc < 3 && range.firstRow == range.lastRow) {
+            col = row;
+            row = 1;
+        }
+        if (row < 1 || col < 1) return Value::error(ErrorCode::Value);
+        if (row > range.lastRow - range.firstRow + 1 || col > range.lastCol - range.firstCol + 1) {
+            return Value::error(ErrorCode::Ref);
+        }
+        return reader.cellValue(CellKey{ range.sheet, range.firstRow + row - 1, range.firstCol + col - 1 });
+    }
+
+    case FunctionId::XLookup: {
+        // key, lookup line, result range [, if not found [, match mode [, search mode]]]
+        if (!argumentsMatch(args, ins.argc, "SRRSSS", 3)) return Value::error(ErrorCode::Value);
+        if (values[0].isError()) return values[0];
+        const RangeRef& line = ranges[args[1].range];
+        const RangeRef& result = ranges[args[2].range];
+        if (!isLine(line)) return Value::error(ErrorCode::Value);
+
+        Value notFound = (ins.argc > 3) ? values[1] : Value::error(ErrorCode::NA);
+        double mode = 0.0, search = 1.0;
+        if (ins.argc > 4 && !numberArgument(values[2], strings, mode, error)) return error;
+        if (ins.argc > 5 && !numberArgument(values[3], strings, search, error)) return error;
+
+        // Mode -1 is exact or next smaller, 1 exact or next larger; wildcards
+        // (2) match exactly. Negative search modes search from the end.
+        LookupMatch match = (mode == -1) ? LookupMatch::Floor : (mode == 1) ? LookupMatch::Ceiling : LookupMatch::Exact;
+        int position = reader.lookupPosition(line, values[0], match, search < 0);
+        if (position < 0) return notFound;
+
+        bool vertical = line.firstCol == line.lastCol && line.firstRow != line.lastRow;
+        CellKey cell = vertical ? CellKey{ result.sheet, result.firstRow + position, result.firstCol } :
+                                  CellKey{ result.sheet, result.firstRow, result.firstCol + position };
+        if (cell.row > result.lastRow || cell.col > result.lastCol) return notFound;
+        return reader.cellValue(cell);
+    }
+
+    case FunctionId::Unknown:
+        break;
+    }
+
+    return Value::error(ErrorCode::Name);
+}
+
+ColumnVM::ColumnVM(const SubexpressionTable* subexpressions) : subexpressions(subexpressions) {
+}
+
+void ColumnVM::run(const Program& program, size_t lanes, CellValueReader& reader, Value* out) {
+    if (program.code.empty() || lanes == 0) {
+        std::fill(out, out + lanes, Value::number(0.0));
+        return;
+    }
+
+    execute(program, lanes, reader, 0);
+    for (size_t i = 0; i < lanes; ++i) {
+        out[i] = (stack[i].type() == ValueType::Empty) ? Value::number(0.0) : stack[i];
+    }
+}
+
+// a[i] = a[i] op b[i]. When every lane holds numbers the loop is plain
+// double arithmetic, which the compiler vectorizes; otherwise each lane is
+// converted on its own.
+static void combineLanes(OpCode op, Value* a, const Value* b, size_t lanes, const StringPool& strings) {
+    bool numbers = true;
+    for (size_t i = 0; i < lanes; ++i) {
+        numbers &= a[i].isNumber() & b[i].isNumber();
+    }
+    if (!numbers) {
+        for (size_t i = 0; i < lanes; ++i) a[i] = binary(op, a[i], b[i], strings);
+        return;
+    }
+
+    switch (op) {
+    case OpCode::Add:
+        for (size_t i = 0; i < lanes; ++i) a[i] = combine(OpCode::Add, a[i].asNumber(), b[i].asNumber());
+        break;
+    case OpCode::Sub:
+        for (size_t i = 0; i < lanes; ++i) a[i] = combine(OpCode::Sub, a[i].asNumber(), b[i].asNumber());
+        break;
+    case OpCode::Mul:
+        for (size_t i = 0; i < lanes; ++i) a[i] = combine(OpCode::Mul, a[i].asNumber(), b[i].asNumber());
+        break;
+    default:
+        for (size_t i = 0; i < lanes; ++i) a[i] = combine(OpCode::Div, a[i].asNumber(), b[i].asNumber());
+        break;
+    }
+}
+
+void ColumnVM::execute(const Program& program, size_t lanes, CellValueReader& reader, size_t base) {
+    if (stack.size() < (base + program.maxStack + 1) * lanes) {
+        stack.resize((base + program.maxStack + 1) * lanes);
+    }
+    // Addressed by index: a nested subexpression may grow the stack
+    auto slot = [&](size_t index) { return stack.data() + index * lanes; };
+    const StringPool& strings = reader.strings();
+
+    size_t sp = base;
+    for (const Instruction& ins : program.code) {
+        switch (ins.op) {
+        case OpCode::PushConst:
+            std::fill(slot(sp), slot(sp) + lanes, program.constants[ins.operand]);
+            sp++;
+            break;
+
+        case OpCode::LoadCell: {
+            const CellKey& cell = program.cells[ins.operand];
+            if (program.cellAbsolute[ins.operand] & ABS_ROW) {
+                Value value = reader.cellValue(cell);
+                std::fill(slot(sp), slot(sp) + lanes, value);
+            }
+            else {
+                reader.cellColumn(cell, lanes, slot(sp));
+            }
+            sp++;
+            break;
+        }
+
+        case OpCode::LoadShared:
+            if (subexpressions) {
+                execute(subexpressions->program(program.shared[ins.operand]), lanes, reader, sp);
+            }
+            else {
+                std::fill(slot(sp), slot(sp) + lanes, Value::number(0.0));
+            }
+            sp++;
+            break;
+
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        case OpCode::Div:
+            sp--;
+            combineLanes(ins.op, slot(sp - 1), slot(sp), lanes, strings);
+            break;
+
+        case OpCode::AddN:
+        case OpCode::MulN: {
+            sp -= ins.argc;
+            OpCode op = (ins.op == OpCode::AddN) ? OpCode::Add : OpCode::Mul;
+            for (uint16_t k = 1; k < ins.argc; ++k) {
+                combineLanes(op, slot(sp), slot(sp + k), lanes, strings);
+            }
+            sp++;
+            break;
+        }
+
+        case OpCode::Call: {
+            // Functions run lane by lane, on the lane's shifted ranges
+            const CallArg* args = &program.args[ins.operand];
+            size_t stackArgs = 0;
+            for (uint16_t i = 0; i < ins.argc; ++i) {
+                if (args[i].kind == CallArg::STACK) stackArgs++;
+            }
+            size_t first = sp - stackArgs;
+            std::vector<Value> values(stackArgs);
+            std::vector<RangeRef> ranges = program.ranges;
+
+            for (size_t lane = 0; lane < lanes; ++lane) {
+                for (size_t i = 0; i < stackArgs; ++i) {
+                    values[i] = slot(first + i)[lane];
+                }
+                Value value = callFunction(program, ins, values.data(), ranges.data(), reader);
+                slot(first)[lane] = value;
+
+                // Move relative corners down to the next lane's row
+                for (size_t i = 0; i < ranges.size(); ++i) {
+                    if (!(program.rangeAbsolute[i] & ABS_ROW)) ranges[i].firstRow++;
+                    if (!(program.rangeAbsolute[i] & ABS_LAST_ROW)) ranges[i].lastRow++;
+                }
+            }
+            sp = first + 1;
+            break;
+        }
+        }
+    }
+
+    if (sp == base) {
+        std::fill(slot(base), slot(base) + lanes, Value::number(0.0));
+    }
+    else if (sp - 1 != base) {
+        std::copy(slot(sp - 1), slot(sp - 1) + lanes, slot(base));
+    }
+}
+
+ScenarioVM::ScenarioVM(const SubexpressionTable* subexpressions) : subexpressions(subexpressions) {
+}
+
+void ScenarioVM::run(const Program& program, size_t lanes, ScenarioReader& reader, Value* out) {
+    if (program.code.empty() || lanes == 0) {
+        std::fill(out, out + lanes, Value::number(0.0));
+        return;
+    }
+
+    execute(program, lanes, reader, 0);
+    for (size_t i = 0; i < lanes; ++i) {
+        out[i] = (stack[i].type() == ValueType::Empty) ? Value::number(0.0) : stack[i];
+    }
+}
+
+void ScenarioVM::execute(const Program& program, size_t lanes, ScenarioReader& reader, size_t base) {
+    if (stack.size() < (base + program.maxStack + 1) * lanes) {
+        stack.resize((base + program.maxStack + 1) * lanes);
+    }
+    // Addressed by index: a nested subexpression may grow the stack
+    auto slot = [&](size_t index) { return stack.data() + index * lanes; };
+    const StringPool& strings = reader.strings();
+
+    size_t sp = base;
+    for (const Instruction& ins : program.code) {
+        switch (ins.op) {
+        case OpCode::PushConst:
+            std::fill(slot(sp), slot(sp) + lanes, program.constants[ins.operand]);
+            sp++;
+            break;
+
+        case OpCode::LoadCell: {
+            const CellKey& cell = program.cells[ins.operand];
+            const Value* values = reader.laneValues(cell);
+            if (values) {
+                std::copy(values, values + lanes, slot(sp));
+            }
+            else {
+                std::fill(slot(sp), slot(sp) + lanes, reader.cellValue(cell));
+            }
+            sp++;
+            break;
+        }
+
+        case OpCode::LoadShared:
+            if (subexpressions) {
+                execute(subexpressions->program(program.shared[ins.operand]), lanes, reader, sp);
+            }
+            else {
+                std::fill(slot(sp), slot(sp) + lanes, Value::number(0.0));
+            }
+            sp++;
+            break;
+
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        case OpCode::Div:
+            sp--;
+            combineLanes(ins.op, slot(sp - 1), slot(sp), lanes, strings);
+            break;
+
+        case OpCode::AddN:
+        case OpCode::MulN: {
+            sp -= ins.argc;
+            OpCode op = (ins.op == OpCode::AddN) ? OpCode::Add : OpCode::Mul;
+            for (uint16_t k = 1; k < ins.argc; ++k) {
+                combineLanes(op, slot(sp), slot(sp + k), lanes, strings);
+            }
+            sp++;
+            break;
+        }
+
+        case OpCode::Call: {
+            const CallArg* args = &program.args[ins.operand];
+            size_t stackArgs = 0;
+            bool varies = false;
+            for (uint16_t i = 0; i < ins.argc; ++i) {
+                if (args[i].kind == CallArg::STACK) {
+                    stackArgs++;
+                }
+                else if (reader.rangeVaries(program.ranges[args[i].range])) {
+                    varies = true;
+                }
+            }
+            size_t first = sp - stackArgs;
+            for (size_t i = 0; i < stackArgs && !varies; ++i) {
+                const Value* lane = slot(first + i);
+                for (size_t k = 1; k < lanes; ++k) {
+                    if (lane[k].raw() != lane[0].raw()) {
+                        varies = true;
+                        break;
+                    }
+                }
+            }
+
+            // The same arguments everywhere give the same result everywhere
+            values.resize(stackArgs);
+            size_t runs = varies ? lanes : 1;
+            for (size_t lane = 0; lane < runs; ++lane) {
+                for (size_t i = 0; i < stackArgs; ++i) {
+                    values[i] = slot(first + i)[lane];
+                }
+                reader.setLane(lane);
+                slot(first)[lane] = callFunction(program, ins, values.data(), program.ranges.data(), reader);
+            }
+            if (!varies) std::fill(slot(first) + 1, slot(first) + lanes, slot(first)[0]);
+            sp = first + 1;
+            break;
+        }
+        }
+    }
+
+    if (sp == base) {
+        std::fill(slot(base), slot(base) + lanes, Value::number(0.0));
+    }
+    else if (sp - 1 != base) {
+        std::copy(slot(sp - 1), slot(sp - 1) + lanes, slot(base));
+    }
+}
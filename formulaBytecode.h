@@ -0,0 +1,252 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "formulaTypes.h"
+#include "formulaValue.h"
+#include "rangeKernels.h"
+#include "stringPool.h"
+
+class SubexpressionTable;
+
+// Rectangular block of cells on one sheet, bounds inclusive
+struct RangeRef {
+    int sheet;
+    int firstRow;
+    int firstCol;
+    int lastRow;
+    int lastCol;
+};
+
+enum class OpCode : uint8_t {
+    PushConst,   // operand: index into constants
+    LoadCell,    // operand: index into cells
+    Add,
+    Sub,
+    Mul,
+    Div,
+    AddN,        // argc: operand count, summed left to right
+    MulN,        // argc: operand count, multiplied left to right
+    Call,        // operand: first entry in args, argc: argument count
+    LoadShared,  // operand: index into shared
+};
+
+// Built-in functions known to the compiler
+enum class FunctionId : uint16_t {
+    Unknown,
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+    CountA,
+    SumProduct,
+    VLookup,
+    HLookup,
+    Match,
+    Index,
+    XLookup,
+};
+
+FunctionId lookupFunction(const std::string& name);
+
+struct Instruction {
+    OpCode op;
+    uint16_t argc;
+    uint32_t operand;
+};
+
+// Function argument: either a value on the stack or a range operand
+struct CallArg {
+    enum Kind : uint8_t {
+        STACK,
+        RANGE
+    };
+
+    Kind kind;
+    uint16_t function;   // FunctionId of the call, set on the first argument
+    uint32_t range;      // index into ranges for RANGE arguments
+};
+
+// Formula lowered to a flat postfix instruction stream
+struct Program {
+    std::vector<Instruction> code;
+    std::vector<Value> constants;
+    std::vector<CellKey> cells;
+    std::vector<RangeRef> ranges;
+    std::vector<CallArg> args;
+    std::vector<uint8_t> cellAbsolute;    // AbsoluteFlags per entry in cells
+    std::vector<uint8_t> rangeAbsolute;   // AbsoluteFlags per entry in ranges
+    std::vector<uint32_t> shared;         // SubexpressionTable ids
+    size_t maxStack = 0;
+
+    size_t memoryBytes() const;
+};
+
+// Program of the same formula copied dRow rows down and dCol columns right:
+// references not marked absolute move along. False if one leaves the sheet.
+// Shared subexpression ids are copied as they are, for the caller to move.
+bool shiftProgram(const Program& from, int dRow, int dCol, Program& to);
+
+// Appends instructions to a program while tracking the stack depth
+class ProgramBuilder {
+public:
+    explicit ProgramBuilder(Program& program);
+
+    void emitConstant(Value value);
+
+    void emitCell(const CellKey& cell, uint8_t absolute = 0);
+
+    // Binary operator, or AddN / MulN over argc operands
+    void emitOperator(OpCode op, uint16_t argc = 2);
+
+    uint32_t addRange(const RangeRef& range, uint8_t absolute = 0);
+
+    // Load shared subexpression id. Its references are appended to the
+    // program's own, which keep listing every cell the formula reads.
+    void emitShared(uint32_t id, const Program& subexpression);
+
+    // Scalar arguments must already be on the stack, in argument order
+    void emitCall(FunctionId function, const std::vector<CallArg>& arguments);
+
+private:
+    void push();
+
+    void pop(size_t count);
+
+    Program& program;
+    size_t depth = 0;
+};
+
+// How a lookup compares cells with its key
+enum class LookupMatch : uint8_t {
+    Exact,
+    Floor,      // largest value not above the key
+    Ceiling     // smallest value not below the key
+};
+
+// Source of cell values for the VM
+class CellValueReader {
+public:
+    virtual ~CellValueReader() {}
+
+    virtual Value cellValue(const CellKey& cell) = 0;
+
+    // Fold the cells of a range into an aggregate
+    virtual void rangeAggregate(const RangeRef& range, AggregateState& state) = 0;
+
+    // Sum, count and counta of a range only, which readers may answer
+    // without visiting the cells
+    virtual void rangeTotals(const RangeRef& range, AggregateState& state) {
+        rangeAggregate(range, state);
+    }
+
+    // SUMPRODUCT of equally shaped ranges, or the first error cell in them;
+    // false if the shapes differ
+    virtual bool rangeSumProduct(const RangeRef* ranges, size_t count, Value& result) = 0;
+
+    // Value of a SubexpressionTable entry
+    virtual Value sharedValue(uint32_t id) = 0;
+
+    // Position in line, part of one row or column, of the cell matching
+    // key; among equal values the first, or the last if last is set. -1 if
+    // none matches. Numbers only match numbers and texts texts, ignoring
+    // case; approximate matches do not apply to booleans.
+    virtual int lookupPosition(const RangeRef& line, Value key, LookupMatch match, bool last) = 0;
+
+    // Values of count cells down a column starting at first
+    virtual void cellColumn(const CellKey& first, size_t count, Value* out) {
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = cellValue(CellKey{ first.sheet, first.row + (int)i, first.col });
+        }
+    }
+
+    // Texts the STRING values handed out refer to
+    virtual const StringPool& strings() const = 0;
+};
+
+// A value as an operand of arithmetic: booleans are 0 or 1, empty cells 0
+// and text its number, or #VALUE! if it is not one. Numbers and errors
+// stay as they are.
+Value numericValue(Value value, const StringPool& strings);
+
+// Add, Sub, Mul or Div on two values of any type; errors propagate, the
+// left one first, and dividing by 0 gives #DIV/0!
+Value arithmetic(OpCode op, Value left, Value right, const StringPool& strings);
+
+// Function call of a program. values holds the stack arguments in order;
+// ranges replaces program.ranges, so callers can pass shifted copies.
+// Errors among scalar arguments propagate; inside ranges they are skipped
+// like text, so SUM over a column holding #N/A still adds up its numbers.
+Value callFunction(const Program& program, const Instruction& ins, const Value* values,
+    const RangeRef* ranges, CellValueReader& reader);
+
+// Stack machine executing compiled programs.
+// Runs may nest (a cell load can evaluate another formula), each run
+// working on the part of the stack above its caller. Nothing is thrown
+// for bad operands: they produce error values, which flow on as results.
+class FormulaVM {
+public:
+    // An empty result, such as a reference to an empty cell, reads as 0
+    Value run(const Program& program, CellValueReader& reader);
+
+private:
+    Value call(const Program& program, const Instruction& ins, size_t& sp, CellValueReader& reader);
+
+    std::vector<Value> stack;
+    size_t top = 0;
+};
+
+// Runs one program for a block of consecutive rows, one lane per row. The
+// program is the one of the first row; cells and range corners not marked
+// absolute move down one row per lane, so loads become column reads and
+// arithmetic runs over whole arrays.
+class ColumnVM {
+public:
+    // Shared subexpressions are evaluated inline from their programs, as
+    // each lane needs its own moved copy
+    explicit ColumnVM(const SubexpressionTable* subexpressions = nullptr);
+
+    void run(const Program& program, size_t lanes, CellValueReader& reader, Value* out);
+
+private:
+    // Run program on the stack slots from base up, leaving the result in slot base
+    void execute(const Program& program, size_t lanes, CellValueReader& reader, size_t base);
+
+    const SubexpressionTable* subexpressions;
+    std::vector<Value> stack;       // slots of lanes values each
+};
+
+// Cell values for ScenarioVM. Cells that differ between scenarios hold one
+// value per lane; everything else is read once through CellValueReader,
+// whose calls see the scenario last selected with setLane.
+class ScenarioReader : public CellValueReader {
+public:
+    // Values of cell per lane, null if it is the same in every scenario
+    virtual const Value* laneValues(const CellKey& cell) const = 0;
+
+    // Whether any cell of range differs between scenarios
+    virtual bool rangeVaries(const RangeRef& range) const = 0;
+
+    virtual void setLane(size_t lane) = 0;
+};
+
+// Runs one program for many what-if scenarios at once, one lane per
+// scenario. Operands the scenarios share are loaded once and broadcast;
+// arithmetic runs over whole lane arrays, and a function call runs once
+// when its arguments are the same in every lane, else lane by lane.
+class ScenarioVM {
+public:
+    // Shared subexpressions are evaluated inline, as their values differ
+    // between lanes
+    explicit ScenarioVM(const SubexpressionTable* subexpressions = nullptr);
+
+    void run(const Program& program, size_t lanes, ScenarioReader& reader, Value* out);
+
+private:
+    void execute(const Program& program, size_t lanes, ScenarioReader& reader, size_t base);
+
+    const SubexpressionTable* subexpressions;
+    std::vector<Value> stack;       // slots of lanes values each
+    std::vector<Value> values;      // arguments of the call being run
+};
@@ -0,0 +1,226 @@
+#include "stdafx.h"
+#include "formulaCache.h"
+#include "textEncoding.h"
+
+FormulaCache::FormulaCache(size_t maxBytes, size_t maxCells)
+    : maxBytes(maxBytes), maxCells(maxCells) {
+}
+
+namespace {
+
+template <typename CharT>
+bool isAsciiAlpha(CharT c) { return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'); }
+
+template <typename CharT>
+bool isAsciiAlnum(CharT c) { return isAsciiAlpha(c) || (c >= '0' && c <= '9'); }
+
+template <typename CharT>
+bool isAsciiSpace(CharT c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f'; }
+
+template <typename CharT>
+void normalizeText(std::basic_string_view<CharT> formula, std::string& result, int hostSheet) {
+    size_t start = 0;
+    if (start < formula.length() && formula[start] == '=') start++;
+    if (start < formula.length() && formula[start] == '+') start++;
+
+    result.clear();
+    result.reserve(formula.length() - start);
+
+    bool unqualified = false;   // a reference that binds to the host sheet
+    size_t i = start;
+    while (i < formula.length()) {
+        CharT c = formula[i];
+        if (isAsciiSpace(c)) {
+            i++;
+            continue;
+        }
+
+        if (c == '\'') {
+            // Quoted sheet names are copied verbatim, spaces and case included
+            size_t end = i + 1;
+            while (end < formula.length()) {
+                if (formula[end] == '\'') {
+                    if (end + 1 < formula.length() && formula[end + 1] == '\'') {
+                        end += 2;
+                        continue;
+                    }
+                    end++;
+                    break;
+                }
+                end++;
+            }
+            while (i < end) {
+                appendUtf8At(formula, i, result);
+            }
+            continue;
+        }
+
+        if (isAsciiAlpha(c) || c == '$') {
+            // Sheet names keep their case, everything else is case-insensitive
+            size_t end = i;
+            while (end < formula.length() && (isAsciiAlnum(formula[end]) || formula[end] == '_' || formula[end] == '$')) {
+                end++;
+            }
+            bool isSheetName = end < formula.length() && formula[end] == '!';
+            bool isFunction = end < formula.length() && formula[end] == '(';
+            bool qualified = !result.empty() && (result.back() == '!' || result.back() == ':');
+            if (!isSheetName && !isFunction && !qualified) unqualified = true;
+
+            for (size_t j = i; j < end; ++j) {
+                char ch = char(formula[j]);
+                result += (isSheetName || ch < 'a' || ch > 'z') ? ch : char(ch - 'a' + 'A');
+            }
+            i = end;
+            continue;
+        }
+
+        appendUtf8At(formula, i, result);
+    }
+
+    // The same text means different cells on different sheets
+    if (unqualified && hostSheet >= 0) {
+        result += '@';
+        result += std::to_string(hostSheet);
+    }
+}
+
+} // namespace
+
+std::string FormulaCache::normalize(const std::string& formula) {
+    std::string result;
+    normalizeText(std::string_view(formula), result, -1);
+    return result;
+}
+
+void FormulaCache::normalize(std::string_view formula, std::string& out, int hostSheet) {
+    normalizeText(formula, out, hostSheet);
+}
+
+void FormulaCache::normalize(std::wstring_view formula, std::string& out, int hostSheet) {
+    normalizeText(formula, out, hostSheet);
+}
+
+std::shared_ptr<CompiledFormula> FormulaCache::findByCell(const CellKey& key) {
+    auto it = byCell.find(key);
+    if (it == byCell.end()) return nullptr;
+
+    auto formula = it->second.lock();
+    if (!formula) {
+        // Evicted since the cell was bound
+        byCell.erase(it);
+        return nullptr;
+    }
+
+    auto textIt = byText.find(formula->text);
+    if (textIt != byText.end()) touch(textIt->second);
+    stats.cellHits++;
+    return formula;
+}
+
+std::shared_ptr<CompiledFormula> FormulaCache::findByText(const std::string& normalizedText) {
+    auto it = byText.find(normalizedText);
+    if (it == byText.end()) return nullptr;
+
+    touch(it->second);
+    stats.textHits++;
+    return *it->second;
+}
+
+void FormulaCache::insert(std::shared_ptr<CompiledFormula> formula, FormulaOrigin origin) {
+    if (!formula) return;
+    switch (origin) {
+    case FormulaOrigin::Parsed: stats.misses++; break;
+    case FormulaOrigin::Derived: stats.derived++; break;
+    case FormulaOrigin::Loaded: stats.loaded++; break;
+    }
+
+    if (formula->memoryBytes == 0) {
+        formula->memoryBytes = sizeof(CompiledFormula) + formula->text.capacity() +
+            formula->program.memoryBytes();
+    }
+
+    auto existing = byText.find(formula->text);
+    if (existing != byText.end()) {
+        usedBytes -= (*existing->second)->memoryBytes;
+        lru.erase(existing->second);
+        byText.erase(existing);
+    }
+
+    lru.push_front(formula);
+    byText[formula->text] = lru.begin();
+    usedBytes += formula->memoryBytes;
+
+    evict();
+}
+
+void FormulaCache::bindCell(const CellKey& key, std::shared_ptr<CompiledFormula> formula) {
+    if (byCell.size() >= maxCells) {
+        // Drop index entries whose formula is gone before giving up on the index
+        for (auto it = byCell.begin(); it != byCell.end();) {
+            if (it->second.expired()) {
+                it = byCell.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        if (byCell.size() >= maxCells) {
+            byCell.clear();
+        }
+    }
+    byCell[key] = formula;
+}
+
+void FormulaCache::eraseCell(const CellKey& key) {
+    byCell.erase(key);
+}
+
+void FormulaCache::eraseSheet(int sheet) {
+    for (auto it = byCell.begin(); it != byCell.end();) {
+        if (it->first.sheet == sheet) {
+            it = byCell.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void FormulaCache::clearCellIndex() {
+    byCell.clear();
+}
+
+void FormulaCache::clear() {
+    lru.clear();
+    byText.clear();
+    byCell.clear();
+    usedBytes = 0;
+}
+
+void FormulaCache::setLimits(size_t newMaxBytes, size_t newMaxCells) {
+    maxBytes = newMaxBytes;
+    maxCells = newMaxCells;
+    evict();
+}
+
+FormulaCacheStats FormulaCache::getStats() const {
+    FormulaCacheStats current = stats;
+    current.entries = lru.size();
+    current.memoryBytes = usedBytes;
+    return current;
+}
+
+void FormulaCache::touch(LruList::iterator it) {
+    lru.splice(lru.begin(), lru, it);
+}
+
+void FormulaCache::evict() {
+    // Always keep the most recent entry, even if it alone exceeds the budget
+    while (usedBytes > maxBytes && lru.size() > 1) {
+        auto& victim = lru.back();
+        usedBytes -= victim->memoryBytes;
+        byText.erase(victim->text);
+        lru.pop_back();
+        stats.evictions++;
+    }
+}
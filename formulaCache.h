@@ -0,0 +1,97 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "formulaTypes.h"
+#include "formulaBytecode.h"
+
+// Parsed form of one formula text, shared by every cell that uses it
+struct CompiledFormula {
+    std::string text;                   // normalized formula text
+    Program program;
+    std::vector<std::string> errors;    // binding problems, found before evaluation
+    bool parsed = false;                // false if the text did not parse
+    size_t memoryBytes = 0;             // approximate footprint, used for eviction
+};
+
+// Where a formula added to the cache came from
+enum class FormulaOrigin : uint8_t {
+    Parsed,
+    Derived,    // references of a same-shape formula moved
+    Loaded      // read from a compiled cache file
+};
+
+struct FormulaCacheStats {
+    size_t cellHits = 0;     // found through the cell index
+    size_t textHits = 0;     // found through the formula text
+    size_t misses = 0;       // had to be parsed
+    size_t derived = 0;      // copied from a same-shape formula instead
+    size_t loaded = 0;       // read from a compiled cache file instead
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t memoryBytes = 0;
+};
+
+// LRU cache of parsed formulas, keyed by normalized formula text.
+// A secondary cell index maps cell coordinates to their formula so repeated
+// visits skip reading and normalizing the formula text as well.
+class FormulaCache {
+public:
+    explicit FormulaCache(size_t maxBytes = 64 * 1024 * 1024, size_t maxCells = 1024 * 1024);
+
+    // Canonical spelling used as the text key: no leading = or +, no
+    // whitespace outside quoted sheet names, function names and cell
+    // addresses upper-cased
+    static std::string normalize(const std::string& formula);
+
+    // Same, written into a reusable buffer; wide input is narrowed on the way.
+    // Text with references lacking a sheet gets "@hostSheet" appended, as
+    // those bind to the sheet holding the formula.
+    static void normalize(std::string_view formula, std::string& out, int hostSheet = -1);
+
+    static void normalize(std::wstring_view formula, std::string& out, int hostSheet = -1);
+
+    std::shared_ptr<CompiledFormula> findByCell(const CellKey& key);
+
+    std::shared_ptr<CompiledFormula> findByText(const std::string& normalizedText);
+
+    // Add a freshly compiled formula, evicting least recently used entries
+    // until the cache fits its memory budget again
+    void insert(std::shared_ptr<CompiledFormula> formula, FormulaOrigin origin = FormulaOrigin::Parsed);
+
+    // Remember which formula a cell holds
+    void bindCell(const CellKey& key, std::shared_ptr<CompiledFormula> formula);
+
+    void eraseCell(const CellKey& key);
+
+    void eraseSheet(int sheet);
+
+    // Forget cell bindings but keep parsed formulas, which only depend on text
+    void clearCellIndex();
+
+    void clear();
+
+    void setLimits(size_t maxBytes, size_t maxCells);
+
+    FormulaCacheStats getStats() const;
+
+private:
+    typedef std::list<std::shared_ptr<CompiledFormula>> LruList;
+
+    void touch(LruList::iterator it);
+
+    void evict();
+
+    size_t maxBytes;
+    size_t maxCells;
+    size_t usedBytes = 0;
+
+    LruList lru;    // most recently used at the front
+    std::unordered_map<std::string, LruList::iterator> byText;
+    std::unordered_map<CellKey, std::weak_ptr<CompiledFormula>, CellKeyHash> byCell;
+
+    FormulaCacheStats stats;
+};
@@ -0,0 +1,538 @@
+#include "stdafx.h"
+#include "formulaLexer.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include "textEncoding.h"
+
+namespace {
+
+template <typename CharT>
+bool isDigit(CharT c) { return c >= '0' && c <= '9'; }
+
+template <typename CharT>
+bool isAlpha(CharT c) { return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'); }
+
+template <typename CharT>
+bool isIdentifierChar(CharT c) { return isAlpha(c) || isDigit(c) || c == '_'; }
+
+template <typename CharT>
+bool isSpace(CharT c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f'; }
+
+template <typename CharT>
+char upper(CharT c) { return (c >= 'a' && c <= 'z') ? char(c - 'a' + 'A') : char(c); }
+
+// 1 for TRUE, 0 for FALSE in any case, -1 for other names
+template <typename CharT>
+int booleanName(std::basic_string_view<CharT> name) {
+    auto equals = [&](const char* word, size_t length) {
+        if (name.size() != length) return false;
+        for (size_t i = 0; i < length; ++i) {
+            if (upper(name[i]) != word[i]) return false;
+        }
+        return true;
+    };
+    if (equals("TRUE", 4)) return 1;
+    if (equals("FALSE", 5)) return 0;
+    return -1;
+}
+
+// Longest name or number kept while narrowing, in UTF-8 bytes for names
+const size_t MAX_SCRATCH = 255;
+
+} // namespace
+
+template <typename CharT>
+FormulaLexer<CharT>::FormulaLexer(std::basic_string_view<CharT> formula, SymbolTable& symbols)
+    : text(formula), symbols(symbols) {
+    // Remove = and leading +
+    if (pos < text.size() && text[pos] == '=') pos++;
+    if (pos < text.size() && text[pos] == '+') pos++;
+}
+
+template <typename CharT>
+SymbolId FormulaLexer<CharT>::intern(size_t begin, size_t end, bool upperCase) {
+    name.clear();
+    for (size_t i = begin; i < end && name.size() < MAX_SCRATCH;) {
+        if (upperCase && text[i] < 0x80) {
+            name += upper(text[i++]);
+        }
+        else {
+            appendUtf8At(text, i, name);
+        }
+    }
+    return symbols.intern(name);
+}
+
+template <typename CharT>
+size_t FormulaLexer<CharT>::scanIdentifier(int32_t& row, int32_t& col, uint8_t& absolute) {
+    size_t begin = pos;
+    int64_t column = 0;
+    int64_t number = 0;
+    size_t letters = 0;
+    size_t digits = 0;
+    bool address = true;
+    absolute = 0;
+
+    while (pos < text.size() && (isIdentifierChar(text[pos]) || text[pos] == '$')) {
+        CharT c = text[pos++];
+        if (!address) {
+            continue;
+        }
+        if (c == '$') {
+            // Allowed once before the column and once before the row
+            if (letters == 0 && absolute == 0) {
+                absolute = ABS_COL;
+            }
+            else if (letters > 0 && digits == 0 && !(absolute & ABS_ROW)) {
+                absolute |= ABS_ROW;
+            }
+            else {
+                address = false;
+            }
+        }
+        else if (isAlpha(c) && digits == 0) {
+            column = column * 26 + (upper(c) - 'A' + 1);
+            letters++;
+        }
+        else if (isDigit(c) && letters > 0) {
+            number = number * 10 + (c - '0');
+            digits++;
+        }
+        else {
+            address = false;
+        }
+        if (column > INT32_MAX || number > INT32_MAX) address = false;
+    }
+
+    if (address && letters > 0 && digits > 0 && number > 0) {
+        row = (int32_t)(number - 1); // Convert to 0-based
+        col = (int32_t)(column - 1);
+    }
+    else {
+        row = col = -1;
+        absolute = 0;
+    }
+    return begin;
+}
+
+template <typename CharT>
+bool FormulaLexer<CharT>::scanQuotedSheet(SymbolId& sheet) {
+    name.clear();
+
+    pos++; // skip opening quote
+    while (pos < text.size()) {
+        if (text[pos] == '\'') {
+            if (pos + 1 < text.size() && text[pos + 1] == '\'') {
+                pos++; // doubled quote, keep one
+            }
+            else {
+                break;
+            }
+        }
+        if (name.size() < MAX_SCRATCH) {
+            appendUtf8At(text, pos, name);
+        }
+        else {
+            pos++;
+        }
+    }
+    if (pos < text.size()) pos++; // skip closing quote
+
+    if (pos >= text.size() || text[pos] != '!') return false;
+    pos++; // skip !
+    sheet = symbols.intern(name);
+    return true;
+}
+
+template <typename CharT>
+LexToken FormulaLexer<CharT>::next() {
+    LexToken token;
+
+    while (pos < text.size()) {
+        CharT c = text[pos];
+
+        if (isSpace(c)) {
+            pos++;
+            continue;
+        }
+
+        if (c == '+' || c == '-' || c == '*' || c == '/') {
+            pos++;
+            token.kind = LexToken::OPERATOR;
+            token.op = char(c);
+            return token;
+        }
+        if (c == '(') {
+            pos++;
+            token.kind = LexToken::LPAREN;
+            return token;
+        }
+        if (c == ')') {
+            pos++;
+            token.kind = LexToken::RPAREN;
+            return token;
+        }
+        if (c == ',') {
+            pos++;
+            token.kind = LexToken::COMMA;
+            return token;
+        }
+
+        // Numbers (constants); all of the digits and points must read as
+        // one number, so 1..2, 1.5.5, . and over-long literals are INVALID
+        if (isDigit(c) || c == '.') {
+            char scratch[MAX_SCRATCH];
+            size_t length = 0;
+            bool truncated = false;
+            while (pos < text.size() && (isDigit(text[pos]) || text[pos] == '.')) {
+                if (length < MAX_SCRATCH) {
+                    scratch[length++] = char(text[pos]);
+                }
+                else {
+                    truncated = true;
+                }
+                pos++;
+            }
+            double value = 0.0;
+            auto result = std::from_chars(scratch, scratch + length, value);
+            bool valid = !truncated && result.ec == std::errc() && result.ptr == scratch + length;
+            token.kind = valid ? LexToken::NUMBER : LexToken::INVALID;
+            token.number = valid ? value : 0.0;
+            return token;
+        }
+
+        // Functions, cell references, ranges
+        if (isAlpha(c) || c == '$' || c == '\'') {
+            size_t begin;
+            if (c == '\'') {
+                // Quoted sheet name; without a ! it is skipped like unknown text
+                if (!scanQuotedSheet(token.sheet)) continue;
+                begin = scanIdentifier(token.row, token.col, token.absolute);
+            }
+            else {
+                begin = scanIdentifier(token.row, token.col, token.absolute);
+
+                // Check for sheet reference (!)
+                if (pos < text.size() && text[pos] == '!') {
+                    token.sheet = intern(begin, pos, false);
+                    pos++; // skip !
+                    begin = scanIdentifier(token.row, token.col, token.absolute);
+                }
+            }
+            size_t end = pos;
+
+            if (pos < text.size() && text[pos] == '(') {
+                token.kind = LexToken::FUNCTION;
+                token.symbol = intern(begin, end, true);
+                token.row = token.col = -1;
+                token.absolute = 0;
+            }
+            else if (pos < text.size() && text[pos] == ':') {
+                pos++; // skip :
+                uint8_t lastAbsolute;
+                scanIdentifier(token.lastRow, token.lastCol, lastAbsolute);
+                token.kind = LexToken::RANGE;
+                token.absolute |= lastAbsolute << 2;
+                if (token.lastRow < 0) token.row = token.col = -1;
+            }
+            else if (token.sheet == NO_SYMBOL && token.row < 0 && booleanName(text.substr(begin, end - begin)) >= 0) {
+                token.kind = LexToken::BOOLEAN;
+                token.number = booleanName(text.substr(begin, end - begin));
+                token.absolute = 0;
+            }
+            else {
+                token.kind = LexToken::CELL;
+                token.lastRow = token.row;
+                token.lastCol = token.col;
+                token.absolute |= token.absolute << 2;
+            }
+            return token;
+        }
+
+        // Unknown character, skip
+        pos++;
+    }
+
+    token.kind = LexToken::END;
+    return token;
+}
+
+template class FormulaLexer<char>;
+template class FormulaLexer<wchar_t>;
+
+namespace {
+
+// Binary operator precedence, 0 for characters that are not operators
+struct PrecedenceTable {
+    uint8_t precedence[128] = {};
+
+    PrecedenceTable() {
+        precedence['+'] = 1;
+        precedence['-'] = 1;
+        precedence['*'] = 2;
+        precedence['/'] = 2;
+    }
+
+    int of(const LexToken& token) const {
+        return (token.kind == LexToken::OPERATOR) ? precedence[(unsigned char)token.op] : 0;
+    }
+};
+
+const PrecedenceTable PRECEDENCE;
+
+template <typename CharT>
+class PrecedenceParser {
+public:
+    PrecedenceParser(FormulaLexer<CharT>& lexer, AstArena& arena)
+        : lexer(lexer), arena(arena) {
+        current = lexer.next();
+    }
+
+    NodeIndex expression(int minPrecedence = 1) {
+        NodeIndex left = primary();
+
+        // Left-associative: operands of an operator bind tighter than it
+        for (int precedence = PRECEDENCE.of(current); precedence >= minPrecedence;
+            precedence = PRECEDENCE.of(current)) {
+            char op = current.op;
+            advance();
+            NodeIndex right = expression(precedence + 1);
+            left = binary(left, op, right);
+        }
+        return left;
+    }
+
+    // The whole formula: NO_NODE if an operand is missing anywhere or
+    // tokens are left over
+    NodeIndex formula() {
+        NodeIndex root = expression();
+        return (failed || current.kind != LexToken::END) ? NO_NODE : root;
+    }
+
+private:
+    void advance() {
+        current = lexer.next();
+    }
+
+    NodeIndex binary(NodeIndex left, char op, NodeIndex right) {
+        if (left == NO_NODE || right == NO_NODE) {
+            failed = true;
+            return NO_NODE;
+        }
+        NodeIndex node = arena.add(AstKind::OPERATOR);
+        arena[node].op = op;
+        arena.addChild(node, left);
+        arena.addChild(node, right);
+        return node;
+    }
+
+    NodeIndex reference(AstKind kind) {
+        NodeIndex node = arena.add(kind);
+        AstNode& n = arena[node];
+        n.sheet = current.sheet;
+        n.row = current.row;
+        n.col = current.col;
+        n.lastRow = current.lastRow;
+        n.lastCol = current.lastCol;
+        n.absolute = current.absolute;
+        advance();
+        return node;
+    }
+
+    NodeIndex primary() {
+        switch (current.kind) {
+        case LexToken::LPAREN: {
+            advance();
+            NodeIndex expr = expression();
+            if (current.kind == LexToken::RPAREN) advance();
+            return expr;
+        }
+
+        case LexToken::FUNCTION: {
+            NodeIndex node = arena.add(AstKind::FUNCTION);
+            arena[node].symbol = current.symbol;
+            advance();
+
+            if (current.kind == LexToken::LPAREN) {
+                advance();
+                while (current.kind != LexToken::RPAREN && current.kind != LexToken::END) {
+                    if (current.kind == LexToken::RANGE) {
+                        arena.addChild(node, reference(AstKind::RANGE));
+                    }
+                    else if (current.kind == LexToken::COMMA) {
+                        advance();
+                    }
+                    else if (current.kind == LexToken::OPERATOR || current.kind == LexToken::NUMBER ||
+                        current.kind == LexToken::BOOLEAN || current.kind == LexToken::CELL || current.kind == LexToken::FUNCTION ||
+                        current.kind == LexToken::LPAREN) {
+                        NodeIndex arg = expression();
+                        if (arg != NO_NODE) arena.addChild(node, arg);
+                    }
+                    else {
+                        failed = failed || current.kind == LexToken::INVALID;
+                        advance();
+                    }
+                }
+                if (current.kind == LexToken::RPAREN) advance();
+            }
+            return node;
+        }
+
+        case LexToken::CELL:
+            return reference(AstKind::CELL_REF);
+
+        case LexToken::RANGE:
+            return reference(AstKind::RANGE);
+
+        case LexToken::NUMBER: {
+            NodeIndex node = arena.add(AstKind::CONSTANT);
+            arena[node].number = current.number;
+            advance();
+            return node;
+        }
+
+        case LexToken::BOOLEAN: {
+            NodeIndex node = arena.add(AstKind::BOOLEAN);
+            arena[node].number = current.number;
+            advance();
+            return node;
+        }
+
+        // Sign prefix, binding tighter than * and /: -x is 0 - x
+        case LexToken::OPERATOR: {
+            char op = current.op;
+            if (op != '-' && op != '+') break;
+            advance();
+            NodeIndex operand = primary();
+            if (op == '+' || operand == NO_NODE) {
+                failed = failed || operand == NO_NODE;
+                return operand;
+            }
+            return binary(arena.add(AstKind::CONSTANT), '-', operand);
+        }
+
+        default:
+            break;
+        }
+        failed = true;
+        return NO_NODE;
+    }
+
+    FormulaLexer<CharT>& lexer;
+    AstArena& arena;
+    LexToken current;
+    bool failed = false;
+};
+
+template <typename CharT>
+NodeIndex parseWith(std::basic_string_view<CharT> formula, AstArena& arena, SymbolTable& symbols) {
+    FormulaLexer<CharT> lexer(formula, symbols);
+    PrecedenceParser<CharT> parser(lexer, arena);
+    return parser.formula();
+}
+
+} // namespace
+
+NodeIndex parseFormula(std::string_view formula, AstArena& arena, SymbolTable& symbols) {
+    return parseWith(formula, arena, symbols);
+}
+
+NodeIndex parseFormula(std::wstring_view formula, AstArena& arena, SymbolTable& symbols) {
+    return parseWith(formula, arena, symbols);
+}
+
+namespace {
+
+void appendCoordinate(char axis, int32_t value, int32_t host, bool absolute, std::string& out) {
+    out += axis;
+    if (absolute) {
+        out += std::to_string(value + 1);
+    }
+    else {
+        out += '[';
+        out += std::to_string(value - host);
+        out += ']';
+    }
+}
+
+template <typename CharT>
+void relativeWith(std::basic_string_view<CharT> formula, int hostRow, int hostCol, SymbolTable& symbols, std::string& out) {
+    FormulaLexer<CharT> lexer(formula, symbols);
+    out.clear();
+
+    for (LexToken token = lexer.next(); token.kind != LexToken::END; token = lexer.next()) {
+        switch (token.kind) {
+        case LexToken::NUMBER: {
+            char buffer[32];
+            int length = std::snprintf(buffer, sizeof(buffer), "%.17g", token.number);
+            out.append(buffer, length);
+            out += ' ';
+            break;
+        }
+
+        case LexToken::BOOLEAN:
+            out += (token.number != 0) ? "TRUE " : "FALSE ";
+            break;
+
+        case LexToken::CELL:
+        case LexToken::RANGE:
+            if (token.sheet != NO_SYMBOL) {
+                out += '#';
+                out += std::to_string(token.sheet);
+                out += '!';
+            }
+            if (token.row < 0) {
+                out += "R?C?";
+                break;
+            }
+            appendCoordinate('R', token.row, hostRow, (token.absolute & ABS_ROW) != 0, out);
+            appendCoordinate('C', token.col, hostCol, (token.absolute & ABS_COL) != 0, out);
+            if (token.kind == LexToken::RANGE) {
+                out += ':';
+                appendCoordinate('R', token.lastRow, hostRow, (token.absolute & ABS_LAST_ROW) != 0, out);
+                appendCoordinate('C', token.lastCol, hostCol, (token.absolute & ABS_LAST_COL) != 0, out);
+            }
+            break;
+
+        case LexToken::FUNCTION:
+            out += '#';
+            out += std::to_string(token.symbol);
+            break;
+
+        case LexToken::OPERATOR:
+            out += token.op;
+            break;
+
+        case LexToken::LPAREN:
+            out += '(';
+            break;
+
+        case LexToken::RPAREN:
+            out += ')';
+            break;
+
+        case LexToken::COMMA:
+            out += ',';
+            break;
+
+        // Every malformed number fails to parse alike
+        case LexToken::INVALID:
+            out += "? ";
+            break;
+
+        case LexToken::END:
+            break;
+        }
+    }
+}
+
+} // namespace
+
+void relativeFormula(std::string_view formula, int hostRow, int hostCol, SymbolTable& symbols, std::string& out) {
+    relativeWith(formula, hostRow, hostCol, symbols, out);
+}
+
+void relativeFormula(std::wstring_view formula, int hostRow, int hostCol, SymbolTable& symbols, std::string& out) {
+    relativeWith(formula, hostRow, hostCol, symbols, out);
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "formulaArena.h"
+
+// Token produced by FormulaLexer. References and numbers arrive decoded;
+// names arrive interned, so a token owns no memory.
+struct LexToken {
+    enum Kind : uint8_t {
+        END,
+        NUMBER,      // 12, 0.9144
+        BOOLEAN,     // TRUE, FALSE in any case; number is 1 or 0
+        CELL,        // G23, $G$23, APPENDIX!C4, 'Sheet 2'!C4
+        RANGE,       // G22:L22
+        FUNCTION,    // SUM( - the name, the ( is the next token
+        OPERATOR,    // +, -, *, /
+        LPAREN,
+        RPAREN,
+        COMMA,
+        INVALID      // malformed number: 1..2, ., 256 digits; fails the parse
+    };
+
+    Kind kind = END;
+    char op = 0;
+    double number = 0.0;
+    SymbolId symbol = NO_SYMBOL;  // function name
+    SymbolId sheet = NO_SYMBOL;   // sheet of a reference
+    int32_t row = -1;             // -1 if the address is malformed
+    int32_t col = -1;
+    int32_t lastRow = -1;
+    int32_t lastCol = -1;
+    uint8_t absolute = 0;         // AbsoluteFlags
+};
+
+// Single-pass lexer over a formula view, narrow or wide (as returned by
+// Sheet::readFormula). Accepts the same input as TreeFormulaEvaluator::tokenize.
+template <typename CharT>
+class FormulaLexer {
+public:
+    FormulaLexer(std::basic_string_view<CharT> formula, SymbolTable& symbols);
+
+    // Next token, END once the input is exhausted
+    LexToken next();
+
+private:
+    // Intern text[begin, end), upper-cased unless it is a sheet name
+    SymbolId intern(size_t begin, size_t end, bool upperCase);
+
+    // Scan an identifier, decoding it as an A1 address on the way; $ marks
+    // are reported as ABS_COL / ABS_ROW
+    size_t scanIdentifier(int32_t& row, int32_t& col, uint8_t& absolute);
+
+    // Scan 'quoted name'! ('' stands for a quote); false if no ! follows
+    bool scanQuotedSheet(SymbolId& sheet);
+
+    std::basic_string_view<CharT> text;
+    size_t pos = 0;
+    SymbolTable& symbols;
+    std::string name;   // UTF-8 spelling of the symbol being interned
+};
+
+// Parse a formula straight into the arena; the lexer feeds a precedence
+// climbing parser one token at a time. Returns the root or NO_NODE.
+NodeIndex parseFormula(std::string_view formula, AstArena& arena, SymbolTable& symbols);
+
+NodeIndex parseFormula(std::wstring_view formula, AstArena& arena, SymbolTable& symbols);
+
+// R1C1 spelling of a formula held by cell (hostRow, hostCol): relative
+// references become offsets from the host, so a formula copied down or
+// across a sheet spells the same everywhere. Names are written as symbol
+// ids; the text is a grouping key, not meant to be parsed back.
+void relativeFormula(std::string_view formula, int hostRow, int hostCol, SymbolTable& symbols, std::string& out);
+
+void relativeFormula(std::wstring_view formula, int hostRow, int hostCol, SymbolTable& symbols, std::string& out);
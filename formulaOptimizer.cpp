@@ -0,0 +1,175 @@
+#include "stdafx.h"
+#include "formulaOptimizer.h"
+#include <cmath>
+#include <vector>
+
+namespace {
+
+bool isConstant(const AstArena& arena, NodeIndex index, double value) {
+    return arena[index].kind == AstKind::CONSTANT && arena[index].number == value;
+}
+
+// Operators always produce numbers (or errors)
+bool isNumeric(const AstArena& arena, NodeIndex index) {
+    return arena[index].kind == AstKind::CONSTANT || arena[index].kind == AstKind::OPERATOR;
+}
+
+double applyOperator(char op, double left, double right) {
+    switch (op) {
+    case '+': return left + right;
+    case '-': return left - right;
+    case '*': return left * right;
+    case '/': return (right != 0) ? left / right : 0.0;
+    default: return 0.0;
+    }
+}
+
+class Optimizer {
+public:
+    Optimizer(AstArena& arena, OptimizerStats& stats) : arena(arena), stats(stats) {}
+
+    // Optimized replacement for the subtree at index
+    NodeIndex optimize(NodeIndex index) {
+        std::vector<NodeIndex> children;
+        for (NodeIndex child = arena[index].firstChild; child != NO_NODE; child = arena[child].nextSibling) {
+            children.push_back(child);
+        }
+        for (NodeIndex& child : children) {
+            child = optimize(child);
+        }
+
+        AstNode& node = arena[index];
+        if (node.kind == AstKind::OPERATOR && children.size() >= 2) {
+            return optimizeOperator(index, children);
+        }
+        relink(index, children);
+        return index;
+    }
+
+private:
+    NodeIndex optimizeOperator(NodeIndex index, std::vector<NodeIndex>& children) {
+        char op = arena[index].op;
+        bool associative = (op == '+' || op == '*');
+
+        // ((a+b)+c) -> +(a,b,c): only the left operand, which the nested
+        // form evaluated first, so the order of operations is unchanged
+        if (associative && arena[children[0]].kind == AstKind::OPERATOR && arena[children[0]].op == op) {
+            std::vector<NodeIndex> merged;
+            for (NodeIndex child = arena[children[0]].firstChild; child != NO_NODE; child = arena[child].nextSibling) {
+                merged.push_back(child);
+            }
+            merged.insert(merged.end(), children.begin() + 1, children.end());
+            children.swap(merged);
+            stats.flattened++;
+        }
+
+        // Leading constants combine exactly as evaluation would
+        while (children.size() >= 2 && arena[children[0]].kind == AstKind::CONSTANT &&
+            arena[children[1]].kind == AstKind::CONSTANT && (associative || children.size() == 2) &&
+            !(op == '/' && arena[children[1]].number == 0)) {
+            arena[children[0]].number = applyOperator(op, arena[children[0]].number, arena[children[1]].number);
+            children.erase(children.begin() + 1);
+            stats.folded++;
+        }
+
+        // Identities: x+0, 0+x, x*1, 1*x anywhere in the chain, x-0 and x/1
+        // as the right operand. The last operator goes only when what is
+        // left is a number already.
+        double identity = (op == '+' || op == '-') ? 0.0 : 1.0;
+        if (associative) {
+            for (size_t i = 0; i < children.size() && children.size() > 1;) {
+                if (isConstant(arena, children[i], identity) &&
+                    (children.size() > 2 || isNumeric(arena, children[1 - i]))) {
+                    children.erase(children.begin() + i);
+                    stats.simplified++;
+                }
+                else {
+                    ++i;
+                }
+            }
+        }
+        else if (children.size() == 2 && isConstant(arena, children[1], identity) && isNumeric(arena, children[0])) {
+            children.pop_back();
+            stats.simplified++;
+        }
+
+        if (children.size() == 1) return children[0];
+        relink(index, children);
+        return index;
+    }
+
+    void relink(NodeIndex index, const std::vector<NodeIndex>& children) {
+        AstNode& node = arena[index];
+        node.firstChild = children.empty() ? NO_NODE : children[0];
+        node.childCount = (uint16_t)children.size();
+        for (size_t i = 0; i < children.size(); ++i) {
+            arena[children[i]].nextSibling = (i + 1 < children.size()) ? children[i + 1] : NO_NODE;
+        }
+    }
+
+    AstArena& arena;
+    OptimizerStats& stats;
+};
+
+// Deterministic stand-in for a cell value
+double syntheticValue(int sheet, int row, int col) {
+    uint64_t h = (uint64_t)(uint32_t)sheet * 0x9E3779B97F4A7C15ull;
+    h ^= (uint64_t)(uint32_t)row * 0xC2B2AE3D27D4EB4Full;
+    h ^= (uint64_t)(uint32_t)col * 0x165667B19E3779F9ull;
+    h ^= h >> 29;
+    return (double)(h % 2001) / 8.0 - 125.0;
+}
+
+double checkValue(const AstArena& arena, NodeIndex index) {
+    if (index == NO_NODE) return 0.0;
+    const AstNode& node = arena[index];
+
+    switch (node.kind) {
+    case AstKind::CONSTANT:
+    case AstKind::BOOLEAN:
+        return node.number;
+
+    case AstKind::CELL_REF:
+        return (node.sheetIndex < 0) ? 0.0 : syntheticValue(node.sheetIndex, node.row, node.col);
+
+    case AstKind::RANGE:
+        return (node.sheetIndex < 0) ? 0.0 :
+            syntheticValue(node.sheetIndex, node.row, node.col) * 3 + syntheticValue(node.sheetIndex, node.lastRow, node.lastCol);
+
+    case AstKind::FUNCTION: {
+        // Function bodies are left alone by the pass, only their arguments
+        // change, so any order-sensitive mix of the arguments will do
+        double mix = node.symbol;
+        for (NodeIndex child = node.firstChild; child != NO_NODE; child = arena[child].nextSibling) {
+            mix = mix * 31.0 + checkValue(arena, child);
+        }
+        return mix;
+    }
+
+    case AstKind::OPERATOR: {
+        NodeIndex child = node.firstChild;
+        if (child == NO_NODE) return 0.0;
+        double value = checkValue(arena, child);
+        for (child = arena[child].nextSibling; child != NO_NODE; child = arena[child].nextSibling) {
+            value = applyOperator(node.op, value, checkValue(arena, child));
+        }
+        return value;
+    }
+    }
+    return 0.0;
+}
+
+} // namespace
+
+NodeIndex optimizeFormula(AstArena& arena, NodeIndex root, OptimizerStats& stats) {
+    if (root == NO_NODE) return root;
+    Optimizer optimizer(arena, stats);
+    return optimizer.optimize(root);
+}
+
+bool sameFormulaValue(const AstArena& original, NodeIndex originalRoot,
+    const AstArena& optimized, NodeIndex optimizedRoot) {
+    double before = checkValue(original, originalRoot);
+    double after = checkValue(optimized, optimizedRoot);
+    return before == after || (std::isnan(before) && std::isnan(after));
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include "formulaArena.h"
+
+struct OptimizerStats {
+    size_t folded = 0;        // operators replaced by their constant result
+    size_t simplified = 0;    // x+0, x-0, x*1, x/1 reduced to x
+    size_t flattened = 0;     // operators merged into an n-ary parent
+    size_t checkFailures = 0; // debug checks that found a changed value
+};
+
+// Rewrites a bound parse tree in place and returns the new root:
+//  - operators on two constants become a constant, except x/0, which
+//    stays for the VM to turn into #DIV/0!
+//  - x+0, 0+x, x-0, x*1, 1*x and x/1 become x where x is a number anyway:
+//    a constant, an operator or an operand of a remaining chain. A cell or
+//    a function could hold text or a boolean, which the operator converts.
+//  - left-nested chains of + or * become one n-ary node, ((a+b)+c)+d
+//    turning into +(a,b,c,d)
+// Nothing is reordered: n-ary nodes add or multiply their children left to
+// right, the order the nested form evaluated in, so results stay exact.
+NodeIndex optimizeFormula(AstArena& arena, NodeIndex root, OptimizerStats& stats);
+
+// Debug check of the pass: evaluates both trees on made-up cell values,
+// with function calls mixed from their arguments, and compares the results.
+// Returns false on a difference.
+bool sameFormulaValue(const AstArena& original, NodeIndex originalRoot,
+    const AstArena& optimized, NodeIndex optimizedRoot);
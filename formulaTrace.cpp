@@ -0,0 +1,330 @@
+#include "stdafx.h"
+#include "formulaTrace.h"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <type_traits>
+
+namespace {
+
+thread_local uint64_t currentFormula = 0;
+thread_local uint32_t threadId = (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename CharT>
+void copyText(char (&target)[sizeof(TraceEvent::text)], std::basic_string_view<CharT> text) {
+    size_t length = std::min(text.size(), sizeof(target) - 1);
+    for (size_t i = 0; i < length; ++i) {
+        // Formulas are ASCII apart from sheet names; other characters show as '?'
+        auto c = (std::make_unsigned_t<CharT>)text[i];
+        target[i] = (c < 128) ? (char)c : '?';
+    }
+    target[length] = 0;
+}
+
+void writeValue(std::ostream& out, Value value, const StringPool* strings) {
+    switch (value.type()) {
+    case ValueType::Number:
+        out << value.asNumber();
+        break;
+    case ValueType::Boolean:
+        out << (value.asBoolean() ? "TRUE" : "FALSE");
+        break;
+    case ValueType::String:
+        if (strings && value.asString() < strings->size()) {
+            std::wstring_view text = strings->text(value.asString());
+            char buffer[sizeof(TraceEvent::text)];
+            copyText(buffer, text);
+            out << '"' << buffer << '"';
+        }
+        else {
+            out << "string:" << value.asString();
+        }
+        break;
+    case ValueType::Error:
+        out << errorText(value.asError());
+        break;
+    case ValueType::Empty:
+        out << "empty";
+        break;
+    }
+}
+
+}
+
+const char* traceKindName(TraceKind kind) {
+    switch (kind) {
+    case TraceKind::FormulaBegin: return "formula";
+    case TraceKind::FormulaEnd: return "result";
+    case TraceKind::ParseFailed: return "parse-failed";
+    case TraceKind::CellRead: return "cell";
+    case TraceKind::CellCached: return "cached";
+    case TraceKind::CellConstant: return "constant";
+    case TraceKind::CellPrecalculated: return "precalculated";
+    case TraceKind::CellFormula: return "cell-formula";
+    case TraceKind::CellResult: return "cell-result";
+    case TraceKind::Circular: return "circular";
+    case TraceKind::Operator: return "operator";
+    case TraceKind::SumBegin: return "sum";
+    case TraceKind::SumEnd: return "sum-result";
+    case TraceKind::Range: return "range";
+    case TraceKind::BindingError: return "binding-error";
+    case TraceKind::OptimizerMismatch: return "optimizer-mismatch";
+    case TraceKind::OptimizerOriginal: return "optimizer-original";
+    case TraceKind::OptimizerResult: return "optimizer-result";
+    case TraceKind::BackendError: return "backend-error";
+    case TraceKind::CacheRejected: return "cache-rejected";
+    case TraceKind::AreaTableMismatch: return "area-table-mismatch";
+    }
+    return "unknown";
+}
+
+StreamTraceSink::StreamTraceSink(std::ostream& out, const StringPool* strings) : out(out), strings(strings) {
+}
+
+void StreamTraceSink::write(const TraceEvent* events, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        format(out, events[i], strings);
+        out << '\n';
+    }
+    out.flush();
+}
+
+void StreamTraceSink::format(std::ostream& out, const TraceEvent& event, const StringPool* strings) {
+    out << "t=" << event.time << " thread=" << event.thread << " formula=" << event.formula
+        << " event=" << traceKindName(event.kind);
+
+    if (event.cell.sheet >= 0) {
+        out << " cell=" << event.cell.sheet << ':' << event.cell.row << ':' << event.cell.col;
+    }
+    if (event.kind == TraceKind::Operator) {
+        out << " op=" << event.op << " left=" << event.left << " right=" << event.right;
+    }
+    if (event.value.type() != ValueType::Empty) {
+        out << " value=";
+        writeValue(out, event.value, strings);
+    }
+    if (event.text[0]) {
+        out << " text=\"" << event.text << '"';
+    }
+}
+
+void RecordingTraceSink::write(const TraceEvent* events, size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < count; ++i) {
+        auto& list = byFormula[events[i].formula];
+        if (list.empty()) order.push_back(events[i].formula);
+        list.push_back(events[i]);
+    }
+}
+
+std::vector<uint64_t> RecordingTraceSink::formulas() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return order;
+}
+
+std::vector<TraceEvent> RecordingTraceSink::events(uint64_t formula) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = byFormula.find(formula);
+    return (it != byFormula.end()) ? it->second : std::vector<TraceEvent>();
+}
+
+void RecordingTraceSink::replay(uint64_t formula, std::ostream& out, const StringPool* strings) const {
+    // Steps of one evaluation all come from one thread, already in order
+    for (const TraceEvent& event : events(formula)) {
+        StreamTraceSink::format(out, event, strings);
+        out << '\n';
+    }
+}
+
+void RecordingTraceSink::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    byFormula.clear();
+    order.clear();
+}
+
+TraceRing::TraceRing(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size *= 2;
+    mask = size - 1;
+    slots.reset(new Slot[size]);
+    for (size_t i = 0; i < size; ++i) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+// A slot is free for position pos once its sequence reaches pos, and
+// holds an event for pos once the sequence is pos + 1
+bool TraceRing::push(const TraceEvent& event) {
+    uint64_t pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot& slot = slots[pos & mask];
+        int64_t diff = (int64_t)(slot.sequence.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.event = event;
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0) {
+            return false;
+        }
+        else {
+            pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool TraceRing::pop(TraceEvent& event) {
+    uint64_t pos = head.load(std::memory_order_relaxed);
+    Slot& slot = slots[pos & mask];
+    if ((int64_t)(slot.sequence.load(std::memory_order_acquire) - (pos + 1)) < 0) return false;
+
+    event = slot.event;
+    slot.sequence.store(pos + mask + 1, std::memory_order_release);
+    head.store(pos + 1, std::memory_order_relaxed);
+    return true;
+}
+
+size_t TraceRing::size() const {
+    uint64_t first = head.load(std::memory_order_relaxed);
+    uint64_t last = tail.load(std::memory_order_relaxed);
+    return (last > first) ? (size_t)(last - first) : 0;
+}
+
+Tracer& Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+Tracer::Tracer() : ring(RING_SIZE), sink(std::make_shared<StreamTraceSink>(std::cerr)), start(now()) {
+    batch.reserve(RING_SIZE);
+}
+
+Tracer::~Tracer() {
+    std::lock_guard<std::mutex> lock(drainLock);
+    drain();
+}
+
+void Tracer::setLevel(TraceLevel level) {
+    currentLevel.store((uint8_t)level, std::memory_order_relaxed);
+}
+
+void Tracer::setSink(std::shared_ptr<TraceSink> newSink) {
+    std::lock_guard<std::mutex> lock(drainLock);
+    drain();
+    sink = std::move(newSink);
+}
+
+void Tracer::record(TraceLevel level, TraceKind kind, std::string_view text) {
+    TraceEvent event;
+    event.level = level;
+    event.kind = kind;
+    copyText(event.text, text);
+    push(event);
+}
+
+void Tracer::record(TraceLevel level, TraceKind kind, std::wstring_view text) {
+    TraceEvent event;
+    event.level = level;
+    event.kind = kind;
+    copyText(event.text, text);
+    push(event);
+}
+
+void Tracer::record(TraceLevel level, TraceKind kind, Value value) {
+    TraceEvent event;
+    event.level = level;
+    event.kind = kind;
+    event.value = value;
+    push(event);
+}
+
+void Tracer::record(TraceLevel level, TraceKind kind, const CellKey& cell, Value value) {
+    TraceEvent event;
+    event.level = level;
+    event.kind = kind;
+    event.cell = cell;
+    event.value = value;
+    push(event);
+}
+
+void Tracer::record(TraceLevel level, TraceKind kind, const CellKey& cell, std::wstring_view text) {
+    TraceEvent event;
+    event.level = level;
+    event.kind = kind;
+    event.cell = cell;
+    copyText(event.text, text);
+    push(event);
+}
+
+void Tracer::record(TraceLevel level, char op, double left, double right, double result) {
+    TraceEvent event;
+    event.level = level;
+    event.kind = TraceKind::Operator;
+    event.op = op;
+    event.left = left;
+    event.right = right;
+    event.value = Value::number(result);
+    push(event);
+}
+
+void Tracer::push(TraceEvent& event) {
+    event.formula = currentFormula;
+    event.time = (uint64_t)(now() - start);
+    event.thread = threadId;
+
+    recorded.fetch_add(1, std::memory_order_relaxed);
+    if (!ring.push(event)) {
+        // Full: make room if no other thread is already at it, then give up
+        flush();
+        if (!ring.push(event)) dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (event.level <= TraceLevel::Warning || ring.size() >= ring.capacity() / 2) {
+        flush();
+    }
+}
+
+void Tracer::flush() {
+    // Whoever holds the lock drains for everyone, so producers never wait
+    std::unique_lock<std::mutex> lock(drainLock, std::try_to_lock);
+    if (lock.owns_lock()) drain();
+}
+
+void Tracer::drain() {
+    TraceEvent event;
+    batch.clear();
+    while (ring.pop(event)) {
+        batch.push_back(event);
+    }
+    if (sink && !batch.empty()) {
+        sink->write(batch.data(), batch.size());
+        written += batch.size();
+    }
+}
+
+uint64_t Tracer::beginFormula() {
+    uint64_t previous = currentFormula;
+    currentFormula = nextFormula.fetch_add(1, std::memory_order_relaxed);
+    return previous;
+}
+
+void Tracer::endFormula(uint64_t previous) {
+    currentFormula = previous;
+}
+
+TraceStats Tracer::getStats() const {
+    TraceStats result;
+    result.recorded = recorded.load(std::memory_order_relaxed);
+    result.dropped = dropped.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(drainLock);
+    result.written = written;
+    return result;
+}
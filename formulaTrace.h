@@ -0,0 +1,252 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "formulaTypes.h"
+#include "formulaValue.h"
+#include "stringPool.h"
+
+// Trace sites above FORMULA_TRACE_LEVEL are compiled out, arguments and
+// all: 0 none, 1 warnings, 2 info, 3 every evaluation step. Debug builds
+// keep every step, release builds only warnings.
+#ifndef FORMULA_TRACE_LEVEL
+#ifdef _DEBUG
+#define FORMULA_TRACE_LEVEL 3
+#else
+#define FORMULA_TRACE_LEVEL 1
+#endif
+#endif
+
+enum class TraceLevel : uint8_t {
+    Off,
+    Warning,
+    Info,
+    Debug
+};
+
+enum class TraceKind : uint8_t {
+    FormulaBegin,       // text: the formula
+    FormulaEnd,         // value: its result
+    ParseFailed,
+    CellRead,           // cell about to be evaluated
+    CellCached,         // cell, value
+    CellConstant,       // cell, value
+    CellPrecalculated,  // cell, value stored by the workbook
+    CellFormula,        // cell, text: its formula
+    CellResult,         // cell, value computed from its formula
+    Circular,           // cell
+    Operator,           // op, left, right, value
+    SumBegin,
+    SumEnd,             // value
+    Range,              // text: the range
+    BindingError,       // text
+    OptimizerMismatch,  // text: the formula
+    OptimizerOriginal,  // text: one node of the tree as parsed
+    OptimizerResult,    // text: one node of the tree as optimized
+    BackendError,       // text
+    CacheRejected,      // text
+    AreaTableMismatch   // cell: top left of the range, value: the sum from the table
+};
+
+const char* traceKindName(TraceKind kind);
+
+// One step of an evaluation. Fixed size, so it is copied into the ring
+// without allocating; longer texts are cut short.
+struct TraceEvent {
+    uint64_t formula = 0;       // evaluation the step belongs to, 0 outside one
+    uint64_t time = 0;          // nanoseconds since the tracer started
+    uint32_t thread = 0;
+    TraceLevel level = TraceLevel::Off;
+    TraceKind kind = TraceKind::FormulaBegin;
+    char op = 0;
+    CellKey cell{ -1, -1, -1 };
+    Value value = Value::empty();
+    double left = 0.0;
+    double right = 0.0;
+    char text[80] = {};
+};
+
+// Where traced events end up. Called by one thread at a time, with the
+// events in the order they were recorded on each thread.
+class TraceSink {
+public:
+    virtual ~TraceSink() {}
+
+    virtual void write(const TraceEvent* events, size_t count) = 0;
+};
+
+// One line of key=value fields per event; string values are shown as text
+// when strings is set
+class StreamTraceSink : public TraceSink {
+public:
+    explicit StreamTraceSink(std::ostream& out, const StringPool* strings = nullptr);
+
+    void write(const TraceEvent* events, size_t count) override;
+
+    static void format(std::ostream& out, const TraceEvent& event, const StringPool* strings);
+
+private:
+    std::ostream& out;
+    const StringPool* strings;
+};
+
+// Keeps the events of each evaluation so it can be replayed afterwards
+class RecordingTraceSink : public TraceSink {
+public:
+    void write(const TraceEvent* events, size_t count) override;
+
+    std::vector<uint64_t> formulas() const;
+
+    std::vector<TraceEvent> events(uint64_t formula) const;
+
+    // Write the steps of one evaluation in the order they were taken
+    void replay(uint64_t formula, std::ostream& out, const StringPool* strings = nullptr) const;
+
+    void clear();
+
+private:
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, std::vector<TraceEvent>> byFormula;
+    std::vector<uint64_t> order;
+};
+
+// Bounded multi-producer, single-consumer queue of events. Producers claim
+// a slot with one compare-and-swap and never wait; when the ring is full
+// the event is refused.
+class TraceRing {
+public:
+    // capacity is rounded up to a power of two
+    explicit TraceRing(size_t capacity);
+
+    bool push(const TraceEvent& event);
+
+    // Only one thread may pop at a time
+    bool pop(TraceEvent& event);
+
+    size_t capacity() const { return mask + 1; }
+
+    // Approximate while producers are running
+    size_t size() const;
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        TraceEvent event;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t mask = 0;
+    alignas(64) std::atomic<uint64_t> head{ 0 };    // next to pop
+    alignas(64) std::atomic<uint64_t> tail{ 0 };    // next to push
+};
+
+struct TraceStats {
+    size_t recorded = 0;
+    size_t dropped = 0;     // refused by a full ring
+    size_t written = 0;     // handed to the sink
+};
+
+// Process-wide tracer behind the TRACE_* macros. Events are queued in the
+// ring and handed to the sink when it is half full, on flush(), and at once
+// for warnings. Draining is done by whichever thread gets there first;
+// the others carry on without waiting.
+class Tracer {
+public:
+    static Tracer& instance();
+
+    ~Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Runtime level, on top of FORMULA_TRACE_LEVEL; Warning to start with
+    void setLevel(TraceLevel level);
+
+    bool enabled(TraceLevel level) const {
+        return (uint8_t)level <= currentLevel.load(std::memory_order_relaxed);
+    }
+
+    // Null drops every event; the queued ones go to the old sink first.
+    // Events start out going to std::cerr.
+    void setSink(std::shared_ptr<TraceSink> sink);
+
+    void record(TraceLevel level, TraceKind kind, std::string_view text);
+    void record(TraceLevel level, TraceKind kind, std::wstring_view text);
+    void record(TraceLevel level, TraceKind kind, Value value);
+    void record(TraceLevel level, TraceKind kind, const CellKey& cell, Value value = Value::empty());
+    void record(TraceLevel level, TraceKind kind, const CellKey& cell, std::wstring_view text);
+    void record(TraceLevel level, char op, double left, double right, double result);
+
+    void flush();
+
+    // Following events on this thread belong to a new evaluation; returns
+    // the evaluation they belonged to before, for endFormula
+    uint64_t beginFormula();
+
+    void endFormula(uint64_t previous);
+
+    TraceStats getStats() const;
+
+private:
+    Tracer();
+
+    void push(TraceEvent& event);
+
+    // Hand the queued events to the sink; drainLock must be held
+    void drain();
+
+    static const size_t RING_SIZE = 8192;
+
+    std::atomic<uint8_t> currentLevel{ (uint8_t)TraceLevel::Warning };
+    TraceRing ring;
+    mutable std::mutex drainLock;
+    std::shared_ptr<TraceSink> sink;
+    std::vector<TraceEvent> batch;
+    std::atomic<uint64_t> nextFormula{ 1 };
+    std::atomic<size_t> recorded{ 0 };
+    std::atomic<size_t> dropped{ 0 };
+    size_t written = 0;
+    int64_t start = 0;
+};
+
+// Ties the events of one evaluation together on the calling thread
+class TraceFormulaScope {
+public:
+    TraceFormulaScope() : previous(Tracer::instance().beginFormula()) {}
+
+    ~TraceFormulaScope() { Tracer::instance().endFormula(previous); }
+
+    TraceFormulaScope(const TraceFormulaScope&) = delete;
+    TraceFormulaScope& operator=(const TraceFormulaScope&) = delete;
+
+private:
+    uint64_t previous;
+};
+
+#define FORMULA_TRACE(level, ...) \
+    do { \
+        if (Tracer::instance().enabled(level)) Tracer::instance().record(level, __VA_ARGS__); \
+    } while (0)
+
+#if FORMULA_TRACE_LEVEL >= 1
+#define TRACE_WARNING(...) FORMULA_TRACE(TraceLevel::Warning, __VA_ARGS__)
+#else
+#define TRACE_WARNING(...) ((void)0)
+#endif
+
+#if FORMULA_TRACE_LEVEL >= 2
+#define TRACE_INFO(...) FORMULA_TRACE(TraceLevel::Info, __VA_ARGS__)
+#else
+#define TRACE_INFO(...) ((void)0)
+#endif
+
+#if FORMULA_TRACE_LEVEL >= 3
+#define TRACE_DEBUG(...) FORMULA_TRACE(TraceLevel::Debug, __VA_ARGS__)
+#else
+#define TRACE_DEBUG(...) ((void)0)
+#endif
@@ -0,0 +1,109 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+// Token structure for parsing
+struct Token {
+    enum Type {
+        CELL_REF,     // G23, APPENDIX!C4
+        FUNCTION,     // SUM, AVERAGE
+        OPERATOR,     // +, -, *, /
+        CONSTANT,     // 12, 0.9144
+        LPAREN,       // (
+        RPAREN,       // )
+        RANGE,        // G22:L22
+        COMMA,         // ,
+        EXCLAMATION, // !
+
+    };
+
+    Type type;
+    std::string value;
+    std::string sheetName; // for cross-sheet references
+
+    Token(Type t, const std::string& v, const std::string& sheet = "")
+        : type(t), value(v), sheetName(sheet) {
+    }
+};
+
+// Formula tree node
+class FormulaNode {
+public:
+    enum Type {
+        CELL_REF,
+        FUNCTION,
+        OPERATOR,
+        CONSTANT,
+        RANGE
+    };
+
+    Type type;
+    std::string value;
+    std::string sheetName;
+    std::vector<std::shared_ptr<FormulaNode>> children;
+
+    // Evaluation state
+    mutable double cachedResult = 0.0;
+    mutable bool isEvaluated = false;
+    mutable bool isEvaluating = false;
+
+    FormulaNode(Type t, const std::string& v, const std::string& sheet = "")
+        : type(t), value(v), sheetName(sheet) {
+    }
+
+    // Clear evaluation state so a shared tree can be evaluated again
+    void resetEvaluation() const {
+        cachedResult = 0.0;
+        isEvaluated = false;
+        isEvaluating = false;
+        for (const auto& child : children) {
+            if (child) child->resetEvaluation();
+        }
+    }
+
+    void addChild(std::shared_ptr<FormulaNode> child) {
+        children.push_back(child);
+    }
+
+    std::string toString() const {
+        std::string result;
+        if (!sheetName.empty()) result += sheetName + "!";
+        result += value;
+        return result;
+    }
+};
+
+// Parts of a reference written with $ (absolute)
+enum AbsoluteFlags : uint8_t {
+    ABS_COL = 0x01,
+    ABS_ROW = 0x02,
+    ABS_LAST_COL = 0x04,
+    ABS_LAST_ROW = 0x08
+};
+
+// Excel's sheet size; addresses beyond it cannot be bound
+const int32_t MAX_SHEET_ROWS = 1048576;
+const int32_t MAX_SHEET_COLS = 16384;
+
+// Workbook cell coordinate, used as the key of evaluator-wide caches
+struct CellKey {
+    int sheet;  // index into the book's sheet list
+    int row;
+    int col;
+
+    bool operator==(const CellKey& other) const {
+        return sheet == other.sheet && row == other.row && col == other.col;
+    }
+};
+
+struct CellKeyHash {
+    size_t operator()(const CellKey& key) const {
+        size_t h = std::hash<int>()(key.sheet);
+        h = h * 31 + std::hash<int>()(key.row);
+        h = h * 31 + std::hash<int>()(key.col);
+        return h;
+    }
+};
@@ -0,0 +1,130 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// Excel error values, in the order of their ERROR.TYPE numbers
+enum class ErrorCode : uint8_t {
+    Null = 1,
+    Div0,
+    Value,
+    Ref,
+    Name,
+    Num,
+    NA
+};
+
+inline const char* errorText(ErrorCode code) {
+    switch (code) {
+    case ErrorCode::Null: return "#NULL!";
+    case ErrorCode::Div0: return "#DIV/0!";
+    case ErrorCode::Value: return "#VALUE!";
+    case ErrorCode::Ref: return "#REF!";
+    case ErrorCode::Name: return "#NAME?";
+    case ErrorCode::Num: return "#NUM!";
+    case ErrorCode::NA: return "#N/A";
+    }
+    return "#VALUE!";
+}
+
+// Error literal as Excel spells it, such as #DIV/0!; false for other text
+inline bool parseErrorText(std::string_view text, ErrorCode& code) {
+    for (int i = (int)ErrorCode::Null; i <= (int)ErrorCode::NA; ++i) {
+        if (text == errorText((ErrorCode)i)) {
+            code = (ErrorCode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+enum class ValueType : uint8_t {
+    Number,
+    Boolean,
+    String,     // handle into the snapshot's StringPool
+    Error,
+    Empty
+};
+
+// Result of evaluating a cell or formula, in 8 bytes. Numbers are stored as
+// plain doubles; the other types are boxed in negative quiet NaNs whose top
+// 14 bits are all set, with the type in bits 48-49 and the payload in the
+// low 32 bits. Arithmetic never produces those NaNs from numbers, and
+// number() turns any NaN into #NUM!, so the two never mix.
+class Value {
+public:
+    Value() : bits(0) {}
+
+    static Value number(double value) {
+        if (value != value) return error(ErrorCode::Num);
+        Value result;
+        memcpy(&result.bits, &value, sizeof(value));
+        return result;
+    }
+
+    static Value boolean(bool value) { return box(BOOLEAN_TAG, value ? 1 : 0); }
+
+    static Value string(uint32_t handle) { return box(STRING_TAG, handle); }
+
+    static Value error(ErrorCode code) { return box(ERROR_TAG, (uint32_t)code); }
+
+    static Value empty() { return box(EMPTY_TAG, 0); }
+
+    // A double that went through arithmetic on asNumber() results: boxed
+    // values carried along in its NaN payload come back as they were, other
+    // NaNs become #NUM!
+    static Value unbox(double value) {
+        Value result;
+        memcpy(&result.bits, &value, sizeof(value));
+        return result.isNumber() ? number(value) : result;
+    }
+
+    static Value fromBits(uint64_t bits) {
+        Value result;
+        result.bits = bits;
+        return result;
+    }
+
+    ValueType type() const {
+        return isNumber() ? ValueType::Number : (ValueType)(((bits >> 48) & 3) + 1);
+    }
+
+    bool isNumber() const { return (bits & BOX_MASK) != BOX_MASK; }
+
+    bool isError() const { return (bits & (BOX_MASK | TAG_MASK)) == (BOX_MASK | ERROR_TAG); }
+
+    // The number, or for other types the boxed NaN
+    double asNumber() const {
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    bool asBoolean() const { return (uint32_t)bits != 0; }
+
+    uint32_t asString() const { return (uint32_t)bits; }
+
+    ErrorCode asError() const { return (ErrorCode)(uint32_t)bits; }
+
+    uint64_t raw() const { return bits; }
+
+    bool operator==(const Value& other) const { return bits == other.bits; }
+
+    bool operator!=(const Value& other) const { return bits != other.bits; }
+
+private:
+    static const uint64_t BOX_MASK = 0xFFFC000000000000ull;
+    static const uint64_t TAG_MASK = 0x0003000000000000ull;
+    static const uint64_t BOOLEAN_TAG = 0x0000000000000000ull;
+    static const uint64_t STRING_TAG = 0x0001000000000000ull;
+    static const uint64_t ERROR_TAG = 0x0002000000000000ull;
+    static const uint64_t EMPTY_TAG = 0x0003000000000000ull;
+
+    static Value box(uint64_t tag, uint32_t payload) {
+        return fromBits(BOX_MASK | tag | payload);
+    }
+
+    uint64_t bits;
+};
+
+static_assert(sizeof(Value) == 8, "Value must stay one machine word");
@@ -0,0 +1,101 @@
+#include "stdafx.h"
+#include "libxlCellSource.h"
+#include "textEncoding.h"
+
+namespace {
+
+ErrorCode errorCode(ErrorType type) {
+    switch (type) {
+    case ERRORTYPE_NULL: return ErrorCode::Null;
+    case ERRORTYPE_DIV_0: return ErrorCode::Div0;
+    case ERRORTYPE_VALUE: return ErrorCode::Value;
+    case ERRORTYPE_REF: return ErrorCode::Ref;
+    case ERRORTYPE_NAME: return ErrorCode::Name;
+    case ERRORTYPE_NUM: return ErrorCode::Num;
+    default: return ErrorCode::NA;
+    }
+}
+
+} // namespace
+
+LibxlCellSource::LibxlCellSource(Book* book) : book(book) {
+    for (int i = 0; i < book->sheetCount(); ++i) {
+        sheets.push_back(book->getSheet(i));
+    }
+}
+
+int LibxlCellSource::sheetCount() const {
+    return (int)sheets.size();
+}
+
+std::string LibxlCellSource::sheetName(int sheet) const {
+    if (sheet < 0 || sheet >= (int)sheets.size() || !sheets[sheet]) return "";
+
+    std::wstring wname = sheets[sheet]->name();
+    return toUtf8(wname);
+}
+
+bool LibxlCellSource::readCell(int sheet, int row, int col, CellData& cell) {
+    cell = CellData();
+    if (sheet < 0 || sheet >= (int)sheets.size() || !sheets[sheet]) return false;
+
+    Sheet* s = sheets[sheet];
+    CellType cellType = s->cellType(row, col);
+    cell.isFormula = s->isFormula(row, col);
+
+    switch (cellType) {
+    case CELLTYPE_NUMBER:
+        cell.kind = CellKind::NUMBER;
+        cell.number = s->readNum(row, col);
+        break;
+
+    case CELLTYPE_STRING: {
+        cell.kind = CellKind::STRING;
+        const wchar_t* text = s->readStr(row, col);
+        if (text) cell.text = text;
+        break;
+    }
+
+    case CELLTYPE_BOOLEAN:
+        cell.kind = CellKind::BOOLEAN;
+        cell.number = s->readBool(row, col) ? 1.0 : 0.0;
+        break;
+
+    case CELLTYPE_ERROR:
+        cell.kind = CellKind::ERROR;
+        cell.error = errorCode(s->readError(row, col));
+        break;
+
+    case CELLTYPE_BLANK:
+        cell.kind = CellKind::BLANK;
+        break;
+
+    default:
+        cell.kind = CellKind::EMPTY;
+        break;
+    }
+
+    if (cell.isFormula && cellType != CELLTYPE_NUMBER) {
+        // Last calculated value, libxl keeps it for formula cells
+        cell.number = s->readNum(row, col);
+    }
+    return true;
+}
+
+std::wstring_view LibxlCellSource::readFormula(int sheet, int row, int col) {
+    if (sheet < 0 || sheet >= (int)sheets.size() || !sheets[sheet]) return std::wstring_view();
+
+    const wchar_t* formula = sheets[sheet]->readFormula(row, col);
+    return formula ? std::wstring_view(formula) : std::wstring_view();
+}
+
+void LibxlCellSource::usedRange(int sheet, int& firstRow, int& lastRow, int& firstCol, int& lastCol) const {
+    firstRow = lastRow = firstCol = lastCol = 0;
+    if (sheet < 0 || sheet >= (int)sheets.size() || !sheets[sheet]) return;
+
+    Sheet* s = sheets[sheet];
+    firstRow = s->firstRow();
+    lastRow = s->lastRow();
+    firstCol = s->firstCol();
+    lastCol = s->lastCol();
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "libxl.h"
+#include <vector>
+#include "cellSource.h"
+
+using namespace libxl;
+
+// CellSource reading a workbook loaded with libxl
+class LibxlCellSource : public CellSource {
+public:
+    explicit LibxlCellSource(Book* book);
+
+    int sheetCount() const override;
+
+    std::string sheetName(int sheet) const override;
+
+    bool readCell(int sheet, int row, int col, CellData& cell) override;
+
+    std::wstring_view readFormula(int sheet, int row, int col) override;
+
+    void usedRange(int sheet, int& firstRow, int& lastRow, int& firstCol, int& lastCol) const override;
+
+private:
+    Book* book;
+    std::vector<Sheet*> sheets;
+};
@@ -0,0 +1,156 @@
+#include "stdafx.h"
+#include "lookupIndex.h"
+
+namespace {
+
+// Floor or ceiling match of key among cells sorted by value then position
+template <typename Key>
+int findSorted(const std::vector<std::pair<Key, uint32_t>>& sorted, const Key& key, LookupMatch match, bool last) {
+    typedef std::pair<Key, uint32_t> Cell;
+    auto byValue = [](const Cell& cell, const Key& value) { return cell.first < value; };
+    auto valueBefore = [](const Key& value, const Cell& cell) { return value < cell.first; };
+
+    // Equal values sit together ordered by position
+    Key value;
+    if (match == LookupMatch::Floor) {
+        auto it = std::upper_bound(sorted.begin(), sorted.end(), key, valueBefore);
+        if (it == sorted.begin()) return -1;
+        value = (it - 1)->first;
+    }
+    else {
+        auto it = std::lower_bound(sorted.begin(), sorted.end(), key, byValue);
+        if (it == sorted.end()) return -1;
+        value = it->first;
+    }
+
+    if (last) {
+        return (int)(std::upper_bound(sorted.begin(), sorted.end(), value, valueBefore) - 1)->second;
+    }
+    return (int)std::lower_bound(sorted.begin(), sorted.end(), value, byValue)->second;
+}
+
+} // namespace
+
+Value LookupIndex::key(Value value, const StringPool& strings) {
+    switch (value.type()) {
+    case ValueType::Number: return Value::number(value.asNumber() + 0.0);
+    case ValueType::String: return Value::string(strings.folded(value.asString()));
+    case ValueType::Empty: return Value::number(0.0);
+    default: return value;
+    }
+}
+
+void LookupIndex::buildHash(const std::vector<Cell>& cells) {
+    hash.clear();
+    hash.reserve(cells.size());
+    for (const auto& cell : cells) {
+        // Cells come in position order, so the first insert is the first position
+        auto inserted = hash.emplace(cell.first.raw(), std::make_pair(cell.second, cell.second));
+        if (!inserted.second) inserted.first->second.second = cell.second;
+    }
+    hashBuilt = true;
+}
+
+void LookupIndex::buildSorted(const std::vector<Cell>& cells, const StringPool& strings) {
+    numbers.clear();
+    texts.clear();
+    for (const auto& cell : cells) {
+        if (cell.first.isNumber()) {
+            numbers.emplace_back(cell.first.asNumber(), cell.second);
+        }
+        else if (cell.first.type() == ValueType::String) {
+            texts.emplace_back(strings.text(cell.first.asString()), cell.second);
+        }
+    }
+    std::sort(numbers.begin(), numbers.end());
+    std::sort(texts.begin(), texts.end());
+    sortedBuilt = true;
+}
+
+int LookupIndex::find(Value key, LookupMatch match, bool last, const StringPool& strings) const {
+    key = LookupIndex::key(key, strings);
+    if (match == LookupMatch::Exact) {
+        auto it = hash.find(key.raw());
+        if (it == hash.end()) return -1;
+        return (int)(last ? it->second.second : it->second.first);
+    }
+
+    switch (key.type()) {
+    case ValueType::Number: return findSorted(numbers, key.asNumber(), match, last);
+    case ValueType::String: return findSorted(texts, strings.text(key.asString()), match, last);
+    default: return -1;
+    }
+}
+
+size_t LookupIndex::memoryBytes() const {
+    return sizeof(LookupIndex) +
+        hash.size() * (sizeof(uint64_t) + sizeof(std::pair<uint32_t, uint32_t>) + 2 * sizeof(void*)) +
+        hash.bucket_count() * sizeof(void*) +
+        numbers.capacity() * sizeof(std::pair<double, uint32_t>) +
+        texts.capacity() * sizeof(std::pair<std::wstring_view, uint32_t>);
+}
+
+bool LookupIndexCache::isIndexed(const RangeRef& line, LookupMatch match) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(LineKey(line.sheet, line.firstRow, line.firstCol, line.lastRow, line.lastCol));
+    if (it == entries.end() || !it->second.index) return false;
+    return (match == LookupMatch::Exact) ? it->second.index->hasHash() : it->second.index->hasSorted();
+}
+
+// Lines are few next to the cells looking them up, so a change scans them all
+void LookupIndexCache::invalidateCell(const CellKey& cell) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end();) {
+        int sheet, firstRow, firstCol, lastRow, lastCol;
+        std::tie(sheet, firstRow, firstCol, lastRow, lastCol) = it->first;
+        if (sheet == cell.sheet && cell.row >= firstRow && cell.row <= lastRow &&
+            cell.col >= firstCol && cell.col <= lastCol) {
+            it = entries.erase(it);
+            stats.invalidations++;
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void LookupIndexCache::invalidateSheet(int sheet) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (std::get<0>(it->first) == sheet) {
+            it = entries.erase(it);
+            stats.invalidations++;
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void LookupIndexCache::invalidateFormulas() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (it->second.hasFormulas) {
+            it = entries.erase(it);
+            stats.invalidations++;
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void LookupIndexCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+}
+
+LookupStats LookupIndexCache::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    LookupStats current = stats;
+    current.indexes = entries.size();
+    for (const auto& entry : entries) {
+        if (entry.second.index) current.memoryBytes += entry.second.index->memoryBytes();
+    }
+    return current;
+}
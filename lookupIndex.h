@@ -0,0 +1,180 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "formulaBytecode.h"
+#include "sheetSnapshot.h"
+
+struct LookupStats {
+    size_t lookups = 0;
+    size_t builds = 0;            // hash and sorted indexes built
+    size_t invalidations = 0;     // indexes dropped because a cell in them changed
+    size_t indexes = 0;           // lines currently indexed
+    size_t memoryBytes = 0;
+};
+
+// Cells of one line, part of a single row or column, by value. Numbers
+// match numbers and texts match texts, ignoring case; booleans only match
+// exactly. Positions count from the start of the line; empty and error
+// cells never match.
+//
+// Sorted texts point into the snapshot's StringPool, so the index must go
+// when the snapshot is loaded again.
+class LookupIndex {
+public:
+    typedef std::pair<Value, uint32_t> Cell;    // key, position
+
+    // Form a value is indexed and searched under: -0 as 0, texts by their
+    // case-folded handle, an empty key as 0
+    static Value key(Value value, const StringPool& strings);
+
+    // Hash of key -> first and last position, for exact matches
+    void buildHash(const std::vector<Cell>& cells);
+
+    // Numbers and texts ordered by value then position, for approximate matches
+    void buildSorted(const std::vector<Cell>& cells, const StringPool& strings);
+
+    bool hasHash() const { return hashBuilt; }
+
+    bool hasSorted() const { return sortedBuilt; }
+
+    // Position of the match nearest the start, or the end if last; -1 if none
+    int find(Value key, LookupMatch match, bool last, const StringPool& strings) const;
+
+    size_t memoryBytes() const;
+
+private:
+    std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>> hash;     // by key bits
+    std::vector<std::pair<double, uint32_t>> numbers;
+    std::vector<std::pair<std::wstring_view, uint32_t>> texts;
+    bool hashBuilt = false;
+    bool sortedBuilt = false;
+};
+
+// Keys of the cells of line in position order; formula cells are valued
+// by formulaValue(sheet, row, col) and set hasFormulas
+template <typename FormulaValue>
+std::vector<LookupIndex::Cell> lineValues(const WorkbookSnapshot& snapshot, const RangeRef& line,
+    bool& hasFormulas, FormulaValue formulaValue) {
+    std::vector<LookupIndex::Cell> cells;
+    hasFormulas = false;
+
+    const SheetColumns& columns = snapshot.sheet(line.sheet);
+    int firstRow = std::max(line.firstRow, columns.firstRow);
+    int lastRow = std::min(line.lastRow, columns.lastRow - 1);
+    int firstCol = std::max(line.firstCol, columns.firstCol);
+    int lastCol = std::min(line.lastCol, columns.lastCol - 1);
+
+    for (int col = firstCol; col <= lastCol; ++col) {
+        for (int row = firstRow; row <= lastRow; ++row) {
+            uint8_t flags = columns.flags[columns.slot(row, col)];
+            uint32_t position = (uint32_t)((row - line.firstRow) + (col - line.firstCol));
+            Value value;
+            if (flags & FORMULA) {
+                value = formulaValue(line.sheet, row, col);
+                hasFormulas = true;
+            }
+            else {
+                value = snapshot.value(line.sheet, row, col);
+            }
+
+            ValueType type = value.type();
+            if (type != ValueType::Empty && type != ValueType::Error) {
+                cells.emplace_back(LookupIndex::key(value, snapshot.strings()), position);
+            }
+        }
+    }
+    return cells;
+}
+
+// Linear search of line, for cells whose values are still changing
+template <typename FormulaValue>
+int scanLine(const WorkbookSnapshot& snapshot, const RangeRef& line, Value key, LookupMatch match, bool last,
+    FormulaValue formulaValue) {
+    bool hasFormulas;
+    LookupIndex index;
+    if (match == LookupMatch::Exact) {
+        index.buildHash(lineValues(snapshot, line, hasFormulas, formulaValue));
+    }
+    else {
+        index.buildSorted(lineValues(snapshot, line, hasFormulas, formulaValue), snapshot.strings());
+    }
+    return index.find(key, match, last, snapshot.strings());
+}
+
+// Lookup indexes of every line searched so far, built on first use: a hash
+// index once an exact match is asked for, a sorted one for approximate
+// matches. An index stays until a cell of its line changes.
+//
+// Safe to share between the workers of a recalculation: indexes are built
+// under a lock and searched after it is released.
+class LookupIndexCache {
+public:
+    // Position in line of the cell matching key, -1 if none. Formula cells
+    // of the line must already have their results in formulaValue.
+    template <typename FormulaValue>
+    int find(const WorkbookSnapshot& snapshot, const RangeRef& line, Value key, LookupMatch match, bool last,
+        FormulaValue formulaValue);
+
+    // Whether find would answer from an index without building one
+    bool isIndexed(const RangeRef& line, LookupMatch match) const;
+
+    void invalidateCell(const CellKey& cell);
+
+    void invalidateSheet(int sheet);
+
+    // Drop the indexes of lines holding formulas, before a recalculation
+    // changes their results
+    void invalidateFormulas();
+
+    void clear();
+
+    LookupStats getStats() const;
+
+private:
+    typedef std::tuple<int, int, int, int, int> LineKey;
+
+    struct Entry {
+        std::shared_ptr<LookupIndex> index;
+        bool hasFormulas = false;
+    };
+
+    mutable std::mutex mutex;
+    std::map<LineKey, Entry> entries;
+    LookupStats stats;
+};
+
+template <typename FormulaValue>
+int LookupIndexCache::find(const WorkbookSnapshot& snapshot, const RangeRef& line, Value key, LookupMatch match,
+    bool last, FormulaValue formulaValue) {
+    if (key.isError()) return -1;
+
+    std::shared_ptr<const LookupIndex> index;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.lookups++;
+        Entry& entry = entries[LineKey(line.sheet, line.firstRow, line.firstCol, line.lastRow, line.lastCol)];
+        bool exact = match == LookupMatch::Exact;
+        if (!entry.index || (exact ? !entry.index->hasHash() : !entry.index->hasSorted())) {
+            // Indexes are never changed once searched; add the other kind to a copy
+            auto built = entry.index ? std::make_shared<LookupIndex>(*entry.index) : std::make_shared<LookupIndex>();
+            if (exact) {
+                built->buildHash(lineValues(snapshot, line, entry.hasFormulas, formulaValue));
+            }
+            else {
+                built->buildSorted(lineValues(snapshot, line, entry.hasFormulas, formulaValue), snapshot.strings());
+            }
+            entry.index = built;
+            stats.builds++;
+        }
+        index = entry.index;
+    }
+    return index->find(key, match, last, snapshot.strings());
+}
@@ -1,34 +1,347 @@
-
-#include "xlsxFormulaEvaluator.h"
-
-int main(){
-Book* pBook = xlCreateBook();
-
-CString sourceFile = L"C:\\T1\\346043(11_106).xls";
-
-//pBook->setKey(_T(""), <your_key>);
-bool isFileLoaded = pBook->load(sourceFile);
-TreeFormulaEvaluator evaluator(pBook);
-
-
-// Test formulae
-std::vector<std::string> testFormulas = {
-				//"=U25/SUM(G22:L22)*0.9144" -- tested working fine
-				//"=U25/SUM(G22:L22)"  -- tested working fine
-				// "=W25/SUM(G22:L22)" -- tsted working fine 
-				//"=W25/SUM(G22:L22)*12" -- tested working fine
-				//"=(+G23*APPENDIX!C4+H23*APPENDIX!D4+I23*APPENDIX!E4+J23*APPENDIX!F4+K23*APPENDIX!G4+L23*APPENDIX!H4)/U25", -- tsted works fine						
-				// "=I11-H11" -- tested working fine
-				// "=U25" -- tested working fine
-};
-
-for (const auto& formula : testFormulas) {
-				double result = evaluator.evaluateFormula(formula);
-				std::cout << "Formula: " << result << std::endl;
-				std::cout << "================================\n" << std::endl;
-}				
-
-pBook->release();
-
-return 0;
-}
\ No newline at end of file
+#include "stdafx.h"
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include "xlsxFormulaEvaluator.h"
+#include "workbookPipeline.h"
+
+// Batch driver: evaluates the formulas and ranges listed in a query file
+// (or stdin) against one workbook, or against every workbook of a list
+// through the WorkbookPipeline, and writes every result as CSV or JSON.
+//
+// Query file: one query per line; lines starting with = are formulas, any
+// other line a cell or range such as Sheet1!B2:D10. Blank lines and lines
+// starting with # are skipped.
+
+namespace {
+
+struct Options {
+    std::string workbook;
+    std::string workbookList;
+    std::string queries = "-";
+    std::string output = "-";
+    std::string cache;
+    bool json = false;
+    bool recalculate = false;
+    size_t threads = 0;
+    PipelineOptions pipeline;
+};
+
+void printUsage() {
+    std::cerr << "usage: formulaEval <workbook> [queries|-] [options]\n"
+                 "       formulaEval --workbooks <list> [queries|-] [options]\n"
+                 "  --format csv|json   output format (csv)\n"
+                 "  --output <file>     write results to file instead of stdout\n"
+                 "  --recalc            recalculate the whole workbook before the queries\n"
+                 "  --threads <n>       threads for --recalc (one per hardware thread)\n"
+                 "  --cache <file>      reuse compiled formulas and results across runs (one\n"
+                 "                      workbook only)\n"
+                 "  --workbooks <list>  evaluate every workbook named in list, one per line\n"
+                 "  --load-workers <n>  workbooks read at a time (2)\n"
+                 "  --workers <n>       workbooks compiled and evaluated at a time (one per\n"
+                 "                      hardware thread)\n"
+                 "  --memory <MB>       memory for workbooks in flight (unlimited)\n";
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--format" && hasValue) {
+            std::string format = argv[++i];
+            if (format != "csv" && format != "json") return false;
+            options.json = (format == "json");
+        }
+        else if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        }
+        else if (arg == "--cache" && hasValue) {
+            options.cache = argv[++i];
+        }
+        else if (arg == "--threads" && hasValue) {
+            options.threads = (size_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--workbooks" && hasValue) {
+            options.workbookList = argv[++i];
+        }
+        else if (arg == "--load-workers" && hasValue) {
+            options.pipeline.loadWorkers = (size_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--workers" && hasValue) {
+            options.pipeline.compileWorkers = (size_t)std::strtoul(argv[++i], nullptr, 10);
+            options.pipeline.evaluateWorkers = options.pipeline.compileWorkers;
+        }
+        else if (arg == "--memory" && hasValue) {
+            options.pipeline.memoryBudget = (size_t)std::strtoull(argv[++i], nullptr, 10) << 20;
+        }
+        else if (arg == "--recalc") {
+            options.recalculate = true;
+        }
+        else if (arg.size() > 1 && arg[0] == '-' && arg != "-") {
+            return false;
+        }
+        else {
+            positional.push_back(arg);
+        }
+    }
+    // With a list the only positional argument is the query file
+    size_t workbooks = options.workbookList.empty() ? 1 : 0;
+    if (positional.size() < workbooks || positional.size() > workbooks + 1) return false;
+    if (workbooks > 0) options.workbook = positional[0];
+    if (positional.size() > workbooks) options.queries = positional[workbooks];
+    options.pipeline.recalculate = options.recalculate;
+    return true;
+}
+
+// Lines with surrounding blanks trimmed, blank and # lines skipped
+void readLines(std::istream& in, std::vector<std::string>& lines) {
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t begin = line.find_first_not_of(" \t\r");
+        size_t end = line.find_last_not_of(" \t\r");
+        if (begin == std::string::npos || line[begin] == '#') continue;
+        lines.push_back(line.substr(begin, end - begin + 1));
+    }
+}
+
+bool readLines(const std::string& path, std::vector<std::string>& lines) {
+    if (path == "-") {
+        readLines(std::cin, lines);
+        return true;
+    }
+    std::ifstream in(path);
+    if (!in) return false;
+    readLines(in, lines);
+    return true;
+}
+
+// Numbers with the 15 significant digits Excel keeps
+std::string numberText(double number) {
+    std::ostringstream text;
+    text << std::setprecision(15) << number;
+    return text.str();
+}
+
+std::string csvField(const std::string& text) {
+    if (text.find_first_of(",\"\r\n") == std::string::npos) return text;
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"') quoted += '"';
+        quoted += c;
+    }
+    quoted += '"';
+    return quoted;
+}
+
+std::string jsonString(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+    return out;
+}
+
+const char* typeName(ValueType type) {
+    switch (type) {
+    case ValueType::Number: return "number";
+    case ValueType::Boolean: return "boolean";
+    case ValueType::String: return "text";
+    case ValueType::Error: return "error";
+    default: return "empty";
+    }
+}
+
+// One row per value: query number, query, cell, type, value, error, after
+// the workbook when there are several. A query without values still gets
+// a row, to carry its error.
+void writeCsvHeader(std::ostream& out, bool withWorkbook) {
+    out << (withWorkbook ? "workbook," : "") << "query,input,cell,type,value,error\n";
+}
+
+void writeCsv(std::ostream& out, const std::string& workbook, TreeFormulaEvaluator& evaluator,
+    const std::vector<BatchQuery>& queries, const BatchResults& results) {
+    for (size_t i = 0; i < queries.size(); ++i) {
+        std::string prefix = workbook + std::to_string(i + 1) + ',' + csvField(queries[i].text) + ',';
+        if (results.offsets[i] == results.offsets[i + 1]) {
+            out << prefix << ",,," << csvField(results.errors[i]) << '\n';
+            continue;
+        }
+        for (uint32_t v = results.offsets[i]; v < results.offsets[i + 1]; ++v) {
+            Value value = results.values[v];
+            const CellKey& cell = results.cells[v];
+            out << prefix << (cell.sheet >= 0 ? csvField(evaluator.cellAddress(cell)) : std::string()) << ','
+                << typeName(value.type()) << ','
+                << csvField(value.isNumber() ? numberText(value.asNumber()) : evaluator.valueText(value)) << ','
+                << csvField(results.errors[i]) << '\n';
+        }
+    }
+}
+
+// Numbers, booleans and text map to their JSON types, empty cells to null
+// and errors to {"error": "#DIV/0!"}
+std::string jsonValue(TreeFormulaEvaluator& evaluator, Value value) {
+    switch (value.type()) {
+    case ValueType::Number:
+        return std::isfinite(value.asNumber()) ? numberText(value.asNumber()) : "null";
+    case ValueType::Boolean:
+        return value.asBoolean() ? "true" : "false";
+    case ValueType::String:
+        return jsonString(evaluator.valueText(value));
+    case ValueType::Error:
+        return "{\"error\": " + jsonString(evaluator.valueText(value)) + "}";
+    default:
+        return "null";
+    }
+}
+
+// One line per query, indented by indent
+void writeJson(std::ostream& out, const char* indent, TreeFormulaEvaluator& evaluator,
+    const std::vector<BatchQuery>& queries, const BatchResults& results) {
+    for (size_t i = 0; i < queries.size(); ++i) {
+        out << indent << "{\"query\": " << jsonString(queries[i].text);
+        if (!results.errors[i].empty()) out << ", \"error\": " << jsonString(results.errors[i]);
+        out << ", \"results\": [";
+        for (uint32_t v = results.offsets[i]; v < results.offsets[i + 1]; ++v) {
+            if (v > results.offsets[i]) out << ", ";
+            const CellKey& cell = results.cells[v];
+            out << '{';
+            if (cell.sheet >= 0) out << "\"cell\": " << jsonString(evaluator.cellAddress(cell)) << ", ";
+            out << "\"value\": " << jsonValue(evaluator, results.values[v]) << '}';
+        }
+        out << "]}" << (i + 1 < queries.size() ? "," : "") << '\n';
+    }
+}
+
+// One workbook, read and evaluated on this thread
+int runSingle(const Options& options, const std::vector<BatchQuery>& queries, std::ostream& out) {
+    std::string error;
+    std::unique_ptr<CellSource> cells = openWorkbook(options.workbook, error);
+    if (!cells) {
+        std::cerr << "Cannot load workbook: " << options.workbook << ": " << error << std::endl;
+        return 1;
+    }
+
+    TreeFormulaEvaluator evaluator(*cells);
+    bool cached = !options.cache.empty() && evaluator.loadCompiledCache(options.cache);
+    if (options.recalculate && !cached) evaluator.recalculateAll(options.threads);
+
+    BatchResults results;
+    evaluator.evaluateBatch(queries, results);
+
+    if (options.json) {
+        out << "[\n";
+        writeJson(out, "  ", evaluator, queries, results);
+        out << "]\n";
+    }
+    else {
+        writeCsvHeader(out, false);
+        writeCsv(out, "", evaluator, queries, results);
+    }
+
+    if (!options.cache.empty() && !evaluator.saveCompiledCache(options.cache)) {
+        std::cerr << "Cannot write cache: " << options.cache << std::endl;
+    }
+    return 0;
+}
+
+// Every workbook of the list through the pipeline, the same queries for
+// each; results are written as workbooks finish, not in list order
+int runPipeline(const Options& options, const std::vector<BatchQuery>& queries, std::ostream& out) {
+    std::vector<std::string> paths;
+    if (!readLines(options.workbookList, paths)) {
+        std::cerr << "Cannot read workbook list: " << options.workbookList << std::endl;
+        return 1;
+    }
+
+    std::vector<WorkbookJob> jobs(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+        jobs[i].path = paths[i];
+        jobs[i].queries = queries;
+    }
+
+    if (options.json) out << "[\n";
+    else writeCsvHeader(out, true);
+
+    size_t written = 0;
+    WorkbookPipeline pipeline(options.pipeline);
+    PipelineStats stats = pipeline.run(jobs, [&](WorkbookResult& result) {
+        const std::string& path = result.job->path;
+        if (options.json) {
+            out << "  {\"workbook\": " << jsonString(path);
+            if (!result.error.empty()) out << ", \"error\": " << jsonString(result.error);
+            out << ", \"queries\": [\n";
+            if (result.evaluator) writeJson(out, "    ", *result.evaluator, result.job->queries, result.results);
+            out << "  ]}" << (++written < jobs.size() ? "," : "") << '\n';
+        }
+        else if (result.evaluator) {
+            writeCsv(out, csvField(path) + ',', *result.evaluator, result.job->queries, result.results);
+        }
+        else {
+            out << csvField(path) << ",,,,,," << csvField(result.error) << '\n';
+        }
+    });
+
+    if (options.json) out << "]\n";
+    std::cerr << stats.workbooks << " workbooks, " << stats.failed << " failed, " << stats.wallSeconds
+              << " s (load " << stats.loadSeconds << " s, compile " << stats.compileSeconds << " s, evaluate "
+              << stats.evaluateSeconds << " s), peak " << (stats.peakMemoryBytes >> 20) << " MB" << std::endl;
+    return stats.failed > 0 ? 1 : 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 2;
+    }
+
+    // Results may go to stdout, so diagnostics must not
+    Tracer::instance().setSink(std::make_shared<StreamTraceSink>(std::cerr));
+
+    std::vector<std::string> lines;
+    if (!readLines(options.queries, lines)) {
+        std::cerr << "Cannot read queries: " << options.queries << std::endl;
+        return 1;
+    }
+    std::vector<BatchQuery> queries;
+    for (auto& text : lines) {
+        queries.push_back(BatchQuery{ text[0] == '=' ? BatchQuery::FORMULA : BatchQuery::CELLS, std::move(text) });
+    }
+
+    std::ofstream file;
+    if (options.output != "-") {
+        file.open(options.output, std::ios::binary);
+        if (!file) {
+            std::cerr << "Cannot write results: " << options.output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = (options.output == "-") ? std::cout : file;
+
+    int status = options.workbookList.empty() ? runSingle(options, queries, out) : runPipeline(options, queries, out);
+    out.flush();
+    if (!out) {
+        std::cerr << "Cannot write results: " << options.output << std::endl;
+        status = 1;
+    }
+    return status;
+}
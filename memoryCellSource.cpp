@@ -0,0 +1,212 @@
+#include "stdafx.h"
+#include "memoryCellSource.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <fstream>
+#include "textEncoding.h"
+
+int MemoryCellSource::addSheet(const std::string& name) {
+    sheets.emplace_back();
+    sheets.back().name = name;
+    return (int)sheets.size() - 1;
+}
+
+int MemoryCellSource::findSheet(const std::string& name) const {
+    for (size_t i = 0; i < sheets.size(); ++i) {
+        if (sheets[i].name == name) return (int)i;
+    }
+    return -1;
+}
+
+MemoryCellSource::Cell* MemoryCellSource::cellAt(int sheet, int row, int col, bool create) {
+    if (sheet < 0 || sheet >= (int)sheets.size() || row < 0 || col < 0) return nullptr;
+
+    SheetData& data = sheets[sheet];
+    if (!create) {
+        auto it = data.cells.find(cellKey(row, col));
+        return (it != data.cells.end()) ? &it->second : nullptr;
+    }
+
+    if (data.cells.empty()) {
+        data.firstRow = row;
+        data.lastRow = row + 1;
+        data.firstCol = col;
+        data.lastCol = col + 1;
+    }
+    else {
+        data.firstRow = std::min(data.firstRow, row);
+        data.lastRow = std::max(data.lastRow, row + 1);
+        data.firstCol = std::min(data.firstCol, col);
+        data.lastCol = std::max(data.lastCol, col + 1);
+    }
+
+    Cell& cell = data.cells[cellKey(row, col)];
+    cell = Cell();
+    return &cell;
+}
+
+void MemoryCellSource::setNumber(int sheet, int row, int col, double value) {
+    Cell* cell = cellAt(sheet, row, col, true);
+    if (!cell) return;
+    cell->kind = CellKind::NUMBER;
+    cell->number = value;
+}
+
+void MemoryCellSource::setString(int sheet, int row, int col, const std::wstring& text) {
+    Cell* cell = cellAt(sheet, row, col, true);
+    if (!cell) return;
+    cell->kind = CellKind::STRING;
+    cell->text = text;
+}
+
+void MemoryCellSource::setBoolean(int sheet, int row, int col, bool value) {
+    Cell* cell = cellAt(sheet, row, col, true);
+    if (!cell) return;
+    cell->kind = CellKind::BOOLEAN;
+    cell->number = value ? 1.0 : 0.0;
+}
+
+void MemoryCellSource::setError(int sheet, int row, int col, ErrorCode code) {
+    Cell* cell = cellAt(sheet, row, col, true);
+    if (!cell) return;
+    cell->kind = CellKind::ERROR;
+    cell->error = code;
+}
+
+void MemoryCellSource::setFormula(int sheet, int row, int col, const std::wstring& formula, double cachedValue) {
+    Cell* cell = cellAt(sheet, row, col, true);
+    if (!cell) return;
+    cell->kind = CellKind::NUMBER;
+    cell->number = cachedValue;
+    cell->formula = formula;
+}
+
+void MemoryCellSource::clearCell(int sheet, int row, int col) {
+    if (sheet < 0 || sheet >= (int)sheets.size()) return;
+    // Used range is left as is; it only has to be an upper bound
+    sheets[sheet].cells.erase(cellKey(row, col));
+}
+
+int MemoryCellSource::loadCsv(const std::string& sheetName, std::istream& input, char separator) {
+    int sheet = findSheet(sheetName);
+    if (sheet < 0) sheet = addSheet(sheetName);
+
+    int row = 0;
+    int col = 0;
+    std::string field;
+    bool quoted = false;
+    bool wasQuoted = false;
+
+    auto storeField = [&]() {
+        if (!field.empty() || wasQuoted) {
+            std::wstring wide = widen(field);
+            ErrorCode code;
+            // Decimal only: no spaces, hex, inf or nan, which would
+            // collide with the NaN-boxed errors
+            double value = 0.0;
+            const char* end = field.data() + field.size();
+            auto parsed = std::from_chars(field.data(), end, value);
+            bool number = parsed.ec == std::errc() && parsed.ptr == end && std::isfinite(value);
+            if (!wasQuoted && !field.empty() && field[0] == '=') {
+                setFormula(sheet, row, col, wide);
+            }
+            else if (!wasQuoted && number) {
+                setNumber(sheet, row, col, value);
+            }
+            else if (!wasQuoted && (field == "TRUE" || field == "FALSE")) {
+                setBoolean(sheet, row, col, field == "TRUE");
+            }
+            else if (!wasQuoted && parseErrorText(field, code)) {
+                setError(sheet, row, col, code);
+            }
+            else {
+                setString(sheet, row, col, wide);
+            }
+        }
+        field.clear();
+        wasQuoted = false;
+    };
+
+    char c;
+    while (input.get(c)) {
+        if (quoted) {
+            if (c == '"') {
+                if (input.peek() == '"') {
+                    input.get(c);
+                    field += '"';
+                }
+                else {
+                    quoted = false;
+                }
+            }
+            else {
+                field += c;
+            }
+        }
+        else if (c == '"') {
+            quoted = true;
+            wasQuoted = true;
+        }
+        else if (c == separator) {
+            storeField();
+            col++;
+        }
+        else if (c == '\n') {
+            storeField();
+            row++;
+            col = 0;
+        }
+        else if (c != '\r') {
+            field += c;
+        }
+    }
+    storeField();
+
+    return sheet;
+}
+
+int MemoryCellSource::loadCsvFile(const std::string& sheetName, const std::string& path, char separator) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) return -1;
+    return loadCsv(sheetName, input, separator);
+}
+
+int MemoryCellSource::sheetCount() const {
+    return (int)sheets.size();
+}
+
+std::string MemoryCellSource::sheetName(int sheet) const {
+    return (sheet >= 0 && sheet < (int)sheets.size()) ? sheets[sheet].name : "";
+}
+
+bool MemoryCellSource::readCell(int sheet, int row, int col, CellData& cell) {
+    cell = CellData();
+    if (sheet < 0 || sheet >= (int)sheets.size()) return false;
+
+    const Cell* data = cellAt(sheet, row, col, false);
+    if (!data) return true;
+
+    cell.kind = data->kind;
+    cell.number = data->number;
+    cell.isFormula = !data->formula.empty();
+    if (data->kind == CellKind::STRING) cell.text = data->text;
+    if (data->kind == CellKind::ERROR) cell.error = data->error;
+    return true;
+}
+
+std::wstring_view MemoryCellSource::readFormula(int sheet, int row, int col) {
+    const Cell* data = cellAt(sheet, row, col, false);
+    return data ? std::wstring_view(data->formula) : std::wstring_view();
+}
+
+void MemoryCellSource::usedRange(int sheet, int& firstRow, int& lastRow, int& firstCol, int& lastCol) const {
+    firstRow = lastRow = firstCol = lastCol = 0;
+    if (sheet < 0 || sheet >= (int)sheets.size()) return;
+
+    const SheetData& data = sheets[sheet];
+    firstRow = data.firstRow;
+    lastRow = data.lastRow;
+    firstCol = data.firstCol;
+    lastCol = data.lastCol;
+}
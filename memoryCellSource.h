@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cellSource.h"
+
+// Sparse in-memory workbook, filled from code or CSV. Lets the evaluator
+// run without libxl or an Excel file.
+class MemoryCellSource : public CellSource {
+public:
+    // Returns the index of the new sheet
+    int addSheet(const std::string& name);
+
+    // -1 if there is no such sheet
+    int findSheet(const std::string& name) const;
+
+    void setNumber(int sheet, int row, int col, double value);
+
+    void setString(int sheet, int row, int col, const std::wstring& text);
+
+    void setBoolean(int sheet, int row, int col, bool value);
+
+    void setError(int sheet, int row, int col, ErrorCode code = ErrorCode::NA);
+
+    // cachedValue plays the role of the value Excel saved with the formula
+    void setFormula(int sheet, int row, int col, const std::wstring& formula, double cachedValue = 0.0);
+
+    void clearCell(int sheet, int row, int col);
+
+    // Fill a sheet from CSV text, one record per row starting at A1.
+    // Finite decimal numbers become numbers, fields starting with = become
+    // formulas, TRUE/FALSE booleans, #DIV/0! and the other error literals
+    // errors and anything else, nan, inf and 0x10 included, text. Returns
+    // the sheet index.
+    int loadCsv(const std::string& sheetName, std::istream& input, char separator = ',');
+
+    int loadCsvFile(const std::string& sheetName, const std::string& path, char separator = ',');
+
+    // CellSource
+    int sheetCount() const override;
+
+    std::string sheetName(int sheet) const override;
+
+    bool readCell(int sheet, int row, int col, CellData& cell) override;
+
+    std::wstring_view readFormula(int sheet, int row, int col) override;
+
+    void usedRange(int sheet, int& firstRow, int& lastRow, int& firstCol, int& lastCol) const override;
+
+private:
+    struct Cell {
+        CellKind kind = CellKind::EMPTY;
+        double number = 0.0;
+        ErrorCode error = ErrorCode::NA;
+        std::wstring text;
+        std::wstring formula;
+    };
+
+    struct SheetData {
+        std::string name;
+        std::unordered_map<uint64_t, Cell> cells;   // keyed by row << 32 | col
+        int firstRow = 0;
+        int lastRow = 0;
+        int firstCol = 0;
+        int lastCol = 0;
+    };
+
+    static uint64_t cellKey(int row, int col) {
+        return ((uint64_t)(uint32_t)row << 32) | (uint32_t)col;
+    }
+
+    Cell* cellAt(int sheet, int row, int col, bool create);
+
+    std::vector<SheetData> sheets;
+};
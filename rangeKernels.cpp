@@ -0,0 +1,171 @@
+#include "stdafx.h"
+#include "rangeKernels.h"
+#include "cellSource.h"
+#include <algorithm>
+
+#if !defined(XLSX_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define XLSX_AVX2_KERNELS 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define XLSX_TARGET_AVX2
+#else
+#define XLSX_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace {
+
+const uint8_t NUMBER_FLAG = (uint8_t)CellKind::NUMBER;
+const uint8_t ERROR_FLAG = (uint8_t)CellKind::ERROR;
+
+bool isNonEmpty(uint8_t flags) {
+    uint8_t kind = flags & 0x07;
+    return kind != (uint8_t)CellKind::EMPTY && kind != (uint8_t)CellKind::BLANK;
+}
+
+void aggregateScalar(const double* values, const uint8_t* flags, size_t count, AggregateState& state) {
+    for (size_t i = 0; i < count; ++i) {
+        if (flags[i] == NUMBER_FLAG) {
+            state.addNumber(values[i]);
+        }
+        else if (flags[i] == ERROR_FLAG) {
+            state.addError((ErrorCode)(int)values[i]);
+        }
+        else if (isNonEmpty(flags[i])) {
+            state.counta += 1.0;
+        }
+    }
+}
+
+double dotScalar(const double* a, const uint8_t* flagsA, const double* b, const uint8_t* flagsB, size_t count) {
+    double sum = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        if (flagsA[i] == NUMBER_FLAG && flagsB[i] == NUMBER_FLAG) {
+            sum += a[i] * b[i];
+        }
+    }
+    return sum;
+}
+
+#ifdef XLSX_AVX2_KERNELS
+
+// All-ones lanes where the flag byte is a plain number
+XLSX_TARGET_AVX2 inline __m256d numberMask(const uint8_t* flags) {
+    int32_t packed;
+    std::copy(flags, flags + 4, reinterpret_cast<uint8_t*>(&packed));
+    __m256i wide = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+    return _mm256_castsi256_pd(_mm256_cmpeq_epi64(wide, _mm256_set1_epi64x(NUMBER_FLAG)));
+}
+
+XLSX_TARGET_AVX2 double horizontalSum(__m256d v) {
+    __m128d low = _mm256_castpd256_pd128(v);
+    __m128d high = _mm256_extractf128_pd(v, 1);
+    low = _mm_add_pd(low, high);
+    return _mm_cvtsd_f64(_mm_add_sd(low, _mm_unpackhi_pd(low, low)));
+}
+
+XLSX_TARGET_AVX2 void aggregateAvx2(const double* values, const uint8_t* flags, size_t count, AggregateState& state) {
+    const __m256d ones = _mm256_set1_pd(1.0);
+    const __m256d posInf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    const __m256d negInf = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+
+    __m256d sum = _mm256_setzero_pd();
+    __m256d numbers = _mm256_setzero_pd();
+    __m256d min = posInf;
+    __m256d max = negInf;
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d mask = numberMask(flags + i);
+        __m256d v = _mm256_loadu_pd(values + i);
+        sum = _mm256_add_pd(sum, _mm256_and_pd(mask, v));
+        numbers = _mm256_add_pd(numbers, _mm256_and_pd(mask, ones));
+        min = _mm256_min_pd(min, _mm256_blendv_pd(posInf, v, mask));
+        max = _mm256_max_pd(max, _mm256_blendv_pd(negInf, v, mask));
+    }
+
+    double lanes[4];
+    state.sum += horizontalSum(sum);
+    double numeric = horizontalSum(numbers);
+    state.count += numeric;
+    state.counta += numeric;
+    _mm256_storeu_pd(lanes, min);
+    state.min = std::min(state.min, std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3])));
+    _mm256_storeu_pd(lanes, max);
+    state.max = std::max(state.max, std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3])));
+
+    // Non-numeric but non-empty cells only matter for COUNTA and errors
+    for (size_t j = 0; j < i; ++j) {
+        if (flags[j] == ERROR_FLAG) state.addError((ErrorCode)(int)values[j]);
+        else if (flags[j] != NUMBER_FLAG && isNonEmpty(flags[j])) state.counta += 1.0;
+    }
+
+    aggregateScalar(values + i, flags + i, count - i, state);
+}
+
+XLSX_TARGET_AVX2 double dotAvx2(const double* a, const uint8_t* flagsA, const double* b, const uint8_t* flagsB, size_t count) {
+    __m256d sum = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d mask = _mm256_and_pd(numberMask(flagsA + i), numberMask(flagsB + i));
+        __m256d product = _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        sum = _mm256_add_pd(sum, _mm256_and_pd(mask, product));
+    }
+
+    return horizontalSum(sum) + dotScalar(a + i, flagsA + i, b + i, flagsB + i, count - i);
+}
+
+bool detectAvx2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+const bool HAS_AVX2 = detectAvx2();
+
+#endif
+
+} // namespace
+
+namespace RangeKernels {
+
+void aggregate(const double* values, const uint8_t* flags, size_t count, AggregateState& state) {
+#ifdef XLSX_AVX2_KERNELS
+    if (HAS_AVX2) {
+        aggregateAvx2(values, flags, count, state);
+        return;
+    }
+#endif
+    aggregateScalar(values, flags, count, state);
+}
+
+double dot(const double* a, const uint8_t* flagsA, const double* b, const uint8_t* flagsB, size_t count) {
+#ifdef XLSX_AVX2_KERNELS
+    if (HAS_AVX2) {
+        return dotAvx2(a, flagsA, b, flagsB, count);
+    }
+#endif
+    return dotScalar(a, flagsA, b, flagsB, count);
+}
+
+bool usingAvx2() {
+#ifdef XLSX_AVX2_KERNELS
+    return HAS_AVX2;
+#else
+    return false;
+#endif
+}
+
+}
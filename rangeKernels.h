@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include "formulaValue.h"
+
+// Running totals of an aggregate over one or more spans of cells
+struct AggregateState {
+    double sum = 0.0;
+    double count = 0.0;      // numeric cells
+    double counta = 0.0;     // non-empty cells
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    Value error = Value::empty();   // first error cell met, the result of all but COUNT and COUNTA
+
+    void addNumber(double value) {
+        sum += value;
+        count += 1.0;
+        counta += 1.0;
+        if (value < min) min = value;
+        if (value > max) max = value;
+    }
+
+    void addError(ErrorCode code) {
+        counta += 1.0;
+        if (!error.isError()) error = Value::error(code);
+    }
+};
+
+// Kernels over a contiguous span of snapshot values and their cell flags.
+// Only cells whose flag is exactly CellKind::NUMBER take part in numeric
+// aggregates; blank, text and unresolved formula cells are masked out.
+// Cells flagged CellKind::ERROR hold their ErrorCode as the value.
+// AVX2 versions are picked at run time when the CPU has them.
+namespace RangeKernels {
+
+void aggregate(const double* values, const uint8_t* flags, size_t count, AggregateState& state);
+
+// Sum of a[i] * b[i], non-numeric cells counting as 0
+double dot(const double* a, const uint8_t* flagsA, const double* b, const uint8_t* flagsB, size_t count);
+
+// Whether the AVX2 kernels are in use
+bool usingAvx2();
+
+}
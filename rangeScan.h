@@ -0,0 +1,155 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include "formulaBytecode.h"
+#include "rangeKernels.h"
+#include "sheetSnapshot.h"
+
+// Column spans handed to the range kernels when they cannot read the
+// snapshot directly. One buffer per range taking part in an operation.
+struct SpanBuffers {
+    std::vector<std::vector<double>> values;
+    std::vector<std::vector<uint8_t>> flags;
+
+    void ensure(size_t count) {
+        if (values.size() < count) {
+            values.resize(count);
+            flags.resize(count);
+        }
+    }
+};
+
+// Kind of cell a formula result reads as inside a range
+inline CellKind cellKind(Value value) {
+    switch (value.type()) {
+    case ValueType::Number: return CellKind::NUMBER;
+    case ValueType::Boolean: return CellKind::BOOLEAN;
+    case ValueType::String: return CellKind::STRING;
+    case ValueType::Error: return CellKind::ERROR;
+    default: return CellKind::EMPTY;
+    }
+}
+
+// The helpers below take formulaValue(sheet, row, col), returning the
+// already computed result of a formula cell as a Value. They never evaluate anything,
+// so callers resolve formula cells first.
+
+// Copy one column of a range into a span buffer, formula cells replaced by
+// their result and rows outside the used area by empty cells
+template <typename FormulaValue>
+void fillSpan(const WorkbookSnapshot& snapshot, int sheet, int col, int firstRow, int lastRow,
+    SpanBuffers& spans, size_t buffer, FormulaValue formulaValue) {
+    spans.ensure(buffer + 1);
+    std::vector<double>& values = spans.values[buffer];
+    std::vector<uint8_t>& flags = spans.flags[buffer];
+    values.assign(lastRow - firstRow + 1, 0.0);
+    flags.assign(lastRow - firstRow + 1, 0);
+
+    const SheetColumns& columns = snapshot.sheet(sheet);
+    if (col < columns.firstCol || col >= columns.lastCol) return;
+
+    int last = std::min(lastRow, columns.lastRow - 1);
+    for (int row = std::max(firstRow, columns.firstRow); row <= last; ++row) {
+        uint32_t slot = columns.slot(row, col);
+        if (columns.flags[slot] & FORMULA) {
+            Value value = formulaValue(sheet, row, col);
+            values[row - firstRow] = value.isNumber() ? value.asNumber() :
+                value.isError() ? (double)value.asError() : 0.0;
+            flags[row - firstRow] = (uint8_t)cellKind(value);
+        }
+        else {
+            values[row - firstRow] = columns.values[slot];
+            flags[row - firstRow] = columns.flags[slot];
+        }
+    }
+}
+
+// Fold a range into state. Columns without formula cells go to the kernels
+// straight from snapshot memory; others through span buffer 0.
+template <typename FormulaValue>
+void aggregateRange(const WorkbookSnapshot& snapshot, const RangeRef& range, SpanBuffers& spans,
+    AggregateState& state, FormulaValue formulaValue) {
+    const SheetColumns& columns = snapshot.sheet(range.sheet);
+    int firstRow = std::max(range.firstRow, columns.firstRow);
+    int lastRow = std::min(range.lastRow, columns.lastRow - 1);
+    int firstCol = std::max(range.firstCol, columns.firstCol);
+    int lastCol = std::min(range.lastCol, columns.lastCol - 1);
+    if (firstRow > lastRow || firstCol > lastCol) return;
+
+    size_t count = lastRow - firstRow + 1;
+    for (int col = firstCol; col <= lastCol; ++col) {
+        if (!columns.columnHasFormulas(col)) {
+            uint32_t first = columns.slot(firstRow, col);
+            RangeKernels::aggregate(columns.values.data() + first, columns.flags.data() + first, count, state);
+            continue;
+        }
+
+        fillSpan(snapshot, range.sheet, col, firstRow, lastRow, spans, 0, formulaValue);
+        RangeKernels::aggregate(spans.values[0].data(), spans.flags[0].data(), count, state);
+    }
+}
+
+// First error cell of a filled span buffer, empty if none
+inline Value spanError(const SpanBuffers& spans, size_t buffer, size_t count) {
+    const std::vector<uint8_t>& flags = spans.flags[buffer];
+    for (size_t i = 0; i < count; ++i) {
+        if ((flags[i] & KIND_MASK) == (uint8_t)CellKind::ERROR) {
+            return Value::error((ErrorCode)(int)spans.values[buffer][i]);
+        }
+    }
+    return Value::empty();
+}
+
+// SUMPRODUCT of equally shaped ranges, or the first error cell in them;
+// false if the shapes differ
+template <typename FormulaValue>
+bool sumProductRanges(const WorkbookSnapshot& snapshot, const RangeRef* ranges, size_t count,
+    SpanBuffers& spans, Value& result, FormulaValue formulaValue) {
+    result = Value::number(0.0);
+    if (count == 0) return false;
+
+    int rows = ranges[0].lastRow - ranges[0].firstRow + 1;
+    int cols = ranges[0].lastCol - ranges[0].firstCol + 1;
+    for (size_t i = 0; i < count; ++i) {
+        if (ranges[i].lastRow - ranges[i].firstRow + 1 != rows ||
+            ranges[i].lastCol - ranges[i].firstCol + 1 != cols) {
+            return false;
+        }
+    }
+    if (rows <= 0 || cols <= 0) return true;
+
+    double total = 0.0;
+    spans.ensure(count);
+    for (int offset = 0; offset < cols; ++offset) {
+        for (size_t i = 0; i < count; ++i) {
+            fillSpan(snapshot, ranges[i].sheet, ranges[i].firstCol + offset,
+                ranges[i].firstRow, ranges[i].lastRow, spans, i, formulaValue);
+            Value error = spanError(spans, i, rows);
+            if (error.isError()) {
+                result = error;
+                return true;
+            }
+        }
+
+        if (count == 1) {
+            AggregateState state;
+            RangeKernels::aggregate(spans.values[0].data(), spans.flags[0].data(), rows, state);
+            total += state.sum;
+        }
+        else if (count == 2) {
+            total += RangeKernels::dot(spans.values[0].data(), spans.flags[0].data(),
+                spans.values[1].data(), spans.flags[1].data(), rows);
+        }
+        else {
+            for (int row = 0; row < rows; ++row) {
+                double product = 1.0;
+                for (size_t i = 0; i < count; ++i) {
+                    product *= (spans.flags[i][row] == (uint8_t)CellKind::NUMBER) ? spans.values[i][row] : 0.0;
+                }
+                total += product;
+            }
+        }
+    }
+    result = Value::number(total);
+    return true;
+}
@@ -0,0 +1,361 @@
+#include "stdafx.h"
+#include "recalcPlan.h"
+#include <algorithm>
+#include <cmath>
+
+// Runs shorter than this are not worth the vector setup
+const size_t MIN_RUN_LENGTH = 8;
+
+// Longer runs are split so a level's runs spread over the workers
+const size_t MAX_RUN_LENGTH = 1024;
+
+void RecalcPlan::addCell(const CellKey& cell, std::shared_ptr<CompiledFormula> formula, uint32_t shape) {
+    ids[cell] = (uint32_t)cells.size();
+    cells.push_back(cell);
+    formulas.push_back(formula);
+    shapes.push_back(shape);
+}
+
+void RecalcPlan::buildEdges(const DependencyGraph& graph) {
+    // Formula rows per (sheet, column), sorted, to find formulas inside ranges
+    std::unordered_map<uint64_t, std::vector<std::pair<int, uint32_t>>> formulaRows;
+    auto columnKey = [](int sheet, int col) { return ((uint64_t)(uint32_t)sheet << 32) | (uint32_t)col; };
+    for (uint32_t id = 0; id < cells.size(); ++id) {
+        formulaRows[columnKey(cells[id].sheet, cells[id].col)].push_back({ cells[id].row, id });
+    }
+    for (auto& entry : formulaRows) {
+        std::sort(entry.second.begin(), entry.second.end());
+    }
+
+    precedentStart.assign(1, 0);
+    precedents.clear();
+    for (uint32_t id = 0; id < cells.size(); ++id) {
+        size_t first = precedents.size();
+
+        for (const auto& cell : graph.cellPrecedents(cells[id])) {
+            auto it = ids.find(cell);
+            if (it != ids.end()) precedents.push_back(it->second);
+        }
+        for (const auto& range : graph.rangePrecedents(cells[id])) {
+            for (int col = range.firstCol; col <= range.lastCol; ++col) {
+                auto rows = formulaRows.find(columnKey(range.sheet, col));
+                if (rows == formulaRows.end()) continue;
+                auto it = std::lower_bound(rows->second.begin(), rows->second.end(),
+                    std::make_pair(range.firstRow, (uint32_t)0));
+                for (; it != rows->second.end() && it->first <= range.lastRow; ++it) {
+                    precedents.push_back(it->second);
+                }
+            }
+        }
+
+        // A cell listed twice must not count twice in Kahn's in-degrees
+        std::sort(precedents.begin() + first, precedents.end());
+        precedents.erase(std::unique(precedents.begin() + first, precedents.end()), precedents.end());
+        precedentStart.push_back((uint32_t)precedents.size());
+    }
+}
+
+void RecalcPlan::computeLevels() {
+    const uint32_t UNVISITED = UINT32_MAX;
+    size_t count = cells.size();
+    std::vector<uint32_t> index(count, UNVISITED);
+    std::vector<uint32_t> lowLink(count, 0);
+    std::vector<uint32_t> component(count, UNVISITED);
+    std::vector<uint32_t> componentLevel;
+    std::vector<uint32_t> stack;                        // cells of unfinished components
+    std::vector<std::pair<uint32_t, uint32_t>> path;    // DFS path: cell, next edge
+    uint32_t nextIndex = 0;
+
+    levels.clear();
+    for (uint32_t root = 0; root < count; ++root) {
+        if (index[root] != UNVISITED) continue;
+
+        index[root] = lowLink[root] = nextIndex++;
+        stack.push_back(root);
+        path.push_back({ root, precedentStart[root] });
+
+        while (!path.empty()) {
+            uint32_t id = path.back().first;
+            if (path.back().second < precedentStart[id + 1]) {
+                uint32_t next = precedents[path.back().second++];
+                if (index[next] == UNVISITED) {
+                    index[next] = lowLink[next] = nextIndex++;
+                    stack.push_back(next);
+                    path.push_back({ next, precedentStart[next] });
+                }
+                else if (component[next] == UNVISITED) {
+                    // Still on the stack: part of the component being built
+                    lowLink[id] = std::min(lowLink[id], index[next]);
+                }
+                continue;
+            }
+
+            path.pop_back();
+            if (!path.empty()) {
+                uint32_t parent = path.back().first;
+                lowLink[parent] = std::min(lowLink[parent], lowLink[id]);
+            }
+            if (lowLink[id] != index[id]) continue;
+
+            // id is the root of a finished component. Tarjan finishes a
+            // component after all components it reads, so their levels are known.
+            uint32_t componentId = (uint32_t)componentLevel.size();
+            std::vector<uint32_t> members;
+            uint32_t member;
+            do {
+                member = stack.back();
+                stack.pop_back();
+                component[member] = componentId;
+                members.push_back(member);
+            } while (member != id);
+
+            uint32_t level = 0;
+            bool selfReference = false;
+            for (uint32_t cell : members) {
+                for (uint32_t i = precedentStart[cell]; i < precedentStart[cell + 1]; ++i) {
+                    uint32_t precedent = precedents[i];
+                    if (component[precedent] == componentId) {
+                        selfReference = true;
+                    }
+                    else {
+                        level = std::max(level, componentLevel[component[precedent]] + 1);
+                    }
+                }
+            }
+            componentLevel.push_back(level);
+
+            if (levels.size() <= level) levels.resize(level + 1);
+            if (members.size() == 1 && !selfReference) {
+                levels[level].cells.push_back(id);
+            }
+            else {
+                // Iterate in the order the cells were reached
+                std::reverse(members.begin(), members.end());
+                levels[level].cycles.push_back(std::move(members));
+            }
+        }
+    }
+
+    groupRuns(MIN_RUN_LENGTH, MAX_RUN_LENGTH);
+}
+
+void RecalcPlan::groupRuns(size_t minLength, size_t maxLength) {
+    for (auto& level : levels) {
+        std::vector<uint32_t>& order = level.cells;
+        std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            const CellKey& x = cells[a];
+            const CellKey& y = cells[b];
+            if (x.sheet != y.sheet) return x.sheet < y.sheet;
+            if (x.col != y.col) return x.col < y.col;
+            return x.row < y.row;
+        });
+
+        std::vector<uint32_t> single;
+        size_t begin = 0;
+        while (begin < order.size()) {
+            const CellKey& first = cells[order[begin]];
+            size_t end = begin + 1;
+            while (end < order.size()) {
+                const CellKey& next = cells[order[end]];
+                if (next.sheet != first.sheet || next.col != first.col ||
+                    next.row != first.row + (int)(end - begin) ||
+                    shapes[order[end]] != shapes[order[begin]]) {
+                    break;
+                }
+                end++;
+            }
+
+            if (end - begin < minLength) {
+                single.insert(single.end(), order.begin() + begin, order.begin() + end);
+            }
+            else {
+                for (size_t chunk = begin; chunk < end; chunk += maxLength) {
+                    size_t chunkEnd = std::min(end, chunk + maxLength);
+                    level.runs.emplace_back(order.begin() + chunk, order.begin() + chunkEnd);
+                }
+            }
+            begin = end;
+        }
+        order.swap(single);
+    }
+}
+
+size_t RecalcPlan::cycleCount() const {
+    size_t count = 0;
+    for (const auto& level : levels) {
+        count += level.cycles.size();
+    }
+    return count;
+}
+
+void RecalcPlan::clear() {
+    cells.clear();
+    formulas.clear();
+    shapes.clear();
+    ids.clear();
+    precedentStart.clear();
+    precedents.clear();
+    levels.clear();
+}
+
+PlanReader::PlanReader(const WorkbookSnapshot& snapshot, const RecalcPlan& plan, SubexpressionTable& subexpressions,
+    LookupIndexCache& lookups, SummedAreaTables& areaTables, const std::vector<Value>& results)
+    : columnVM(&subexpressions), snapshot(snapshot), plan(plan), subexpressions(subexpressions), lookups(lookups),
+      areaTables(areaTables), results(results) {
+}
+
+Value PlanReader::sharedValue(uint32_t id) {
+    if (iterating) return vm.run(subexpressions.program(id), *this);
+    return subexpressions.value(id, vm, *this);
+}
+
+Value PlanReader::formulaResult(int sheet, int row, int col) const {
+    auto it = plan.ids.find(CellKey{ sheet, row, col });
+    return (it != plan.ids.end()) ? results[it->second] : Value::number(0.0);
+}
+
+Value PlanReader::cellValue(const CellKey& cell) {
+    uint8_t flags = snapshot.flags(cell.sheet, cell.row, cell.col);
+    if (flags & FORMULA) {
+        return formulaResult(cell.sheet, cell.row, cell.col);
+    }
+    return snapshot.value(cell.sheet, cell.row, cell.col);
+}
+
+const StringPool& PlanReader::strings() const {
+    return snapshot.strings();
+}
+
+void PlanReader::cellColumn(const CellKey& first, size_t count, Value* out) {
+    const SheetColumns& columns = snapshot.sheet(first.sheet);
+    for (size_t i = 0; i < count; ++i) {
+        int row = first.row + (int)i;
+        if (!columns.contains(row, first.col)) {
+            out[i] = Value::empty();
+            continue;
+        }
+
+        // Consecutive rows of a column are adjacent in the snapshot
+        uint32_t slot = columns.slot(row, first.col);
+        uint8_t flags = columns.flags[slot];
+        if (flags & FORMULA) {
+            out[i] = formulaResult(first.sheet, row, first.col);
+        }
+        else if ((CellKind)(flags & KIND_MASK) == CellKind::NUMBER) {
+            out[i] = Value::number(columns.values[slot]);
+        }
+        else {
+            out[i] = cellValue(CellKey{ first.sheet, row, first.col });
+        }
+    }
+}
+
+void PlanReader::rangeAggregate(const RangeRef& range, AggregateState& state) {
+    aggregateRange(snapshot, range, spans, state,
+        [this](int sheet, int row, int col) { return formulaResult(sheet, row, col); });
+}
+
+void PlanReader::rangeTotals(const RangeRef& range, AggregateState& state) {
+    if (!areaTables.aggregate(snapshot, range, state)) rangeAggregate(range, state);
+}
+
+bool PlanReader::rangeSumProduct(const RangeRef* ranges, size_t count, Value& result) {
+    return sumProductRanges(snapshot, ranges, count, spans, result,
+        [this](int sheet, int row, int col) { return formulaResult(sheet, row, col); });
+}
+
+// Lines being looked up are precedents, finished in a lower level unless
+// they are on the cycle being iterated
+int PlanReader::lookupPosition(const RangeRef& line, Value key, LookupMatch match, bool last) {
+    auto formulaValue = [this](int sheet, int row, int col) { return formulaResult(sheet, row, col); };
+    if (iterating) return scanLine(snapshot, line, key, match, last, formulaValue);
+    return lookups.find(snapshot, line, key, match, last, formulaValue);
+}
+
+static Value evaluatePlanCell(const RecalcPlan& plan, PlanReader& reader, uint32_t id) {
+    return reader.vm.run(plan.formulas[id]->program, reader);
+}
+
+// Gauss-Seidel sweeps over the component until no cell moves by maxChange
+static void iterateCycle(const RecalcPlan& plan, const std::vector<uint32_t>& members, PlanReader& reader,
+    const IterativeCalc& iteration, std::vector<Value>& results) {
+    if (!iteration.enabled) {
+        for (uint32_t id : members) {
+            results[id] = Value::number(0.0);
+        }
+        return;
+    }
+
+    for (int i = 0; i < iteration.maxIterations; ++i) {
+        bool converged = true;
+        for (uint32_t id : members) {
+            Value value = evaluatePlanCell(plan, reader, id);
+            if (value.isNumber() && results[id].isNumber()) {
+                converged = converged && std::fabs(value.asNumber() - results[id].asNumber()) < iteration.maxChange;
+            }
+            else {
+                converged = converged && value == results[id];
+            }
+            results[id] = value;
+        }
+        if (converged) break;
+    }
+}
+
+// One program for the whole run
+static void evaluateRun(const RecalcPlan& plan, const std::vector<uint32_t>& run, PlanReader& reader,
+    std::vector<Value>& results) {
+    reader.columnResults.resize(run.size());
+    reader.columnVM.run(plan.formulas[run[0]]->program, run.size(), reader, reader.columnResults.data());
+    for (size_t i = 0; i < run.size(); ++i) {
+        results[run[i]] = reader.columnResults[i];
+    }
+}
+
+void runRecalcPlan(const RecalcPlan& plan, const WorkbookSnapshot& snapshot, SubexpressionTable& subexpressions,
+    LookupIndexCache& lookups, SummedAreaTables& areaTables, WorkStealingPool& pool, const IterativeCalc& iteration,
+    std::vector<Value>& results) {
+    results.resize(plan.cells.size(), Value::number(0.0));
+
+    std::vector<std::unique_ptr<PlanReader>> readers;
+    for (size_t i = 0; i < pool.size(); ++i) {
+        readers.push_back(std::make_unique<PlanReader>(snapshot, plan, subexpressions, lookups, areaTables, results));
+    }
+
+    for (const auto& level : plan.levels) {
+        for (const auto& cycle : level.cycles) {
+            for (uint32_t id : cycle) {
+                const CellKey& cell = plan.cells[id];
+                results[id] = snapshot.value(cell.sheet, cell.row, cell.col);
+            }
+        }
+    }
+
+    for (const auto& level : plan.levels) {
+        // Each cell writes only its own slot and reads lower levels, so the
+        // outcome does not depend on how the level is split among workers
+        pool.parallelFor(level.cells.size(), 64, [&](size_t begin, size_t end, size_t worker) {
+            PlanReader& reader = *readers[worker];
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t id = level.cells[i];
+                results[id] = evaluatePlanCell(plan, reader, id);
+            }
+        });
+
+        pool.parallelFor(level.runs.size(), 1, [&](size_t begin, size_t end, size_t worker) {
+            for (size_t i = begin; i < end; ++i) {
+                evaluateRun(plan, level.runs[i], *readers[worker], results);
+            }
+        });
+
+        // Components of one level do not read each other
+        pool.parallelFor(level.cycles.size(), 1, [&](size_t begin, size_t end, size_t worker) {
+            PlanReader& reader = *readers[worker];
+            reader.iterating = true;
+            for (size_t i = begin; i < end; ++i) {
+                iterateCycle(plan, level.cycles[i], reader, iteration, results);
+            }
+            reader.iterating = false;
+        });
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "dependencyGraph.h"
+#include "formulaCache.h"
+#include "lookupIndex.h"
+#include "rangeScan.h"
+#include "sheetSnapshot.h"
+#include "subexpressionTable.h"
+#include "summedAreaTables.h"
+#include "workStealingPool.h"
+
+// Excel's iterative calculation settings for circular references. When
+// disabled, cells on a cycle evaluate to 0. Convergence is measured on
+// numbers; a cell holding anything else has converged once it stops changing.
+struct IterativeCalc {
+    bool enabled = true;
+    int maxIterations = 100;
+    double maxChange = 0.001;
+};
+
+// Cells of one level only read cells of lower levels or, for a cycle,
+// cells of the same component
+struct RecalcLevel {
+    std::vector<uint32_t> cells;                    // evaluated once
+    std::vector<std::vector<uint32_t>> runs;        // same-shape cells down a column, in row order
+    std::vector<std::vector<uint32_t>> cycles;      // components iterated to convergence
+};
+
+// Formula cells of a workbook numbered densely, with the formula-to-formula
+// edges of the dependency graph in compressed (CSR) form
+struct RecalcPlan {
+    std::vector<CellKey> cells;                                 // by id
+    std::vector<std::shared_ptr<CompiledFormula>> formulas;     // by id
+    std::vector<uint32_t> shapes;       // by id; equal for equal R1C1 formulas
+    std::unordered_map<CellKey, uint32_t, CellKeyHash> ids;
+
+    // Precedent ids of cell i: precedents[precedentStart[i] .. precedentStart[i + 1])
+    std::vector<uint32_t> precedentStart;
+    std::vector<uint32_t> precedents;
+
+    std::vector<RecalcLevel> levels;
+
+    void addCell(const CellKey& cell, std::shared_ptr<CompiledFormula> formula, uint32_t shape);
+
+    // Resolve every cell's precedents (single cells and ranges) to formula ids
+    void buildEdges(const DependencyGraph& graph);
+
+    // Split the cells into strongly connected components (Tarjan, without
+    // recursion), group the components into levels and collect the runs
+    void computeLevels();
+
+    // Move stretches of at least minLength consecutive rows sharing a shape
+    // from each level's cells into runs of at most maxLength
+    void groupRuns(size_t minLength, size_t maxLength);
+
+    size_t cycleCount() const;
+
+    void clear();
+};
+
+// CellValueReader over the plan's result array, for evaluating cells whose
+// precedents are all computed already. Holds no evaluator state, so one
+// reader per worker thread can run concurrently.
+class PlanReader : public CellValueReader {
+public:
+    PlanReader(const WorkbookSnapshot& snapshot, const RecalcPlan& plan, SubexpressionTable& subexpressions,
+        LookupIndexCache& lookups, SummedAreaTables& areaTables, const std::vector<Value>& results);
+
+    Value cellValue(const CellKey& cell) override;
+
+    void rangeAggregate(const RangeRef& range, AggregateState& state) override;
+
+    void rangeTotals(const RangeRef& range, AggregateState& state) override;
+
+    bool rangeSumProduct(const RangeRef* ranges, size_t count, Value& result) override;
+
+    void cellColumn(const CellKey& first, size_t count, Value* out) override;
+
+    Value sharedValue(uint32_t id) override;
+
+    int lookupPosition(const RangeRef& line, Value key, LookupMatch match, bool last) override;
+
+    const StringPool& strings() const override;
+
+    FormulaVM vm;
+    ColumnVM columnVM;
+    std::vector<Value> columnResults;
+
+    // Inside a cycle subexpression values change between sweeps, so they
+    // are computed every time instead of taken from the table, and lookups
+    // search their lines instead of indexing them
+    bool iterating = false;
+
+private:
+    Value formulaResult(int sheet, int row, int col) const;
+
+    const WorkbookSnapshot& snapshot;
+    const RecalcPlan& plan;
+    SubexpressionTable& subexpressions;
+    LookupIndexCache& lookups;
+    SummedAreaTables& areaTables;
+    const std::vector<Value>& results;
+    SpanBuffers spans;
+};
+
+// Evaluate the plan level by level, the cells and runs of a level in
+// parallel. Each cycle is iterated by one worker, starting from the saved
+// cell values.
+void runRecalcPlan(const RecalcPlan& plan, const WorkbookSnapshot& snapshot, SubexpressionTable& subexpressions,
+    LookupIndexCache& lookups, SummedAreaTables& areaTables, WorkStealingPool& pool, const IterativeCalc& iteration,
+    std::vector<Value>& results);
@@ -0,0 +1,98 @@
+#include "stdafx.h"
+#include "referenceBinder.h"
+#include <algorithm>
+#include "formulaBytecode.h"
+
+ReferenceBinder::ReferenceBinder(const SymbolTable& symbols, const std::map<std::string, int>& sheetIndices)
+    : symbols(symbols), sheetIndices(sheetIndices) {
+}
+
+void ReferenceBinder::reset() {
+    sheetBySymbol.clear();
+}
+
+void ReferenceBinder::bind(AstArena& arena, NodeIndex root, int hostSheet, std::vector<std::string>& errors) {
+    this->hostSheet = hostSheet;
+    this->errors = &errors;
+    if (root != NO_NODE) bindNode(arena, root);
+    this->errors = nullptr;
+}
+
+void ReferenceBinder::bindNode(AstArena& arena, NodeIndex index) {
+    AstNode& node = arena[index];
+    switch (node.kind) {
+    case AstKind::CELL_REF:
+    case AstKind::RANGE:
+        bindReference(node);
+        break;
+
+    case AstKind::FUNCTION:
+        if (lookupFunction(symbols.name(node.symbol)) == FunctionId::Unknown) {
+            errors->push_back("unknown function " + symbols.name(node.symbol));
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    for (NodeIndex child = arena[index].firstChild; child != NO_NODE; child = arena[child].nextSibling) {
+        bindNode(arena, child);
+    }
+}
+
+void ReferenceBinder::bindReference(AstNode& node) {
+    node.sheetIndex = -1;
+
+    if (node.row < 0 || node.lastRow < 0) {
+        errors->push_back("malformed reference " + describe(node));
+        return;
+    }
+
+    // B5:A1 means A1:B5; the $ marks move with the coordinates
+    if (node.lastRow < node.row) {
+        std::swap(node.row, node.lastRow);
+        if (!(node.absolute & ABS_ROW) != !(node.absolute & ABS_LAST_ROW)) node.absolute ^= ABS_ROW | ABS_LAST_ROW;
+    }
+    if (node.lastCol < node.col) {
+        std::swap(node.col, node.lastCol);
+        if (!(node.absolute & ABS_COL) != !(node.absolute & ABS_LAST_COL)) node.absolute ^= ABS_COL | ABS_LAST_COL;
+    }
+
+    if (node.lastRow >= MAX_SHEET_ROWS || node.lastCol >= MAX_SHEET_COLS) {
+        errors->push_back("reference out of range " + describe(node));
+        return;
+    }
+
+    int sheet = resolveSheet(node.sheet);
+    if (sheet < 0) {
+        errors->push_back("unknown sheet " + describe(node));
+        return;
+    }
+    node.sheetIndex = sheet;
+}
+
+int ReferenceBinder::resolveSheet(SymbolId sheet) {
+    if (sheet == NO_SYMBOL) return hostSheet;
+
+    if (sheet >= sheetBySymbol.size()) {
+        sheetBySymbol.resize(symbols.size(), -2);
+    }
+    if (sheetBySymbol[sheet] == -2) {
+        auto it = sheetIndices.find(symbols.name(sheet));
+        sheetBySymbol[sheet] = (it != sheetIndices.end()) ? it->second : -1;
+    }
+    return sheetBySymbol[sheet];
+}
+
+// Sheet name plus the R/C coordinates, for messages
+std::string ReferenceBinder::describe(const AstNode& node) const {
+    std::string text;
+    if (node.sheet != NO_SYMBOL) text = "'" + symbols.name(node.sheet) + "'!";
+    if (node.row < 0 || node.lastRow < 0) return text + "?";
+    text += "R" + std::to_string(node.row + 1) + "C" + std::to_string(node.col + 1);
+    if (node.kind == AstKind::RANGE) {
+        text += ":R" + std::to_string(node.lastRow + 1) + "C" + std::to_string(node.lastCol + 1);
+    }
+    return text;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include "formulaArena.h"
+
+// Binding pass run between parsing and compiling. Resolves the sheet of
+// every reference to its index (unqualified references take the host sheet,
+// the one holding the formula), orders range corners and checks function
+// names, so compiled code holds only integers. Problems are collected as
+// messages instead of surfacing as zeros during evaluation.
+class ReferenceBinder {
+public:
+    ReferenceBinder(const SymbolTable& symbols, const std::map<std::string, int>& sheetIndices);
+
+    // Bind every node below root; sheetIndex stays -1 on references in error
+    void bind(AstArena& arena, NodeIndex root, int hostSheet, std::vector<std::string>& errors);
+
+    // Forget resolved sheet names, after the sheet list changed
+    void reset();
+
+private:
+    void bindNode(AstArena& arena, NodeIndex index);
+
+    void bindReference(AstNode& node);
+
+    int resolveSheet(SymbolId sheet);
+
+    std::string describe(const AstNode& node) const;
+
+    const SymbolTable& symbols;
+    const std::map<std::string, int>& sheetIndices;
+    std::vector<int> sheetBySymbol;   // sheet index per SymbolId, -2 = not resolved yet
+
+    int hostSheet = 0;
+    std::vector<std::string>* errors = nullptr;
+};
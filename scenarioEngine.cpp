@@ -0,0 +1,301 @@
+#include "stdafx.h"
+#include "scenarioEngine.h"
+#include <algorithm>
+
+namespace {
+
+void merge(AggregateState& state, const AggregateState& part) {
+    if (!state.error.isError()) state.error = part.error;
+    state.sum += part.sum;
+    state.count += part.count;
+    state.counta += part.counta;
+    state.min = std::min(state.min, part.min);
+    state.max = std::max(state.max, part.max);
+}
+
+// A formula result inside a range counts the way the range kernels count
+// the cell it came from
+void addValue(AggregateState& state, Value value) {
+    if (value.isNumber()) {
+        state.addNumber(value.asNumber());
+    }
+    else if (value.isError()) {
+        state.addError(value.asError());
+    }
+    else if (value.type() != ValueType::Empty) {
+        state.counta += 1.0;
+    }
+}
+
+}
+
+ScenarioLanes::ScenarioLanes(CellValueReader& base, size_t lanes) : base(base), lanes(lanes) {
+}
+
+size_t ScenarioLanes::addCell(const CellKey& cell) {
+    auto inserted = rows.emplace(cell, rows.size());
+    if (!inserted.second) return inserted.first->second;
+
+    size_t index = inserted.first->second;
+    values.resize((index + 1) * lanes);
+    columns[std::make_pair(cell.sheet, cell.col)].emplace_back(cell.row, index);
+    columnsSorted = false;
+    return index;
+}
+
+const ScenarioLanes::ColumnMap& ScenarioLanes::sortedColumns() const {
+    if (!columnsSorted) {
+        for (auto& entry : columns) std::sort(entry.second.begin(), entry.second.end());
+        columnsSorted = true;
+    }
+    return columns;
+}
+
+const Value* ScenarioLanes::laneValues(const CellKey& cell) const {
+    auto it = rows.find(cell);
+    return (it != rows.end()) ? values.data() + it->second * lanes : nullptr;
+}
+
+void ScenarioLanes::findHoles(const RangeRef& range, std::vector<Hole>& holes) const {
+    const ColumnMap& sorted = sortedColumns();
+    for (auto it = sorted.lower_bound(std::make_pair(range.sheet, range.firstCol));
+         it != sorted.end() && it->first.first == range.sheet && it->first.second <= range.lastCol; ++it) {
+        const auto& column = it->second;
+        auto row = std::lower_bound(column.begin(), column.end(), std::make_pair(range.firstRow, (size_t)0));
+        for (; row != column.end() && row->first <= range.lastRow; ++row) {
+            holes.push_back(Hole{ row->first - range.firstRow, it->first.second - range.firstCol, row->second });
+        }
+    }
+}
+
+bool ScenarioLanes::rangeVaries(const RangeRef& range) const {
+    const ColumnMap& sorted = sortedColumns();
+    for (auto it = sorted.lower_bound(std::make_pair(range.sheet, range.firstCol));
+         it != sorted.end() && it->first.first == range.sheet && it->first.second <= range.lastCol; ++it) {
+        const auto& column = it->second;
+        auto row = std::lower_bound(column.begin(), column.end(), std::make_pair(range.firstRow, (size_t)0));
+        if (row != column.end() && row->first <= range.lastRow) return true;
+    }
+    return false;
+}
+
+// Columns without holes are merged into one piece; a column with holes
+// becomes the runs of rows between them
+void ScenarioLanes::splitAround(const RangeRef& range, std::vector<std::pair<int, int>> offsets,
+    std::vector<RangeRef>& pieces) {
+    std::sort(offsets.begin(), offsets.end(),
+        [](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+            return a.second != b.second ? a.second < b.second : a.first < b.first;
+        });
+
+    int height = range.lastRow - range.firstRow + 1;
+    int width = range.lastCol - range.firstCol + 1;
+    size_t next = 0;
+    int clearFrom = 0;
+    for (int col = 0; col <= width; ++col) {
+        bool holed = next < offsets.size() && offsets[next].second == col;
+        if (!holed && col < width) continue;
+
+        if (clearFrom < col) {
+            pieces.push_back(RangeRef{ range.sheet, range.firstRow, range.firstCol + clearFrom,
+                range.lastRow, range.firstCol + col - 1 });
+        }
+        clearFrom = col + 1;
+        if (col == width) break;
+
+        int rowFrom = 0;
+        for (; next < offsets.size() && offsets[next].second == col; ++next) {
+            int row = offsets[next].first;
+            if (rowFrom < row) {
+                pieces.push_back(RangeRef{ range.sheet, range.firstRow + rowFrom, range.firstCol + col,
+                    range.firstRow + row - 1, range.firstCol + col });
+            }
+            rowFrom = std::max(rowFrom, row + 1);
+        }
+        if (rowFrom < height) {
+            pieces.push_back(RangeRef{ range.sheet, range.firstRow + rowFrom, range.firstCol + col,
+                range.lastRow, range.firstCol + col });
+        }
+    }
+}
+
+const ScenarioLanes::RangeSplit& ScenarioLanes::aggregateSplit(const RangeRef& range) {
+    auto found = aggregates.find(rangeKey(range));
+    if (found != aggregates.end()) return found->second;
+
+    RangeSplit split;
+    findHoles(range, split.holes);
+    std::vector<std::pair<int, int>> offsets;
+    for (const Hole& hole : split.holes) offsets.emplace_back(hole.row, hole.col);
+
+    std::vector<RangeRef> pieces;
+    splitAround(range, offsets, pieces);
+    for (const RangeRef& piece : pieces) {
+        AggregateState part;
+        base.rangeAggregate(piece, part);
+        merge(split.rest, part);
+    }
+    return aggregates.emplace(rangeKey(range), std::move(split)).first->second;
+}
+
+Value ScenarioLanes::cellValue(const CellKey& cell) {
+    const Value* lane = laneValues(cell);
+    return lane ? lane[current] : base.cellValue(cell);
+}
+
+void ScenarioLanes::rangeAggregate(const RangeRef& range, AggregateState& state) {
+    if (!rangeVaries(range)) {
+        base.rangeAggregate(range, state);
+        return;
+    }
+
+    const RangeSplit& split = aggregateSplit(range);
+    merge(state, split.rest);
+    for (const Hole& hole : split.holes) {
+        addValue(state, row(hole.index)[current]);
+    }
+}
+
+void ScenarioLanes::rangeTotals(const RangeRef& range, AggregateState& state) {
+    if (!rangeVaries(range)) {
+        base.rangeTotals(range, state);
+        return;
+    }
+    rangeAggregate(range, state);
+}
+
+const ScenarioLanes::ProductSplit& ScenarioLanes::productSplit(const RangeRef* ranges, size_t count) {
+    std::vector<RangeKey> key;
+    for (size_t i = 0; i < count; ++i) key.push_back(rangeKey(ranges[i]));
+    auto found = products.find(key);
+    if (found != products.end()) return found->second;
+
+    // Positions where any of the ranges has a hole
+    std::vector<Hole> holes;
+    for (size_t i = 0; i < count; ++i) findHoles(ranges[i], holes);
+    std::vector<std::pair<int, int>> offsets;
+    for (const Hole& hole : holes) offsets.emplace_back(hole.row, hole.col);
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+
+    ProductSplit split;
+    std::vector<RangeRef> pieces;
+    splitAround(ranges[0], offsets, pieces);
+    std::vector<RangeRef> parts(count);
+    for (const RangeRef& piece : pieces) {
+        for (size_t i = 0; i < count; ++i) {
+            int dRow = piece.firstRow - ranges[0].firstRow;
+            int dCol = piece.firstCol - ranges[0].firstCol;
+            parts[i] = RangeRef{ ranges[i].sheet, ranges[i].firstRow + dRow, ranges[i].firstCol + dCol,
+                ranges[i].firstRow + dRow + (piece.lastRow - piece.firstRow),
+                ranges[i].firstCol + dCol + (piece.lastCol - piece.firstCol) };
+        }
+        Value part;
+        base.rangeSumProduct(parts.data(), count, part);
+        if (part.isNumber()) split.rest += part.asNumber();
+        else if (!split.error.isError()) split.error = part;
+    }
+
+    for (const auto& offset : offsets) {
+        for (size_t i = 0; i < count; ++i) {
+            CellKey cell{ ranges[i].sheet, ranges[i].firstRow + offset.first, ranges[i].firstCol + offset.second };
+            auto it = rows.find(cell);
+            if (it != rows.end()) {
+                split.laneRows.push_back(it->second);
+                split.baseNumbers.push_back(0.0);
+            }
+            else {
+                Value value = base.cellValue(cell);
+                split.laneRows.push_back(NO_ROW);
+                split.baseNumbers.push_back(value.isNumber() ? value.asNumber() : 0.0);
+                if (value.isError() && !split.error.isError()) split.error = value;
+            }
+        }
+    }
+    return products.emplace(std::move(key), std::move(split)).first->second;
+}
+
+bool ScenarioLanes::rangeSumProduct(const RangeRef* ranges, size_t count, Value& result) {
+    bool varies = false;
+    for (size_t i = 0; i < count && !varies; ++i) varies = rangeVaries(ranges[i]);
+    if (!varies) return base.rangeSumProduct(ranges, count, result);
+
+    int rows = ranges[0].lastRow - ranges[0].firstRow;
+    int cols = ranges[0].lastCol - ranges[0].firstCol;
+    for (size_t i = 1; i < count; ++i) {
+        if (ranges[i].lastRow - ranges[i].firstRow != rows || ranges[i].lastCol - ranges[i].firstCol != cols) {
+            result = Value::number(0.0);
+            return false;
+        }
+    }
+
+    const ProductSplit& split = productSplit(ranges, count);
+    if (split.error.isError()) {
+        result = split.error;
+        return true;
+    }
+    double total = split.rest;
+    for (size_t at = 0; at < split.laneRows.size(); at += count) {
+        double product = 1.0;
+        for (size_t i = 0; i < count; ++i) {
+            size_t index = split.laneRows[at + i];
+            if (index == NO_ROW) {
+                product *= split.baseNumbers[at + i];
+                continue;
+            }
+            Value value = row(index)[current];
+            if (value.isError()) {
+                result = value;
+                return true;
+            }
+            product *= value.isNumber() ? value.asNumber() : 0.0;
+        }
+        total += product;
+    }
+    result = Value::number(total);
+    return true;
+}
+
+const ScenarioLanes::LineSplit& ScenarioLanes::lineSplit(const RangeRef& line) {
+    auto found = lines.find(rangeKey(line));
+    if (found != lines.end()) return found->second;
+
+    LineSplit split;
+    findHoles(line, split.holes);
+    for (int col = line.firstCol; col <= line.lastCol; ++col) {
+        for (int row = line.firstRow; row <= line.lastRow; ++row) {
+            CellKey cell{ line.sheet, row, col };
+            split.cells.push_back(rows.count(cell) ? Value() : base.cellValue(cell));
+        }
+    }
+    return lines.emplace(rangeKey(line), std::move(split)).first->second;
+}
+
+// A line with varying cells is indexed again for every lane that searches it
+int ScenarioLanes::lookupPosition(const RangeRef& line, Value key, LookupMatch match, bool last) {
+    if (!rangeVaries(line)) return base.lookupPosition(line, key, match, last);
+
+    const LineSplit& split = lineSplit(line);
+    std::vector<Value> cells = split.cells;
+    for (const Hole& hole : split.holes) {
+        cells[hole.row + hole.col] = row(hole.index)[current];
+    }
+
+    const StringPool& pool = base.strings();
+    std::vector<LookupIndex::Cell> indexed;
+    for (size_t position = 0; position < cells.size(); ++position) {
+        ValueType type = cells[position].type();
+        if (type != ValueType::Empty && type != ValueType::Error) {
+            indexed.emplace_back(LookupIndex::key(cells[position], pool), (uint32_t)position);
+        }
+    }
+
+    LookupIndex index;
+    if (match == LookupMatch::Exact) {
+        index.buildHash(indexed);
+    }
+    else {
+        index.buildSorted(indexed, pool);
+    }
+    return index.find(key, match, last, pool);
+}
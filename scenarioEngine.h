@@ -0,0 +1,118 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "formulaBytecode.h"
+#include "formulaTypes.h"
+#include "lookupIndex.h"
+#include "rangeKernels.h"
+
+// Lane storage of a scenario run: one row of lane values per cell that
+// differs between scenarios (the inputs and every formula depending on
+// them), everything else read from base, the evaluator holding the
+// workbook as it is. Ranges are split around the varying cells, so base
+// answers the rest of a range once and each lane only adds its own cells.
+class ScenarioLanes : public ScenarioReader {
+public:
+    ScenarioLanes(CellValueReader& base, size_t lanes);
+
+    // Row of a varying cell, added on first use. Add every varying cell
+    // before reading ranges, and before holding on to row pointers.
+    size_t addCell(const CellKey& cell);
+
+    Value* row(size_t index) { return values.data() + index * lanes; }
+
+    size_t laneCount() const { return lanes; }
+
+    // ScenarioReader
+    const Value* laneValues(const CellKey& cell) const override;
+
+    bool rangeVaries(const RangeRef& range) const override;
+
+    void setLane(size_t lane) override { current = lane; }
+
+    // CellValueReader
+    Value cellValue(const CellKey& cell) override;
+
+    void rangeAggregate(const RangeRef& range, AggregateState& state) override;
+
+    void rangeTotals(const RangeRef& range, AggregateState& state) override;
+
+    bool rangeSumProduct(const RangeRef* ranges, size_t count, Value& result) override;
+
+    Value sharedValue(uint32_t id) override { return base.sharedValue(id); }
+
+    int lookupPosition(const RangeRef& line, Value key, LookupMatch match, bool last) override;
+
+    const StringPool& strings() const override { return base.strings(); }
+
+private:
+    // A varying cell inside a range: its offset from the range's top left
+    // and its row of lane values
+    struct Hole {
+        int row;
+        int col;
+        size_t index;
+    };
+
+    // The part of a range base can answer, kept for the lanes to come
+    struct RangeSplit {
+        AggregateState rest;
+        std::vector<Hole> holes;
+    };
+
+    // Per position holding a hole in some range, and per range there: the
+    // lane row of the cell, or NO_ROW and its base value as a number
+    struct ProductSplit {
+        double rest = 0.0;
+        Value error = Value::empty();   // first error cell outside the lanes
+        std::vector<size_t> laneRows;
+        std::vector<double> baseNumbers;
+    };
+
+    static constexpr size_t NO_ROW = SIZE_MAX;
+
+    struct LineSplit {
+        std::vector<Value> cells;                       // base values by position
+        std::vector<Hole> holes;
+    };
+
+    typedef std::tuple<int, int, int, int, int> RangeKey;
+
+    // (sheet, col) -> (row, index) of the varying cells in that column
+    typedef std::map<std::pair<int, int>, std::vector<std::pair<int, size_t>>> ColumnMap;
+
+    static RangeKey rangeKey(const RangeRef& range) {
+        return RangeKey(range.sheet, range.firstRow, range.firstCol, range.lastRow, range.lastCol);
+    }
+
+    const ColumnMap& sortedColumns() const;
+
+    void findHoles(const RangeRef& range, std::vector<Hole>& holes) const;
+
+    // Rectangles of range without any of the given offsets, column by column
+    static void splitAround(const RangeRef& range, std::vector<std::pair<int, int>> offsets,
+        std::vector<RangeRef>& pieces);
+
+    const ProductSplit& productSplit(const RangeRef* ranges, size_t count);
+
+    const LineSplit& lineSplit(const RangeRef& line);
+
+    const RangeSplit& aggregateSplit(const RangeRef& range);
+
+    CellValueReader& base;
+    size_t lanes;
+    size_t current = 0;
+
+    std::unordered_map<CellKey, size_t, CellKeyHash> rows;
+    std::vector<Value> values;                          // rows of lanes values
+    mutable ColumnMap columns;                          // sorted by row on the first range read
+    mutable bool columnsSorted = true;
+
+    std::map<RangeKey, RangeSplit> aggregates;
+    std::map<std::vector<RangeKey>, ProductSplit> products;
+    std::map<RangeKey, LineSplit> lines;
+};
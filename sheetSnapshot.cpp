@@ -0,0 +1,237 @@
+#include "stdafx.h"
+#include "sheetSnapshot.h"
+#include <algorithm>
+#include "contentHash.h"
+
+void WorkbookSnapshot::load(CellSource& source) {
+    sheets.clear();
+    texts.clear();
+    formulaTexts.clear();
+    sheets.resize(source.sheetCount());
+    for (int i = 0; i < source.sheetCount(); ++i) {
+        loadSheet(source, i, sheets[i]);
+    }
+}
+
+void WorkbookSnapshot::reloadSheet(CellSource& source, int sheet) {
+    if (sheet < 0 || sheet >= (int)sheets.size()) return;
+    loadSheet(source, sheet, sheets[sheet]);
+}
+
+void WorkbookSnapshot::reloadCell(CellSource& source, int sheet, int row, int col) {
+    if (sheet < 0 || sheet >= (int)sheets.size()) return;
+
+    SheetColumns& columns = sheets[sheet];
+    if (!columns.contains(row, col)) {
+        // The used area grew
+        loadSheet(source, sheet, columns);
+        return;
+    }
+
+    uint32_t slot = columns.slot(row, col);
+    if (columns.flags[slot] & FORMULA) columns.formulaCounts[col - columns.firstCol]--;
+    columns.textHandles.erase(slot);
+    columns.formulaHandles.erase(slot);
+    storeCell(source, sheet, row, col, columns);
+}
+
+void WorkbookSnapshot::loadSheet(CellSource& source, int sheet, SheetColumns& columns) {
+    columns = SheetColumns();
+    columns.name = source.sheetName(sheet);
+    source.usedRange(sheet, columns.firstRow, columns.lastRow, columns.firstCol, columns.lastCol);
+    if (columns.lastRow < columns.firstRow) columns.lastRow = columns.firstRow;
+    if (columns.lastCol < columns.firstCol) columns.lastCol = columns.firstCol;
+
+    size_t cells = (size_t)columns.rows() * (columns.lastCol - columns.firstCol);
+    columns.values.assign(cells, 0.0);
+    columns.flags.assign(cells, 0);
+    columns.formulaCounts.assign(columns.lastCol - columns.firstCol, 0);
+
+    for (int col = columns.firstCol; col < columns.lastCol; ++col) {
+        for (int row = columns.firstRow; row < columns.lastRow; ++row) {
+            storeCell(source, sheet, row, col, columns);
+        }
+    }
+}
+
+void WorkbookSnapshot::storeCell(CellSource& source, int sheet, int row, int col, SheetColumns& columns) {
+    uint32_t slot = columns.slot(row, col);
+
+    CellData cell;
+    if (!source.readCell(sheet, row, col, cell)) {
+        columns.values[slot] = 0.0;
+        columns.flags[slot] = 0;
+        return;
+    }
+
+    columns.values[slot] = (cell.kind == CellKind::ERROR) ? (double)cell.error : cell.number;
+    columns.flags[slot] = (uint8_t)cell.kind;
+    if (cell.isFormula) {
+        // A saved result of 0 is indistinguishable from "never calculated"
+        columns.flags[slot] |= FORMULA | (columns.values[slot] != 0.0 ? CALCULATED : 0);
+    }
+
+    if (cell.kind == CellKind::STRING) {
+        columns.textHandles[slot] = texts.intern(cell.text);
+    }
+    if (cell.isFormula) {
+        columns.formulaCounts[col - columns.firstCol]++;
+        columns.formulaHandles[slot] = addFormula(source.readFormula(sheet, row, col));
+    }
+}
+
+bool WorkbookSnapshot::setNumber(int sheet, int row, int col, double value) {
+    if (sheet < 0 || sheet >= (int)sheets.size()) return false;
+    if (row < 0 || row >= MAX_SHEET_ROWS || col < 0 || col >= MAX_SHEET_COLS) return false;
+
+    SheetColumns& columns = sheets[sheet];
+    if (!columns.contains(row, col) && !grow(columns, row, col)) return false;
+
+    uint32_t slot = columns.slot(row, col);
+    if (columns.flags[slot] & FORMULA) columns.formulaCounts[col - columns.firstCol]--;
+    columns.textHandles.erase(slot);
+    columns.formulaHandles.erase(slot);
+    columns.values[slot] = value;
+    columns.flags[slot] = (uint8_t)CellKind::NUMBER;
+    return true;
+}
+
+void WorkbookSnapshot::markStale(int sheet, int row, int col) {
+    SheetColumns& columns = sheets[sheet];
+    if (columns.contains(row, col)) {
+        columns.flags[columns.slot(row, col)] &= ~CALCULATED;
+    }
+}
+
+// Re-layout a sheet so its stored area also covers (row, col); false if
+// that area would have more than MAX_GROWN_SLOTS slots
+bool WorkbookSnapshot::grow(SheetColumns& columns, int row, int col) {
+    SheetColumns grown;
+    grown.name = columns.name;
+    bool empty = columns.rows() == 0 || columns.lastCol == columns.firstCol;
+    grown.firstRow = empty ? row : std::min(columns.firstRow, row);
+    grown.lastRow = empty ? row + 1 : std::max(columns.lastRow, row + 1);
+    grown.firstCol = empty ? col : std::min(columns.firstCol, col);
+    grown.lastCol = empty ? col + 1 : std::max(columns.lastCol, col + 1);
+
+    uint64_t cells = (uint64_t)grown.rows() * (uint64_t)(grown.lastCol - grown.firstCol);
+    if (cells > MAX_GROWN_SLOTS) return false;
+    grown.values.assign((size_t)cells, 0.0);
+    grown.flags.assign((size_t)cells, 0);
+    grown.formulaCounts.assign(grown.lastCol - grown.firstCol, 0);
+
+    for (int c = columns.firstCol; c < columns.lastCol && !empty; ++c) {
+        grown.formulaCounts[c - grown.firstCol] = columns.formulaCounts[c - columns.firstCol];
+        for (int r = columns.firstRow; r < columns.lastRow; ++r) {
+            grown.values[grown.slot(r, c)] = columns.values[columns.slot(r, c)];
+            grown.flags[grown.slot(r, c)] = columns.flags[columns.slot(r, c)];
+        }
+    }
+
+    auto remap = [&](const std::unordered_map<uint32_t, uint32_t>& from, std::unordered_map<uint32_t, uint32_t>& to) {
+        for (const auto& entry : from) {
+            int r = columns.firstRow + (int)(entry.first % columns.rows());
+            int c = columns.firstCol + (int)(entry.first / columns.rows());
+            to[grown.slot(r, c)] = entry.second;
+        }
+    };
+    if (!empty) {
+        remap(columns.textHandles, grown.textHandles);
+        remap(columns.formulaHandles, grown.formulaHandles);
+    }
+
+    columns = std::move(grown);
+    return true;
+}
+
+uint32_t WorkbookSnapshot::addFormula(std::wstring_view text) {
+    formulaTexts.emplace_back(text);
+    return (uint32_t)formulaTexts.size() - 1;
+}
+
+Value WorkbookSnapshot::value(int sheet, int row, int col) const {
+    const SheetColumns& s = sheets[sheet];
+    if (!s.contains(row, col)) return Value::empty();
+
+    uint32_t slot = s.slot(row, col);
+    double number = s.values[slot];
+    switch ((CellKind)(s.flags[slot] & KIND_MASK)) {
+    case CellKind::NUMBER:
+        return Value::number(number);
+
+    case CellKind::BOOLEAN:
+        return Value::boolean(number != 0.0);
+
+    case CellKind::STRING: {
+        auto it = s.textHandles.find(slot);
+        return (it != s.textHandles.end()) ? Value::string(it->second) : Value::empty();
+    }
+
+    case CellKind::ERROR:
+        return Value::error((ErrorCode)(int)number);
+
+    default:
+        return Value::empty();
+    }
+}
+
+std::wstring_view WorkbookSnapshot::text(int sheet, int row, int col) const {
+    const SheetColumns& s = sheets[sheet];
+    if (!s.contains(row, col)) return std::wstring_view();
+
+    auto it = s.textHandles.find(s.slot(row, col));
+    return (it != s.textHandles.end()) ? texts.text(it->second) : std::wstring_view();
+}
+
+std::wstring_view WorkbookSnapshot::formula(int sheet, int row, int col) const {
+    const SheetColumns& s = sheets[sheet];
+    if (!s.contains(row, col)) return std::wstring_view();
+
+    auto it = s.formulaHandles.find(s.slot(row, col));
+    return (it != s.formulaHandles.end()) ? std::wstring_view(formulaTexts[it->second]) : std::wstring_view();
+}
+
+uint64_t WorkbookSnapshot::contentHash() const {
+    ContentHasher hasher;
+    hasher.addValue(sheets.size());
+    for (const auto& s : sheets) {
+        hasher.add(s.name.data(), s.name.size());
+        int bounds[] = { s.firstRow, s.lastRow, s.firstCol, s.lastCol };
+        hasher.add(bounds, sizeof(bounds));
+        hasher.add(s.values.data(), s.values.size() * sizeof(double));
+        hasher.add(s.flags.data(), s.flags.size());
+
+        // Texts and formulas in slot order; the maps iterate in no fixed order
+        for (uint32_t slot = 0; slot < (uint32_t)s.flags.size(); ++slot) {
+            if ((s.flags[slot] & KIND_MASK) == (uint8_t)CellKind::STRING) {
+                auto text = s.textHandles.find(slot);
+                if (text != s.textHandles.end()) {
+                    std::wstring_view chars = texts.text(text->second);
+                    hasher.addValue(slot);
+                    hasher.add(chars.data(), chars.size() * sizeof(wchar_t));
+                }
+            }
+            if (s.flags[slot] & FORMULA) {
+                auto formula = s.formulaHandles.find(slot);
+                if (formula != s.formulaHandles.end()) {
+                    const std::wstring& chars = formulaTexts[formula->second];
+                    hasher.addValue(slot);
+                    hasher.add(chars.data(), chars.size() * sizeof(wchar_t));
+                }
+            }
+        }
+    }
+    return hasher.finish();
+}
+
+size_t WorkbookSnapshot::memoryBytes() const {
+    size_t bytes = 0;
+    for (const auto& s : sheets) {
+        bytes += s.values.capacity() * sizeof(double) + s.flags.capacity() +
+            (s.textHandles.size() + s.formulaHandles.size()) * 2 * sizeof(uint32_t);
+    }
+    for (const auto& text : formulaTexts) {
+        bytes += text.capacity() * sizeof(wchar_t);
+    }
+    return bytes + texts.memoryBytes();
+}
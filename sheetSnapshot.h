@@ -0,0 +1,125 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "cellSource.h"
+#include "formulaTypes.h"
+#include "formulaValue.h"
+#include "stringPool.h"
+
+// Per-cell flags: the low bits hold the CellKind, FORMULA marks formula cells
+// and CALCULATED formula cells whose stored value is still current
+enum SnapshotFlags : uint8_t {
+    KIND_MASK = 0x07,
+    FORMULA = 0x08,
+    CALCULATED = 0x10
+};
+
+// Used area of one sheet, stored column-major so a column of a range is a
+// contiguous run of doubles
+struct SheetColumns {
+    std::string name;
+    int firstRow = 0;   // half-open bounds of the stored area
+    int lastRow = 0;
+    int firstCol = 0;
+    int lastCol = 0;
+
+    std::vector<double> values;     // number, boolean, error code or last calculated value
+    std::vector<uint8_t> flags;
+    std::vector<uint32_t> formulaCounts;                    // formula cells per column
+    std::unordered_map<uint32_t, uint32_t> textHandles;     // slot -> StringPool handle
+    std::unordered_map<uint32_t, uint32_t> formulaHandles;  // slot -> index into formula texts
+
+    int rows() const { return lastRow - firstRow; }
+
+    bool contains(int row, int col) const {
+        return row >= firstRow && row < lastRow && col >= firstCol && col < lastCol;
+    }
+
+    uint32_t slot(int row, int col) const {
+        return (uint32_t)((col - firstCol) * rows() + (row - firstRow));
+    }
+
+    bool columnHasFormulas(int col) const {
+        return col >= firstCol && col < lastCol && formulaCounts[col - firstCol] != 0;
+    }
+};
+
+// Copy of a CellSource's cells taken in one bulk pass, so evaluation reads
+// plain memory instead of calling into the source per cell
+class WorkbookSnapshot {
+public:
+    // Most slots one sheet's stored area may grow to, about 2.4 GB of
+    // values and flags; well inside the 32-bit slot numbers
+    static const uint64_t MAX_GROWN_SLOTS = 1ull << 28;
+
+    void load(CellSource& source);
+
+    // Re-read one sheet or cell after the source changed
+    void reloadSheet(CellSource& source, int sheet);
+
+    void reloadCell(CellSource& source, int sheet, int row, int col);
+
+    // Overwrite a cell with a number, growing the stored area if needed.
+    // False, with nothing changed, for a cell outside the sheet or one the
+    // stored area cannot grow to cover.
+    bool setNumber(int sheet, int row, int col, double value);
+
+    // The stored value of a formula cell is out of date
+    void markStale(int sheet, int row, int col);
+
+    int sheetCount() const { return (int)sheets.size(); }
+
+    const SheetColumns& sheet(int index) const { return sheets[index]; }
+
+    // 0 (an EMPTY, non-formula cell) outside the used area
+    uint8_t flags(int sheet, int row, int col) const {
+        const SheetColumns& s = sheets[sheet];
+        return s.contains(row, col) ? s.flags[s.slot(row, col)] : 0;
+    }
+
+    CellKind kind(int sheet, int row, int col) const {
+        return (CellKind)(flags(sheet, row, col) & KIND_MASK);
+    }
+
+    bool isFormula(int sheet, int row, int col) const {
+        return (flags(sheet, row, col) & FORMULA) != 0;
+    }
+
+    double number(int sheet, int row, int col) const {
+        const SheetColumns& s = sheets[sheet];
+        return s.contains(row, col) ? s.values[s.slot(row, col)] : 0.0;
+    }
+
+    // Stored value of a cell, the last calculated one for a formula cell;
+    // empty outside the used area
+    Value value(int sheet, int row, int col) const;
+
+    std::wstring_view text(int sheet, int row, int col) const;
+
+    // Texts of the cells, which STRING values are handles into
+    const StringPool& strings() const { return texts; }
+
+    std::wstring_view formula(int sheet, int row, int col) const;
+
+    // Hash of every sheet's name, bounds, cells and formula texts; equal
+    // for snapshots of the same workbook content
+    uint64_t contentHash() const;
+
+    size_t memoryBytes() const;
+
+private:
+    void loadSheet(CellSource& source, int sheet, SheetColumns& columns);
+
+    void storeCell(CellSource& source, int sheet, int row, int col, SheetColumns& columns);
+
+    uint32_t addFormula(std::wstring_view text);
+
+    bool grow(SheetColumns& columns, int row, int col);
+
+    std::vector<SheetColumns> sheets;
+    StringPool texts;
+    std::vector<std::wstring> formulaTexts;
+};
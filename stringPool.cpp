@@ -0,0 +1,56 @@
+#include "stdafx.h"
+#include "stringPool.h"
+#include <cwchar>
+#include <cwctype>
+#include <limits>
+
+uint32_t StringPool::intern(std::wstring_view text) {
+    auto it = index.find(text);
+    if (it != index.end()) return it->second;
+
+    std::wstring lower(text);
+    for (wchar_t& c : lower) {
+        c = (wchar_t)std::towlower(c);
+    }
+    // The folded form is its own folded form, so this recurses at most once
+    uint32_t folded = (lower == text) ? (uint32_t)entries.size() : intern(lower);
+
+    uint32_t handle = (uint32_t)entries.size();
+    entries.push_back(Entry{ std::wstring(text), folded, parseNumber(text) });
+    index.emplace(entries.back().text, handle);
+    return handle;
+}
+
+// Whole text with optional surrounding spaces, as Excel converts text in
+// arithmetic; "" is not a number
+double StringPool::parseNumber(std::wstring_view text) {
+    const double notNumber = std::numeric_limits<double>::quiet_NaN();
+    size_t first = text.find_first_not_of(L' ');
+    if (first == std::wstring_view::npos) return notNumber;
+    size_t last = text.find_last_not_of(L' ');
+
+    std::wstring trimmed(text.substr(first, last - first + 1));
+    wchar_t* end = nullptr;
+    double value = std::wcstod(trimmed.c_str(), &end);
+    if (end != trimmed.c_str() + trimmed.size()) return notNumber;
+
+    // wcstod also takes nan, inf and hex, which Excel does not
+    for (wchar_t c : trimmed) {
+        if (std::iswalpha(c) && c != L'e' && c != L'E') return notNumber;
+    }
+    return value;
+}
+
+size_t StringPool::memoryBytes() const {
+    size_t bytes = index.bucket_count() * sizeof(void*);
+    for (const auto& entry : entries) {
+        bytes += sizeof(Entry) + entry.text.capacity() * sizeof(wchar_t) +
+            sizeof(std::wstring_view) + sizeof(uint32_t) + 2 * sizeof(void*);
+    }
+    return bytes;
+}
+
+void StringPool::clear() {
+    index.clear();
+    entries.clear();
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Interned text of the workbook's cells. Equal texts share one handle, and
+// what evaluation needs of a text is worked out once when it is added: the
+// handle of its case-folded form, for case-insensitive comparisons, and its
+// value as a number, for arithmetic on text cells.
+//
+// Only added to while the snapshot loads, so workers may read it freely
+// during a recalculation.
+class StringPool {
+public:
+    uint32_t intern(std::wstring_view text);
+
+    std::wstring_view text(uint32_t handle) const { return entries[handle].text; }
+
+    // Handle of the lower-cased text; equal for texts differing only in case
+    uint32_t folded(uint32_t handle) const { return entries[handle].folded; }
+
+    // The text as a number, NaN if it is not one
+    double number(uint32_t handle) const { return entries[handle].number; }
+
+    size_t size() const { return entries.size(); }
+
+    size_t memoryBytes() const;
+
+    void clear();
+
+private:
+    struct Entry {
+        std::wstring text;
+        uint32_t folded = 0;
+        double number = 0.0;
+    };
+
+    static double parseNumber(std::wstring_view text);
+
+    std::deque<Entry> entries;      // deque: the index keys view into entries
+    std::unordered_map<std::wstring_view, uint32_t> index;
+};
@@ -0,0 +1,96 @@
+#include "stdafx.h"
+#include "subexpressionTable.h"
+
+namespace {
+
+template <typename T>
+void append(std::string& key, const T& value) {
+    key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+} // namespace
+
+// Field by field, so struct padding never reaches the key
+void SubexpressionTable::encode(const Program& program, std::string& key) {
+    key.clear();
+    append(key, program.code.size());
+    for (const Instruction& ins : program.code) {
+        append(key, ins.op);
+        append(key, ins.argc);
+        append(key, ins.operand);
+    }
+    append(key, program.constants.size());
+    for (Value constant : program.constants) append(key, constant.raw());
+    append(key, program.cells.size());
+    for (size_t i = 0; i < program.cells.size(); ++i) {
+        append(key, program.cells[i]);
+        append(key, program.cellAbsolute[i]);
+    }
+    append(key, program.ranges.size());
+    for (size_t i = 0; i < program.ranges.size(); ++i) {
+        append(key, program.ranges[i]);
+        append(key, program.rangeAbsolute[i]);
+    }
+    append(key, program.args.size());
+    for (const CallArg& arg : program.args) {
+        append(key, arg.kind);
+        append(key, arg.function);
+        append(key, arg.range);
+    }
+    append(key, program.shared.size());
+    for (uint32_t id : program.shared) append(key, id);
+}
+
+uint32_t SubexpressionTable::intern(Program&& program) {
+    references++;
+    encode(program, key);
+    auto it = index.find(key);
+    if (it != index.end()) return it->second;
+
+    uint32_t id = (uint32_t)entries.size();
+    memoryBytes += sizeof(Entry) + program.memoryBytes() + key.size();
+    entries.emplace_back(std::move(program));
+    index.emplace(key, id);
+    return id;
+}
+
+bool SubexpressionTable::shift(uint32_t id, int dRow, int dCol, uint32_t& shifted) {
+    Program moved;
+    if (!shiftProgram(entries[id].program, dRow, dCol, moved)) return false;
+
+    // Nested calls move along with their parent
+    for (uint32_t& child : moved.shared) {
+        if (!shift(child, dRow, dCol, child)) return false;
+    }
+    shifted = intern(std::move(moved));
+    return true;
+}
+
+Value SubexpressionTable::value(uint32_t id, FormulaVM& vm, CellValueReader& reader) {
+    Entry& entry = entries[id];
+    if (entry.generation.load(std::memory_order_acquire) == generation) {
+        reuses.fetch_add(1, std::memory_order_relaxed);
+        return Value::fromBits(entry.value.load(std::memory_order_relaxed));
+    }
+
+    Value result = vm.run(entry.program, reader);
+    entry.value.store(result.raw(), std::memory_order_relaxed);
+    entry.generation.store(generation, std::memory_order_release);
+    evaluations.fetch_add(1, std::memory_order_relaxed);
+    return result;
+}
+
+SubexpressionStats SubexpressionTable::getStats() const {
+    SubexpressionStats stats;
+    stats.unique = entries.size();
+    stats.references = references;
+    stats.evaluations = evaluations.load();
+    stats.reuses = reuses.load();
+    stats.memoryBytes = memoryBytes;
+    return stats;
+}
+
+void SubexpressionTable::resetCounters() {
+    evaluations = 0;
+    reuses = 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include "formulaBytecode.h"
+
+struct SubexpressionStats {
+    size_t unique = 0;        // distinct subexpressions stored
+    size_t references = 0;    // subexpressions compiled, duplicates included
+    size_t evaluations = 0;   // computed since the counters were reset
+    size_t reuses = 0;        // answered from a value computed earlier in the generation
+    size_t memoryBytes = 0;
+};
+
+// Hash-consed function calls of every formula compiled. Structurally equal
+// calls (same function, arguments, references and $ marks) share one entry,
+// whose value is computed once per generation and then reused by all
+// formulas containing it. A generation ends whenever an input may change.
+//
+// Values are stamped with their generation through atomics, so workers of
+// a parallel recalculation can share them without locks; two workers
+// racing on the same entry both compute it and store the same value.
+class SubexpressionTable {
+public:
+    // Id of the entry equal to program, adding it if new
+    uint32_t intern(Program&& program);
+
+    // Id of entry id copied dRow rows down and dCol columns right; false if
+    // a reference leaves the sheet
+    bool shift(uint32_t id, int dRow, int dCol, uint32_t& shifted);
+
+    const Program& program(uint32_t id) const { return entries[id].program; }
+
+    size_t size() const { return entries.size(); }
+
+    // Drop every computed value; call before inputs change or a recalculation
+    void nextGeneration() { generation++; }
+
+    // Value of id in the current generation, computed on first use
+    Value value(uint32_t id, FormulaVM& vm, CellValueReader& reader);
+
+    SubexpressionStats getStats() const;
+
+    void resetCounters();
+
+private:
+    struct Entry {
+        explicit Entry(Program&& program) : program(std::move(program)) {}
+
+        Program program;
+        std::atomic<uint64_t> generation{ 0 };
+        std::atomic<uint64_t> value{ 0 };     // Value bits
+    };
+
+    static void encode(const Program& program, std::string& key);
+
+    std::deque<Entry> entries;          // deque: entries never move
+    std::unordered_map<std::string, uint32_t> index;
+    std::string key;                    // scratch buffer for intern
+
+    uint64_t generation = 1;
+    size_t references = 0;
+    size_t memoryBytes = 0;
+    std::atomic<size_t> evaluations{ 0 };
+    std::atomic<size_t> reuses{ 0 };
+};
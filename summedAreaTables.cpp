@@ -0,0 +1,338 @@
+#include "stdafx.h"
+#include "summedAreaTables.h"
+#include <algorithm>
+#include <cmath>
+#include "formulaTrace.h"
+
+namespace {
+
+bool isNonEmpty(uint8_t flags) {
+    CellKind kind = (CellKind)(flags & KIND_MASK);
+    return kind != CellKind::EMPTY && kind != CellKind::BLANK;
+}
+
+double cellCount(const RangeRef& range) {
+    return (double)(range.lastRow - range.firstRow + 1) * (range.lastCol - range.firstCol + 1);
+}
+
+// Running sum kept as the rounded total and the exact error of each
+// rounding (TwoSum), so small values survive next to large ones
+struct ExactSum {
+    double sum = 0.0;
+    double error = 0.0;
+
+    void add(double value) {
+        double total = sum + value;
+        double virtualValue = total - sum;
+        error += (sum - (total - virtualValue)) + (value - virtualValue);
+        sum = total;
+    }
+
+    double total() const { return sum + error; }
+};
+
+} // namespace
+
+size_t SummedAreaTables::Table::memoryBytes() const {
+    return sizeof(Table) +
+        (sums.capacity() + sumErrors.capacity()) * sizeof(double) +
+        (counts.capacity() + countas.capacity()) * sizeof(uint32_t) +
+        deltas.capacity() * sizeof(Delta);
+}
+
+void SummedAreaTables::Table::add(const RangeRef& rect, AggregateState& state) const {
+    size_t stride = rows + 1;
+    size_t r1 = rect.firstRow - block.firstRow;
+    size_t r2 = rect.lastRow - block.firstRow + 1;
+    size_t c1 = rect.firstCol - block.firstCol;
+    size_t c2 = rect.lastCol - block.firstCol + 1;
+
+    // The four corners are combined as exactly as they were summed
+    ExactSum sum;
+    auto corner = [&](size_t at, double sign) {
+        sum.add(sign * sums[at]);
+        sum.error += sign * sumErrors[at];
+    };
+    corner(c2 * stride + r2, 1.0);
+    corner(c1 * stride + r2, -1.0);
+    corner(c2 * stride + r1, -1.0);
+    corner(c1 * stride + r1, 1.0);
+    state.count += (double)counts[c2 * stride + r2] - counts[c1 * stride + r2] - counts[c2 * stride + r1] + counts[c1 * stride + r1];
+    state.counta += (double)countas[c2 * stride + r2] - countas[c1 * stride + r2] - countas[c2 * stride + r1] + countas[c1 * stride + r1];
+
+    for (const Delta& delta : deltas) {
+        if (delta.row >= rect.firstRow && delta.row <= rect.lastRow &&
+            delta.col >= rect.firstCol && delta.col <= rect.lastCol) {
+            sum.add(delta.added);
+            sum.add(-delta.removed);
+            state.count += delta.count;
+            state.counta += delta.counta;
+        }
+    }
+    state.sum += sum.total();
+}
+
+bool SummedAreaTables::contains(const RangeRef& outer, const RangeRef& inner) {
+    return outer.sheet == inner.sheet &&
+        inner.firstRow >= outer.firstRow && inner.lastRow <= outer.lastRow &&
+        inner.firstCol >= outer.firstCol && inner.lastCol <= outer.lastCol;
+}
+
+void SummedAreaTables::scan(const WorkbookSnapshot& snapshot, const RangeRef& rect, AggregateState& state) {
+    const SheetColumns& columns = snapshot.sheet(rect.sheet);
+    size_t count = rect.lastRow - rect.firstRow + 1;
+    for (int col = rect.firstCol; col <= rect.lastCol; ++col) {
+        uint32_t first = columns.slot(rect.firstRow, col);
+        RangeKernels::aggregate(columns.values.data() + first, columns.flags.data() + first, count, state);
+    }
+}
+
+bool SummedAreaTables::aggregate(const WorkbookSnapshot& snapshot, const RangeRef& range, AggregateState& state) {
+    // Cells outside the stored area are empty and add nothing
+    const SheetColumns& columns = snapshot.sheet(range.sheet);
+    RangeRef rect{ range.sheet,
+        std::max(range.firstRow, columns.firstRow), std::max(range.firstCol, columns.firstCol),
+        std::min(range.lastRow, columns.lastRow - 1), std::min(range.lastCol, columns.lastCol - 1) };
+    if (rect.firstRow > rect.lastRow || rect.firstCol > rect.lastCol) return true;
+
+    std::shared_ptr<const Table> table;
+    bool checking;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& candidate : tables) {
+            if (contains(candidate->block, rect)) {
+                candidate->lastUse = ++clock;
+                table = candidate;
+                break;
+            }
+        }
+
+        if (!table) {
+            Heat& sheetHeat = heat[rect.sheet];
+            if (sheetHeat.scanned == 0.0) {
+                sheetHeat.box = rect;
+            }
+            else {
+                sheetHeat.box.firstRow = std::min(sheetHeat.box.firstRow, rect.firstRow);
+                sheetHeat.box.firstCol = std::min(sheetHeat.box.firstCol, rect.firstCol);
+                sheetHeat.box.lastRow = std::max(sheetHeat.box.lastRow, rect.lastRow);
+                sheetHeat.box.lastCol = std::max(sheetHeat.box.lastCol, rect.lastCol);
+            }
+            sheetHeat.scanned += cellCount(rect);
+
+            // Building costs one pass over the box, so wait until scanning
+            // has cost two
+            double area = cellCount(sheetHeat.box);
+            if (area >= MIN_CELLS && sheetHeat.scanned >= 2.0 * area) {
+                RangeRef box = sheetHeat.box;
+                heat.erase(rect.sheet);
+                auto built = build(snapshot, box);
+                if (built) {
+                    built->lastUse = ++clock;
+                    addTable(built);
+                    stats.builds++;
+                    table = built;
+                }
+            }
+        }
+
+        if (!table) {
+            stats.scans++;
+            return false;
+        }
+        stats.hits++;
+        checking = check;
+    }
+
+    if (!checking) {
+        table->add(rect, state);
+        return true;
+    }
+
+    AggregateState tabled;
+    AggregateState scanned;
+    table->add(rect, tabled);
+    scan(snapshot, rect, scanned);
+    if (tabled.count != scanned.count || tabled.counta != scanned.counta ||
+        !(std::fabs(tabled.sum - scanned.sum) <= 1e-12 * std::max(1.0, std::fabs(scanned.sum)))) {
+        TRACE_WARNING(TraceKind::AreaTableMismatch, CellKey{ rect.sheet, rect.firstRow, rect.firstCol },
+            Value::number(tabled.sum));
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.checkFailures++;
+        tabled = scanned;
+    }
+    state.sum += tabled.sum;
+    state.count += tabled.count;
+    state.counta += tabled.counta;
+    return true;
+}
+
+std::shared_ptr<SummedAreaTables::Table> SummedAreaTables::build(const WorkbookSnapshot& snapshot,
+    const RangeRef& block) const {
+    auto table = std::make_shared<Table>();
+    table->block = block;
+    table->rows = block.lastRow - block.firstRow + 1;
+    table->cols = block.lastCol - block.firstCol + 1;
+
+    size_t stride = table->rows + 1;
+    size_t size = stride * (table->cols + 1);
+    table->sums.assign(size, 0.0);
+    table->sumErrors.assign(size, 0.0);
+    table->counts.assign(size, 0);
+    table->countas.assign(size, 0);
+
+    const SheetColumns& columns = snapshot.sheet(block.sheet);
+    for (int c = 1; c <= table->cols; ++c) {
+        uint32_t first = columns.slot(block.firstRow, block.firstCol + c - 1);
+        ExactSum columnSum;
+        uint32_t columnCount = 0;
+        uint32_t columnCountA = 0;
+        for (int r = 1; r <= table->rows; ++r) {
+            uint8_t flags = columns.flags[first + r - 1];
+            if ((flags & FORMULA) || flags == (uint8_t)CellKind::ERROR) return nullptr;
+            if (flags == (uint8_t)CellKind::NUMBER) {
+                // Infinities would turn the differences into NaN
+                double value = columns.values[first + r - 1];
+                if (!std::isfinite(value)) return nullptr;
+                columnSum.add(value);
+                columnCount++;
+            }
+            if (isNonEmpty(flags)) columnCountA++;
+
+            // Column prefix plus the table one column to the left
+            size_t at = c * stride + r;
+            size_t left = (c - 1) * stride + r;
+            ExactSum sum{ table->sums[left], table->sumErrors[left] + columnSum.error };
+            sum.add(columnSum.sum);
+            if (!std::isfinite(sum.sum)) return nullptr;
+            table->sums[at] = sum.sum;
+            table->sumErrors[at] = sum.error;
+            table->counts[at] = table->counts[left] + columnCount;
+            table->countas[at] = table->countas[left] + columnCountA;
+        }
+    }
+    return table;
+}
+
+void SummedAreaTables::addTable(std::shared_ptr<Table> table) {
+    // Tables inside the new block are superseded by it
+    for (auto it = tables.begin(); it != tables.end();) {
+        if (contains(table->block, (*it)->block)) {
+            memoryBytes -= (*it)->memoryBytes();
+            it = tables.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    evict(table->memoryBytes());
+    if (memoryBytes + table->memoryBytes() > memoryLimit) return;
+    memoryBytes += table->memoryBytes();
+    tables.push_back(std::move(table));
+}
+
+void SummedAreaTables::evict(size_t incoming) {
+    while (!tables.empty() && memoryBytes + incoming > memoryLimit) {
+        auto oldest = std::min_element(tables.begin(), tables.end(),
+            [](const std::shared_ptr<Table>& a, const std::shared_ptr<Table>& b) { return a->lastUse < b->lastUse; });
+        memoryBytes -= (*oldest)->memoryBytes();
+        tables.erase(oldest);
+        stats.evictions++;
+    }
+}
+
+void SummedAreaTables::cellChanged(const WorkbookSnapshot& snapshot, const CellKey& cell, uint8_t oldFlags,
+    double oldValue) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint8_t flags = snapshot.flags(cell.sheet, cell.row, cell.col);
+    double value = snapshot.number(cell.sheet, cell.row, cell.col);
+    bool wasNumber = oldFlags == (uint8_t)CellKind::NUMBER;
+    bool isNumber = flags == (uint8_t)CellKind::NUMBER;
+
+    Delta delta{ cell.row, cell.col, isNumber ? value : 0.0, wasNumber ? oldValue : 0.0,
+        (int32_t)isNumber - (int32_t)wasNumber,
+        (int32_t)isNonEmpty(flags) - (int32_t)isNonEmpty(oldFlags) };
+
+    RangeRef point{ cell.sheet, cell.row, cell.col, cell.row, cell.col };
+    for (auto& table : tables) {
+        if (!contains(table->block, point)) continue;
+
+        if ((flags & KIND_MASK) == (uint8_t)CellKind::ERROR || (isNumber && !std::isfinite(value))) {
+            memoryBytes -= table->memoryBytes();
+            table = nullptr;
+            continue;
+        }
+        if (table->deltas.size() < MAX_DELTAS) {
+            memoryBytes -= table->memoryBytes();
+            table->deltas.push_back(delta);
+            memoryBytes += table->memoryBytes();
+            stats.updates++;
+            continue;
+        }
+
+        auto rebuilt = build(snapshot, table->block);
+        memoryBytes -= table->memoryBytes();
+        if (rebuilt) {
+            rebuilt->lastUse = table->lastUse;
+            memoryBytes += rebuilt->memoryBytes();
+            stats.rebuilds++;
+        }
+        table = rebuilt;
+    }
+    tables.erase(std::remove(tables.begin(), tables.end(), nullptr), tables.end());
+}
+
+void SummedAreaTables::invalidateCell(const CellKey& cell) {
+    std::lock_guard<std::mutex> lock(mutex);
+    RangeRef point{ cell.sheet, cell.row, cell.col, cell.row, cell.col };
+    for (auto it = tables.begin(); it != tables.end();) {
+        if (contains((*it)->block, point)) {
+            memoryBytes -= (*it)->memoryBytes();
+            it = tables.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void SummedAreaTables::invalidateSheet(int sheet) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = tables.begin(); it != tables.end();) {
+        if ((*it)->block.sheet == sheet) {
+            memoryBytes -= (*it)->memoryBytes();
+            it = tables.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    heat.erase(sheet);
+}
+
+void SummedAreaTables::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    tables.clear();
+    heat.clear();
+    memoryBytes = 0;
+}
+
+void SummedAreaTables::setCheck(bool enabled) {
+    std::lock_guard<std::mutex> lock(mutex);
+    check = enabled;
+}
+
+void SummedAreaTables::setMemoryLimit(size_t maxBytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    memoryLimit = maxBytes;
+    evict(0);
+}
+
+SummedAreaStats SummedAreaTables::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    SummedAreaStats current = stats;
+    current.tables = tables.size();
+    current.memoryBytes = memoryBytes;
+    return current;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "formulaBytecode.h"
+#include "rangeKernels.h"
+#include "sheetSnapshot.h"
+
+struct SummedAreaStats {
+    size_t hits = 0;          // aggregates answered from a table
+    size_t scans = 0;         // aggregates left to the range kernels
+    size_t builds = 0;
+    size_t rebuilds = 0;      // tables rebuilt once their delta list filled up
+    size_t updates = 0;       // cell changes recorded as deltas
+    size_t evictions = 0;     // tables dropped to stay under the memory limit
+    size_t checkFailures = 0; // answers the check found to differ from a scan
+    size_t tables = 0;
+    size_t memoryBytes = 0;
+};
+
+// 2-D prefix sums (summed-area tables) over blocks of constant cells that
+// are aggregated often, answering SUM, COUNT, COUNTA and AVERAGE over any
+// rectangle inside a block in constant time.
+//
+// Per sheet the rectangles that had to be scanned are tracked; once the
+// cells scanned add up to twice their bounding box, the box gets a table.
+// Boxes holding formula or error cells are not tabled, so an error in
+// a range reaches the scan that reports it. Changed cells are kept as a
+// short list of deltas added to the answers, and the table is rebuilt when
+// the list is full.
+//
+// Prefix sums are kept compensated, as a rounded sum and the error it
+// dropped, so a large value in a block does not swamp the small ones next
+// to it: a rectangle gets the same total a straight scan of it would.
+//
+// Safe to share between the workers of a recalculation; cells must only
+// change while no aggregate is running.
+class SummedAreaTables {
+public:
+    // Add the sum, count and counta of range to state, min and max left
+    // out; false if no table covers it, so the caller should scan
+    bool aggregate(const WorkbookSnapshot& snapshot, const RangeRef& range, AggregateState& state);
+
+    // After a constant cell changed; oldFlags and oldValue are what the
+    // snapshot held before
+    void cellChanged(const WorkbookSnapshot& snapshot, const CellKey& cell, uint8_t oldFlags, double oldValue);
+
+    // Drop the tables over a cell that may have become a formula
+    void invalidateCell(const CellKey& cell);
+
+    void invalidateSheet(int sheet);
+
+    void clear();
+
+    // Least recently used tables are dropped beyond maxBytes
+    void setMemoryLimit(size_t maxBytes);
+
+    // Debug mode: scan every rectangle answered from a table as well, and
+    // answer with the scan when the two differ
+    void setCheck(bool enabled);
+
+    SummedAreaStats getStats() const;
+
+private:
+    struct Delta {
+        int row;
+        int col;
+        double added;       // number the cell holds now, 0 if none
+        double removed;     // number it held before
+        int32_t count;
+        int32_t counta;
+    };
+
+    struct Table {
+        RangeRef block;
+        int rows = 0;
+        int cols = 0;
+        std::vector<double> sums;         // (rows + 1) x (cols + 1), column major
+        std::vector<double> sumErrors;    // what rounding dropped from each sum
+        std::vector<uint32_t> counts;     // numeric cells
+        std::vector<uint32_t> countas;    // non-empty cells
+        std::vector<Delta> deltas;
+        uint64_t lastUse = 0;
+
+        size_t memoryBytes() const;
+
+        void add(const RangeRef& rect, AggregateState& state) const;
+    };
+
+    // Rectangles scanned on a sheet since its last table was built
+    struct Heat {
+        RangeRef box;
+        double scanned = 0.0;
+    };
+
+    static bool contains(const RangeRef& outer, const RangeRef& inner);
+
+    // Sum, count and counta of rect straight from the snapshot
+    static void scan(const WorkbookSnapshot& snapshot, const RangeRef& rect, AggregateState& state);
+
+    // Null if the block holds a formula or an error
+    std::shared_ptr<Table> build(const WorkbookSnapshot& snapshot, const RangeRef& block) const;
+
+    void addTable(std::shared_ptr<Table> table);
+
+    void evict(size_t incoming);
+
+    static const size_t MAX_DELTAS = 64;
+    static const int MIN_CELLS = 256;
+
+    mutable std::mutex mutex;
+    std::vector<std::shared_ptr<Table>> tables;
+    std::unordered_map<int, Heat> heat;
+    size_t memoryBytes = 0;
+    size_t memoryLimit = 64 * 1024 * 1024;
+    bool check = false;
+    uint64_t clock = 0;
+    SummedAreaStats stats;
+};
@@ -0,0 +1,197 @@
+#include "stdafx.h"
+#include "testing.h"
+
+namespace {
+
+// Formulas every backend understands: arithmetic, references across
+// sheets, errors and SUM, which is all the tree walker evaluates, and the
+// identities the optimizer removes or keeps for a text cell
+const char* const SHARED_CORPUS[] = {
+    "=1+2*3",
+    "=(1+2)*3",
+    "=10/4-1",
+    "=2*-3+-A1",
+    "=-(A1+A2)*2",
+    "=A1+A2*A3-A4/A5",
+    "=A1/(A2-A2)",
+    "=A6*A1",
+    "=SUM(A1:A10)",
+    "=SUM(A1:A10)/SUM(B1:B3)",
+    "=SUM(A1:B10)-SUM(A1:A10)",
+    "=SUM(A1,A3,5)",
+    "=SUM(A1:A3)*SUM(B1:B3)+1",
+    "=Data!A1+Data!B2*2",
+    "=SUM(Data!A1:B3)",
+    "=C1+C2",
+    "=C3*2",
+    "=0.1+0.2",
+    "=1/3*3",
+    "=1000000*1000000",
+    "=SUM(E1:E3)",
+    "=C4*2",
+    "=F2+1",
+    "=A1/0+C4",
+    "=2*3+4",
+    "=A1+A2+A3+A4",
+    "=A1*A2*A3*A4",
+    "=(A1-A2)+0",
+    "=1*(A1-A2)",
+    "=A1*1",
+    "=F2*1",
+    "=F2+0",
+    "=0+F2/1",
+};
+
+// Everything else the bytecode VM and exprtk both evaluate
+const char* const COMPILED_CORPUS[] = {
+    "=AVERAGE(A1:A10)",
+    "=MIN(A1:A10)+MAX(B1:B10)",
+    "=COUNT(A1:C10)",
+    "=COUNTA(A1:C10)",
+    "=SUMPRODUCT(A1:A3,B1:B3)",
+    "=AVERAGE(A1:A3,10)",
+    "=MAX(A1,A2,-5)",
+    "=VLOOKUP(4,A1:B10,2,FALSE)",
+    "=VLOOKUP(4.5,A1:B10,2,TRUE)",
+    "=VLOOKUP(99,A1:B10,2,FALSE)",
+    "=HLOOKUP(2,A1:B10,3,FALSE)",
+    "=MATCH(7,A1:A10,0)",
+    "=INDEX(B1:B10,MATCH(7,A1:A10,0))",
+    "=XLOOKUP(5,A1:A10,B1:B10)",
+    "=TRUE+1",
+    "=SUM(TRUE,FALSE,3)",
+    "=SUM(A1:A10)+D1",
+    "=COUNT(E1:E3)",
+    "=AVERAGE(E1:E3)",
+    "=MIN(F1:F3)",
+    "=C4",
+};
+
+// A1:A10 = 1..10, B1:B10 = 10, 20, ..., 100, A6 blank, formulas in C, an
+// error in E2, text in F2 and a second sheet
+void fillCorpusBook(TestBook& book) {
+    for (int row = 1; row <= 10; ++row) {
+        if (row != 6) book.number("A" + std::to_string(row), row);
+        book.number("B" + std::to_string(row), row * 10.0);
+    }
+    book.formula("C1", L"A1*A2+B1");
+    book.formula("C2", L"SUM(A1:A5)-C1");
+    book.formula("C3", L"C1/C2");
+    book.formula("C4", L"1/0");
+    book.number("D1", 0.5);
+    book.number("E1", 1);
+    book.source.setError(0, 1, 4, ErrorCode::Value);
+    book.number("E3", 3);
+    book.number("F1", 4);
+    book.text("F2", L"text");
+    book.number("F3", 2);
+
+    int data = book.addSheet("Data");
+    book.number("A1", 7, data);
+    book.number("B2", 1.5, data);
+    book.number("B3", 2, data);
+}
+
+// Equal numbers within rounding, or the same error. Booleans count as the
+// numbers 1 and 0, as exprtk has nothing else.
+bool sameResult(Value expected, Value actual) {
+    if (expected.isError() || actual.isError()) return expected == actual;
+    auto number = [](Value value) {
+        if (value.type() == ValueType::Boolean) return value.asBoolean() ? 1.0 : 0.0;
+        return value.isNumber() ? value.asNumber() : std::nan("");
+    };
+    double a = number(expected);
+    double b = number(actual);
+    return std::fabs(a - b) <= 1e-12 * std::max(1.0, std::fabs(a));
+}
+
+const char* backendName(EvaluationBackend backend) {
+    switch (backend) {
+    case EvaluationBackend::TreeWalker: return "tree walker";
+    case EvaluationBackend::Bytecode: return "bytecode";
+    case EvaluationBackend::Exprtk: return "exprtk";
+    }
+    return "?";
+}
+
+// Evaluate the corpus on the bytecode VM and compare every other backend
+// against it, reporting each formula that differs
+template <size_t N>
+void compareBackends(const char* const (&corpus)[N], std::initializer_list<EvaluationBackend> others,
+    const char* file, int line) {
+    TestBook book;
+    fillCorpusBook(book);
+
+    std::vector<Value> expected;
+    for (const char* formula : corpus) expected.push_back(book.eval(formula));
+
+    for (EvaluationBackend backend : others) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        for (size_t i = 0; i < N; ++i) {
+            Value actual = book.eval(corpus[i]);
+            if (!sameResult(expected[i], actual)) {
+                checkFailed(file, line, std::string(corpus[i]) + ": bytecode gives " + describe(expected[i]) +
+                    ", " + backendName(backend) + " gives " + describe(actual));
+            }
+        }
+    }
+}
+
+}
+
+TEST_CASE(backendsAgreeOnSharedCorpus) {
+    compareBackends(SHARED_CORPUS, { EvaluationBackend::Exprtk, EvaluationBackend::TreeWalker }, __FILE__, __LINE__);
+}
+
+TEST_CASE(compiledBackendsAgreeOnCorpus) {
+    compareBackends(COMPILED_CORPUS, { EvaluationBackend::Exprtk }, __FILE__, __LINE__);
+}
+
+// The corpus results themselves, so a bug shared by every backend shows too
+TEST_CASE(corpusMatchesExcel) {
+    TestBook book;
+    fillCorpusBook(book);
+    CHECK_NUMBER(book.eval("=2*-3+-A1"), -7);
+    CHECK_ERROR(book.eval("=A1/(A2-A2)"), ErrorCode::Div0);
+    CHECK_NUMBER(book.eval("=A6*A1"), 0);
+    CHECK_NUMBER(book.eval("=SUM(A1:A10)"), 49);
+    CHECK_NUMBER(book.eval("=SUM(Data!A1:B3)"), 10.5);
+    CHECK_NUMBER(book.eval("=C3*2"), 8);
+    CHECK_NUMBER(book.eval("=AVERAGE(A1:A10)"), 49.0 / 9);
+    CHECK_NUMBER(book.eval("=COUNT(A1:C10)"), 22);
+    CHECK_NUMBER(book.eval("=VLOOKUP(4.5,A1:B10,2,TRUE)"), 40);
+    CHECK_ERROR(book.eval("=VLOOKUP(99,A1:B10,2,FALSE)"), ErrorCode::NA);
+    CHECK_NUMBER(book.eval("=INDEX(B1:B10,MATCH(7,A1:A10,0))"), 70);
+    CHECK_ERROR(book.eval("=SUM(E1:E3)"), ErrorCode::Value);
+    CHECK_NUMBER(book.eval("=COUNT(E1:E3)"), 2);
+    CHECK_NUMBER(book.eval("=MIN(F1:F3)"), 2);
+    CHECK_ERROR(book.eval("=C4"), ErrorCode::Div0);
+    CHECK_ERROR(book.eval("=F2+1"), ErrorCode::Value);
+    CHECK_ERROR(book.eval("=F2*1"), ErrorCode::Value);
+    CHECK_NUMBER(book.eval("=(A1-A2)+0"), -1);
+}
+
+// Lookups exprtk calls back into the VM for are dropped with the
+// expressions of formulas the formula cache evicts
+TEST_CASE(exprtkDropsCallsOfEvictedFormulas) {
+    const int FORMULAS = 3000;
+    TestBook book;
+    fillCorpusBook(book);
+    book.evaluator().setBackend(EvaluationBackend::Exprtk);
+    book.evaluator().setFormulaCacheLimits(1, 1024);
+    size_t wrong = 0;
+    for (int i = 0; i < FORMULAS; ++i) {
+        Value value = book.eval("=VLOOKUP(4,A1:B10,2,FALSE)+" + std::to_string(i));
+        if (value != Value::number(40.0 + i)) wrong++;
+    }
+    CHECK(wrong == 0);
+
+    ExprtkStats stats = book.evaluator().exprtkStats();
+    CHECK(stats.compiled >= (size_t)FORMULAS);
+    CHECK(stats.calls > 0);
+    CHECK(stats.calls <= 2048);
+
+    book.evaluator().invalidateAll();
+    CHECK(book.evaluator().exprtkStats().calls == 0);
+}
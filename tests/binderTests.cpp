@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include <map>
+#include "formulaLexer.h"
+#include "referenceBinder.h"
+#include "testing.h"
+
+namespace {
+
+// Sheets Sheet1, My Sheet and Data, the formula held on hostSheet
+struct Bound {
+    AstArena arena;
+    SymbolTable symbols;
+    std::map<std::string, int> sheets = { { "Sheet1", 0 }, { "My Sheet", 1 }, { "Data", 2 } };
+    std::vector<std::string> errors;
+    NodeIndex root = NO_NODE;
+
+    Bound(const std::string& formula, int hostSheet = 0) {
+        root = parseFormula(formula, arena, symbols);
+        ReferenceBinder binder(symbols, sheets);
+        binder.bind(arena, root, hostSheet, errors);
+    }
+
+    // The nth reference below the root, depth first
+    const AstNode* reference(int nth = 0) const {
+        std::vector<NodeIndex> pending = { root };
+        while (!pending.empty() && root != NO_NODE) {
+            const AstNode& node = arena[pending.back()];
+            pending.pop_back();
+            if ((node.kind == AstKind::CELL_REF || node.kind == AstKind::RANGE) && nth-- == 0) return &node;
+            std::vector<NodeIndex> children;
+            for (NodeIndex child = node.firstChild; child != NO_NODE; child = arena[child].nextSibling) {
+                children.push_back(child);
+            }
+            pending.insert(pending.end(), children.rbegin(), children.rend());
+        }
+        return nullptr;
+    }
+};
+
+bool boundTo(const AstNode* node, int sheet, int row, int col, int lastRow, int lastCol) {
+    return node && node->sheetIndex == sheet && node->row == row && node->col == col &&
+        node->lastRow == lastRow && node->lastCol == lastCol;
+}
+
+}
+
+// Unqualified references take the host sheet, qualified ones theirs,
+// quoted names included; ranges come out with ordered corners
+TEST_CASE(binderResolvesSheets) {
+    Bound plain("=B3+Data!C4", 1);
+    CHECK(plain.errors.empty());
+    CHECK(boundTo(plain.reference(0), 1, 2, 1, 2, 1));
+    CHECK(boundTo(plain.reference(1), 2, 3, 2, 3, 2));
+
+    Bound quoted("='My Sheet'!A1*SUM('My Sheet'!B2:C5)");
+    CHECK(quoted.errors.empty());
+    CHECK(boundTo(quoted.reference(0), 1, 0, 0, 0, 0));
+    CHECK(boundTo(quoted.reference(1), 1, 1, 1, 4, 2));
+
+    Bound reversed("=SUM(C5:B2)");
+    CHECK(reversed.errors.empty());
+    CHECK(boundTo(reversed.reference(), 0, 1, 1, 4, 2));
+}
+
+// $ marks fix the row, the column or both, and follow their coordinate
+// when a range is reordered
+TEST_CASE(binderKeepsAbsoluteMarks) {
+    Bound bound("=$A$1+A$2+$B3+SUM($C$9:D1)");
+    CHECK(bound.errors.empty());
+    const AstNode* both = bound.reference(0);
+    const AstNode* row = bound.reference(1);
+    const AstNode* col = bound.reference(2);
+    const AstNode* range = bound.reference(3);
+    CHECK(boundTo(both, 0, 0, 0, 0, 0));
+    CHECK(both && (both->absolute & (ABS_ROW | ABS_COL)) == (ABS_ROW | ABS_COL));
+    CHECK(boundTo(row, 0, 1, 0, 1, 0));
+    CHECK(row && (row->absolute & (ABS_ROW | ABS_COL)) == ABS_ROW);
+    CHECK(boundTo(col, 0, 2, 1, 2, 1));
+    CHECK(col && (col->absolute & (ABS_ROW | ABS_COL)) == ABS_COL);
+
+    // $C$9:D1 is C1:D9 with $C$ on the first corner and $9 on the last
+    CHECK(boundTo(range, 0, 0, 2, 8, 3));
+    CHECK(range && range->absolute == (ABS_COL | ABS_LAST_ROW));
+}
+
+// References that cannot be bound are reported by what is wrong with them
+// and left unbound
+TEST_CASE(binderReportsBadReferences) {
+    Bound unknown("=Missing!A1+'No Sheet'!B2");
+    CHECK(unknown.errors.size() == 2);
+    CHECK(unknown.errors.size() == 2 && unknown.errors[0] == "unknown sheet 'Missing'!R1C1");
+    CHECK(unknown.errors.size() == 2 && unknown.errors[1] == "unknown sheet 'No Sheet'!R2C2");
+    CHECK(unknown.reference(0) && unknown.reference(0)->sheetIndex == -1);
+
+    Bound outside("=A1048577+XFE1+SUM(A1:XFD1048576)");
+    CHECK(outside.errors.size() == 2);
+    CHECK(outside.errors.size() == 2 && outside.errors[0] == "reference out of range R1048577C1");
+    CHECK(outside.errors.size() == 2 && outside.errors[1] == "reference out of range R1C16385");
+    CHECK(boundTo(outside.reference(2), 0, 0, 0, MAX_SHEET_ROWS - 1, MAX_SHEET_COLS - 1));
+
+    Bound malformed("=Data!1A+NOSUCH(1)");
+    CHECK(malformed.errors.size() == 2);
+    CHECK(malformed.errors.size() == 2 && malformed.errors[0] == "malformed reference 'Data'!?");
+    CHECK(malformed.errors.size() == 2 && malformed.errors[1] == "unknown function NOSUCH");
+}
+
+// Binding errors reach the compiled formula and evaluate to #REF! or #NAME?
+TEST_CASE(binderErrorsReachEvaluation) {
+    TestBook book;
+    int sheet = book.addSheet("My Sheet");
+    book.number("A1", 4, sheet);
+    CHECK_NUMBER(book.eval("='My Sheet'!$A$1*2"), 8);
+
+    auto compiled = book.evaluator().compileFormula("=Missing!A1+1");
+    CHECK(compiled->errors.size() == 1);
+    CHECK(compiled->errors.size() == 1 && compiled->errors[0].compare(0, 13, "unknown sheet") == 0);
+    CHECK_ERROR(book.eval("=Missing!A1+1"), ErrorCode::Ref);
+    CHECK_ERROR(book.eval("=A1048577"), ErrorCode::Ref);
+    CHECK_ERROR(book.eval("=NOSUCH(1)"), ErrorCode::Name);
+}
@@ -0,0 +1,103 @@
+#include "stdafx.h"
+#include <fstream>
+#include "testing.h"
+
+namespace {
+
+void fillBook(TestBook& book) {
+    int other = book.addSheet("Other");
+    for (int row = 1; row <= 10; ++row) {
+        book.number("A" + std::to_string(row), row);
+        book.formula("B" + std::to_string(row), L"A" + std::to_wstring(row) + L"*2+SUM($A$1:$A$10)");
+    }
+    book.text("C1", L"label");
+    book.formula("C2", L"C1");
+    book.formula("C3", L"MAX(A1:A10)/SUM($A$1:$A$10)");
+    book.formula("A1", L"Sheet1!B10+1", other);
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::string& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+}
+
+}
+
+// A cache written for a workbook gives a fresh evaluator of the same
+// content its formulas, dependencies and results without parsing
+TEST_CASE(compiledCacheRoundTrips) {
+    std::string path = testDirectory() + "/roundTrip.xlfc";
+    {
+        TestBook book;
+        fillBook(book);
+        CHECK_NUMBER(book.eval("=Other!A1"), 76);
+        CHECK(book.evaluator().saveCompiledCache(path));
+    }
+
+    TestBook book;
+    fillBook(book);
+    CHECK(book.evaluator().loadCompiledCache(path));
+    CHECK_NUMBER(book.eval("=B3"), 61);
+    CHECK_NUMBER(book.eval("=Other!A1"), 76);
+    CHECK(book.evaluator().valueText(book.eval("=C2")) == "label");
+    CHECK_NUMBER(book.eval("=C3"), 10.0 / 55);
+
+    // Only the four queries above were parsed
+    FormulaCacheStats stats = book.evaluator().formulaCacheStats();
+    CHECK(stats.misses == 4);
+    CHECK(stats.loaded > 0);
+
+    // Loaded dependencies still carry changes to every dependent
+    CHECK(book.evaluator().setValue("Sheet1", 0, 0, 12));
+    book.evaluator().recalculate();
+    CHECK_NUMBER(book.eval("=B3"), 72);
+    CHECK_NUMBER(book.eval("=Other!A1"), 87);
+    CHECK_NUMBER(book.eval("=C3"), 12.0 / 66);
+}
+
+// Missing, damaged, truncated or foreign cache files are turned down and
+// leave the evaluator working as if none had been given
+TEST_CASE(compiledCacheRejectsUnusableFiles) {
+    std::string path = testDirectory() + "/rejected.xlfc";
+    {
+        TestBook book;
+        fillBook(book);
+        book.eval("=Other!A1");
+        CHECK(book.evaluator().saveCompiledCache(path));
+    }
+    std::string good = readFile(path);
+    CHECK(good.size() > 64);
+
+    TestBook changed;
+    fillBook(changed);
+    changed.number("A5", 50);
+    CHECK(!changed.evaluator().loadCompiledCache(path));
+    CHECK_NUMBER(changed.eval("=B5"), 200);
+
+    TestBook book;
+    fillBook(book);
+    CHECK(!book.evaluator().loadCompiledCache(testDirectory() + "/missing.xlfc"));
+
+    std::string damaged = good;
+    damaged[damaged.size() - 5] ^= 0x40;
+    writeFile(path, damaged);
+    CHECK(!book.evaluator().loadCompiledCache(path));
+
+    writeFile(path, good.substr(0, good.size() / 2));
+    CHECK(!book.evaluator().loadCompiledCache(path));
+
+    writeFile(path, std::string());
+    CHECK(!book.evaluator().loadCompiledCache(path));
+
+    CHECK_NUMBER(book.eval("=B3"), 61);
+    CHECK_NUMBER(book.eval("=Other!A1"), 76);
+
+    writeFile(path, good);
+    CHECK(book.evaluator().loadCompiledCache(path));
+    CHECK_NUMBER(book.eval("=Other!A1"), 76);
+}
@@ -0,0 +1,34 @@
+#include "stdafx.h"
+#include <sstream>
+#include "testing.h"
+
+// Only finite decimal fields load as numbers; nan and inf would collide
+// with the NaN-boxed errors, and hex or padded fields stay text as well
+TEST_CASE(csvLoadsOnlyDecimalNumbers) {
+    TestBook book;
+    std::istringstream csv("1,2.5,-3,1e2\n"
+                           "nan,inf,0x10, 5\n"
+                           "\"7\",TRUE,#DIV/0!,-inf\n");
+    CHECK(book.source.loadCsv("Sheet1", csv) == 0);
+
+    for (EvaluationBackend backend : BACKENDS) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        CHECK_NUMBER(book.eval("=SUM(A1:D1)"), 100.5);
+        CHECK_NUMBER(book.eval("=SUM(A2:D2)"), 0);
+        CHECK_NUMBER(book.eval("=A1+D1"), 101);
+    }
+
+    book.evaluator().setBackend(EvaluationBackend::Bytecode);
+    CHECK_NUMBER(book.eval("=COUNT(A1:D3)"), 4);
+    CHECK_NUMBER(book.eval("=COUNTA(A2:D3)"), 8);
+    const char* texts[] = { "=A2", "=B2", "=C2", "=D2", "=A3", "=D3" };
+    const char* expected[] = { "nan", "inf", "0x10", " 5", "7", "-inf" };
+    for (size_t i = 0; i < 6; ++i) {
+        Value value = book.eval(texts[i]);
+        CHECK(value.type() == ValueType::String);
+        CHECK(book.evaluator().valueText(value) == expected[i]);
+    }
+    CHECK_BOOLEAN(book.eval("=B3"), true);
+    CHECK_ERROR(book.eval("=C3"), ErrorCode::Div0);
+}
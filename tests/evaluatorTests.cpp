@@ -0,0 +1,250 @@
+#include "stdafx.h"
+#include "testing.h"
+
+// Cell results are computed once and served from the result cache after
+TEST_CASE(resultCacheServesRepeatedCells) {
+    TestBook book;
+    book.number("A1", 2);
+    book.formula("B1", L"A1*3");
+    book.formula("C1", L"B1+B1");
+    CHECK_NUMBER(book.eval("=C1"), 12);
+
+    book.evaluator().resetCacheStats();
+    CHECK_NUMBER(book.eval("=C1+B1"), 18);
+    CacheStats stats = book.evaluator().cacheStats();
+    CHECK(stats.hits >= 2);
+    CHECK(stats.misses == 0);
+}
+
+// Copies of one formula are parsed once, whatever cell they are in
+TEST_CASE(formulaCacheSharesText) {
+    TestBook book;
+    book.number("A1", 1);
+    book.formula("B1", L"SUM($A$1:$A$1)");
+    book.formula("B2", L"SUM($A$1:$A$1)");
+    book.formula("B3", L"sum( $A$1:$A$1 )");
+    CHECK_NUMBER(book.eval("=B1+B2+B3"), 3);
+    FormulaCacheStats stats = book.evaluator().formulaCacheStats();
+    CHECK(stats.misses <= 2);
+    CHECK(stats.textHits + stats.derived >= 2);
+}
+
+// A formula cell evaluated again is found through the cell index, and an
+// evicted formula is parsed again rather than answered with another one
+TEST_CASE(formulaCacheEvictsByLimit) {
+    TestBook book;
+    for (int row = 1; row <= 20; ++row) {
+        book.number("A" + std::to_string(row), row);
+        book.formula("B" + std::to_string(row), L"A" + std::to_wstring(row) + L"*" + std::to_wstring(row));
+    }
+    book.evaluator().setFormulaCacheLimits(1, 1024);
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int row = 1; row <= 20; ++row) {
+            CHECK_NUMBER(book.eval("=B" + std::to_string(row)), (double)row * row);
+        }
+        book.evaluator().invalidateAll();
+    }
+    FormulaCacheStats stats = book.evaluator().formulaCacheStats();
+    CHECK(stats.entries == 1);
+    CHECK(stats.evictions > 0);
+
+    book.evaluator().setFormulaCacheLimits(1 << 20, 1024);
+    CHECK_NUMBER(book.eval("=B1"), 1);
+    book.evaluator().invalidateCell("Sheet1", 0, 0);
+    size_t cellHits = book.evaluator().formulaCacheStats().cellHits;
+    CHECK_NUMBER(book.eval("=B1"), 1);
+    CHECK(book.evaluator().formulaCacheStats().cellHits > cellHits);
+}
+
+// Invalidating a changed cell also drops what was computed from it
+TEST_CASE(invalidateCellReachesDependents) {
+    TestBook book;
+    book.number("A1", 1);
+    book.formula("B1", L"A1*2");
+    book.formula("C1", L"B1+1");
+    CHECK_NUMBER(book.eval("=C1"), 3);
+
+    book.number("A1", 10);
+    book.evaluator().invalidateCell("Sheet1", 0, 0);
+    CHECK_NUMBER(book.eval("=C1"), 21);
+    CHECK_NUMBER(book.eval("=B1"), 20);
+}
+
+TEST_CASE(invalidateSheetReachesOtherSheets) {
+    TestBook book;
+    int other = book.addSheet("Other");
+    book.number("A1", 1);
+    book.formula("A1", L"Sheet1!A1*2", other);
+    book.formula("B1", L"A1+1", other);
+    book.formula("B1", L"Other!B1*10");
+    CHECK_NUMBER(book.eval("=B1"), 30);
+
+    book.number("A1", 10);
+    book.evaluator().invalidateSheet("Sheet1");
+    CHECK_NUMBER(book.eval("=Other!B1"), 21);
+    CHECK_NUMBER(book.eval("=B1"), 210);
+}
+
+// setValue dirties only the cells depending on the changed one and turns
+// down cells the sheet or the snapshot cannot hold
+TEST_CASE(setValueDirtiesDependents) {
+    TestBook book;
+    book.number("A1", 1);
+    book.number("A2", 2);
+    book.formula("B1", L"A1*2");
+    book.formula("C1", L"B1+SUM(A1:A3)");
+    book.formula("B2", L"A2+1");
+    CHECK_NUMBER(book.eval("=C1"), 5);
+
+    TreeFormulaEvaluator& evaluator = book.evaluator();
+    CHECK(evaluator.setValue("Sheet1", 0, 0, 10));
+    CHECK(evaluator.dirtyCount() == 2);
+    CHECK(evaluator.recalculate() == 2);
+    CHECK_NUMBER(book.eval("=C1"), 32);
+    CHECK_NUMBER(book.eval("=B2"), 3);
+
+    // A3 lies outside the used area, which grows to hold it
+    CHECK(evaluator.setValue("Sheet1", 2, 0, 100));
+    CHECK(evaluator.recalculate() == 1);
+    CHECK_NUMBER(book.eval("=C1"), 132);
+
+    CHECK(!evaluator.setValue("Missing", 0, 0, 1));
+    CHECK(!evaluator.setValue("Sheet1", -1, 0, 1));
+    CHECK(!evaluator.setValue("Sheet1", MAX_SHEET_ROWS, 0, 1));
+    CHECK(!evaluator.setValue("Sheet1", 0, MAX_SHEET_COLS, 1));
+    CHECK(!evaluator.setValue("Sheet1", MAX_SHEET_ROWS - 1, MAX_SHEET_COLS - 1, 1));
+    CHECK(evaluator.dirtyCount() == 0);
+    CHECK_NUMBER(book.eval("=C1"), 132);
+}
+
+// An error cell inside a range is the result of every aggregate but COUNT
+// and COUNTA, whether the error is computed or stored
+TEST_CASE(errorCellsInRangesPropagate) {
+    TestBook book;
+    book.number("A1", 1);
+    book.formula("A2", L"1/0");
+    book.number("A3", 3);
+    book.number("B1", 1);
+    book.number("B2", 2);
+    book.number("B3", 3);
+    book.source.setError(0, 2, 2, ErrorCode::NA);   // C3
+    book.number("C1", 5);
+    for (EvaluationBackend backend : { EvaluationBackend::Bytecode, EvaluationBackend::Exprtk }) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        CHECK_ERROR(book.eval("=SUM(A1:A3)"), ErrorCode::Div0);
+        CHECK_ERROR(book.eval("=AVERAGE(A1:A3)"), ErrorCode::Div0);
+        CHECK_ERROR(book.eval("=MIN(A1:A3)"), ErrorCode::Div0);
+        CHECK_ERROR(book.eval("=MAX(A1:B3)"), ErrorCode::Div0);
+        CHECK_ERROR(book.eval("=SUMPRODUCT(A1:A3,B1:B3)"), ErrorCode::Div0);
+        CHECK_ERROR(book.eval("=SUMPRODUCT(B1:B3,C1:C3)"), ErrorCode::NA);
+        CHECK_ERROR(book.eval("=SUM(C1:C3)"), ErrorCode::NA);
+        CHECK_NUMBER(book.eval("=COUNT(A1:A3)"), 2);
+        CHECK_NUMBER(book.eval("=COUNTA(A1:A3)"), 3);
+        CHECK_NUMBER(book.eval("=COUNT(C1:C3)"), 1);
+        CHECK_NUMBER(book.eval("=COUNTA(A1:C3)"), 8);
+        CHECK_NUMBER(book.eval("=SUM(B1:B3)"), 6);
+    }
+}
+
+// The tree walker computes in doubles but keeps the error code in the NaN
+// payload, so its errors are the same as the compiled backends
+TEST_CASE(treeWalkerKeepsErrorCodes) {
+    TestBook book;
+    book.number("A1", 4);
+    book.source.setError(0, 1, 0, ErrorCode::Ref);    // A2
+    book.number("A3", 1);
+    book.formula("B1", L"A1/0");
+    book.formula("B2", L"B1+1");
+    book.text("C1", L"text");
+    for (EvaluationBackend backend : BACKENDS) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        CHECK_ERROR(book.eval("=A1/(A3-1)"), ErrorCode::Div0);
+        CHECK_ERROR(book.eval("=B2*2"), ErrorCode::Div0);
+        CHECK_ERROR(book.eval("=SUM(A1:A3)"), ErrorCode::Ref);
+        CHECK_ERROR(book.eval("=A2/0"), ErrorCode::Ref);
+        CHECK_ERROR(book.eval("=C1+1"), ErrorCode::Value);
+        CHECK_NUMBER(book.eval("=SUM(A1,A3)/2"), 2.5);
+    }
+    book.evaluator().setBackend(EvaluationBackend::Bytecode);
+}
+
+// Blocks holding an error are never tabled, however often they are summed
+TEST_CASE(errorCellsKeepAreaTablesOut) {
+    TestBook book;
+    for (int row = 1; row <= 40; ++row) {
+        for (char col = 'A'; col <= 'J'; ++col) book.number(std::string(1, col) + std::to_string(row), 1);
+    }
+    book.source.setError(0, 20, 4, ErrorCode::Value);    // E21
+    for (int i = 0; i < 10; ++i) {
+        CHECK_ERROR(book.eval("=SUM(A1:J40)"), ErrorCode::Value);
+        CHECK_NUMBER(book.eval("=COUNT(A1:J40)"), 399);
+    }
+    CHECK(book.evaluator().areaTableStats().tables == 0);
+    CHECK_NUMBER(book.eval("=SUM(A1:J20)"), 200);
+}
+
+// Small values next to a large one keep their exact totals when answered
+// from a table, and the debug check finds nothing to correct
+TEST_CASE(areaTablesKeepSmallValuesExact) {
+    TestBook book;
+    for (int row = 1; row <= 40; ++row) {
+        for (char col = 'A'; col <= 'J'; ++col) book.number(std::string(1, col) + std::to_string(row), 1);
+    }
+    book.number("A1", 1e17);
+    book.evaluator().setAreaTableCheck(true);
+    for (int row = 30; row <= 40; ++row) book.eval("=SUM(A1:J" + std::to_string(row) + ")");
+    CHECK(book.evaluator().areaTableStats().tables > 0);
+
+    CHECK_NEAR(book.eval("=SUM(B2:B5)"), 4, 0);
+    CHECK_NEAR(book.eval("=SUM(B1:J40)"), 360, 0);
+    CHECK_NEAR(book.eval("=SUM(A2:J40)"), 390, 0);
+    CHECK(book.evaluator().setValue("Sheet1", 2, 2, 0.5));    // C3
+    CHECK_NEAR(book.eval("=SUM(B2:D4)"), 8.5, 0);
+    CHECK(book.evaluator().areaTableStats().hits >= 4);
+    CHECK(book.evaluator().areaTableStats().checkFailures == 0);
+}
+
+// Batch results stay with their own formula when the formula cache evicts
+// entries mid-batch, and failed queries own no values
+TEST_CASE(batchKeepsResultsPerQuery) {
+    TestBook book;
+    book.number("A1", 2);
+    book.number("A2", 3);
+    book.number("B1", 5);
+    // A byte budget this small keeps only the latest formula
+    book.evaluator().setFormulaCacheLimits(1, 1024);
+
+    std::vector<BatchQuery> queries;
+    for (int i = 1; i <= 20; ++i) queries.push_back({ BatchQuery::FORMULA, "=A1*" + std::to_string(i) });
+    queries.push_back({ BatchQuery::FORMULA, "=Missing!A1+1" });
+    queries.push_back({ BatchQuery::FORMULA, "=1+" });
+    queries.push_back({ BatchQuery::CELLS, "A1:B2" });
+    queries.push_back({ BatchQuery::FORMULA, "= a1 * 3" });
+
+    for (EvaluationBackend backend : BACKENDS) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        BatchResults results;
+        book.evaluator().evaluateBatch(queries, results);
+        CHECK(results.offsets.size() == queries.size() + 1);
+        for (int i = 0; i < 20; ++i) {
+            CHECK(results.errors[i].empty());
+            CHECK(results.offsets[i + 1] - results.offsets[i] == 1);
+            CHECK_NUMBER(results.values[results.offsets[i]], 2.0 * (i + 1));
+        }
+        CHECK(!results.errors[20].empty());
+        CHECK(results.offsets[21] == results.offsets[20]);
+        CHECK(!results.errors[21].empty());
+        CHECK(results.offsets[22] == results.offsets[21]);
+
+        CHECK(results.offsets[23] - results.offsets[22] == 4);
+        CHECK_NUMBER(results.values[results.offsets[22] + 1], 5);
+        CHECK(results.cells[results.offsets[22] + 2].row == 1);
+        CHECK_NUMBER(results.values[results.offsets[23]], 6);
+        CHECK(results.values.size() == results.cells.size());
+    }
+    CHECK(book.evaluator().formulaCacheStats().evictions > 0);
+    book.evaluator().setBackend(EvaluationBackend::Bytecode);
+}
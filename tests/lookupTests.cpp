@@ -0,0 +1,72 @@
+#include "stdafx.h"
+#include "testing.h"
+
+namespace {
+
+// A1:A20 = 2, 4, ..., 40 and B1:B20 = 1, 2, ..., 20
+void fillTable(TestBook& book) {
+    for (int row = 1; row <= 20; ++row) {
+        book.number("A" + std::to_string(row), row * 2.0);
+        book.number("B" + std::to_string(row), row);
+    }
+}
+
+}
+
+// TRUE and FALSE are constants, not references to a column named TRUE
+TEST_CASE(booleanLiterals) {
+    TestBook book;
+    fillTable(book);
+    book.formula("C1", L"VLOOKUP(5,A1:B20,2,false)");
+    for (EvaluationBackend backend : { EvaluationBackend::Bytecode, EvaluationBackend::Exprtk }) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        CHECK_NUMBER(book.eval("=VLOOKUP(4,A1:A20,1,FALSE)"), 4);
+        CHECK_ERROR(book.eval("=VLOOKUP(5,A1:A20,1,FALSE)"), ErrorCode::NA);
+        CHECK_NUMBER(book.eval("=VLOOKUP(5,A1:B20,2,TRUE)"), 2);
+        CHECK_ERROR(book.eval("=C1"), ErrorCode::NA);
+        CHECK_NUMBER(book.eval("=TRUE+1"), 2);
+        CHECK_NUMBER(book.eval("=SUM(true,FALSE,3)"), 4);
+    }
+    book.evaluator().setBackend(EvaluationBackend::Bytecode);
+    CHECK_BOOLEAN(book.eval("=TRUE"), true);
+    CHECK_BOOLEAN(book.eval("=False"), false);
+    CHECK_NUMBER(book.eval("=-TRUE"), -1);
+
+    book.evaluator().setBackend(EvaluationBackend::TreeWalker);
+    CHECK_NUMBER(book.eval("=TRUE+1"), 2);
+    CHECK_NUMBER(book.eval("=FALSE*2+1"), 1);
+}
+
+// Repeated lookups into one line share a cached index, which a changed
+// cell in the line drops so the next lookup sees the new value.
+// invalidateAll reloads the source, undoing setValue for the next backend.
+TEST_CASE(lookupIndexesFollowChanges) {
+    TestBook book;
+    fillTable(book);
+    book.text("C1", L"Apple");
+    book.text("C2", L"pear");
+    book.text("C3", L"Plum");
+    book.text("D1", L"PEAR");
+    for (EvaluationBackend backend : { EvaluationBackend::Bytecode, EvaluationBackend::Exprtk }) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        size_t builds = book.evaluator().lookupStats().builds;
+        for (int key = 1; key <= 20; ++key) {
+            CHECK_NUMBER(book.eval("=MATCH(" + std::to_string(key * 2) + ",A1:A20,0)"), key);
+        }
+        CHECK(book.evaluator().lookupStats().builds - builds <= 2);
+        CHECK_NUMBER(book.eval("=MATCH(15,A1:A20,1)"), 7);
+        CHECK_ERROR(book.eval("=MATCH(1,A1:A20,1)"), ErrorCode::NA);
+        CHECK_NUMBER(book.eval("=XLOOKUP(40,A1:A20,B1:B20)"), 20);
+
+        CHECK(book.evaluator().setValue("Sheet1", 4, 0, 99));    // A5
+        CHECK_NUMBER(book.eval("=XLOOKUP(99,A1:A20,B1:B20)"), 5);
+        CHECK_ERROR(book.eval("=MATCH(10,A1:A20,0)"), ErrorCode::NA);
+        CHECK(book.evaluator().lookupStats().invalidations > 0);
+    }
+
+    // exprtk reads text cells as #VALUE!, so text keys are the VM's alone
+    book.evaluator().setBackend(EvaluationBackend::Bytecode);
+    CHECK_NUMBER(book.eval("=MATCH(D1,C1:C3,0)"), 2);
+}
@@ -0,0 +1,122 @@
+#include "stdafx.h"
+#include "testing.h"
+
+namespace {
+
+// What the optimizer did while compiling formula, and its result
+struct Optimized {
+    Value value;
+    OptimizerStats stats;
+};
+
+Optimized optimize(TestBook& book, const std::string& formula) {
+    OptimizerStats before = book.evaluator().getOptimizerStats();
+    Value value = book.eval(formula);
+    OptimizerStats after = book.evaluator().getOptimizerStats();
+    OptimizerStats stats;
+    stats.folded = after.folded - before.folded;
+    stats.simplified = after.simplified - before.simplified;
+    stats.flattened = after.flattened - before.flattened;
+    stats.checkFailures = after.checkFailures - before.checkFailures;
+    return Optimized{ value, stats };
+}
+
+void fillOptimizerBook(TestBook& book) {
+    book.number("A1", 2);
+    book.number("A2", 3);
+    book.number("A3", 4);
+    book.number("A4", 5);
+    book.text("B1", L"text");
+}
+
+}
+
+// Operators on constants fold, down to one constant for a whole tree
+TEST_CASE(optimizerFoldsConstants) {
+    TestBook book;
+    fillOptimizerBook(book);
+    book.evaluator().setOptimizerCheck(true);
+
+    Optimized result = optimize(book, "=2*3+4");
+    CHECK_NUMBER(result.value, 10);
+    CHECK(result.stats.folded == 2);
+
+    result = optimize(book, "=A1*(10-4)");
+    CHECK_NUMBER(result.value, 12);
+    CHECK(result.stats.folded == 1);
+    CHECK(result.stats.checkFailures == 0);
+}
+
+// x/0 is left for the VM, which gives #DIV/0!; what feeds it still folds
+TEST_CASE(optimizerKeepsDivisionByZero) {
+    TestBook book;
+    fillOptimizerBook(book);
+    book.evaluator().setOptimizerCheck(true);
+
+    Optimized result = optimize(book, "=1/0");
+    CHECK_ERROR(result.value, ErrorCode::Div0);
+    CHECK(result.stats.folded == 0);
+
+    result = optimize(book, "=4/(2-2)");
+    CHECK_ERROR(result.value, ErrorCode::Div0);
+    CHECK(result.stats.folded == 1);
+    CHECK(result.stats.checkFailures == 0);
+}
+
+// x+0 and x*1 reduce to x where x is a number anyway; a cell may hold text,
+// which the operator turns into #VALUE!, so it keeps its operator
+TEST_CASE(optimizerRemovesIdentities) {
+    TestBook book;
+    fillOptimizerBook(book);
+    book.evaluator().setOptimizerCheck(true);
+
+    Optimized result = optimize(book, "=(A1-A2)+0");
+    CHECK_NUMBER(result.value, -1);
+    CHECK(result.stats.simplified == 1);
+
+    result = optimize(book, "=1*(A1-A2)");
+    CHECK_NUMBER(result.value, -1);
+    CHECK(result.stats.simplified == 1);
+
+    result = optimize(book, "=(A1-A2)/1");
+    CHECK_NUMBER(result.value, -1);
+    CHECK(result.stats.simplified == 1);
+
+    result = optimize(book, "=A1*1");
+    CHECK_NUMBER(result.value, 2);
+    CHECK(result.stats.simplified == 0);
+
+    result = optimize(book, "=B1*1");
+    CHECK_ERROR(result.value, ErrorCode::Value);
+    CHECK(result.stats.simplified == 0);
+
+    result = optimize(book, "=B1+0");
+    CHECK_ERROR(result.value, ErrorCode::Value);
+    CHECK(result.stats.simplified == 0);
+    CHECK(result.stats.checkFailures == 0);
+}
+
+// Left-nested chains of + or * become one n-ary node; - and mixed
+// operators stay binary
+TEST_CASE(optimizerFlattensChains) {
+    TestBook book;
+    fillOptimizerBook(book);
+    book.evaluator().setOptimizerCheck(true);
+
+    Optimized result = optimize(book, "=A1+A2+A3+A4");
+    CHECK_NUMBER(result.value, 14);
+    CHECK(result.stats.flattened == 2);
+
+    result = optimize(book, "=A1*A2*A3*A4");
+    CHECK_NUMBER(result.value, 120);
+    CHECK(result.stats.flattened == 2);
+
+    result = optimize(book, "=A1+A2*A3+A4");
+    CHECK_NUMBER(result.value, 19);
+    CHECK(result.stats.flattened == 1);
+
+    result = optimize(book, "=A1-A2-A3");
+    CHECK_NUMBER(result.value, -5);
+    CHECK(result.stats.flattened == 0);
+    CHECK(result.stats.checkFailures == 0);
+}
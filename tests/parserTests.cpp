@@ -0,0 +1,89 @@
+#include "stdafx.h"
+#include "testing.h"
+
+// A sign after an operator applies to the next operand only
+TEST_CASE(unaryMinusAfterOperator) {
+    TestBook book;
+    book.number("A2", 2);
+    book.number("A3", 3);
+    for (EvaluationBackend backend : BACKENDS) {
+        book.evaluator().setBackend(backend);
+        CHECK_NUMBER(book.eval("=A2*-1"), -2);
+        CHECK_NUMBER(book.eval("=(1+2)*-A3"), -9);
+        CHECK_NUMBER(book.eval("=2*-3"), -6);
+        CHECK_NUMBER(book.eval("=-2*3"), -6);
+        CHECK_NUMBER(book.eval("=10/-2/-5"), 1);
+        CHECK_NUMBER(book.eval("=1--1"), 2);
+        CHECK_NUMBER(book.eval("=-(A2+A3)"), -5);
+        CHECK_NUMBER(book.eval("=2*+3"), 6);
+    }
+}
+
+TEST_CASE(unaryMinusInFunctionArguments) {
+    TestBook book;
+    book.number("A1", 4);
+    CHECK_NUMBER(book.eval("=SUM(-A1,2)"), -2);
+    CHECK_NUMBER(book.eval("=MAX(-1,-A1*-2)"), 8);
+}
+
+// Missing operands are parse errors, not an implicit 0
+TEST_CASE(missingOperandIsParseError) {
+    TestBook book;
+    book.number("A1", 1);
+    book.formula("B1", L"A1+");
+    for (EvaluationBackend backend : BACKENDS) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        CHECK_ERROR(book.eval("=A1+"), ErrorCode::Name);
+        CHECK_ERROR(book.eval("=*2"), ErrorCode::Name);
+        CHECK_ERROR(book.eval("=(A1*)"), ErrorCode::Name);
+        CHECK_ERROR(book.eval("=A1 2"), ErrorCode::Name);
+        CHECK_ERROR(book.eval("=B1"), ErrorCode::Name);
+    }
+    book.evaluator().setBackend(EvaluationBackend::Bytecode);
+    book.evaluator().invalidateAll();
+    CHECK_ERROR(book.eval("=B1"), ErrorCode::Name);
+    CHECK(!book.evaluator().compileFormula("=A1-")->parsed);
+    CHECK(book.evaluator().compileFormula("=-A1")->parsed);
+}
+
+// Digits and points that do not read as one number fail the parse rather
+// than keep what reads; so does a literal longer than the lexer keeps
+TEST_CASE(malformedNumberIsParseError) {
+    std::string longLiteral = "=" + std::string(260, '1');
+    for (EvaluationBackend backend : BACKENDS) {
+        TestBook book;
+        book.formula("A1", L"SUM(1..2,3)");
+        book.evaluator().setBackend(backend);
+        CHECK_ERROR(book.eval("=1..2"), ErrorCode::Name);
+        CHECK_ERROR(book.eval("=1.5.5"), ErrorCode::Name);
+        CHECK_ERROR(book.eval("=."), ErrorCode::Name);
+        CHECK_ERROR(book.eval("=.."), ErrorCode::Name);
+        CHECK_ERROR(book.eval("=2*1..2"), ErrorCode::Name);
+        CHECK_ERROR(book.eval("=A1"), ErrorCode::Name);
+        CHECK_ERROR(book.eval(longLiteral), ErrorCode::Name);
+        CHECK_NUMBER(book.eval("=.5+1."), 1.5);
+        CHECK_NUMBER(book.eval("=" + std::string(255, '1')), std::stod(std::string(255, '1')));
+        CHECK_NUMBER(book.eval("=" + std::string(250, '0') + "12"), 12);
+    }
+}
+
+// Sheet names outside ASCII bind from wide cell text and UTF-8 formula text;
+// the tree walker predates quoted sheet names and is left out
+TEST_CASE(nonAsciiSheetNames) {
+    TestBook book;
+    int first = book.addSheet("Donn\xC3\xA9" "es");      // U+00E9
+    int second = book.addSheet("Donn\xC7\xA9" "es");     // U+01E9, same low byte
+    book.number("A1", 1, first);
+    book.number("A1", 10, second);
+    book.formula("B1", L"'Données'!A1+1");
+    book.formula("B2", L"'Donnǩes'!A1+1");
+    for (EvaluationBackend backend : { EvaluationBackend::Bytecode, EvaluationBackend::Exprtk }) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        CHECK_NUMBER(book.eval("=B1"), 2);
+        CHECK_NUMBER(book.eval("=B2"), 11);
+        CHECK_NUMBER(book.eval("='Donn\xC3\xA9" "es'!A1+1"), 2);
+        CHECK_NUMBER(book.eval("=SUM('Donn\xC7\xA9" "es'!A1:A2)"), 10);
+    }
+}
@@ -0,0 +1,113 @@
+#include "stdafx.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include "memoryCellSource.h"
+#include "testing.h"
+#include "workbookPipeline.h"
+
+namespace {
+
+const size_t JOBS = 24;
+
+// "book7" opens as A1 = 7 and B1 = A1*2+SUM(A1:A2) with A2 = 1; anything
+// else fails to open
+std::unique_ptr<CellSource> openTestBook(const std::string& path, std::string& error) {
+    if (path.compare(0, 4, "book") != 0) {
+        error = "no such book";
+        return nullptr;
+    }
+    auto source = std::make_unique<MemoryCellSource>();
+    int sheet = source->addSheet("Sheet1");
+    source->setNumber(sheet, 0, 0, std::stod(path.substr(4)));
+    source->setNumber(sheet, 1, 0, 1);
+    source->setFormula(sheet, 0, 1, L"A1*2+SUM(A1:A2)");
+    return source;
+}
+
+std::vector<WorkbookJob> makeJobs() {
+    std::vector<WorkbookJob> jobs;
+    for (size_t i = 0; i < JOBS; ++i) {
+        WorkbookJob job;
+        job.path = (i == 5) ? "missing" : "book" + std::to_string(i);
+        job.queries.push_back({ BatchQuery::CELLS, "B1" });
+        job.queries.push_back({ BatchQuery::FORMULA, "=B1+A2" });
+        jobs.push_back(std::move(job));
+    }
+    return jobs;
+}
+
+}
+
+// Every job is emitted exactly once with its own results, whatever the
+// number of workers, and a failed load is reported rather than dropped
+TEST_CASE(pipelineEmitsEveryJobOnce) {
+    std::vector<WorkbookJob> jobs = makeJobs();
+    for (size_t workers : { 1, 3 }) {
+        PipelineOptions options;
+        options.loadWorkers = workers;
+        options.compileWorkers = workers;
+        options.evaluateWorkers = workers;
+        options.queueCapacity = 2;
+        options.recalculate = workers > 1;
+        WorkbookPipeline pipeline(options);
+        pipeline.setOpener(openTestBook);
+
+        std::mutex mutex;
+        std::vector<int> emitted(JOBS, 0);
+        size_t wrong = 0;
+        PipelineStats stats = pipeline.run(jobs, [&](WorkbookResult& result) {
+            std::lock_guard<std::mutex> lock(mutex);
+            emitted[result.index]++;
+            if (result.job != &jobs[result.index]) wrong++;
+            if (result.index == 5) {
+                if (result.error.empty() || result.evaluator) wrong++;
+                return;
+            }
+
+            double a1 = (double)result.index;
+            const BatchResults& values = result.results;
+            if (!result.error.empty() || !result.evaluator || values.offsets.size() != 3 ||
+                values.values.size() != 2) {
+                wrong++;
+                return;
+            }
+            if (values.values[0] != Value::number(3 * a1 + 1)) wrong++;
+            if (values.values[1] != Value::number(3 * a1 + 2)) wrong++;
+        });
+
+        for (size_t i = 0; i < JOBS; ++i) CHECK(emitted[i] == 1);
+        CHECK(wrong == 0);
+        CHECK(stats.workbooks == JOBS);
+        CHECK(stats.failed == 1);
+    }
+}
+
+// A memory budget smaller than one workbook still lets each run, alone
+TEST_CASE(pipelineRunsUnderTightBudget) {
+    std::vector<WorkbookJob> jobs = makeJobs();
+    PipelineOptions options;
+    options.loadWorkers = 2;
+    options.evaluateWorkers = 2;
+    options.memoryBudget = 1;
+    WorkbookPipeline pipeline(options);
+    pipeline.setOpener(openTestBook);
+
+    std::atomic<size_t> done{ 0 };
+    PipelineStats stats = pipeline.run(jobs, [&](WorkbookResult& result) {
+        if (result.error.empty()) done++;
+    });
+    CHECK(done == JOBS - 1);
+    CHECK(stats.failed == 1);
+
+    MemoryBudget budget(100);
+    budget.acquire(60);
+    size_t reserved = 60;
+    budget.adjust(reserved, 150);
+    CHECK(reserved == 150);
+    CHECK(budget.peak() == 150);
+    budget.release(reserved);
+    budget.acquire(100);
+    budget.release(100);
+    CHECK(budget.peak() == 150);
+}
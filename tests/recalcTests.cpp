@@ -0,0 +1,110 @@
+#include "stdafx.h"
+#include "testing.h"
+
+namespace {
+
+const int CHAIN_ROWS = 200;
+
+// A1:A200 = 1..200, B = A*2, C a running total of B, D1 their sum. The B
+// column is one wide level, the C column one long chain.
+void fillChain(TestBook& book) {
+    for (int row = 1; row <= CHAIN_ROWS; ++row) {
+        std::wstring r = std::to_wstring(row);
+        book.number("A" + std::to_string(row), row);
+        book.formula("B" + std::to_string(row), L"A" + r + L"*2");
+        book.formula("C" + std::to_string(row), row == 1 ? L"B1" : L"B" + r + L"+C" + std::to_wstring(row - 1));
+    }
+    book.formula("D1", L"SUM(C1:C200)");
+}
+
+}
+
+// Whole-book recalculation gives the same results on one thread and many
+TEST_CASE(parallelRecalculationMatchesSerial) {
+    const double total = (double)CHAIN_ROWS * (CHAIN_ROWS + 1) * (CHAIN_ROWS + 2) / 3;
+    for (size_t threads : { 1, 4, 0 }) {
+        TestBook book;
+        fillChain(book);
+        CHECK(book.evaluator().recalculateAll(threads) == 2 * CHAIN_ROWS + 1);
+        CHECK_NUMBER(book.eval("=C1"), 2);
+        CHECK_NUMBER(book.eval("=C200"), 200.0 * 201);
+        CHECK_NUMBER(book.eval("=D1"), total);
+
+        // A1 + 10 adds 20 to every running total
+        CHECK(book.evaluator().setValue("Sheet1", 0, 0, 11));
+        CHECK(book.evaluator().recalculateAll(threads) == 2 * CHAIN_ROWS + 1);
+        CHECK_NUMBER(book.eval("=C200"), 200.0 * 201 + 20);
+        CHECK_NUMBER(book.eval("=D1"), total + 20.0 * CHAIN_ROWS);
+        CHECK(book.evaluator().cycleCount() == 0);
+    }
+}
+
+// Errors reach every level above them, whichever thread computes them
+TEST_CASE(parallelRecalculationCarriesErrors) {
+    TestBook book;
+    fillChain(book);
+    book.formula("B100", L"1/0");
+    book.evaluator().recalculateAll(4);
+    CHECK_NUMBER(book.eval("=C99"), 99.0 * 100);
+    CHECK_ERROR(book.eval("=C100"), ErrorCode::Div0);
+    CHECK_ERROR(book.eval("=C200"), ErrorCode::Div0);
+    CHECK_ERROR(book.eval("=D1"), ErrorCode::Div0);
+    CHECK_NUMBER(book.eval("=B101"), 202);
+}
+
+// Circular references evaluate to 0 with iterative calculation off; on,
+// the default, a converging cycle settles within maxChange and a diverging
+// one stops after maxIterations sweeps
+TEST_CASE(cyclesIterateToConvergence) {
+    TestBook book;
+    book.formula("A1", L"B1/2+1");
+    book.formula("B1", L"A1");
+    book.formula("C1", L"A1*10");
+    book.formula("D1", L"D1+1");
+    book.number("E1", 3);
+    book.formula("F1", L"E1*2");
+
+    book.evaluator().setIterativeCalculation(false);
+    CHECK(book.evaluator().recalculateAll(2) == 5);
+    CHECK(book.evaluator().cycleCount() == 2);
+    CHECK_NUMBER(book.eval("=A1"), 0);
+    CHECK_NUMBER(book.eval("=C1"), 0);
+    CHECK_NUMBER(book.eval("=D1"), 0);
+    CHECK_NUMBER(book.eval("=F1"), 6);
+
+    book.evaluator().setIterativeCalculation(true, 5, 1e-9);
+    book.evaluator().recalculateAll(2);
+    CHECK_NUMBER(book.eval("=D1"), 5);
+
+    book.evaluator().setIterativeCalculation(true, 100, 1e-9);
+    book.evaluator().recalculateAll(2);
+    CHECK_NEAR(book.eval("=A1"), 2, 1e-8);
+    CHECK_NEAR(book.eval("=B1"), 2, 1e-8);
+    CHECK_NEAR(book.eval("=C1"), 20, 1e-7);
+    CHECK_NUMBER(book.eval("=D1"), 100);
+    CHECK_NUMBER(book.eval("=F1"), 6);
+}
+
+// A changed cell reaches exactly the ranges holding it, among many
+// overlapping windows and running totals over the same column
+TEST_CASE(rangeDependentsFollowOverlappingRanges) {
+    TestBook book;
+    for (int row = 1; row <= CHAIN_ROWS; ++row) {
+        std::wstring r = std::to_wstring(row);
+        book.number("A" + std::to_string(row), 1);
+        book.formula("B" + std::to_string(row), L"SUM(A" + r + L":A" + std::to_wstring(row + 9) + L")");
+        book.formula("C" + std::to_string(row), L"SUM($A$1:A" + r + L")");
+    }
+    book.evaluator().recalculateAll(1);
+    CHECK(book.evaluator().setValue("Sheet1", 49, 0, 11));
+    book.evaluator().recalculate();
+
+    size_t wrong = 0;
+    for (int row = 1; row <= CHAIN_ROWS; ++row) {
+        double window = std::min(10, CHAIN_ROWS - row + 1) + ((row <= 50 && row + 9 >= 50) ? 10 : 0);
+        double total = row + (row >= 50 ? 10 : 0);
+        if (book.eval("=B" + std::to_string(row)) != Value::number(window)) wrong++;
+        if (book.eval("=C" + std::to_string(row)) != Value::number(total)) wrong++;
+    }
+    CHECK(wrong == 0);
+}
@@ -0,0 +1,100 @@
+#include "stdafx.h"
+#include "testing.h"
+
+namespace {
+
+// A1 and A2 are the inputs; B1 and C1 depend on them, D1 does not
+void fillModel(TestBook& book) {
+    book.number("A1", 1);
+    book.number("A2", 2);
+    book.number("A3", 10);
+    book.formula("B1", L"A1*A2");
+    book.formula("C1", L"B1+SUM(A1:A3)");
+    book.formula("D1", L"A3*5");
+}
+
+}
+
+// Each scenario sees its own inputs, across more scenarios than one block
+// of lanes holds, and the workbook itself is left as it was
+TEST_CASE(scenariosEvaluateEachInputSet) {
+    const size_t SCENARIOS = 300;
+    TestBook book;
+    fillModel(book);
+    CHECK_NUMBER(book.eval("=C1"), 15);
+
+    ScenarioInputs inputs;
+    inputs.cells = { "Sheet1!A1", "A2" };
+    inputs.values.resize(2);
+    for (size_t s = 0; s < SCENARIOS; ++s) {
+        inputs.values[0].push_back((double)s);
+        inputs.values[1].push_back(s % 7 == 3 ? 0.0 : 2.0);
+    }
+    std::vector<std::string> outputs = { "C1", "=B1*2", "D1", "=A1/A2" };
+
+    for (EvaluationBackend backend : { EvaluationBackend::Bytecode, EvaluationBackend::Exprtk }) {
+        book.evaluator().setBackend(backend);
+        book.evaluator().invalidateAll();
+        std::vector<Value> results;
+        std::string error;
+        CHECK(book.evaluator().evaluateScenarios(inputs, outputs, results, error));
+        CHECK(error.empty());
+        CHECK(results.size() == SCENARIOS * outputs.size());
+        size_t wrong = 0;
+        for (size_t s = 0; s < SCENARIOS && results.size() == SCENARIOS * outputs.size(); ++s) {
+            double a1 = inputs.values[0][s];
+            double a2 = inputs.values[1][s];
+            const Value* row = &results[s * outputs.size()];
+            if (row[0] != Value::number(a1 * a2 + a1 + a2 + 10)) wrong++;
+            if (row[1] != Value::number(a1 * a2 * 2)) wrong++;
+            if (row[2] != Value::number(50)) wrong++;
+            if (a2 == 0.0 ? row[3] != Value::error(ErrorCode::Div0) : row[3] != Value::number(a1 / a2)) wrong++;
+        }
+        CHECK(wrong == 0);
+
+        CHECK_NUMBER(book.eval("=C1"), 15);
+        CHECK_NUMBER(book.eval("=A1"), 1);
+    }
+    book.evaluator().setBackend(EvaluationBackend::Bytecode);
+}
+
+// Inputs that are not single cells or disagree on the scenario count, and
+// outputs that cannot be read, are reported instead of evaluated
+TEST_CASE(scenariosRejectBadInputs) {
+    TestBook book;
+    fillModel(book);
+    std::vector<Value> results;
+    std::string error;
+
+    ScenarioInputs inputs;
+    inputs.cells = { "A1:A2" };
+    inputs.values = { { 1, 2 } };
+    CHECK(!book.evaluator().evaluateScenarios(inputs, { "C1" }, results, error));
+    CHECK(!error.empty());
+
+    inputs.cells = { "A1", "A2" };
+    inputs.values = { { 1, 2 }, { 3 } };
+    error.clear();
+    CHECK(!book.evaluator().evaluateScenarios(inputs, { "C1" }, results, error));
+    CHECK(!error.empty());
+
+    inputs.values = { { 1, 2 } };
+    error.clear();
+    CHECK(!book.evaluator().evaluateScenarios(inputs, { "C1" }, results, error));
+    CHECK(!error.empty());
+
+    inputs.cells = { "Missing!A1" };
+    error.clear();
+    CHECK(!book.evaluator().evaluateScenarios(inputs, { "C1" }, results, error));
+    CHECK(!error.empty());
+
+    inputs.cells = { "A1" };
+    error.clear();
+    CHECK(book.evaluator().evaluateScenarios(inputs, { "C1" }, results, error));
+    CHECK(results.size() == 2);
+    CHECK(!book.evaluator().evaluateScenarios(inputs, { "=1+" }, results, error));
+    CHECK(!error.empty());
+    error.clear();
+    CHECK(!book.evaluator().evaluateScenarios(inputs, { "B1:C1" }, results, error));
+    CHECK(!error.empty());
+}
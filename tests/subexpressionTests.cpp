@@ -0,0 +1,51 @@
+#include "stdafx.h"
+#include "testing.h"
+
+namespace {
+
+// G22:L22 = 1..6, and formulas in A that all call SUM(G22:L22)
+void fillSharedCalls(TestBook& book) {
+    const char* columns[] = { "G", "H", "I", "J", "K", "L" };
+    for (int i = 0; i < 6; ++i) book.number(std::string(columns[i]) + "22", i + 1.0);
+    book.formula("A1", L"SUM(G22:L22)*2");
+    book.formula("A2", L"SUM(G22:L22)+1");
+    book.formula("A3", L"SUM(G22:L22)/SUM(G22:L22)");
+    book.formula("B1", L"A1+SUM(G22:L22)");
+}
+
+}
+
+// Equal calls in any formula are one subexpression, computed once per
+// generation and shared by every formula holding it
+TEST_CASE(equalCallsShareOneSubexpression) {
+    TestBook book;
+    fillSharedCalls(book);
+    SubexpressionStats before = book.evaluator().subexpressionStats();
+
+    CHECK_NUMBER(book.eval("=A1"), 42);
+    CHECK_NUMBER(book.eval("=A2"), 22);
+    CHECK_NUMBER(book.eval("=A3"), 1);
+    CHECK_NUMBER(book.eval("=B1"), 63);
+    CHECK_NUMBER(book.eval("=SUM(G22:L22)"), 21);
+
+    SubexpressionStats after = book.evaluator().subexpressionStats();
+    CHECK(after.unique - before.unique == 1);
+    CHECK(after.references - before.references == 6);
+    CHECK(after.evaluations - before.evaluations == 1);
+    CHECK(after.reuses - before.reuses >= 5);
+
+    // A changed input starts a generation: the shared value is computed
+    // once more and every formula sees it
+    CHECK(book.evaluator().setValue("Sheet1", 21, 6, 11));
+    book.evaluator().recalculate();
+    CHECK_NUMBER(book.eval("=A1"), 62);
+    CHECK_NUMBER(book.eval("=A2"), 32);
+    CHECK_NUMBER(book.eval("=B1"), 93);
+    SubexpressionStats changed = book.evaluator().subexpressionStats();
+    CHECK(changed.unique == after.unique);
+    CHECK(changed.evaluations - after.evaluations == 1);
+
+    // $ marks make a different call, as does a different range
+    book.eval("=SUM($G$22:$L$22)+SUM(G22:K22)");
+    CHECK(book.evaluator().subexpressionStats().unique - after.unique == 2);
+}
@@ -0,0 +1,197 @@
+#include "stdafx.h"
+#include "testing.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <zlib.h>
+
+namespace {
+
+int failures = 0;
+const char* currentCase = "";
+
+}
+
+std::vector<TestCase>& testCases() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+void checkFailed(const char* file, int line, const std::string& what) {
+    failures++;
+    fprintf(stderr, "%s:%d: %s: check failed: %s\n", file, line, currentCase, what.c_str());
+}
+
+std::string describe(Value value) {
+    std::ostringstream out;
+    switch (value.type()) {
+    case ValueType::Number: out.precision(17); out << value.asNumber(); break;
+    case ValueType::Boolean: out << (value.asBoolean() ? "TRUE" : "FALSE"); break;
+    case ValueType::String: out << "string #" << value.asString(); break;
+    case ValueType::Error: out << errorText(value.asError()); break;
+    case ValueType::Empty: out << "empty"; break;
+    }
+    return out.str();
+}
+
+void checkNumber(const char* file, int line, Value value, double expected, double tolerance) {
+    if (!value.isNumber() || !(std::fabs(value.asNumber() - expected) <= tolerance * std::max(1.0, std::fabs(expected)))) {
+        std::ostringstream what;
+        what.precision(17);
+        what << "expected " << expected << ", got " << describe(value);
+        checkFailed(file, line, what.str());
+    }
+}
+
+void checkError(const char* file, int line, Value value, ErrorCode expected) {
+    if (!value.isError() || value.asError() != expected) {
+        checkFailed(file, line, std::string("expected ") + errorText(expected) + ", got " + describe(value));
+    }
+}
+
+void checkBoolean(const char* file, int line, Value value, bool expected) {
+    if (value.type() != ValueType::Boolean || value.asBoolean() != expected) {
+        checkFailed(file, line, std::string("expected ") + (expected ? "TRUE" : "FALSE") + ", got " + describe(value));
+    }
+}
+
+void cellPosition(const std::string& cell, int& row, int& col) {
+    size_t i = 0;
+    col = 0;
+    for (; i < cell.size() && isalpha((unsigned char)cell[i]); ++i) col = col * 26 + (toupper(cell[i]) - 'A' + 1);
+    col -= 1;
+    row = atoi(cell.c_str() + i) - 1;
+}
+
+TestBook::TestBook() {
+    source.addSheet("Sheet1");
+}
+
+void TestBook::number(const std::string& cell, double value, int sheet) {
+    int row, col;
+    cellPosition(cell, row, col);
+    source.setNumber(sheet, row, col, value);
+}
+
+void TestBook::text(const std::string& cell, const std::wstring& value, int sheet) {
+    int row, col;
+    cellPosition(cell, row, col);
+    source.setString(sheet, row, col, value);
+}
+
+void TestBook::formula(const std::string& cell, const std::wstring& text, int sheet) {
+    int row, col;
+    cellPosition(cell, row, col);
+    source.setFormula(sheet, row, col, text);
+}
+
+TreeFormulaEvaluator& TestBook::evaluator() {
+    if (!engine) engine = std::make_unique<TreeFormulaEvaluator>(source);
+    return *engine;
+}
+
+std::string testDirectory() {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "formulaTests";
+    std::filesystem::create_directories(dir);
+    return dir.string();
+}
+
+namespace {
+
+void put16(std::string& out, uint32_t value) {
+    out += (char)(value & 0xFF);
+    out += (char)((value >> 8) & 0xFF);
+}
+
+void put32(std::string& out, uint32_t value) {
+    put16(out, value & 0xFFFF);
+    put16(out, value >> 16);
+}
+
+std::string rawDeflate(const std::string& data) {
+    z_stream stream = {};
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&stream, (uLong)data.size()), '\0');
+    stream.next_in = (Bytef*)data.data();
+    stream.avail_in = (uInt)data.size();
+    stream.next_out = (Bytef*)&out[0];
+    stream.avail_out = (uInt)out.size();
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+}
+
+}
+
+bool writeZip(const std::string& path, const std::vector<ZipPart>& parts) {
+    std::string body;
+    std::string directory;
+    for (const ZipPart& part : parts) {
+        std::string stored = part.deflate ? rawDeflate(part.data) : part.data;
+        uint32_t crc = (uint32_t)crc32(0, (const Bytef*)part.data.data(), (uInt)part.data.size());
+        uint32_t size = (uint32_t)(part.size >= 0 ? part.size : (int64_t)part.data.size());
+        uint32_t compressedSize = (uint32_t)(part.compressedSize >= 0 ? part.compressedSize : (int64_t)stored.size());
+        uint32_t offset = (uint32_t)body.size();
+
+        put32(body, 0x04034b50);
+        put16(body, 20);
+        put16(body, 0);
+        put16(body, part.deflate ? 8 : 0);
+        put32(body, 0);
+        put32(body, crc);
+        put32(body, compressedSize);
+        put32(body, size);
+        put16(body, (uint32_t)part.name.size());
+        put16(body, 0);
+        body += part.name;
+        body += stored;
+
+        put32(directory, 0x02014b50);
+        put16(directory, 20);
+        put16(directory, 20);
+        put16(directory, 0);
+        put16(directory, part.deflate ? 8 : 0);
+        put32(directory, 0);
+        put32(directory, crc);
+        put32(directory, compressedSize);
+        put32(directory, size);
+        put16(directory, (uint32_t)part.name.size());
+        put32(directory, 0);    // extra and comment lengths
+        put32(directory, 0);    // disk, internal attributes
+        put32(directory, 0);    // external attributes
+        put32(directory, offset);
+        directory += part.name;
+    }
+
+    std::string end;
+    put32(end, 0x06054b50);
+    put32(end, 0);
+    put16(end, (uint32_t)parts.size());
+    put16(end, (uint32_t)parts.size());
+    put32(end, (uint32_t)directory.size());
+    put32(end, (uint32_t)body.size());
+    put16(end, 0);
+
+    std::ofstream file(path, std::ios::binary);
+    file << body << directory << end;
+    return (bool)file;
+}
+
+// Runs every case, or those whose names contain the first argument
+int main(int argc, char** argv) {
+    Tracer::instance().setLevel(TraceLevel::Off);
+    size_t run = 0;
+    for (const TestCase& test : testCases()) {
+        if (argc > 1 && !strstr(test.name, argv[1])) continue;
+        currentCase = test.name;
+        int before = failures;
+        test.run();
+        run++;
+        if (failures > before) fprintf(stderr, "FAILED %s\n", test.name);
+    }
+    printf("%zu test cases, %d failed checks\n", run, failures);
+    return failures == 0 ? 0 : 1;
+}
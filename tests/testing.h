@@ -0,0 +1,94 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "memoryCellSource.h"
+#include "xlsxFormulaEvaluator.h"
+
+// Self-registering test cases: TEST_CASE(name) { CHECK(...); } anywhere in
+// tests/, run in registration order by testMain.cpp. A failed check is
+// reported and the case goes on, so one run shows every failure.
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+std::vector<TestCase>& testCases();
+
+struct TestRegistrar {
+    TestRegistrar(const char* name, void (*run)()) { testCases().push_back(TestCase{ name, run }); }
+};
+
+#define TEST_CASE(name)                                     \
+    static void name();                                     \
+    static TestRegistrar name##Registrar(#name, name);      \
+    static void name()
+
+void checkFailed(const char* file, int line, const std::string& what);
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) checkFailed(__FILE__, __LINE__, #condition);          \
+    } while (0)
+
+// Value checks, with what was actually found in the failure message
+void checkNumber(const char* file, int line, Value value, double expected, double tolerance);
+void checkError(const char* file, int line, Value value, ErrorCode expected);
+void checkBoolean(const char* file, int line, Value value, bool expected);
+
+#define CHECK_NUMBER(value, expected) checkNumber(__FILE__, __LINE__, (value), (expected), 1e-9)
+#define CHECK_NEAR(value, expected, tolerance) checkNumber(__FILE__, __LINE__, (value), (expected), (tolerance))
+#define CHECK_ERROR(value, expected) checkError(__FILE__, __LINE__, (value), (expected))
+#define CHECK_BOOLEAN(value, expected) checkBoolean(__FILE__, __LINE__, (value), (expected))
+
+std::string describe(Value value);
+
+// A workbook filled from code and an evaluator over it. Cells are given
+// A1-style on sheet 0 ("Sheet1") unless another sheet index is passed;
+// call evaluator() once the cells are in, it snapshots the source.
+class TestBook {
+public:
+    TestBook();
+
+    int addSheet(const std::string& name) { return source.addSheet(name); }
+
+    void number(const std::string& cell, double value, int sheet = 0);
+
+    void text(const std::string& cell, const std::wstring& value, int sheet = 0);
+
+    void formula(const std::string& cell, const std::wstring& text, int sheet = 0);
+
+    TreeFormulaEvaluator& evaluator();
+
+    Value eval(const std::string& formula) { return evaluator().evaluateFormulaValue(formula); }
+
+    MemoryCellSource source;
+
+private:
+    std::unique_ptr<TreeFormulaEvaluator> engine;
+};
+
+// Every evaluation backend, for tests that must agree across all three
+inline const EvaluationBackend BACKENDS[] = { EvaluationBackend::Bytecode, EvaluationBackend::Exprtk,
+    EvaluationBackend::TreeWalker };
+
+// "B3" -> row 2, column 1
+void cellPosition(const std::string& cell, int& row, int& col);
+
+// Directory for files written by tests, created on first use
+std::string testDirectory();
+
+// One part of an archive written by writeZip. The directory sizes are
+// taken from the data unless given, so tests can forge them.
+struct ZipPart {
+    std::string name;
+    std::string data;
+    bool deflate = true;
+    int64_t size = -1;
+    int64_t compressedSize = -1;
+};
+
+// False if the file could not be written
+bool writeZip(const std::string& path, const std::vector<ZipPart>& parts);
@@ -0,0 +1,48 @@
+#include "stdafx.h"
+#include "testing.h"
+#include <iostream>
+#include <sstream>
+
+// Trace output stays off standard output, which carries the results
+TEST_CASE(defaultSinkWritesToStandardError) {
+    std::ostringstream out;
+    std::ostringstream err;
+    std::streambuf* oldOut = std::cout.rdbuf(out.rdbuf());
+    std::streambuf* oldErr = std::cerr.rdbuf(err.rdbuf());
+
+    Tracer& tracer = Tracer::instance();
+    tracer.setLevel(TraceLevel::Warning);
+    tracer.record(TraceLevel::Warning, TraceKind::BindingError, std::string_view("unknown sheet"));
+    tracer.flush();
+    tracer.setLevel(TraceLevel::Off);
+
+    std::cout.rdbuf(oldOut);
+    std::cerr.rdbuf(oldErr);
+    CHECK(out.str().empty());
+    CHECK(err.str().find("unknown sheet") != std::string::npos);
+}
+
+// Every node of both trees is recorded, in printTree order
+TEST_CASE(traceTreeRecordsEachNode) {
+    TestBook book;
+    auto recording = std::make_shared<RecordingTraceSink>();
+    Tracer& tracer = Tracer::instance();
+    tracer.setSink(recording);
+    tracer.setLevel(TraceLevel::Warning);
+    {
+        TraceFormulaScope scope;
+        auto tree = book.evaluator().parse(book.evaluator().tokenize("=1+A1*2"));
+        book.evaluator().traceTree(tree, TraceKind::OptimizerOriginal, 1);
+    }
+    tracer.flush();
+    tracer.setLevel(TraceLevel::Off);
+    tracer.setSink(std::make_shared<StreamTraceSink>(std::cerr));
+
+    std::vector<uint64_t> formulas = recording->formulas();
+    CHECK(formulas.size() == 1);
+    std::vector<TraceEvent> events = recording->events(formulas.back());
+    CHECK(events.size() == 5);
+    CHECK(events.size() == 5 && events[0].kind == TraceKind::OptimizerOriginal);
+    CHECK(events.size() == 5 && std::string(events[0].text) == "  + (OP)");
+    CHECK(events.size() == 5 && std::string(events[4].text) == "      2 (CONST)");
+}
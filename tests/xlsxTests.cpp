@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include "testing.h"
+#include "xlsxCellSource.h"
+#include "zipArchive.h"
+
+namespace {
+
+std::string zipPath(const char* name) {
+    return testDirectory() + "/" + name;
+}
+
+// A workbook of one sheet named Data holding the <row> elements given
+// One sheet named Data; sharedStrings, when given, is the <sst> content
+std::string writeWorkbook(const char* name, const std::string& rows, const std::string& sharedStrings = "") {
+    std::string path = zipPath(name);
+    const std::string TYPE = "http://schemas.openxmlformats.org/officeDocument/2006/relationships/";
+    std::string relationships = "<Relationships><Relationship Id=\"rId1\" Target=\"worksheets/sheet1.xml\" "
+        "Type=\"" + TYPE + "worksheet\"/>";
+    if (!sharedStrings.empty()) {
+        relationships += "<Relationship Id=\"rId2\" Target=\"sharedStrings.xml\" Type=\"" + TYPE + "sharedStrings\"/>";
+    }
+    relationships += "</Relationships>";
+
+    std::vector<ZipPart> parts = {
+        ZipPart{ "xl/workbook.xml",
+            "<workbook xmlns:r=\"r\"><sheets><sheet name=\"Data\" sheetId=\"1\" r:id=\"rId1\"/></sheets></workbook>" },
+        ZipPart{ "xl/_rels/workbook.xml.rels", relationships },
+        ZipPart{ "xl/worksheets/sheet1.xml", "<worksheet><sheetData>" + rows + "</sheetData></worksheet>" } };
+    if (!sharedStrings.empty()) parts.push_back(ZipPart{ "xl/sharedStrings.xml", "<sst>" + sharedStrings + "</sst>" });
+    writeZip(path, parts);
+    return path;
+}
+
+}
+
+TEST_CASE(zipReadsStoredAndDeflatedParts) {
+    std::string path = zipPath("parts.zip");
+    std::string text(100000, 'x');
+    CHECK(writeZip(path, { ZipPart{ "a.txt", "stored part", false }, ZipPart{ "b.txt", text } }));
+
+    ZipArchive zip;
+    CHECK(zip.open(path));
+    CHECK(zip.size() == 2);
+    std::string out;
+    CHECK(zip.readAll("a.txt", out) && out == "stored part");
+    CHECK(zip.readAll("b.txt", out) && out == text);
+    CHECK(!zip.readAll("c.txt", out));
+}
+
+// Directory sizes are not trusted past the end of the mapping
+TEST_CASE(zipRejectsForgedSizes) {
+    std::string path = zipPath("forged.zip");
+    CHECK(writeZip(path, {
+        ZipPart{ "short.txt", "stored part", false, 1 << 30, -1 },      // size != compressed size
+        ZipPart{ "long.txt", "stored part", false, 1 << 30, 1 << 30 },  // past the end of the file
+        ZipPart{ "deflated.txt", "data that is not too short to squeeze", true, 4, -1 },
+        ZipPart{ "ok.txt", "fine", false } }));
+
+    ZipArchive zip;
+    CHECK(zip.open(path));
+    std::string out;
+    CHECK(!zip.readAll("short.txt", out));
+    CHECK(!zip.readAll("long.txt", out));
+    CHECK(!zip.readAll("deflated.txt", out));
+    CHECK(zip.readAll("ok.txt", out) && out == "fine");
+}
+
+// A shared formula is stored once and shifted for each cell as it is read
+TEST_CASE(xlsxSharedFormulasShiftOnRead) {
+    std::string rows;
+    for (int row = 1; row <= 4; ++row) {
+        std::string r = std::to_string(row);
+        rows += "<row r=\"" + r + "\"><c r=\"A" + r + "\"><v>" + r + "</v></c>";
+        if (row == 1) rows += "<c r=\"B1\"><f t=\"shared\" ref=\"B1:B4\" si=\"0\">A1*$A$1+SUM(A1:A2)</f><v>0</v></c>";
+        else rows += "<c r=\"B" + r + "\"><f t=\"shared\" si=\"0\"/><v>0</v></c>";
+        rows += "</row>";
+    }
+
+    XlsxCellSource source;
+    CHECK(source.load(writeWorkbook("shared.xlsx", rows)));
+    CHECK(source.sheetName(0) == "Data");
+    CHECK(source.readFormula(0, 0, 1) == L"A1*$A$1+SUM(A1:A2)");
+    CHECK(source.readFormula(0, 3, 1) == L"A4*$A$1+SUM(A4:A5)");
+    CHECK(source.readFormula(0, 2, 1) == L"A3*$A$1+SUM(A3:A4)");
+    CHECK(source.readFormula(0, 2, 0).empty());
+
+    TreeFormulaEvaluator evaluator(source);
+    CHECK_NUMBER(evaluator.evaluateFormulaValue("=Data!B3"), 3 + 3 + 4);
+    CHECK_NUMBER(evaluator.evaluateFormulaValue("=SUM(Data!B1:B4)"), 4 + 7 + 10 + 8);
+}
+
+// Every cell type the reader knows, with the values and formula results
+// Excel saved
+TEST_CASE(xlsxReadsCellTypes) {
+    std::string rows =
+        "<row r=\"1\"><c r=\"A1\"><v>2.5</v></c><c r=\"B1\" t=\"s\"><v>1</v></c>"
+        "<c r=\"C1\" t=\"b\"><v>1</v></c><c r=\"D1\" t=\"e\"><v>#DIV/0!</v></c></row>"
+        "<row r=\"3\"><c r=\"A3\" t=\"inlineStr\"><is><t>inline &amp; text</t></is></c>"
+        "<c r=\"B3\"><f>A1*4</f><v>10</v></c><c r=\"C3\" t=\"str\"><f>B1</f><v>caf\xC3\xA9</v></c>"
+        "<c r=\"E3\" t=\"s\"><v>0</v></c></row>";
+    std::string strings = "<si><t>first</t></si><si><r><t>caf</t></r><r><t>\xC3\xA9</t></r></si>";
+
+    XlsxCellSource source;
+    CHECK(source.load(writeWorkbook("types.xlsx", rows, strings)));
+    CellData cell;
+    CHECK(source.readCell(0, 0, 0, cell) && cell.kind == CellKind::NUMBER && cell.number == 2.5);
+    CHECK(source.readCell(0, 0, 1, cell) && cell.kind == CellKind::STRING && cell.text == L"caf\u00E9");
+    CHECK(source.readCell(0, 0, 2, cell) && cell.kind == CellKind::BOOLEAN && cell.number == 1);
+    CHECK(source.readCell(0, 0, 3, cell) && cell.kind == CellKind::ERROR && cell.error == ErrorCode::Div0);
+    CHECK(source.readCell(0, 2, 0, cell) && cell.kind == CellKind::STRING && cell.text == L"inline & text");
+    CHECK(source.readCell(0, 2, 1, cell) && cell.isFormula && cell.number == 10);
+    CHECK(source.readCell(0, 2, 4, cell) && cell.kind == CellKind::STRING && cell.text == L"first");
+    CHECK(!source.readCell(0, 1, 0, cell) || cell.kind == CellKind::EMPTY);
+
+    TreeFormulaEvaluator evaluator(source);
+    CHECK_NUMBER(evaluator.evaluateFormulaValue("=Data!B3+Data!C1"), 11);
+    CHECK_ERROR(evaluator.evaluateFormulaValue("=Data!D1*2"), ErrorCode::Div0);
+    CHECK(evaluator.valueText(evaluator.evaluateFormulaValue("=Data!C3")) == "caf\xC3\xA9");
+    CHECK_NUMBER(evaluator.evaluateFormulaValue("=COUNTA(Data!A1:E3)"), 8);
+}
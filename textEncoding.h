@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Narrow text in the engine is UTF-8: sheet names, interned symbols,
+// normalized formula text. Wide text is UTF-16 where wchar_t has 16 bits
+// and UTF-32 elsewhere.
+
+inline void appendUtf8(uint32_t code, std::string& out) {
+    if (code < 0x80) {
+        out += (char)code;
+    }
+    else if (code < 0x800) {
+        out += (char)(0xC0 | (code >> 6));
+        out += (char)(0x80 | (code & 0x3F));
+    }
+    else if (code < 0x10000) {
+        out += (char)(0xE0 | (code >> 12));
+        out += (char)(0x80 | ((code >> 6) & 0x3F));
+        out += (char)(0x80 | (code & 0x3F));
+    }
+    else {
+        out += (char)(0xF0 | (code >> 18));
+        out += (char)(0x80 | ((code >> 12) & 0x3F));
+        out += (char)(0x80 | ((code >> 6) & 0x3F));
+        out += (char)(0x80 | (code & 0x3F));
+    }
+}
+
+// Append the character at text[i] and step i past it. Narrow text is
+// already UTF-8 and is copied a byte at a time.
+inline void appendUtf8At(std::string_view text, size_t& i, std::string& out) {
+    out += text[i++];
+}
+
+inline void appendUtf8At(std::wstring_view text, size_t& i, std::string& out) {
+    uint32_t code = (uint32_t)text[i++];
+    if (sizeof(wchar_t) == 2 && code >= 0xD800 && code < 0xDC00 && i < text.size()) {
+        uint32_t low = (uint32_t)text[i];
+        if (low >= 0xDC00 && low < 0xE000) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            i++;
+        }
+    }
+    appendUtf8(code, out);
+}
+
+inline std::string toUtf8(std::wstring_view text) {
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size();) {
+        appendUtf8At(text, i, out);
+    }
+    return out;
+}
+
+inline void appendWide(std::string_view utf8, std::wstring& out) {
+    for (size_t i = 0; i < utf8.size();) {
+        unsigned char c = (unsigned char)utf8[i++];
+        if (c < 0x80) {
+            out += (wchar_t)c;
+            continue;
+        }
+
+        uint32_t code;
+        int extra;
+        if ((c >> 5) == 6) { code = c & 0x1F; extra = 1; }
+        else if ((c >> 4) == 14) { code = c & 0x0F; extra = 2; }
+        else if ((c >> 3) == 30) { code = c & 0x07; extra = 3; }
+        else { code = 0xFFFD; extra = 0; }
+        for (int k = 0; k < extra && i < utf8.size(); ++k, ++i) {
+            code = (code << 6) | ((unsigned char)utf8[i] & 0x3F);
+        }
+
+        if (sizeof(wchar_t) == 2 && code >= 0x10000) {
+            code -= 0x10000;
+            out += (wchar_t)(0xD800 + (code >> 10));
+            out += (wchar_t)(0xDC00 + (code & 0x3FF));
+        }
+        else {
+            out += (wchar_t)code;
+        }
+    }
+}
+
+inline std::wstring widen(std::string_view utf8) {
+    std::wstring out;
+    out.reserve(utf8.size());
+    appendWide(utf8, out);
+    return out;
+}
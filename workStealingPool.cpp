@@ -0,0 +1,121 @@
+#include "stdafx.h"
+#include "workStealingPool.h"
+#include <algorithm>
+
+WorkStealingPool::WorkStealingPool(size_t threadCount) {
+    if (threadCount == 0) threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t i = 0; i < threadCount; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 1; i < threadCount; ++i) {
+        threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> guard(jobLock);
+        stopping = true;
+    }
+    jobReady.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t, size_t)>& loopBody) {
+    if (count == 0) return;
+    if (grain == 0) grain = 1;
+
+    if (queues.size() == 1 || count <= grain) {
+        loopBody(0, count, 0);
+        return;
+    }
+
+    size_t chunks = (count + grain - 1) / grain;
+    {
+        std::lock_guard<std::mutex> guard(jobLock);
+        body = &loopBody;
+        failure = nullptr;
+        remaining.store(chunks);
+
+        // Deal chunks round-robin so every worker starts with local work
+        size_t index = 0;
+        for (size_t begin = 0; begin < count; begin += grain, ++index) {
+            Queue& queue = *queues[index % queues.size()];
+            std::lock_guard<std::mutex> queueGuard(queue.lock);
+            queue.chunks.push_back({ begin, std::min(count, begin + grain) });
+        }
+        generation++;
+    }
+    jobReady.notify_all();
+
+    while (runOne(0)) {
+    }
+
+    std::unique_lock<std::mutex> guard(jobLock);
+    jobDone.wait(guard, [this] { return remaining.load() == 0; });
+    body = nullptr;
+    if (failure) {
+        std::exception_ptr error = failure;
+        failure = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void WorkStealingPool::workerLoop(size_t worker) {
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(jobLock);
+            jobReady.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+
+        while (runOne(worker)) {
+        }
+    }
+}
+
+bool WorkStealingPool::runOne(size_t worker) {
+    Chunk chunk;
+    bool found = false;
+
+    {
+        Queue& own = *queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.chunks.empty()) {
+            chunk = own.chunks.back();
+            own.chunks.pop_back();
+            found = true;
+        }
+    }
+
+    for (size_t i = 1; !found && i < queues.size(); ++i) {
+        Queue& victim = *queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.chunks.empty()) {
+            chunk = victim.chunks.front();
+            victim.chunks.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found) return false;
+
+    try {
+        (*body)(chunk.begin, chunk.end, worker);
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> guard(jobLock);
+        if (!failure) failure = std::current_exception();
+    }
+
+    if (remaining.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> guard(jobLock);
+        jobDone.notify_all();
+    }
+    return true;
+}
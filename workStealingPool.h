@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running parallel loops. Each worker owns a
+// deque of chunks, works from its back and steals from the front of the
+// others when it runs dry. The calling thread takes part as worker 0.
+class WorkStealingPool {
+public:
+    // 0 threads means one per hardware thread
+    explicit WorkStealingPool(size_t threads = 0);
+
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Workers including the calling thread
+    size_t size() const { return queues.size(); }
+
+    // Run body(begin, end, worker) over [0, count) in chunks of at most grain
+    // items and return once all of them are done. The first exception thrown
+    // by body is rethrown here.
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t, size_t)>& body);
+
+private:
+    struct Chunk {
+        size_t begin;
+        size_t end;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Chunk> chunks;
+    };
+
+    void workerLoop(size_t worker);
+
+    // Run one chunk from the worker's own queue or a stolen one
+    bool runOne(size_t worker);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex jobLock;
+    std::condition_variable jobReady;
+    std::condition_variable jobDone;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    const std::function<void(size_t, size_t, size_t)>* body = nullptr;
+    std::atomic<size_t> remaining{ 0 };
+    std::exception_ptr failure;
+};
@@ -0,0 +1,286 @@
+#include "stdafx.h"
+#include "workbookPipeline.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <thread>
+#include "boundedQueue.h"
+#include "xlsxCellSource.h"
+#ifndef XLF_NO_LIBXL
+#include "libxlCellSource.h"
+#endif
+
+namespace {
+
+#ifndef XLF_NO_LIBXL
+// Releases its book along with the source
+class LibxlWorkbook : public LibxlCellSource {
+public:
+    explicit LibxlWorkbook(Book* book) : LibxlCellSource(book), owned(book) {}
+
+    ~LibxlWorkbook() override { owned->release(); }
+
+private:
+    Book* owned;
+};
+#endif
+
+// A workbook on its way through the stages
+struct Work {
+    size_t index = 0;
+    const WorkbookJob* job = nullptr;
+    size_t reserved = 0;                    // bytes held in the budget
+    std::unique_ptr<CellSource> source;
+    std::unique_ptr<TreeFormulaEvaluator> evaluator;
+    WorkbookResult result;
+};
+
+typedef BoundedQueue<std::unique_ptr<Work>> WorkQueue;
+
+size_t fileSize(const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    return in ? (size_t)in.tellg() : 0;
+}
+
+size_t workerCount(size_t requested) {
+    return requested > 0 ? requested : std::max(1u, std::thread::hardware_concurrency());
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Busy time of a stage, added up by its workers
+class StageClock {
+public:
+    void add(double seconds) {
+        nanoseconds.fetch_add((uint64_t)(seconds * 1e9), std::memory_order_relaxed);
+    }
+
+    double seconds() const { return nanoseconds.load() / 1e9; }
+
+private:
+    std::atomic<uint64_t> nanoseconds{ 0 };
+};
+
+}
+
+std::unique_ptr<CellSource> openWorkbook(const std::string& path, std::string& error) {
+    if (path.size() > 5 && path.compare(path.size() - 5, 5, ".xlsx") == 0) {
+        auto xlsx = std::make_unique<XlsxCellSource>();
+        if (!xlsx->load(path)) {
+            error = xlsx->lastError();
+            return nullptr;
+        }
+        return xlsx;
+    }
+
+#ifdef XLF_NO_LIBXL
+    error = "only .xlsx workbooks can be read without libxl";
+    return nullptr;
+#else
+    Book* book = xlCreateBook();
+    if (!book) {
+        error = "cannot create libxl book";
+        return nullptr;
+    }
+    //book->setKey(_T(""), <your_key>);
+    if (!book->load(std::wstring(path.begin(), path.end()).c_str())) {
+        error = "cannot load workbook";
+        book->release();
+        return nullptr;
+    }
+    return std::make_unique<LibxlWorkbook>(book);
+#endif
+}
+
+void MemoryBudget::acquire(size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (limit > 0) {
+        freed.wait(lock, [&] { return used == 0 || used + bytes <= limit; });
+    }
+    used += bytes;
+    peakUsed = std::max(peakUsed, used);
+}
+
+void MemoryBudget::adjust(size_t& reserved, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    used = used - reserved + bytes;
+    peakUsed = std::max(peakUsed, used);
+    if (bytes < reserved) freed.notify_all();
+    reserved = bytes;
+}
+
+void MemoryBudget::release(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    used -= bytes;
+    freed.notify_all();
+}
+
+size_t MemoryBudget::peak() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return peakUsed;
+}
+
+WorkbookPipeline::WorkbookPipeline(const PipelineOptions& options) : options(options), open(openWorkbook) {}
+
+PipelineStats WorkbookPipeline::run(const std::vector<WorkbookJob>& jobs, const Emitter& emit) {
+    auto start = std::chrono::steady_clock::now();
+    MemoryBudget budget(options.memoryBudget);
+    WorkQueue loaded(options.queueCapacity);
+    WorkQueue compiled(options.queueCapacity);
+    WorkQueue evaluated(options.queueCapacity);
+    StageClock loadClock, compileClock, evaluateClock, emitClock;
+    std::atomic<size_t> nextJob{ 0 };
+    std::atomic<size_t> failed{ 0 };
+    std::mutex emitLock;
+    std::exception_ptr emitFailure;
+
+    // Each stage closes its output queue when its last worker leaves
+    struct Stage {
+        std::vector<std::thread> threads;
+        std::atomic<size_t> running{ 0 };
+    };
+    Stage loadStage, compileStage, evaluateStage, emitStage;
+
+    auto startStage = [](Stage& stage, size_t workers, WorkQueue* output, std::function<void()> body) {
+        stage.running = workers;
+        for (size_t i = 0; i < workers; ++i) {
+            stage.threads.emplace_back([&stage, output, body] {
+                body();
+                if (stage.running.fetch_sub(1) == 1 && output) output->close();
+            });
+        }
+    };
+
+    // A source that cannot tell its own size keeps the estimate made for it
+    auto measure = [](const Work& work) {
+        size_t bytes = work.evaluator->memoryBytes();
+        size_t sourceBytes = work.source->memoryBytes();
+        return sourceBytes > 0 ? bytes + sourceBytes : std::max(bytes, work.reserved);
+    };
+
+    // Failures travel on with their error, so every job is emitted once
+    auto fail = [&](Work& work, const std::string& error) {
+        work.result.error = error;
+        work.evaluator.reset();
+        work.source.reset();
+    };
+
+    startStage(loadStage, workerCount(options.loadWorkers), &loaded, [&] {
+        for (size_t index = nextJob++; index < jobs.size(); index = nextJob++) {
+            auto work = std::make_unique<Work>();
+            work->index = index;
+            work->job = &jobs[index];
+
+            // Reserve before reading, so a full budget holds back the I/O
+            size_t estimate = std::max<size_t>(fileSize(work->job->path) * options.bytesPerFileByte, 1 << 20);
+            budget.acquire(estimate);
+            work->reserved = estimate;
+
+            auto begin = std::chrono::steady_clock::now();
+            try {
+                std::string error;
+                work->source = open(work->job->path, error);
+                if (!work->source) fail(*work, error.empty() ? "cannot open workbook" : error);
+            }
+            catch (const std::exception& e) {
+                fail(*work, e.what());
+            }
+            catch (...) {
+                fail(*work, "unknown error");
+            }
+            loadClock.add(secondsSince(begin));
+            loaded.push(std::move(work));
+        }
+    });
+
+    startStage(compileStage, workerCount(options.compileWorkers), &compiled, [&] {
+        std::unique_ptr<Work> work;
+        while (loaded.pop(work)) {
+            auto begin = std::chrono::steady_clock::now();
+            if (work->source) {
+                try {
+                    work->evaluator = std::make_unique<TreeFormulaEvaluator>(*work->source);
+                    work->evaluator->compileAll();
+                    budget.adjust(work->reserved, measure(*work));
+                }
+                catch (const std::exception& e) {
+                    fail(*work, e.what());
+                }
+                catch (...) {
+                    fail(*work, "unknown error");
+                }
+            }
+            compileClock.add(secondsSince(begin));
+            compiled.push(std::move(work));
+        }
+    });
+
+    startStage(evaluateStage, workerCount(options.evaluateWorkers), &evaluated, [&] {
+        std::unique_ptr<Work> work;
+        while (compiled.pop(work)) {
+            auto begin = std::chrono::steady_clock::now();
+            if (work->evaluator) {
+                try {
+                    // Parallelism comes from the workbooks, one thread each
+                    if (options.recalculate) work->evaluator->recalculateAll(1);
+                    work->evaluator->evaluateBatch(work->job->queries, work->result.results);
+                    budget.adjust(work->reserved, measure(*work));
+                }
+                catch (const std::exception& e) {
+                    fail(*work, e.what());
+                }
+                catch (...) {
+                    fail(*work, "unknown error");
+                }
+            }
+            evaluateClock.add(secondsSince(begin));
+            evaluated.push(std::move(work));
+        }
+    });
+
+    startStage(emitStage, workerCount(options.emitWorkers), nullptr, [&] {
+        std::unique_ptr<Work> work;
+        while (evaluated.pop(work)) {
+            auto begin = std::chrono::steady_clock::now();
+            WorkbookResult& result = work->result;
+            result.index = work->index;
+            result.job = work->job;
+            result.evaluator = work->evaluator.get();
+            result.memoryBytes = work->reserved;
+            if (!result.error.empty()) failed++;
+            try {
+                emit(result);
+            }
+            catch (...) {
+                // The rest still drains, so no stage is left blocked
+                std::lock_guard<std::mutex> lock(emitLock);
+                if (!emitFailure) emitFailure = std::current_exception();
+            }
+
+            work->evaluator.reset();
+            work->source.reset();
+            budget.release(work->reserved);
+            emitClock.add(secondsSince(begin));
+        }
+    });
+
+    for (Stage* stage : { &loadStage, &compileStage, &evaluateStage, &emitStage }) {
+        for (auto& thread : stage->threads) thread.join();
+    }
+    if (emitFailure) std::rethrow_exception(emitFailure);
+
+    PipelineStats stats;
+    stats.workbooks = jobs.size();
+    stats.failed = failed;
+    stats.peakMemoryBytes = budget.peak();
+    stats.loadSeconds = loadClock.seconds();
+    stats.compileSeconds = compileClock.seconds();
+    stats.evaluateSeconds = evaluateClock.seconds();
+    stats.emitSeconds = emitClock.seconds();
+    stats.wallSeconds = secondsSince(start);
+    return stats;
+}
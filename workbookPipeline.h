@@ -0,0 +1,107 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cellSource.h"
+#include "xlsxFormulaEvaluator.h"
+
+// .xlsx read natively, anything else through libxl unless built with
+// XLF_NO_LIBXL; null on failure with the reason in error. The source owns
+// everything it reads from.
+std::unique_ptr<CellSource> openWorkbook(const std::string& path, std::string& error);
+
+// Bytes of memory shared by the workbooks in flight. A workbook waits for
+// its estimate to fit before it is loaded; one larger than the whole budget
+// still runs, alone, rather than never.
+class MemoryBudget {
+public:
+    // 0 means unlimited
+    explicit MemoryBudget(size_t limit) : limit(limit) {}
+
+    void acquire(size_t bytes);
+
+    // Replace a reservation by a measured size without waiting: memory
+    // already in use cannot be refused, it only holds back later acquires
+    void adjust(size_t& reserved, size_t bytes);
+
+    void release(size_t bytes);
+
+    size_t peak() const;
+
+private:
+    size_t limit;
+    size_t used = 0;
+    size_t peakUsed = 0;
+    mutable std::mutex mutex;
+    std::condition_variable freed;
+};
+
+// One workbook and the queries to answer from it
+struct WorkbookJob {
+    std::string path;
+    std::vector<BatchQuery> queries;
+};
+
+// Handed to the emitter once a workbook is done. evaluator is null if the
+// workbook failed to load, and only valid during the call, as are the
+// string values in results.
+struct WorkbookResult {
+    size_t index = 0;                       // position of the job in the input
+    const WorkbookJob* job = nullptr;
+    std::string error;
+    TreeFormulaEvaluator* evaluator = nullptr;
+    BatchResults results;
+    size_t memoryBytes = 0;                 // measured after evaluation
+};
+
+struct PipelineOptions {
+    // Workers per stage; 0 is one per hardware thread
+    size_t loadWorkers = 2;                 // reading and inflating files
+    size_t compileWorkers = 0;              // snapshot and compile
+    size_t evaluateWorkers = 0;
+    size_t emitWorkers = 1;                 // 1 keeps emitter calls serialized
+
+    size_t queueCapacity = 4;               // workbooks waiting between two stages
+    size_t memoryBudget = 0;                // bytes for workbooks in flight, 0 unlimited
+    size_t bytesPerFileByte = 16;           // memory estimate before loading
+
+    bool recalculate = false;               // recalculate each workbook before its queries
+};
+
+struct PipelineStats {
+    size_t workbooks = 0;
+    size_t failed = 0;
+    size_t peakMemoryBytes = 0;             // reserved and measured, not the process total
+    double loadSeconds = 0.0;               // busy time summed over the stage's workers
+    double compileSeconds = 0.0;
+    double evaluateSeconds = 0.0;
+    double emitSeconds = 0.0;
+    double wallSeconds = 0.0;
+};
+
+// Evaluates many independent workbooks in one process. Stages (load,
+// snapshot and compile, evaluate, emit) run on their own workers and hand
+// workbooks on through bounded queues, so loading the next files overlaps
+// computing the current ones. Each workbook's evaluator is used by one
+// stage at a time, never concurrently.
+class WorkbookPipeline {
+public:
+    typedef std::function<void(WorkbookResult& result)> Emitter;
+    typedef std::function<std::unique_ptr<CellSource>(const std::string& path, std::string& error)> Opener;
+
+    explicit WorkbookPipeline(const PipelineOptions& options = PipelineOptions());
+
+    // Replaces openWorkbook, for sources other than files
+    void setOpener(Opener opener) { open = std::move(opener); }
+
+    // Returns once every job has been emitted; emit runs on the emit
+    // workers, in completion order rather than job order
+    PipelineStats run(const std::vector<WorkbookJob>& jobs, const Emitter& emit);
+
+private:
+    PipelineOptions options;
+    Opener open;
+};
@@ -0,0 +1,583 @@
+#include "stdafx.h"
+#include "xlsxCellSource.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <unordered_map>
+#include "formulaTypes.h"
+#include "textEncoding.h"
+#include "xmlScanner.h"
+
+namespace {
+
+// "B12" or "$B$12" to 0-based row and column
+bool parseAddress(std::string_view text, int& row, int& col, bool& absoluteRow, bool& absoluteCol) {
+    size_t i = 0;
+    absoluteCol = i < text.size() && text[i] == '$';
+    if (absoluteCol) ++i;
+
+    size_t letters = i;
+    col = 0;
+    while (i < text.size() && std::isalpha((unsigned char)text[i]) && i - letters < 4) {
+        col = col * 26 + (std::toupper((unsigned char)text[i]) - 'A' + 1);
+        ++i;
+    }
+    if (i == letters || i - letters > 3) return false;
+
+    absoluteRow = i < text.size() && text[i] == '$';
+    if (absoluteRow) ++i;
+
+    size_t digits = i;
+    long long number = 0;
+    while (i < text.size() && std::isdigit((unsigned char)text[i]) && i - digits < 8) {
+        number = number * 10 + (text[i] - '0');
+        ++i;
+    }
+    if (i == digits || i != text.size()) return false;
+
+    row = (int)number - 1;
+    col -= 1;
+    return row >= 0 && row < MAX_SHEET_ROWS && col < MAX_SHEET_COLS;
+}
+
+void appendColumn(int col, std::string& out) {
+    char letters[4];
+    int count = 0;
+    for (++col; col > 0; col = (col - 1) / 26) {
+        letters[count++] = (char)('A' + (col - 1) % 26);
+    }
+    while (count > 0) out += letters[--count];
+}
+
+bool isNameChar(char c) {
+    return std::isalnum((unsigned char)c) || c == '_' || c == '.' || c == '$' || c == '\\' || (unsigned char)c >= 0x80;
+}
+
+// Formula text as stored in the sheet XML, made ready for the evaluator:
+// the _xlfn. marks of newer functions are dropped and relative references
+// moved by (dRow, dCol), as Excel does for the cells of a shared formula.
+// References moved off the sheet become #REF!.
+void shiftFormula(std::string_view formula, int dRow, int dCol, std::string& out) {
+    out.clear();
+    size_t i = 0;
+    while (i < formula.size()) {
+        char c = formula[i];
+
+        if (c == '"' || c == '\'') {
+            // String literal or quoted sheet name; a doubled quote is part of it
+            size_t start = i++;
+            while (i < formula.size()) {
+                if (formula[i] == c) {
+                    if (i + 1 < formula.size() && formula[i + 1] == c) {
+                        i += 2;
+                        continue;
+                    }
+                    ++i;
+                    break;
+                }
+                ++i;
+            }
+            out.append(formula.data() + start, i - start);
+            continue;
+        }
+
+        if (std::isdigit((unsigned char)c) || (c == '.' && i + 1 < formula.size() && std::isdigit((unsigned char)formula[i + 1]))) {
+            size_t start = i;
+            while (i < formula.size() && (std::isdigit((unsigned char)formula[i]) || formula[i] == '.')) ++i;
+            if (i < formula.size() && (formula[i] == 'E' || formula[i] == 'e')) {
+                size_t exponent = i + 1;
+                if (exponent < formula.size() && (formula[exponent] == '+' || formula[exponent] == '-')) ++exponent;
+                if (exponent < formula.size() && std::isdigit((unsigned char)formula[exponent])) {
+                    i = exponent;
+                    while (i < formula.size() && std::isdigit((unsigned char)formula[i])) ++i;
+                }
+            }
+            out.append(formula.data() + start, i - start);
+            continue;
+        }
+
+        if (!isNameChar(c)) {
+            out += c;
+            ++i;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < formula.size() && isNameChar(formula[i])) ++i;
+        std::string_view name = formula.substr(start, i - start);
+
+        if (i < formula.size() && formula[i] == '(') {
+            for (std::string_view prefix : { std::string_view("_xlfn."), std::string_view("_xlws.") }) {
+                if (name.substr(0, prefix.size()) == prefix) name.remove_prefix(prefix.size());
+            }
+            out.append(name.data(), name.size());
+            continue;
+        }
+
+        int row, col;
+        bool absoluteRow, absoluteCol;
+        if ((i < formula.size() && formula[i] == '!') || !parseAddress(name, row, col, absoluteRow, absoluteCol)) {
+            // Sheet, defined name or boolean
+            out.append(name.data(), name.size());
+            continue;
+        }
+
+        if (!absoluteRow) row += dRow;
+        if (!absoluteCol) col += dCol;
+        if (row < 0 || row >= MAX_SHEET_ROWS || col < 0 || col >= MAX_SHEET_COLS) {
+            out += "#REF!";
+            continue;
+        }
+        if (absoluteCol) out += '$';
+        appendColumn(col, out);
+        if (absoluteRow) out += '$';
+        out += std::to_string(row + 1);
+    }
+}
+
+// Part a relationship target points at, relative to the folder of the
+// part holding the relationships
+std::string resolvePart(const std::string& folder, std::string_view target) {
+    if (!target.empty() && target[0] == '/') return std::string(target.substr(1));
+
+    std::string path = folder;
+    while (target.substr(0, 3) == "../") {
+        target.remove_prefix(3);
+        size_t slash = path.find_last_of('/', path.size() >= 2 ? path.size() - 2 : 0);
+        path = (slash == std::string::npos) ? std::string() : path.substr(0, slash + 1);
+    }
+    return path + std::string(target);
+}
+
+std::string folderOf(const std::string& part) {
+    size_t slash = part.find_last_of('/');
+    return (slash == std::string::npos) ? std::string() : part.substr(0, slash + 1);
+}
+
+// _rels/<part>.rels next to part
+std::string relationshipsOf(const std::string& part) {
+    size_t slash = part.find_last_of('/');
+    if (slash == std::string::npos) return "_rels/" + part + ".rels";
+    return part.substr(0, slash + 1) + "_rels/" + part.substr(slash + 1) + ".rels";
+}
+
+bool endsWith(std::string_view text, std::string_view suffix) {
+    return text.size() >= suffix.size() && text.substr(text.size() - suffix.size()) == suffix;
+}
+
+bool streamPart(const ZipArchive& package, const std::string& part, XmlHandler& handler) {
+    const ZipArchive::Entry* entry = package.find(part);
+    if (!entry) return false;
+
+    XmlScanner scanner(handler);
+    bool read = package.read(*entry, [&scanner](const char* data, size_t size) {
+        scanner.feed(data, size);
+        return true;
+    });
+    return scanner.finish() && read;
+}
+
+struct Relationship {
+    std::string target;
+    std::string type;
+};
+
+class RelationshipsHandler : public XmlHandler {
+public:
+    std::unordered_map<std::string, Relationship> byId;
+
+    void startElement(std::string_view name, const XmlAttributes& attributes) override {
+        if (name != "Relationship") return;
+        Relationship& relationship = byId[std::string(attributes.get("Id"))];
+        relationship.target = std::string(attributes.get("Target"));
+        relationship.type = std::string(attributes.get("Type"));
+    }
+
+    void endElement(std::string_view) override {}
+
+    void characters(std::string_view) override {}
+};
+
+class WorkbookHandler : public XmlHandler {
+public:
+    std::vector<std::pair<std::string, std::string>> sheets;    // name, relationship id
+
+    void startElement(std::string_view name, const XmlAttributes& attributes) override {
+        if (name != "sheet") return;
+        std::string sheetName(attributes.get("name"));
+        sheets.emplace_back(sheetName, std::string(attributes.get("id")));
+    }
+
+    void endElement(std::string_view) override {}
+
+    void characters(std::string_view) override {}
+};
+
+// Text of each <si>, runs joined and phonetic guides left out
+class SharedStringsHandler : public XmlHandler {
+public:
+    explicit SharedStringsHandler(std::vector<std::wstring>& strings) : strings(strings) {}
+
+    void startElement(std::string_view name, const XmlAttributes&) override {
+        if (name == "si") current.clear();
+        else if (name == "rPh") phonetic++;
+        else if (name == "t") inText = phonetic == 0;
+    }
+
+    void endElement(std::string_view name) override {
+        if (name == "si") strings.push_back(widen(current));
+        else if (name == "rPh") phonetic--;
+        else if (name == "t") inText = false;
+    }
+
+    void characters(std::string_view text) override {
+        if (inText) current.append(text.data(), text.size());
+    }
+
+private:
+    std::vector<std::wstring>& strings;
+    std::string current;
+    int phonetic = 0;
+    bool inText = false;
+};
+
+}
+
+class XlsxCellSource::SheetHandler : public XmlHandler {
+public:
+    SheetHandler(SheetData& sheet, std::vector<std::wstring>& strings, std::vector<Formula>& formulas,
+        size_t sharedStrings)
+        : sheet(sheet), strings(strings), formulas(formulas), sharedStrings(sharedStrings) {}
+
+    void startElement(std::string_view name, const XmlAttributes& attributes) override {
+        if (name == "c") {
+            // Cells without an address follow the one before
+            bool absoluteRow, absoluteCol;
+            std::string_view address = attributes.get("r");
+            if (address.empty() || !parseAddress(address, row, col, absoluteRow, absoluteCol)) {
+                col = nextCol;
+            }
+            type = typeOf(attributes.get("t"));
+            value.clear();
+            formula.clear();
+            hasFormula = false;
+            sharedIndex = -1;
+        }
+        else if (name == "v") {
+            target = &value;
+        }
+        else if (name == "f") {
+            std::string_view formulaType = attributes.get("t");
+            // Data tables are filled in by Excel; their cells keep their values
+            hasFormula = formulaType != "dataTable";
+            if (formulaType == "shared") sharedIndex = std::atoi(std::string(attributes.get("si")).c_str());
+            target = &formula;
+        }
+        else if (name == "t") {
+            if (phonetic == 0) target = &value;
+        }
+        else if (name == "rPh") {
+            phonetic++;
+        }
+        else if (name == "row") {
+            std::string_view number = attributes.get("r");
+            row = number.empty() ? row + 1 : std::atoi(std::string(number).c_str()) - 1;
+            nextCol = 0;
+        }
+    }
+
+    void endElement(std::string_view name) override {
+        if (name == "v" || name == "f" || name == "t") {
+            target = nullptr;
+        }
+        else if (name == "rPh") {
+            phonetic--;
+        }
+        else if (name == "c") {
+            addCell();
+            nextCol = col + 1;
+        }
+    }
+
+    void characters(std::string_view text) override {
+        if (target) target->append(text.data(), text.size());
+    }
+
+private:
+    enum class Type {
+        Number,
+        SharedString,
+        String,         // formula result or inline string
+        Boolean,
+        Error
+    };
+
+    static Type typeOf(std::string_view type) {
+        if (type == "s") return Type::SharedString;
+        if (type == "str" || type == "inlineStr") return Type::String;
+        if (type == "b") return Type::Boolean;
+        if (type == "e") return Type::Error;
+        return Type::Number;
+    }
+
+    void addCell() {
+        if (row < 0 || row >= MAX_SHEET_ROWS || col < 0 || col >= MAX_SHEET_COLS) return;
+
+        Cell cell;
+        cell.row = row;
+        cell.col = col;
+
+        if (hasFormula) {
+            if (!formula.empty()) {
+                // The first cell of a shared group holds the text for all of them
+                cell.formula = (uint32_t)formulas.size();
+                formulas.push_back(Formula{ formula, row, col });
+                if (sharedIndex >= 0) anchors[sharedIndex] = cell.formula;
+            }
+            else {
+                auto anchor = anchors.find(sharedIndex);
+                if (anchor == anchors.end()) {
+                    hasFormula = false;
+                }
+                else {
+                    cell.formula = anchor->second;
+                }
+            }
+        }
+
+        switch (type) {
+        case Type::SharedString: {
+            uint32_t index = (uint32_t)std::strtoul(value.c_str(), nullptr, 10);
+            if (value.empty() || index >= sharedStrings) return;
+            cell.kind = CellKind::STRING;
+            cell.text = index;
+            break;
+        }
+
+        case Type::String:
+            cell.kind = CellKind::STRING;
+            cell.text = (uint32_t)strings.size();
+            strings.push_back(widen(value));
+            break;
+
+        case Type::Boolean:
+            cell.kind = CellKind::BOOLEAN;
+            cell.number = (value == "1") ? 1.0 : 0.0;
+            break;
+
+        case Type::Error:
+            cell.kind = CellKind::ERROR;
+            if (!parseErrorText(value, cell.error)) cell.error = ErrorCode::Value;
+            break;
+
+        case Type::Number:
+            if (!value.empty()) {
+                cell.kind = CellKind::NUMBER;
+                cell.number = std::strtod(value.c_str(), nullptr);
+            }
+            else if (hasFormula) {
+                cell.kind = CellKind::NUMBER;
+            }
+            else {
+                // Formatted but empty
+                return;
+            }
+            break;
+        }
+
+        sheet.cells.push_back(cell);
+    }
+
+    SheetData& sheet;
+    std::vector<std::wstring>& strings;
+    std::vector<Formula>& formulas;
+    size_t sharedStrings;
+
+    std::unordered_map<int, uint32_t> anchors;   // shared formulas by si
+    int row = -1;
+    int col = 0;
+    int nextCol = 0;
+    Type type = Type::Number;
+    std::string value;
+    std::string formula;
+    std::string* target = nullptr;
+    bool hasFormula = false;
+    int sharedIndex = -1;
+    int phonetic = 0;
+};
+
+bool XlsxCellSource::load(const std::string& path, const std::vector<std::string>& onlySheets) {
+    sheets.clear();
+    strings.clear();
+    formulas.clear();
+    error.clear();
+
+    ZipArchive package;
+    if (!package.open(path)) {
+        error = "cannot open " + path + " as a ZIP package";
+        return false;
+    }
+
+    std::string sharedStringsPart;
+    if (!readWorkbook(package, sharedStringsPart)) return false;
+
+    if (!sharedStringsPart.empty() && package.find(sharedStringsPart)) {
+        SharedStringsHandler handler(strings);
+        if (!streamPart(package, sharedStringsPart, handler)) {
+            error = "corrupt part " + sharedStringsPart;
+            return false;
+        }
+    }
+
+    for (SheetData& sheet : sheets) {
+        bool wanted = onlySheets.empty() ||
+            std::find(onlySheets.begin(), onlySheets.end(), sheet.name) != onlySheets.end();
+        if (wanted && !sheet.part.empty() && !readSheet(package, sheet)) return false;
+    }
+
+    strings.shrink_to_fit();
+    formulas.shrink_to_fit();
+    return true;
+}
+
+bool XlsxCellSource::readWorkbook(const ZipArchive& package, std::string& sharedStringsPart) {
+    // The package relationships say where the workbook is
+    std::string workbookPart = "xl/workbook.xml";
+    RelationshipsHandler packageRelationships;
+    if (streamPart(package, "_rels/.rels", packageRelationships)) {
+        for (const auto& relationship : packageRelationships.byId) {
+            if (endsWith(relationship.second.type, "/officeDocument")) {
+                workbookPart = resolvePart("", relationship.second.target);
+            }
+        }
+    }
+
+    WorkbookHandler workbook;
+    if (!streamPart(package, workbookPart, workbook)) {
+        error = "no workbook part " + workbookPart;
+        return false;
+    }
+
+    RelationshipsHandler relationships;
+    streamPart(package, relationshipsOf(workbookPart), relationships);
+    std::string folder = folderOf(workbookPart);
+    for (const auto& relationship : relationships.byId) {
+        if (endsWith(relationship.second.type, "/sharedStrings")) {
+            sharedStringsPart = resolvePart(folder, relationship.second.target);
+        }
+    }
+
+    for (const auto& entry : workbook.sheets) {
+        sheets.emplace_back();
+        sheets.back().name = entry.first;
+
+        // Chart sheets and dialogs have no cells
+        auto relationship = relationships.byId.find(entry.second);
+        if (relationship != relationships.byId.end() && endsWith(relationship->second.type, "/worksheet")) {
+            sheets.back().part = resolvePart(folder, relationship->second.target);
+        }
+    }
+    return true;
+}
+
+bool XlsxCellSource::readSheet(const ZipArchive& package, SheetData& sheet) {
+    SheetHandler handler(sheet, strings, formulas, strings.size());
+    if (!streamPart(package, sheet.part, handler)) {
+        error = "corrupt or missing part " + sheet.part + " of sheet " + sheet.name;
+        return false;
+    }
+
+    std::vector<Cell>& cells = sheet.cells;
+    cells.shrink_to_fit();
+    auto before = [](const Cell& a, const Cell& b) { return a.row != b.row ? a.row < b.row : a.col < b.col; };
+    if (!std::is_sorted(cells.begin(), cells.end(), before)) {
+        std::stable_sort(cells.begin(), cells.end(), before);
+    }
+    if (cells.empty()) return true;
+
+    sheet.firstRow = cells.front().row;
+    sheet.lastRow = cells.back().row + 1;
+    sheet.firstCol = cells.front().col;
+    sheet.lastCol = cells.front().col + 1;
+    for (const Cell& cell : cells) {
+        sheet.firstCol = std::min(sheet.firstCol, (int)cell.col);
+        sheet.lastCol = std::max(sheet.lastCol, (int)cell.col + 1);
+    }
+
+    sheet.rowStarts.assign(sheet.lastRow - sheet.firstRow + 1, 0);
+    size_t index = 0;
+    for (int row = sheet.firstRow; row <= sheet.lastRow; ++row) {
+        while (index < cells.size() && cells[index].row < row) ++index;
+        sheet.rowStarts[row - sheet.firstRow] = (uint32_t)index;
+    }
+    return true;
+}
+
+const XlsxCellSource::Cell* XlsxCellSource::findCell(int sheet, int row, int col) const {
+    if (sheet < 0 || sheet >= (int)sheets.size()) return nullptr;
+
+    const SheetData& data = sheets[sheet];
+    if (row < data.firstRow || row >= data.lastRow) return nullptr;
+
+    auto first = data.cells.begin() + data.rowStarts[row - data.firstRow];
+    auto last = data.cells.begin() + data.rowStarts[row - data.firstRow + 1];
+    auto it = std::lower_bound(first, last, col, [](const Cell& cell, int c) { return cell.col < c; });
+    return (it != last && it->col == col) ? &*it : nullptr;
+}
+
+size_t XlsxCellSource::memoryBytes() const {
+    size_t bytes = 0;
+    for (const SheetData& sheet : sheets) {
+        bytes += sheet.cells.capacity() * sizeof(Cell) + sheet.rowStarts.capacity() * sizeof(uint32_t);
+    }
+    for (const auto& text : strings) {
+        bytes += sizeof(text) + text.capacity() * sizeof(wchar_t);
+    }
+    for (const Formula& formula : formulas) {
+        bytes += sizeof(formula) + formula.text.capacity();
+    }
+    bytes += shifted.capacity() + current.capacity() * sizeof(wchar_t);
+    return bytes;
+}
+
+int XlsxCellSource::sheetCount() const {
+    return (int)sheets.size();
+}
+
+std::string XlsxCellSource::sheetName(int sheet) const {
+    return (sheet >= 0 && sheet < (int)sheets.size()) ? sheets[sheet].name : "";
+}
+
+bool XlsxCellSource::readCell(int sheet, int row, int col, CellData& cell) {
+    const Cell* found = findCell(sheet, row, col);
+    if (!found) return false;
+
+    cell.kind = found->kind;
+    cell.isFormula = found->formula != NO_FORMULA;
+    cell.number = found->number;
+    cell.text = (found->kind == CellKind::STRING) ? std::wstring_view(strings[found->text]) : std::wstring_view();
+    cell.error = found->error;
+    return true;
+}
+
+std::wstring_view XlsxCellSource::readFormula(int sheet, int row, int col) {
+    const Cell* found = findCell(sheet, row, col);
+    if (!found || found->formula == NO_FORMULA) return std::wstring_view();
+
+    const Formula& formula = formulas[found->formula];
+    shiftFormula(formula.text, row - formula.row, col - formula.col, shifted);
+    current.clear();
+    appendWide(shifted, current);
+    return current;
+}
+
+void XlsxCellSource::usedRange(int sheet, int& firstRow, int& lastRow, int& firstCol, int& lastCol) const {
+    firstRow = lastRow = firstCol = lastCol = 0;
+    if (sheet < 0 || sheet >= (int)sheets.size()) return;
+
+    const SheetData& data = sheets[sheet];
+    firstRow = data.firstRow;
+    lastRow = data.lastRow;
+    firstCol = data.firstCol;
+    lastCol = data.lastCol;
+}
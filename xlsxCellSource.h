@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "cellSource.h"
+#include "zipArchive.h"
+
+// CellSource reading an .xlsx workbook directly, without libxl. The file is
+// memory-mapped and each part needed (workbook, shared strings, sheets) is
+// inflated in chunks straight into a SAX parser, so no part is ever held
+// whole. Cells keep their saved values; formulas keep their text. A shared
+// formula is kept once, as written in the first cell of its group, and is
+// shifted to the other cells as they are read.
+//
+// Read-only: the workbook is never written back.
+class XlsxCellSource : public CellSource {
+public:
+    // Load the workbook; sheets not named in onlySheets (every sheet when
+    // it is empty) are listed but left without cells, and their parts are
+    // never inflated. False on failure, with the reason in lastError().
+    bool load(const std::string& path, const std::vector<std::string>& onlySheets = {});
+
+    const std::string& lastError() const { return error; }
+
+    size_t memoryBytes() const override;
+
+    // CellSource
+    int sheetCount() const override;
+
+    std::string sheetName(int sheet) const override;
+
+    bool readCell(int sheet, int row, int col, CellData& cell) override;
+
+    std::wstring_view readFormula(int sheet, int row, int col) override;
+
+    void usedRange(int sheet, int& firstRow, int& lastRow, int& firstCol, int& lastCol) const override;
+
+private:
+    static const uint32_t NO_FORMULA = 0xFFFFFFFF;
+
+    struct Cell {
+        int32_t row = 0;
+        int32_t col = 0;
+        double number = 0.0;            // NUMBER, BOOLEAN (0/1)
+        uint32_t text = 0;              // STRING: index into strings
+        uint32_t formula = NO_FORMULA;  // index into formulas, shared by a group
+        CellKind kind = CellKind::EMPTY;
+        ErrorCode error = ErrorCode::NA;
+    };
+
+    // Text as stored in the sheet XML and the cell it was written for
+    struct Formula {
+        std::string text;
+        int32_t row = 0;
+        int32_t col = 0;
+    };
+
+    // Builds the cells of one sheet from its XML
+    class SheetHandler;
+
+    struct SheetData {
+        std::string name;
+        std::string part;               // path of the sheet XML in the package
+        std::vector<Cell> cells;        // by row, then column
+        std::vector<uint32_t> rowStarts;    // first cell of each row from firstRow, plus an end marker
+        int firstRow = 0;
+        int lastRow = 0;
+        int firstCol = 0;
+        int lastCol = 0;
+    };
+
+    bool readWorkbook(const ZipArchive& package, std::string& sharedStringsPart);
+
+    bool readSheet(const ZipArchive& package, SheetData& sheet);
+
+    const Cell* findCell(int sheet, int row, int col) const;
+
+    std::vector<SheetData> sheets;
+    std::vector<std::wstring> strings;      // shared strings, then inline ones
+    std::vector<Formula> formulas;
+    std::string shifted;                    // last formula read, before and
+    std::wstring current;                   // after widening
+    std::string error;
+};
@@ -1,531 +1,1544 @@
-#include "stdafx.h"
-#include"xlsxFormulaEvaluator.h"
-
-
-
-TreeFormulaEvaluator::TreeFormulaEvaluator(Book* b) : book(b) {
-    // Cache all sheets
-    for (int i = 0; i < book->sheetCount(); ++i) {
-        Sheet* sheet = book->getSheet(i);
-        if (sheet) {
-            std::wstring wname = sheet->name();
-            std::string name(wname.begin(), wname.end());
-            sheets[name] = sheet;
-        }
-    }
-}
-
-// Tokenize formula string
-std::vector<Token> TreeFormulaEvaluator::tokenize(const std::string& formula) {
-    std::vector<Token> tokens;
-    std::string cleanFormula = formula;
-
-    // Remove = and leading +
-    if (!cleanFormula.empty() && cleanFormula[0] == '=') {
-        cleanFormula = cleanFormula.substr(1);
-    }
-    if (!cleanFormula.empty() && cleanFormula[0] == '+') {
-        cleanFormula = cleanFormula.substr(1);
-    }
-
-    size_t i = 0;
-    while (i < cleanFormula.length()) {
-        char c = cleanFormula[i];
-
-        // Skip whitespace
-        if (std::isspace(c)) {
-            i++;
-            continue;
-        }
-
-        // Operators and parentheses
-        if (c == '+' || c == '-' || c == '*' || c == '/') {
-            tokens.emplace_back(Token::OPERATOR, std::string(1, c));
-            i++;
-        }
-        else if (c == '(') {
-            tokens.emplace_back(Token::LPAREN, "(");
-            i++;
-        }
-        else if (c == ')') {
-            tokens.emplace_back(Token::RPAREN, ")");
-            i++;
-        }
-        else if (c == ',') {
-            tokens.emplace_back(Token::COMMA, ",");
-            i++;
-        }
-        // Numbers (constants)
-        else if (std::isdigit(c) || c == '.') {
-            std::string number;
-            while (i < cleanFormula.length() && (std::isdigit(cleanFormula[i]) || cleanFormula[i] == '.')) {
-                number += cleanFormula[i++];
-            }
-            tokens.emplace_back(Token::CONSTANT, number);
-        }
-        // Functions, cell references, ranges
-        else if (std::isalpha(c)) {
-            std::string identifier;
-            std::string sheetName;
-
-            // Read the identifier
-            while (i < cleanFormula.length() &&
-                (std::isalnum(cleanFormula[i]) || cleanFormula[i] == '_')) {
-                identifier += cleanFormula[i++];
-            }
-
-            // Check for sheet reference (!)
-            if (i < cleanFormula.length() && cleanFormula[i] == '!') {
-                sheetName = identifier;
-                identifier = "";
-                i++; // skip !
-
-                // Read the actual cell reference after !
-                while (i < cleanFormula.length() &&
-                    (std::isalnum(cleanFormula[i]) || cleanFormula[i] == '_')) {
-                    identifier += cleanFormula[i++];
-                }
-            }
-
-            // Check if it's followed by ( - then it's a function
-            if (i < cleanFormula.length() && cleanFormula[i] == '(') {
-                tokens.emplace_back(Token::FUNCTION, identifier);
-            }
-            // Check if it contains : - then it might be a range
-            else if (i < cleanFormula.length() && cleanFormula[i] == ':') {
-                // This is start of a range, read the full range
-                std::string range = identifier;
-                range += cleanFormula[i++]; // add :
-
-                // Read end of range
-                while (i < cleanFormula.length() &&
-                    (std::isalnum(cleanFormula[i]) || cleanFormula[i] == '_')) {
-                    range += cleanFormula[i++];
-                }
-                tokens.emplace_back(Token::RANGE, range, sheetName);
-            }
-            // Regular cell reference
-            else {
-                tokens.emplace_back(Token::CELL_REF, identifier, sheetName);
-            }
-        }
-        else {
-            // Unknown character, skip
-            i++;
-        }
-    }
-
-    return tokens;
-}
-
-// Parse tokens into expression tree
-std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parse(const std::vector<Token>& tokens) {
-    size_t index = 0;
-    return parseExpression(tokens, index);
-}
-
-// Parse expression with operator precedence
-std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parseExpression(const std::vector<Token>& tokens, size_t& index) {
-    return parseAddition(tokens, index);
-}
-
-std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parseAddition(const std::vector<Token>& tokens, size_t& index) {
-    auto left = parseMultiplication(tokens, index);
-
-    while (index < tokens.size() &&
-        tokens[index].type == Token::OPERATOR &&
-        (tokens[index].value == "+" || tokens[index].value == "-")) {
-
-        std::string op = tokens[index].value;
-        index++;
-        auto right = parseMultiplication(tokens, index);
-
-        auto opNode = std::make_shared<FormulaNode>(FormulaNode::OPERATOR, op);
-        opNode->addChild(left);
-        opNode->addChild(right);
-        left = opNode;
-    }
-
-    return left;
-}
-
-std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parseMultiplication(const std::vector<Token>& tokens, size_t& index) {
-    auto left = parseFactor(tokens, index);
-
-    while (index < tokens.size() &&
-        tokens[index].type == Token::OPERATOR &&
-        (tokens[index].value == "*" || tokens[index].value == "/")) {
-
-        std::string op = tokens[index].value;
-        index++;
-        auto right = parseFactor(tokens, index);
-
-        auto opNode = std::make_shared<FormulaNode>(FormulaNode::OPERATOR, op);
-        opNode->addChild(left);
-        opNode->addChild(right);
-        left = opNode;
-    }
-
-    return left;
-}
-
-std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parseFactor(const std::vector<Token>& tokens, size_t& index) {
-    if (index >= tokens.size()) return nullptr;
-
-    const Token& token = tokens[index];
-
-    // Parentheses
-    if (token.type == Token::LPAREN) {
-        index++; // skip (
-        auto expr = parseExpression(tokens, index);
-        if (index < tokens.size() && tokens[index].type == Token::RPAREN) {
-            index++; // skip )
-        }
-        return expr;
-    }
-
-    // Functions
-    if (token.type == Token::FUNCTION) {
-        std::string funcName = token.value;
-        index++; // skip function name
-
-        auto funcNode = std::make_shared<FormulaNode>(FormulaNode::FUNCTION, funcName);
-
-        if (index < tokens.size() && tokens[index].type == Token::LPAREN) {
-            index++; // skip (
-
-            // Parse function arguments
-            while (index < tokens.size() && tokens[index].type != Token::RPAREN) {
-                if (tokens[index].type == Token::RANGE) {
-                    auto rangeNode = std::make_shared<FormulaNode>(
-                        FormulaNode::RANGE,
-                        tokens[index].value,
-                        tokens[index].sheetName
-                    );
-                    funcNode->addChild(rangeNode);
-                    index++;
-                }
-                else if (tokens[index].type == Token::COMMA) {
-                    index++; // skip comma
-                }
-                else {
-                    auto arg = parseExpression(tokens, index);
-                    if (arg) funcNode->addChild(arg);
-                }
-            }
-
-            if (index < tokens.size() && tokens[index].type == Token::RPAREN) {
-                index++; // skip )
-            }
-        }
-
-        return funcNode;
-    }
-
-    // Cell references
-    if (token.type == Token::CELL_REF) {
-        auto cellNode = std::make_shared<FormulaNode>(
-            FormulaNode::CELL_REF,
-            token.value,
-            token.sheetName
-        );
-        index++;
-        return cellNode;
-    }
-
-    // Constants
-    if (token.type == Token::CONSTANT) {
-        auto constNode = std::make_shared<FormulaNode>(FormulaNode::CONSTANT, token.value);
-        index++;
-        return constNode;
-    }
-
-    // Ranges (standalone)
-    if (token.type == Token::RANGE) {
-        auto rangeNode = std::make_shared<FormulaNode>(
-            FormulaNode::RANGE,
-            token.value,
-            token.sheetName
-        );
-        index++;
-        return rangeNode;
-    }
-
-    return nullptr;
-}
-
-double TreeFormulaEvaluator::evaluateFunction(std::shared_ptr<FormulaNode> node) {
-    if (node->value == "SUM") {
-        return evaluateSum(node);
-    }
-    // Add other functions as needed (AVERAGE, MAX, etc.)
-    return 0.0;
-}
-
-// Evaluate the tree
-double TreeFormulaEvaluator::evaluate(std::shared_ptr<FormulaNode> node)  {
-    if (!node) return 0.0;
-
-    // Check for circular reference
-    if (node->isEvaluating) {
-        std::cout << "Circular reference detected!" << std::endl;
-        return 0.0;
-    }
-
-    // Return cached result if already evaluated
-    if (node->isEvaluated) {
-        return node->cachedResult;
-    }
-
-    node->isEvaluating = true;
-    double result = 0.0;
-
-    switch (node->type) {
-    case FormulaNode::CONSTANT:
-        result = std::stod(node->value);
-        break;
-
-    case FormulaNode::CELL_REF:
-        result = evaluateCellReference(node);
-        break;
-
-    case FormulaNode::FUNCTION:
-        result = evaluateFunction(node);
-        break;
-
-    case FormulaNode::OPERATOR:
-        result = evaluateOperator(node);
-        break;
-
-    case FormulaNode::RANGE:
-        // Ranges are typically handled within functions
-        result = 0.0;
-        break;
-    }
-
-    node->isEvaluating = false;
-    node->isEvaluated = true;
-    node->cachedResult = result;
-
-    return result;
-}
-
-double TreeFormulaEvaluator::evaluateCellReference(std::shared_ptr<FormulaNode> node)  {
-    Sheet* sheet = getSheet(node->sheetName);
-    if (!sheet) return 0.0;
-
-    auto [row, col] = parseCellAddress(node->value);
-    if (row < 0 || col < 0) return 0.0;
-
-    std::cout << "Evaluating cell " << node->toString() << std::endl;
-
-    CellType cellType = sheet->cellType(row, col);
-	bool isFormula = sheet->isFormula(row, col);
-    if (!isFormula && (cellType == CELLTYPE_STRING || cellType == CELLTYPE_NUMBER)) {
-        if(cellType == CELLTYPE_NUMBER) {
-            // Direct numeric value
-            double value = sheet->readNum(row, col);
-            std::cout << "  Direct numeric value: " << value << std::endl;
-            return value;
-		}
-        std::wstring cvalue = sheet->readStr(row, col);
-        std::string svalue(cvalue.begin(), cvalue.end());
-        double value = std::stoi(svalue);
-        //double value = sheet->readNum(row, col);
-        std::cout << "  Direct value: " << value << std::endl;
-        return value;
-    }
-    else if (isFormula/*cellType == CELLTYPE_FORMULA*/) {
-        // Try pre-calculated value first
-        double preCalc = sheet->readNum(row, col);
-        if (preCalc != 0.0) {
-            std::cout << "  Pre-calculated: " << preCalc << std::endl;
-            return preCalc;
-        }
-
-        // Evaluate formula recursively
-        const wchar_t* formula = sheet->readFormula(row, col);
-        if (formula) {
-            std::string formulaStr(formula, formula + wcslen(formula));
-            std::wcout << L"  Has formula: " << formula << std::endl;
-
-            auto tokens = tokenize(formulaStr);
-            auto tree = parse(tokens);
-            double result = evaluate(tree);
-            std::cout << "  Recursive result: " << result << std::endl;
-            return result;
-        }
-    }
-
-
-    return 0.0;
-}
-
-double TreeFormulaEvaluator::evaluateSum(std::shared_ptr<FormulaNode> node) {
-    double sum = 0.0;
-    std::cout << "Evaluating SUM function" << std::endl;
-
-    for (auto& child : node->children) {
-        if (child->type == FormulaNode::RANGE) {
-            sum += evaluateRange(child);
-        }
-        else {
-            sum += evaluate(child);
-        }
-    }
-
-    std::cout << "SUM result: " << sum << std::endl;
-    return sum;
-}
-
-double TreeFormulaEvaluator::evaluateRange(std::shared_ptr<FormulaNode> node) {
-    std::string range = node->value;
-    std::cout << "Evaluating range: " << node->toString() << std::endl;
-
-    // Parse range like "G22:L22"
-    size_t colonPos = range.find(':');
-    if (colonPos == std::string::npos) {
-        // Single cell
-        auto singleCell = std::make_shared<FormulaNode>(
-            FormulaNode::CELL_REF, range, node->sheetName);
-        return evaluate(singleCell);
-    }
-
-    std::string startCell = range.substr(0, colonPos);
-    std::string endCell = range.substr(colonPos + 1);
-
-    auto [startRow, startCol] = parseCellAddress(startCell);
-    auto [endRow, endCol] = parseCellAddress(endCell);
-
-    Sheet* sheet = getSheet(node->sheetName);
-    if (!sheet) return 0.0;
-
-    double sum = 0.0;
-    for (int row = startRow; row <= endRow; ++row) {
-        for (int col = startCol; col <= endCol; ++col) {
-            std::string cellAddr = columnToLetter(col) + std::to_string(row + 1);
-            auto cellNode = std::make_shared<FormulaNode>(
-                FormulaNode::CELL_REF, cellAddr, node->sheetName);
-            sum += evaluate(cellNode);
-        }
-    }
-
-    return sum;
-}
-
-double TreeFormulaEvaluator::evaluateOperator(std::shared_ptr<FormulaNode> node) {
-    if (node->children.size() != 2) return 0.0;
-
-    double left = evaluate(node->children[0]);
-    double right = evaluate(node->children[1]);
-
-    std::cout << "Operator " << node->value << ": " << left << " " << node->value << " " << right;
-
-    if (node->value == "+") {
-        double result = left + right;
-        std::cout << " = " << result << std::endl;
-        return result;
-    }
-    else if (node->value == "-") {
-        double result = left - right;
-        std::cout << " = " << result << std::endl;
-        return result;
-    }
-    else if (node->value == "*") {
-        double result = left * right;
-        std::cout << " = " << result << std::endl;
-        return result;
-    }
-    else if (node->value == "/") {
-        double result = (right != 0) ? left / right : 0.0;
-        std::cout << " = " << result << std::endl;
-        return result;
-    }
-
-    return 0.0;
-}
-
-Sheet* TreeFormulaEvaluator::getSheet(const std::string& sheetName) {
-    if (sheetName.empty()) {
-        return book->getSheet(0); // Default sheet
-    }
-
-    auto it = sheets.find(sheetName);
-    return (it != sheets.end()) ? it->second : nullptr;
-}
-
-std::pair<int, int> TreeFormulaEvaluator::parseCellAddress(const std::string& cellAddr) {
-    std::string colPart, rowPart;
-
-    for (char c : cellAddr) {
-        if (std::isalpha(c)) {
-            colPart += c;
-        }
-        else if (std::isdigit(c)) {
-            rowPart += c;
-        }
-    }
-
-    if (colPart.empty() || rowPart.empty()) {
-        return { -1, -1 };
-    }
-
-    int col = 0;
-    for (char c : colPart) {
-        col = col * 26 + (std::toupper(c) - 'A' + 1);
-    }
-    col--; // Convert to 0-based
-
-    int row = std::stoi(rowPart) - 1; // Convert to 0-based
-
-    return { row, col };
-}
-
-std::string TreeFormulaEvaluator::columnToLetter(int col) {
-    std::string result;
-    while (col >= 0) {
-        result = char('A' + (col % 26)) + result;
-        col = col / 26 - 1;
-    }
-    return result;
-}
-
-// Main evaluation function
-double TreeFormulaEvaluator::evaluateFormula(const std::string& formula) {
-    std::cout << "\n=== Evaluating Formula: " << formula << " ===" << std::endl;
-
-    auto tokens = tokenize(formula);
-
-    std::cout << "Tokens: ";
-    for (const auto& token : tokens) {
-        std::cout << "[" << token.value << "] ";
-    }
-    std::cout << std::endl;
-
-    auto tree = parse(tokens);
-    if (!tree) {
-        std::cout << "Failed to parse formula!" << std::endl;
-        return 0.0;
-    }
-
-    double result = evaluate(tree);
-    std::cout << "Final result: " << result << std::endl;
-    return result;
-}
-
-// Helper to print tree structure (for debugging puspose only )
-void TreeFormulaEvaluator::printTree(std::shared_ptr<FormulaNode> node, int depth)  {
-    if (!node) return;
-
-    std::string indent(depth * 2, ' ');
-    std::cout << indent << node->toString() << " (" <<
-        (node->type == FormulaNode::OPERATOR ? "OP" :
-            node->type == FormulaNode::FUNCTION ? "FUNC" :
-            node->type == FormulaNode::CELL_REF ? "CELL" :
-            node->type == FormulaNode::CONSTANT ? "CONST" : "RANGE")
-        << ")" << std::endl;
-
-    for (auto& child : node->children) {
-        printTree(child, depth + 1);
-    }
-}
+#include "stdafx.h"
+#include"xlsxFormulaEvaluator.h"
+#include <charconv>
+#include "textEncoding.h"
+
+
+
+TreeFormulaEvaluator::TreeFormulaEvaluator(CellSource& cells)
+    : source(&cells), exprtk(snapshot, subexpressions), binder(symbols, sheetIndices) {
+    snapshot.load(*source);
+
+    // Cache all sheet names
+    for (int i = 0; i < snapshot.sheetCount(); ++i) {
+        sheetIndices[snapshot.sheet(i).name] = i;
+    }
+}
+
+// Tokenize formula string
+static std::string upperName(std::string name) {
+    for (char& c : name) c = (char)std::toupper((unsigned char)c);
+    return name;
+}
+
+// A constant's digits and points as one number; false for 1..2, . and
+// literals longer than the formula lexer keeps, which fail its parse too
+static bool readConstant(const std::string& text, double& value) {
+    if (text.size() > 255) return false;
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+std::vector<Token> TreeFormulaEvaluator::tokenize(const std::string& formula) {
+    std::vector<Token> tokens;
+    std::string cleanFormula = formula;
+
+    // Remove = and leading +
+    if (!cleanFormula.empty() && cleanFormula[0] == '=') {
+        cleanFormula = cleanFormula.substr(1);
+    }
+    if (!cleanFormula.empty() && cleanFormula[0] == '+') {
+        cleanFormula = cleanFormula.substr(1);
+    }
+
+    size_t i = 0;
+    while (i < cleanFormula.length()) {
+        char c = cleanFormula[i];
+
+        // Skip whitespace
+        if (std::isspace(c)) {
+            i++;
+            continue;
+        }
+
+        // Operators and parentheses
+        if (c == '+' || c == '-' || c == '*' || c == '/') {
+            tokens.emplace_back(Token::OPERATOR, std::string(1, c));
+            i++;
+        }
+        else if (c == '(') {
+            tokens.emplace_back(Token::LPAREN, "(");
+            i++;
+        }
+        else if (c == ')') {
+            tokens.emplace_back(Token::RPAREN, ")");
+            i++;
+        }
+        else if (c == ',') {
+            tokens.emplace_back(Token::COMMA, ",");
+            i++;
+        }
+        // Numbers (constants)
+        else if (std::isdigit(c) || c == '.') {
+            std::string number;
+            while (i < cleanFormula.length() && (std::isdigit(cleanFormula[i]) || cleanFormula[i] == '.')) {
+                number += cleanFormula[i++];
+            }
+            tokens.emplace_back(Token::CONSTANT, number);
+        }
+        // Functions, cell references, ranges
+        else if (std::isalpha(c)) {
+            std::string identifier;
+            std::string sheetName;
+
+            // Read the identifier
+            while (i < cleanFormula.length() &&
+                (std::isalnum(cleanFormula[i]) || cleanFormula[i] == '_')) {
+                identifier += cleanFormula[i++];
+            }
+
+            // Check for sheet reference (!)
+            if (i < cleanFormula.length() && cleanFormula[i] == '!') {
+                sheetName = identifier;
+                identifier = "";
+                i++; // skip !
+
+                // Read the actual cell reference after !
+                while (i < cleanFormula.length() &&
+                    (std::isalnum(cleanFormula[i]) || cleanFormula[i] == '_')) {
+                    identifier += cleanFormula[i++];
+                }
+            }
+
+            // Check if it's followed by ( - then it's a function
+            if (i < cleanFormula.length() && cleanFormula[i] == '(') {
+                tokens.emplace_back(Token::FUNCTION, identifier);
+            }
+            // Check if it contains : - then it might be a range
+            else if (i < cleanFormula.length() && cleanFormula[i] == ':') {
+                // This is start of a range, read the full range
+                std::string range = identifier;
+                range += cleanFormula[i++]; // add :
+
+                // Read end of range
+                while (i < cleanFormula.length() &&
+                    (std::isalnum(cleanFormula[i]) || cleanFormula[i] == '_')) {
+                    range += cleanFormula[i++];
+                }
+                tokens.emplace_back(Token::RANGE, range, sheetName);
+            }
+            // TRUE and FALSE, as 1 and 0
+            else if (sheetName.empty() && (upperName(identifier) == "TRUE" || upperName(identifier) == "FALSE")) {
+                tokens.emplace_back(Token::CONSTANT, upperName(identifier) == "TRUE" ? "1" : "0");
+            }
+            // Regular cell reference
+            else {
+                tokens.emplace_back(Token::CELL_REF, identifier, sheetName);
+            }
+        }
+        else {
+            // Unknown character, skip
+            i++;
+        }
+    }
+
+    return tokens;
+}
+
+// Parse tokens into expression tree
+std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parse(const std::vector<Token>& tokens) {
+    size_t index = 0;
+    auto tree = parseExpression(tokens, index);
+    return (index == tokens.size()) ? tree : nullptr;
+}
+
+// Parse expression with operator precedence
+std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parseExpression(const std::vector<Token>& tokens, size_t& index) {
+    return parseAddition(tokens, index);
+}
+
+std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parseAddition(const std::vector<Token>& tokens, size_t& index) {
+    auto left = parseMultiplication(tokens, index);
+    if (!left) return nullptr;
+
+    while (index < tokens.size() &&
+        tokens[index].type == Token::OPERATOR &&
+        (tokens[index].value == "+" || tokens[index].value == "-")) {
+
+        std::string op = tokens[index].value;
+        index++;
+        auto right = parseMultiplication(tokens, index);
+        if (!right) return nullptr;
+
+        auto opNode = std::make_shared<FormulaNode>(FormulaNode::OPERATOR, op);
+        opNode->addChild(left);
+        opNode->addChild(right);
+        left = opNode;
+    }
+
+    return left;
+}
+
+std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parseMultiplication(const std::vector<Token>& tokens, size_t& index) {
+    auto left = parseFactor(tokens, index);
+    if (!left) return nullptr;
+
+    while (index < tokens.size() &&
+        tokens[index].type == Token::OPERATOR &&
+        (tokens[index].value == "*" || tokens[index].value == "/")) {
+
+        std::string op = tokens[index].value;
+        index++;
+        auto right = parseFactor(tokens, index);
+        if (!right) return nullptr;
+
+        auto opNode = std::make_shared<FormulaNode>(FormulaNode::OPERATOR, op);
+        opNode->addChild(left);
+        opNode->addChild(right);
+        left = opNode;
+    }
+
+    return left;
+}
+
+std::shared_ptr<FormulaNode> TreeFormulaEvaluator::parseFactor(const std::vector<Token>& tokens, size_t& index) {
+    if (index >= tokens.size()) return nullptr;
+
+    const Token& token = tokens[index];
+
+    // Sign prefix, binding tighter than * and /: -x is 0 - x
+    if (token.type == Token::OPERATOR && (token.value == "-" || token.value == "+")) {
+        bool negate = token.value == "-";
+        index++;
+        auto operand = parseFactor(tokens, index);
+        if (!operand || !negate) return operand;
+
+        auto opNode = std::make_shared<FormulaNode>(FormulaNode::OPERATOR, "-");
+        opNode->addChild(std::make_shared<FormulaNode>(FormulaNode::CONSTANT, "0"));
+        opNode->addChild(operand);
+        return opNode;
+    }
+
+    // Parentheses
+    if (token.type == Token::LPAREN) {
+        index++; // skip (
+        auto expr = parseExpression(tokens, index);
+        if (!expr) return nullptr;
+        if (index < tokens.size() && tokens[index].type == Token::RPAREN) {
+            index++; // skip )
+        }
+        return expr;
+    }
+
+    // Functions
+    if (token.type == Token::FUNCTION) {
+        std::string funcName = token.value;
+        index++; // skip function name
+
+        auto funcNode = std::make_shared<FormulaNode>(FormulaNode::FUNCTION, funcName);
+
+        if (index < tokens.size() && tokens[index].type == Token::LPAREN) {
+            index++; // skip (
+
+            // Parse function arguments
+            while (index < tokens.size() && tokens[index].type != Token::RPAREN) {
+                if (tokens[index].type == Token::RANGE) {
+                    auto rangeNode = std::make_shared<FormulaNode>(
+                        FormulaNode::RANGE,
+                        tokens[index].value,
+                        tokens[index].sheetName
+                    );
+                    funcNode->addChild(rangeNode);
+                    index++;
+                }
+                else if (tokens[index].type == Token::COMMA) {
+                    index++; // skip comma
+                }
+                else {
+                    auto arg = parseExpression(tokens, index);
+                    if (!arg) return nullptr;
+                    funcNode->addChild(arg);
+                }
+            }
+
+            if (index < tokens.size() && tokens[index].type == Token::RPAREN) {
+                index++; // skip )
+            }
+        }
+
+        return funcNode;
+    }
+
+    // Cell references
+    if (token.type == Token::CELL_REF) {
+        auto cellNode = std::make_shared<FormulaNode>(
+            FormulaNode::CELL_REF,
+            token.value,
+            token.sheetName
+        );
+        index++;
+        return cellNode;
+    }
+
+    // Constants
+    double number;
+    if (token.type == Token::CONSTANT && readConstant(token.value, number)) {
+        auto constNode = std::make_shared<FormulaNode>(FormulaNode::CONSTANT, token.value);
+        index++;
+        return constNode;
+    }
+
+    // Ranges (standalone)
+    if (token.type == Token::RANGE) {
+        auto rangeNode = std::make_shared<FormulaNode>(
+            FormulaNode::RANGE,
+            token.value,
+            token.sheetName
+        );
+        index++;
+        return rangeNode;
+    }
+
+    return nullptr;
+}
+
+double TreeFormulaEvaluator::evaluateFunction(std::shared_ptr<FormulaNode> node) {
+    if (node->value == "SUM") {
+        return evaluateSum(node);
+    }
+    // Add other functions as needed (AVERAGE, MAX, etc.)
+    return 0.0;
+}
+
+// Evaluate the tree
+double TreeFormulaEvaluator::evaluate(std::shared_ptr<FormulaNode> node)  {
+    if (!node) return 0.0;
+
+    // Check for circular reference
+    if (node->isEvaluating) {
+        TRACE_WARNING(TraceKind::Circular, std::string_view(node->toString()));
+        return 0.0;
+    }
+
+    // Return cached result if already evaluated
+    if (node->isEvaluated) {
+        return node->cachedResult;
+    }
+
+    node->isEvaluating = true;
+    double result = 0.0;
+
+    switch (node->type) {
+    case FormulaNode::CONSTANT:
+        if (!readConstant(node->value, result)) result = Value::error(ErrorCode::Value).asNumber();
+        break;
+
+    case FormulaNode::CELL_REF:
+        result = evaluateCellReference(node);
+        break;
+
+    case FormulaNode::FUNCTION:
+        result = evaluateFunction(node);
+        break;
+
+    case FormulaNode::OPERATOR:
+        result = evaluateOperator(node);
+        break;
+
+    case FormulaNode::RANGE:
+        // Ranges are typically handled within functions
+        result = 0.0;
+        break;
+    }
+
+    node->isEvaluating = false;
+    node->isEvaluated = true;
+    node->cachedResult = result;
+
+    return result;
+}
+
+double TreeFormulaEvaluator::evaluateCellReference(std::shared_ptr<FormulaNode> node)  {
+    int sheetIndex = getSheetIndex(node->sheetName);
+    if (sheetIndex < 0) return 0.0;
+
+    auto [row, col] = parseCellAddress(node->value);
+    if (row < 0 || col < 0) return 0.0;
+
+    TRACE_DEBUG(TraceKind::CellRead, CellKey{ sheetIndex, row, col });
+
+    return treeNumber(evaluateCell(sheetIndex, row, col));
+}
+
+double TreeFormulaEvaluator::treeNumber(Value value) const {
+    Value number = numericValue(value, snapshot.strings());
+    return (number.isNumber() || number.isError()) ? number.asNumber() : std::nan("");
+}
+
+// Cell value through the workbook-wide result cache
+Value TreeFormulaEvaluator::evaluateCell(int sheetIndex, int row, int col) {
+    CellKey key{ sheetIndex, row, col };
+    uint8_t flags = snapshot.flags(sheetIndex, row, col);
+    if (!(flags & FORMULA)) {
+        // Constants are read from the snapshot, caching them gains nothing
+        return constantValue(key);
+    }
+
+    auto it = resultCache.find(key);
+    if (it != resultCache.end()) {
+        stats.hits++;
+        TRACE_DEBUG(TraceKind::CellCached, key, it->second);
+        return it->second;
+    }
+    stats.misses++;
+
+    // Reaching a cell already on the evaluation path is a circular
+    // reference; demand mode does not iterate, so it reads as 0
+    if (!evaluating.insert(key).second) {
+        TRACE_WARNING(TraceKind::Circular, key);
+        return Value::number(0.0);
+    }
+    Value value;
+    try {
+        value = readCellValue(key);
+    }
+    catch (...) {
+        evaluating.erase(key);
+        throw;
+    }
+    evaluating.erase(key);
+
+    resultCache[key] = value;
+    return value;
+}
+
+// Text is converted where it is used, by the operator or function reading it
+Value TreeFormulaEvaluator::constantValue(const CellKey& key) {
+    Value value = snapshot.value(key.sheet, key.row, key.col);
+    if (value.type() != ValueType::Empty) {
+        TRACE_DEBUG(TraceKind::CellConstant, key, value);
+    }
+    return value;
+}
+
+Value TreeFormulaEvaluator::readCellValue(const CellKey& key) {
+    uint8_t flags = snapshot.flags(key.sheet, key.row, key.col);
+    if (!(flags & FORMULA)) {
+        return constantValue(key);
+    }
+    else {
+        // Try pre-calculated value first
+        if (flags & CALCULATED) {
+            Value preCalc = snapshot.value(key.sheet, key.row, key.col);
+            TRACE_DEBUG(TraceKind::CellPrecalculated, key, preCalc);
+            return preCalc;
+        }
+
+        // Evaluate formula recursively
+        if (backend == EvaluationBackend::TreeWalker) {
+            std::wstring_view formula = snapshot.formula(key.sheet, key.row, key.col);
+            auto tree = parse(tokenize(toUtf8(formula)));
+            Value result = tree ? Value::unbox(evaluate(tree)) : Value::error(ErrorCode::Name);
+            TRACE_DEBUG(TraceKind::CellResult, key, result);
+            return result;
+        }
+
+        auto compiled = getCellFormula(key);
+        if (compiled && compiled->parsed) {
+            Value result = (backend == EvaluationBackend::Exprtk) ? exprtk.evaluate(compiled, *this)
+                                                                  : vm.run(compiled->program, *this);
+            TRACE_DEBUG(TraceKind::CellResult, key, result);
+            return result;
+        }
+    }
+
+    // A formula that does not parse
+    return Value::error(ErrorCode::Name);
+}
+
+// Parsed formula of a cell, read from the workbook only on a cache miss
+std::shared_ptr<CompiledFormula> TreeFormulaEvaluator::getCellFormula(const CellKey& key) {
+    auto compiled = formulaCache.findByCell(key);
+    if (compiled) return compiled;
+
+    std::wstring_view formula = snapshot.formula(key.sheet, key.row, key.col);
+    if (formula.empty()) return nullptr;
+
+    TRACE_DEBUG(TraceKind::CellFormula, key, formula);
+
+    compiled = compileShared(formula, key);
+    formulaCache.bindCell(key, compiled);
+    return compiled;
+}
+
+bool TreeFormulaEvaluator::shiftShared(Program& program, int dRow, int dCol) {
+    for (uint32_t& id : program.shared) {
+        if (!subexpressions.shift(id, dRow, dCol, id)) return false;
+    }
+    return true;
+}
+
+void TreeFormulaEvaluator::relativeKey(std::wstring_view formula, const CellKey& key) {
+    relativeFormula(formula, key.row, key.col, symbols, relativeText);
+    relativeText += '@';
+    relativeText += std::to_string(key.sheet);
+}
+
+std::shared_ptr<CompiledFormula> TreeFormulaEvaluator::compileShared(std::wstring_view formula, const CellKey& key) {
+    relativeKey(formula, key);
+    auto shared = sharedFormulas.find(relativeText);
+    if (shared != sharedFormulas.end()) {
+        auto anchor = shared->second.formula.lock();
+        if (anchor && anchor->errors.empty()) {
+            FormulaCache::normalize(formula, normalizedText, key.sheet);
+            auto compiled = formulaCache.findByText(normalizedText);
+            if (compiled) return compiled;
+
+            compiled = std::make_shared<CompiledFormula>();
+            int dRow = key.row - shared->second.anchor.row;
+            int dCol = key.col - shared->second.anchor.col;
+            if (shiftProgram(anchor->program, dRow, dCol, compiled->program) && shiftShared(compiled->program, dRow, dCol)) {
+                compiled->text = normalizedText;
+                compiled->parsed = anchor->parsed;
+                formulaCache.insert(compiled, FormulaOrigin::Derived);
+                return compiled;
+            }
+        }
+    }
+
+    auto compiled = compileText(formula, key.sheet);
+    sharedFormulas[relativeText] = SharedFormula{ compiled, key };
+    return compiled;
+}
+
+Value TreeFormulaEvaluator::cellValue(const CellKey& cell) {
+    return evaluateCell(cell.sheet, cell.row, cell.col);
+}
+
+void TreeFormulaEvaluator::rangeAggregate(const RangeRef& range, AggregateState& state) {
+    resolveFormulas(range);
+    aggregateRange(snapshot, range, spans, state,
+        [this](int sheet, int row, int col) { return cachedResult(sheet, row, col); });
+}
+
+// Tabled blocks hold no formulas, so nothing needs resolving first
+void TreeFormulaEvaluator::rangeTotals(const RangeRef& range, AggregateState& state) {
+    if (!areaTables.aggregate(snapshot, range, state)) rangeAggregate(range, state);
+}
+
+Value TreeFormulaEvaluator::sharedValue(uint32_t id) {
+    return subexpressions.value(id, vm, *this);
+}
+
+const StringPool& TreeFormulaEvaluator::strings() const {
+    return snapshot.strings();
+}
+
+int TreeFormulaEvaluator::lookupPosition(const RangeRef& line, Value key, LookupMatch match, bool last) {
+    // Formula results only matter while the index is built
+    if (!lookups.isIndexed(line, match)) resolveFormulas(line);
+    return lookups.find(snapshot, line, key, match, last,
+        [this](int sheet, int row, int col) { return cachedResult(sheet, row, col); });
+}
+
+bool TreeFormulaEvaluator::rangeSumProduct(const RangeRef* ranges, size_t count, Value& result) {
+    for (size_t i = 0; i < count; ++i) {
+        resolveFormulas(ranges[i]);
+    }
+    return sumProductRanges(snapshot, ranges, count, spans, result,
+        [this](int sheet, int row, int col) { return cachedResult(sheet, row, col); });
+}
+
+void TreeFormulaEvaluator::resolveFormulas(const RangeRef& range) {
+    const SheetColumns& columns = snapshot.sheet(range.sheet);
+    int firstRow = std::max(range.firstRow, columns.firstRow);
+    int lastRow = std::min(range.lastRow, columns.lastRow - 1);
+    int firstCol = std::max(range.firstCol, columns.firstCol);
+    int lastCol = std::min(range.lastCol, columns.lastCol - 1);
+
+    for (int col = firstCol; col <= lastCol; ++col) {
+        if (!columns.columnHasFormulas(col)) continue;
+        for (int row = firstRow; row <= lastRow; ++row) {
+            if (columns.flags[columns.slot(row, col)] & FORMULA) {
+                evaluateCell(range.sheet, row, col);
+            }
+        }
+    }
+}
+
+Value TreeFormulaEvaluator::cachedResult(int sheet, int row, int col) const {
+    auto it = resultCache.find(CellKey{ sheet, row, col });
+    return (it != resultCache.end()) ? it->second : Value::number(0.0);
+}
+
+double TreeFormulaEvaluator::evaluateSum(std::shared_ptr<FormulaNode> node) {
+    double sum = 0.0;
+    TRACE_DEBUG(TraceKind::SumBegin, std::string_view(node->value));
+
+    for (auto& child : node->children) {
+        if (child->type == FormulaNode::RANGE) {
+            sum += evaluateRange(child);
+        }
+        else {
+            sum += evaluate(child);
+        }
+    }
+
+    TRACE_DEBUG(TraceKind::SumEnd, Value::number(sum));
+    return sum;
+}
+
+double TreeFormulaEvaluator::evaluateRange(std::shared_ptr<FormulaNode> node) {
+    std::string range = node->value;
+    TRACE_DEBUG(TraceKind::Range, std::string_view(node->toString()));
+
+    // Parse range like "G22:L22"
+    size_t colonPos = range.find(':');
+    if (colonPos == std::string::npos) {
+        // Single cell
+        auto singleCell = std::make_shared<FormulaNode>(
+            FormulaNode::CELL_REF, range, node->sheetName);
+        return evaluate(singleCell);
+    }
+
+    std::string startCell = range.substr(0, colonPos);
+    std::string endCell = range.substr(colonPos + 1);
+
+    auto [startRow, startCol] = parseCellAddress(startCell);
+    auto [endRow, endCol] = parseCellAddress(endCell);
+
+    int sheetIndex = getSheetIndex(node->sheetName);
+    if (sheetIndex < 0) return 0.0;
+
+    // Only numbers count, as in the VM's SUM over a range; the first error
+    // is the result
+    double sum = 0.0;
+    for (int row = startRow; row <= endRow; ++row) {
+        for (int col = startCol; col <= endCol; ++col) {
+            Value value = evaluateCell(sheetIndex, row, col);
+            if (value.isError()) return value.asNumber();
+            if (value.isNumber()) sum += value.asNumber();
+        }
+    }
+
+    return sum;
+}
+
+double TreeFormulaEvaluator::evaluateOperator(std::shared_ptr<FormulaNode> node) {
+    if (node->children.size() != 2) return 0.0;
+
+    double left = evaluate(node->children[0]);
+    double right = evaluate(node->children[1]);
+
+    char op = node->value.empty() ? 0 : node->value[0];
+    double result;
+    switch (op) {
+    case '+': result = left + right; break;
+    case '-': result = left - right; break;
+    case '*': result = left * right; break;
+    case '/': result = (right != 0 || left != left) ? left / right : Value::error(ErrorCode::Div0).asNumber(); break;
+    default: return 0.0;
+    }
+
+    TRACE_DEBUG(op, left, right, result);
+    return result;
+}
+
+int TreeFormulaEvaluator::getSheetIndex(const std::string& sheetName) {
+    if (sheetName.empty()) {
+        return snapshot.sheetCount() > 0 ? 0 : -1; // Default sheet
+    }
+
+    auto it = sheetIndices.find(sheetName);
+    return (it != sheetIndices.end()) ? it->second : -1;
+}
+
+std::pair<int, int> TreeFormulaEvaluator::parseCellAddress(const std::string& cellAddr) {
+    std::string colPart, rowPart;
+
+    for (char c : cellAddr) {
+        if (std::isalpha(c)) {
+            colPart += c;
+        }
+        else if (std::isdigit(c)) {
+            rowPart += c;
+        }
+    }
+
+    if (colPart.empty() || rowPart.empty()) {
+        return { -1, -1 };
+    }
+
+    int col = 0;
+    for (char c : colPart) {
+        col = col * 26 + (std::toupper(c) - 'A' + 1);
+    }
+    col--; // Convert to 0-based
+
+    int row = std::stoi(rowPart) - 1; // Convert to 0-based
+
+    return { row, col };
+}
+
+std::string TreeFormulaEvaluator::columnToLetter(int col) const {
+    std::string result;
+    while (col >= 0) {
+        result = char('A' + (col % 26)) + result;
+        col = col / 26 - 1;
+    }
+    return result;
+}
+
+// Sheet names other than plain words are quoted, as Excel writes them
+std::string TreeFormulaEvaluator::cellAddress(const CellKey& key) const {
+    const std::string& sheet = snapshot.sheet(key.sheet).name;
+    bool plain = !sheet.empty() && std::all_of(sheet.begin(), sheet.end(),
+        [](char c) { return std::isalnum((unsigned char)c) || c == '_'; });
+    std::string address;
+    if (plain) {
+        address = sheet;
+    }
+    else {
+        address = "'";
+        for (char c : sheet) {
+            if (c == '\'') address += '\'';
+            address += c;
+        }
+        address += '\'';
+    }
+    address += '!';
+    address += columnToLetter(key.col);
+    address += std::to_string(key.row + 1);
+    return address;
+}
+
+bool TreeFormulaEvaluator::parseReference(const std::string& text, RangeRef& range, std::string& error) {
+    parseArena.clear();
+    NodeIndex root = parseFormula(std::string_view(text), parseArena, symbols);
+    if (root == NO_NODE || (parseArena[root].kind != AstKind::CELL_REF && parseArena[root].kind != AstKind::RANGE)) {
+        error = "not a cell or range: " + text;
+        return false;
+    }
+
+    std::vector<std::string> errors;
+    binder.bind(parseArena, root, getSheetIndex(""), errors);
+    const AstNode& node = parseArena[root];
+    if (!errors.empty() || node.sheetIndex < 0 || node.row < 0 || node.col < 0) {
+        error = errors.empty() ? "invalid reference: " + text : errors.front();
+        return false;
+    }
+
+    range = RangeRef{ node.sheetIndex, node.row, node.col, node.lastRow, node.lastCol };
+    return true;
+}
+
+std::shared_ptr<CompiledFormula> TreeFormulaEvaluator::compileFormula(const std::string& formula) {
+    return compileText(std::string_view(formula), getSheetIndex(""));
+}
+
+// Wide text from the workbook is lexed as is, without a narrowed copy
+template <typename CharT>
+std::shared_ptr<CompiledFormula> TreeFormulaEvaluator::compileText(std::basic_string_view<CharT> formula, int hostSheet) {
+    FormulaCache::normalize(formula, normalizedText, hostSheet);
+    auto compiled = formulaCache.findByText(normalizedText);
+    if (compiled) return compiled;
+
+    compiled = std::make_shared<CompiledFormula>();
+    compiled->text = normalizedText;
+
+    parseArena.clear();
+    NodeIndex root = parseFormula(formula, parseArena, symbols);
+    compiled->parsed = (root != NO_NODE);
+
+    binder.bind(parseArena, root, hostSheet, compiled->errors);
+    for (const auto& error : compiled->errors) {
+        TRACE_WARNING(TraceKind::BindingError, std::string_view(error));
+    }
+
+    if (checkOptimizer) checkArena = parseArena;
+    NodeIndex optimized = optimizeFormula(parseArena, root, optimizerStats);
+    if (checkOptimizer && !sameFormulaValue(checkArena, root, parseArena, optimized)) {
+        optimizerStats.checkFailures++;
+        TRACE_WARNING(TraceKind::OptimizerMismatch, std::string_view(compiled->text));
+        traceTree(toFormulaTree(checkArena, symbols, root), TraceKind::OptimizerOriginal, 1);
+        traceTree(toFormulaTree(parseArena, symbols, optimized), TraceKind::OptimizerResult, 1);
+    }
+
+    ProgramBuilder builder(compiled->program);
+    compileNode(optimized, builder);
+    formulaCache.insert(compiled);
+    return compiled;
+}
+
+// What the tree walker treats as 0 compiles to the error Excel gives for
+// it: #REF! for unknown sheets, #NAME? for unknown functions and for a
+// formula that does not parse
+void TreeFormulaEvaluator::compileNode(NodeIndex index, ProgramBuilder& builder) {
+    if (index == NO_NODE) {
+        builder.emitConstant(Value::error(ErrorCode::Name));
+        return;
+    }
+
+    const AstNode& node = parseArena[index];
+    switch (node.kind) {
+    case AstKind::CONSTANT:
+        builder.emitConstant(Value::number(node.number));
+        break;
+
+    case AstKind::BOOLEAN:
+        builder.emitConstant(Value::boolean(node.number != 0));
+        break;
+
+    case AstKind::CELL_REF:
+        if (node.sheetIndex < 0) {
+            builder.emitConstant(Value::error(ErrorCode::Ref));
+        }
+        else {
+            builder.emitCell(CellKey{ node.sheetIndex, node.row, node.col }, node.absolute);
+        }
+        break;
+
+    case AstKind::FUNCTION: {
+        FunctionId function = lookupFunction(symbols.name(node.symbol));
+        if (function == FunctionId::Unknown) {
+            builder.emitConstant(Value::error(ErrorCode::Name));
+            break;
+        }
+
+        // Calls are hash-consed: equal calls in any formula become one
+        // subexpression, computed once per generation
+        Program call;
+        ProgramBuilder callBuilder(call);
+        std::vector<CallArg> arguments;
+        for (NodeIndex child = node.firstChild; child != NO_NODE; child = parseArena[child].nextSibling) {
+            const AstNode& arg = parseArena[child];
+            if (arg.kind == AstKind::RANGE) {
+                if (arg.sheetIndex < 0) continue;
+                RangeRef range{ arg.sheetIndex, arg.row, arg.col, arg.lastRow, arg.lastCol };
+                arguments.push_back({ CallArg::RANGE, 0, callBuilder.addRange(range, arg.absolute) });
+            }
+            else {
+                compileNode(child, callBuilder);
+                arguments.push_back({ CallArg::STACK, 0, 0 });
+            }
+        }
+        callBuilder.emitCall(function, arguments);
+
+        uint32_t id = subexpressions.intern(std::move(call));
+        builder.emitShared(id, subexpressions.program(id));
+        break;
+    }
+
+    case AstKind::OPERATOR: {
+        OpCode op;
+        switch (node.op) {
+        case '+': op = OpCode::Add; break;
+        case '-': op = OpCode::Sub; break;
+        case '*': op = OpCode::Mul; break;
+        case '/': op = OpCode::Div; break;
+        default:
+            builder.emitConstant(Value::error(ErrorCode::Value));
+            return;
+        }
+
+        if (node.childCount > 2 && (op == OpCode::Add || op == OpCode::Mul)) {
+            // n-ary chain from the optimizer
+            for (NodeIndex child = node.firstChild; child != NO_NODE; child = parseArena[child].nextSibling) {
+                compileNode(child, builder);
+            }
+            builder.emitOperator(op == OpCode::Add ? OpCode::AddN : OpCode::MulN, node.childCount);
+            break;
+        }
+
+        NodeIndex left = node.firstChild;
+        NodeIndex right = parseArena[left].nextSibling;
+        compileNode(left, builder);
+        compileNode(right, builder);
+        builder.emitOperator(op);
+        break;
+    }
+
+    case AstKind::RANGE:
+        // Ranges only have a value as function arguments
+        builder.emitConstant(Value::error(ErrorCode::Value));
+        break;
+    }
+}
+
+// Main evaluation function
+double TreeFormulaEvaluator::evaluateFormula(const std::string& formula) {
+    return treeNumber(evaluateFormulaValue(formula));
+}
+
+Value TreeFormulaEvaluator::evaluateFormulaValue(const std::string& formula) {
+    TraceFormulaScope trace;
+    TRACE_INFO(TraceKind::FormulaBegin, std::string_view(formula));
+
+    if (backend == EvaluationBackend::TreeWalker) {
+        auto tree = parse(tokenize(formula));
+        if (!tree) {
+            TRACE_WARNING(TraceKind::ParseFailed, std::string_view(formula));
+            return Value::error(ErrorCode::Name);
+        }
+
+        Value result = Value::unbox(evaluate(tree));
+        TRACE_INFO(TraceKind::FormulaEnd, result);
+        return result;
+    }
+
+    auto compiled = compileFormula(formula);
+    if (!compiled->parsed) {
+        TRACE_WARNING(TraceKind::ParseFailed, std::string_view(formula));
+        return Value::error(ErrorCode::Name);
+    }
+
+    Value result = (backend == EvaluationBackend::Exprtk) ? exprtk.evaluate(compiled, *this)
+                                                          : vm.run(compiled->program, *this);
+    TRACE_INFO(TraceKind::FormulaEnd, result);
+    return result;
+}
+
+void TreeFormulaEvaluator::evaluateBatch(const std::vector<BatchQuery>& queries, BatchResults& results) {
+    const size_t MAX_RANGE_CELLS = 16 * 1024 * 1024;
+
+    results.values.clear();
+    results.cells.clear();
+    results.offsets.assign(1, 0);
+    results.errors.assign(queries.size(), std::string());
+
+    // Keyed by normalized text, so spellings that normalize alike share a
+    // result
+    std::unordered_map<std::string, Value> formulaResults;
+
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const BatchQuery& query = queries[i];
+        if (query.kind == BatchQuery::FORMULA) {
+            auto compiled = compileFormula(query.text);
+            if (!compiled->parsed) {
+                results.errors[i] = "cannot parse formula";
+            }
+            else if (!compiled->errors.empty()) {
+                results.errors[i] = compiled->errors.front();
+            }
+            else {
+                auto found = formulaResults.find(compiled->text);
+                if (found == formulaResults.end()) {
+                    // Run the program compiled above; the tree walker has
+                    // none and parses the text itself
+                    Value value;
+                    if (backend == EvaluationBackend::TreeWalker) value = evaluateFormulaValue(query.text);
+                    else if (backend == EvaluationBackend::Exprtk) value = exprtk.evaluate(compiled, *this);
+                    else value = vm.run(compiled->program, *this);
+                    found = formulaResults.emplace(compiled->text, value).first;
+                }
+                results.values.push_back(found->second);
+                results.cells.push_back(CellKey{ -1, -1, -1 });
+            }
+        }
+        else {
+            RangeRef range;
+            if (parseReference(query.text, range, results.errors[i])) {
+                uint64_t count = (uint64_t)(range.lastRow - range.firstRow + 1) * (range.lastCol - range.firstCol + 1);
+                if (count > MAX_RANGE_CELLS) {
+                    results.errors[i] = "range too large";
+                }
+                else {
+                    for (int row = range.firstRow; row <= range.lastRow; ++row) {
+                        for (int col = range.firstCol; col <= range.lastCol; ++col) {
+                            results.values.push_back(evaluateCell(range.sheet, row, col));
+                            results.cells.push_back(CellKey{ range.sheet, row, col });
+                        }
+                    }
+                }
+            }
+        }
+        results.offsets.push_back((uint32_t)results.values.size());
+    }
+}
+
+bool TreeFormulaEvaluator::evaluateScenarios(const ScenarioInputs& inputs, const std::vector<std::string>& outputs,
+    std::vector<Value>& results, std::string& error) {
+    // Scenarios run in blocks of lanes, narrower when many cells vary so a
+    // block's lane values stay within LANE_BYTES
+    const size_t SCENARIO_BLOCK = 256;
+    const size_t LANE_BYTES = 64 << 20;
+
+    if (inputs.values.size() != inputs.cells.size()) {
+        error = "one list of values is needed per input cell";
+        return false;
+    }
+    size_t scenarios = inputs.values.empty() ? 0 : inputs.values[0].size();
+
+    std::vector<CellKey> cells;
+    for (size_t i = 0; i < inputs.cells.size(); ++i) {
+        RangeRef range;
+        if (!parseReference(inputs.cells[i], range, error)) return false;
+        if (range.firstRow != range.lastRow || range.firstCol != range.lastCol) {
+            error = "input is not a single cell: " + inputs.cells[i];
+            return false;
+        }
+        if (inputs.values[i].size() != scenarios) {
+            error = "inputs have different numbers of scenarios";
+            return false;
+        }
+        cells.push_back(CellKey{ range.sheet, range.firstRow, range.firstCol });
+    }
+
+    struct Output {
+        CellKey cell;
+        std::shared_ptr<CompiledFormula> formula;
+    };
+    std::vector<Output> targets;
+    for (const auto& text : outputs) {
+        Output output{ CellKey{ -1, -1, -1 }, nullptr };
+        RangeRef range;
+        if (!text.empty() && text[0] == '=') {
+            output.formula = compileFormula(text);
+            if (!output.formula->parsed) {
+                error = "cannot parse formula: " + text;
+                return false;
+            }
+        }
+        else if (!parseReference(text, range, error)) {
+            return false;
+        }
+        else if (range.firstRow != range.lastRow || range.firstCol != range.lastCol) {
+            error = "output is not a single cell: " + text;
+            return false;
+        }
+        else {
+            output.cell = CellKey{ range.sheet, range.firstRow, range.firstCol };
+        }
+        targets.push_back(output);
+    }
+
+    buildDependencies();
+    size_t cycleBegin = 0, cycleEnd = 0;
+    std::vector<CellKey> order = scenarioOrder(cells, cycleBegin, cycleEnd);
+    std::vector<std::shared_ptr<CompiledFormula>> programs;
+    for (const auto& cell : order) programs.push_back(getCellFormula(cell));
+
+    // What the workbook holds now, for everything the inputs cannot change
+    // and for cycles to start iterating from, as recalculateAll does
+    CellSet varying(cells.begin(), cells.end());
+    varying.insert(order.begin(), order.end());
+    std::vector<Value> fixed(targets.size());
+    for (size_t o = 0; o < targets.size(); ++o) {
+        const CellKey& cell = targets[o].cell;
+        if (!targets[o].formula && !varying.count(cell)) fixed[o] = evaluateCell(cell.sheet, cell.row, cell.col);
+    }
+    std::vector<Value> cycleStart;
+    for (size_t k = cycleBegin; k < cycleEnd && iteration.enabled; ++k) {
+        cycleStart.push_back(evaluateCell(order[k].sheet, order[k].row, order[k].col));
+    }
+
+    size_t block = LANE_BYTES / sizeof(Value) / std::max<size_t>(1, varying.size());
+    block = std::max<size_t>(1, std::min(SCENARIO_BLOCK, block));
+    results.assign(scenarios * targets.size(), Value::number(0.0));
+    ScenarioVM machine(&subexpressions);
+    std::vector<Value> column;
+    for (size_t first = 0; first < scenarios; first += block) {
+        size_t count = std::min(block, scenarios - first);
+        ScenarioLanes lanes(*this, count);
+        std::vector<size_t> inputRows, orderRows;
+        for (const auto& cell : cells) inputRows.push_back(lanes.addCell(cell));
+        for (const auto& cell : order) orderRows.push_back(lanes.addCell(cell));
+
+        for (size_t i = 0; i < cells.size(); ++i) {
+            Value* row = lanes.row(inputRows[i]);
+            for (size_t s = 0; s < count; ++s) row[s] = Value::number(inputs.values[i][first + s]);
+        }
+        for (size_t k = cycleBegin; k < cycleEnd; ++k) {
+            Value* row = lanes.row(orderRows[k]);
+            std::fill(row, row + count, iteration.enabled ? cycleStart[k - cycleBegin] : Value::number(0.0));
+        }
+
+        auto evaluate = [&](size_t k, Value* out) {
+            if (programs[k] && programs[k]->parsed) {
+                machine.run(programs[k]->program, count, lanes, out);
+            }
+            else {
+                std::fill(out, out + count, evaluateCell(order[k].sheet, order[k].row, order[k].col));
+            }
+        };
+        for (size_t k = 0; k < cycleBegin; ++k) evaluate(k, lanes.row(orderRows[k]));
+
+        // Gauss-Seidel sweeps until no lane of any cell moves by maxChange
+        column.resize(count);
+        for (int sweep = 0; cycleBegin < cycleEnd && iteration.enabled && sweep < iteration.maxIterations; ++sweep) {
+            bool converged = true;
+            for (size_t k = cycleBegin; k < cycleEnd; ++k) {
+                Value* row = lanes.row(orderRows[k]);
+                evaluate(k, column.data());
+                for (size_t s = 0; s < count && converged; ++s) {
+                    if (column[s].isNumber() && row[s].isNumber()) {
+                        converged = std::fabs(column[s].asNumber() - row[s].asNumber()) < iteration.maxChange;
+                    }
+                    else {
+                        converged = column[s] == row[s];
+                    }
+                }
+                std::copy(column.begin(), column.end(), row);
+            }
+            if (converged) break;
+        }
+
+        for (size_t k = cycleEnd; k < order.size(); ++k) evaluate(k, lanes.row(orderRows[k]));
+        for (size_t o = 0; o < targets.size(); ++o) {
+            const Value* lane = targets[o].formula ? nullptr : lanes.laneValues(targets[o].cell);
+            if (targets[o].formula) {
+                machine.run(targets[o].formula->program, count, lanes, column.data());
+            }
+            else if (lane) {
+                std::copy(lane, lane + count, column.begin());
+            }
+            else {
+                std::fill(column.begin(), column.end(), fixed[o]);
+            }
+            for (size_t s = 0; s < count; ++s) results[(first + s) * targets.size() + o] = column[s];
+        }
+    }
+    return true;
+}
+
+std::string TreeFormulaEvaluator::valueText(Value value) const {
+    switch (value.type()) {
+    case ValueType::Number: {
+        std::ostringstream text;
+        text << value.asNumber();
+        return text.str();
+    }
+
+    case ValueType::Boolean:
+        return value.asBoolean() ? "TRUE" : "FALSE";
+
+    case ValueType::String:
+        return toUtf8(snapshot.strings().text(value.asString()));
+
+    case ValueType::Error:
+        return errorText(value.asError());
+
+    default:
+        return "";
+    }
+}
+
+void TreeFormulaEvaluator::buildDependencies() {
+    if (dependenciesBuilt) return;
+    dependenciesBuilt = true;
+    dependencies.clear();
+
+    for (int sheet = 0; sheet < snapshot.sheetCount(); ++sheet) {
+        const SheetColumns& columns = snapshot.sheet(sheet);
+        for (const auto& entry : columns.formulaHandles) {
+            int row = columns.firstRow + (int)(entry.first % columns.rows());
+            int col = columns.firstCol + (int)(entry.first / columns.rows());
+            addDependencies(CellKey{ sheet, row, col });
+        }
+    }
+}
+
+void TreeFormulaEvaluator::addDependencies(const CellKey& key) {
+    auto compiled = getCellFormula(key);
+    if (!compiled) {
+        dependencies.removeCell(key);
+        return;
+    }
+    dependencies.setPrecedents(key, compiled->program.cells, compiled->program.ranges);
+}
+
+bool TreeFormulaEvaluator::saveCompiledCache(const std::string& path) {
+    buildDependencies();
+
+    CompiledWorkbook workbook;
+    for (uint32_t id = 0; id < subexpressions.size(); ++id) {
+        workbook.subexpressions.push_back(subexpressions.program(id));
+    }
+
+    // Cells sharing a formula keep sharing it after loading
+    std::unordered_map<const CompiledFormula*, uint32_t> formulaIndex;
+    dependencies.forEachFormula([&](const CellKey& cell) {
+        auto compiled = getCellFormula(cell);
+        if (!compiled) return;
+        auto inserted = formulaIndex.emplace(compiled.get(), (uint32_t)workbook.formulas.size());
+        if (inserted.second) workbook.formulas.push_back(compiled);
+        workbook.cellFormulas.emplace_back(cell, inserted.first->second);
+
+        CompiledWorkbook::Precedents node;
+        node.cell = cell;
+        node.cells = dependencies.cellPrecedents(cell);
+        node.ranges = dependencies.rangePrecedents(cell);
+        workbook.dependencies.push_back(std::move(node));
+    });
+
+    for (const auto& entry : resultCache) {
+        if (!dirtyCells.count(entry.first)) workbook.results.emplace_back(entry.first, entry.second);
+    }
+
+    return saveCompiledWorkbook(path, snapshot.contentHash(), workbook);
+}
+
+bool TreeFormulaEvaluator::loadCompiledCache(const std::string& path) {
+    CompiledWorkbook workbook;
+    std::string reason;
+    if (!loadCompiledWorkbook(path, snapshot.contentHash(), workbook, reason)) {
+        TRACE_INFO(TraceKind::CacheRejected, std::string_view(path + ": " + reason));
+        return false;
+    }
+
+    // Ids in the file are those of the table that wrote it; entries only
+    // refer to earlier ones, so interning in order can map each as it comes
+    std::vector<uint32_t> ids;
+    ids.reserve(workbook.subexpressions.size());
+    for (Program& program : workbook.subexpressions) {
+        for (uint32_t& id : program.shared) id = ids[id];
+        ids.push_back(subexpressions.intern(std::move(program)));
+    }
+
+    std::vector<std::shared_ptr<CompiledFormula>> formulas;
+    formulas.reserve(workbook.formulas.size());
+    for (auto& compiled : workbook.formulas) {
+        auto existing = formulaCache.findByText(compiled->text);
+        if (existing) {
+            formulas.push_back(existing);
+            continue;
+        }
+        for (uint32_t& id : compiled->program.shared) id = ids[id];
+        formulaCache.insert(compiled, FormulaOrigin::Loaded);
+        formulas.push_back(compiled);
+    }
+    for (const auto& entry : workbook.cellFormulas) {
+        formulaCache.bindCell(entry.first, formulas[entry.second]);
+    }
+
+    dependencies.clear();
+    for (const auto& node : workbook.dependencies) {
+        dependencies.setPrecedents(node.cell, node.cells, node.ranges);
+    }
+    dependenciesBuilt = true;
+    dirtyCells.clear();
+
+    for (const auto& entry : workbook.results) {
+        resultCache[entry.first] = entry.second;
+    }
+    return true;
+}
+
+std::vector<CellKey> TreeFormulaEvaluator::scenarioOrder(const std::vector<CellKey>& inputs, size_t& cycleBegin,
+    size_t& cycleEnd) {
+    CellSet affected;
+    for (const auto& input : inputs) dependencies.collectDependents(input, affected);
+    for (const auto& input : inputs) affected.erase(input);
+
+    // Topological sort of the affected cells: each waits for its affected
+    // precedents, counted once per edge
+    std::unordered_map<CellKey, size_t, CellKeyHash> waiting;
+    std::vector<CellKey> dependents;
+    for (const auto& cell : affected) waiting.emplace(cell, 0);
+    for (const auto& cell : affected) {
+        dependents.clear();
+        dependencies.directDependents(cell, dependents);
+        for (const auto& dependent : dependents) {
+            auto it = waiting.find(dependent);
+            if (it != waiting.end()) it->second++;
+        }
+    }
+
+    std::vector<CellKey> order;
+    for (const auto& entry : waiting) {
+        if (entry.second == 0) order.push_back(entry.first);
+    }
+    for (size_t next = 0; next < order.size(); ++next) {
+        dependents.clear();
+        dependencies.directDependents(order[next], dependents);
+        for (const auto& dependent : dependents) {
+            auto it = waiting.find(dependent);
+            if (it != waiting.end() && --it->second == 0) order.push_back(dependent);
+        }
+    }
+    cycleBegin = order.size();
+
+    // What is left reads a cycle. Peel from the other end the cells no
+    // other leftover cell reads: they go last, after the cycles they read.
+    std::unordered_map<CellKey, size_t, CellKeyHash> readers;
+    std::unordered_map<CellKey, std::vector<CellKey>, CellKeyHash> precedents;
+    for (const auto& entry : waiting) {
+        if (entry.second == 0) continue;
+        dependents.clear();
+        dependencies.directDependents(entry.first, dependents);
+        size_t& count = readers[entry.first];
+        for (const auto& dependent : dependents) {
+            auto it = waiting.find(dependent);
+            if (it != waiting.end() && it->second > 0) {
+                count++;
+                precedents[dependent].push_back(entry.first);
+            }
+        }
+    }
+
+    std::vector<CellKey> tail;
+    for (const auto& entry : readers) {
+        if (entry.second == 0) tail.push_back(entry.first);
+    }
+    for (size_t next = 0; next < tail.size(); ++next) {
+        for (const auto& precedent : precedents[tail[next]]) {
+            if (--readers[precedent] == 0) tail.push_back(precedent);
+        }
+    }
+
+    for (const auto& entry : readers) {
+        if (entry.second > 0) order.push_back(entry.first);
+    }
+    cycleEnd = order.size();
+    order.insert(order.end(), tail.rbegin(), tail.rend());
+    return order;
+}
+
+void TreeFormulaEvaluator::markDependentsDirty(const CellKey& key) {
+    std::vector<CellKey> added;
+    dependencies.collectDependents(key, dirtyCells, &added);
+    for (const auto& cell : added) {
+        resultCache.erase(cell);
+        lookups.invalidateCell(cell);
+        snapshot.markStale(cell.sheet, cell.row, cell.col);
+    }
+}
+
+bool TreeFormulaEvaluator::setValue(const std::string& sheetName, int row, int col, double value) {
+    int sheetIndex = getSheetIndex(sheetName);
+    if (sheetIndex < 0) return false;
+    if (row < 0 || row >= MAX_SHEET_ROWS || col < 0 || col >= MAX_SHEET_COLS) return false;
+
+    buildDependencies();
+
+    CellKey key{ sheetIndex, row, col };
+    bool grows = !snapshot.sheet(sheetIndex).contains(row, col);
+    uint8_t oldFlags = snapshot.flags(sheetIndex, row, col);
+    double oldValue = snapshot.number(sheetIndex, row, col);
+    if (!snapshot.setNumber(sheetIndex, row, col, value)) return false;
+    if (grows) exprtk.clear();
+    areaTables.cellChanged(snapshot, key, oldFlags, oldValue);
+    subexpressions.nextGeneration();
+    resultCache.erase(key);
+    lookups.invalidateCell(key);
+    formulaCache.eraseCell(key);
+    dependencies.removeCell(key);
+    dirtyCells.erase(key);
+
+    markDependentsDirty(key);
+    return true;
+}
+
+size_t TreeFormulaEvaluator::recalculate() {
+    // Dirty precedents are pulled in (and cached) by whichever dependent
+    // reaches them first, so the order does not matter
+    size_t count = dirtyCells.size();
+    for (const auto& cell : dirtyCells) {
+        evaluateCell(cell.sheet, cell.row, cell.col);
+    }
+    dirtyCells.clear();
+    return count;
+}
+
+void TreeFormulaEvaluator::buildRecalcPlan() {
+    buildDependencies();
+    recalcPlan.clear();
+
+    // Cells with the same R1C1 formula get the same shape, so runs of them
+    // down a column can be evaluated as one vector
+    std::unordered_map<std::string, uint32_t> shapes;
+    dependencies.forEachFormula([&](const CellKey& cell) {
+        relativeKey(snapshot.formula(cell.sheet, cell.row, cell.col), cell);
+        uint32_t shape = shapes.emplace(relativeText, (uint32_t)shapes.size()).first->second;
+        recalcPlan.addCell(cell, getCellFormula(cell), shape);
+    });
+    recalcPlan.buildEdges(dependencies);
+    recalcPlan.computeLevels();
+}
+
+size_t TreeFormulaEvaluator::recalculateAll(size_t threads) {
+    buildRecalcPlan();
+    subexpressions.nextGeneration();
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    if (!pool || pool->size() != threads) {
+        pool = std::make_unique<WorkStealingPool>(threads);
+    }
+
+    planResults.assign(recalcPlan.cells.size(), Value::number(0.0));
+    lookups.invalidateFormulas();
+    runRecalcPlan(recalcPlan, snapshot, subexpressions, lookups, areaTables, *pool, iteration, planResults);
+
+    resultCache.clear();
+    dirtyCells.clear();
+    for (size_t id = 0; id < recalcPlan.cells.size(); ++id) {
+        resultCache[recalcPlan.cells[id]] = planResults[id];
+    }
+    return recalcPlan.cells.size();
+}
+
+void TreeFormulaEvaluator::setIterativeCalculation(bool enabled, int maxIterations, double maxChange) {
+    iteration.enabled = enabled;
+    iteration.maxIterations = maxIterations;
+    iteration.maxChange = maxChange;
+}
+
+void TreeFormulaEvaluator::invalidateCell(const std::string& sheetName, int row, int col) {
+    int sheetIndex = getSheetIndex(sheetName);
+    if (sheetIndex < 0) return;
+    buildDependencies();
+    resultCache.erase(CellKey{ sheetIndex, row, col });
+    lookups.invalidateCell(CellKey{ sheetIndex, row, col });
+    areaTables.invalidateCell(CellKey{ sheetIndex, row, col });
+    formulaCache.eraseCell(CellKey{ sheetIndex, row, col });
+    subexpressions.nextGeneration();
+    if (!snapshot.sheet(sheetIndex).contains(row, col)) exprtk.clear();
+    snapshot.reloadCell(*source, sheetIndex, row, col);
+    addDependencies(CellKey{ sheetIndex, row, col });
+    markDependentsDirty(CellKey{ sheetIndex, row, col });
+}
+
+void TreeFormulaEvaluator::invalidateSheet(const std::string& sheetName) {
+    int sheetIndex = getSheetIndex(sheetName);
+    if (sheetIndex < 0) return;
+    buildDependencies();
+
+    for (auto it = resultCache.begin(); it != resultCache.end();) {
+        if (it->first.sheet == sheetIndex) {
+            it = resultCache.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    formulaCache.eraseSheet(sheetIndex);
+    lookups.invalidateSheet(sheetIndex);
+    areaTables.invalidateSheet(sheetIndex);
+    subexpressions.nextGeneration();
+    exprtk.clear();
+    snapshot.reloadSheet(*source, sheetIndex);
+
+    // Formulas elsewhere reading the sheet, and whatever depends on them,
+    // through the graph as it was; the sheet's own formulas are rebuilt
+    std::vector<CellKey> readers;
+    dependencies.forEachFormula([&](const CellKey& cell) {
+        if (cell.sheet == sheetIndex) return;
+        bool reads = false;
+        for (const auto& precedent : dependencies.cellPrecedents(cell)) reads = reads || precedent.sheet == sheetIndex;
+        for (const auto& range : dependencies.rangePrecedents(cell)) reads = reads || range.sheet == sheetIndex;
+        if (reads) readers.push_back(cell);
+    });
+    for (const auto& cell : readers) {
+        if (dirtyCells.insert(cell).second) {
+            resultCache.erase(cell);
+            lookups.invalidateCell(cell);
+            snapshot.markStale(cell.sheet, cell.row, cell.col);
+        }
+        markDependentsDirty(cell);
+    }
+    dependenciesBuilt = false;
+}
+
+void TreeFormulaEvaluator::invalidateAll() {
+    resultCache.clear();
+    sharedFormulas.clear();
+    subexpressions.nextGeneration();
+    formulaCache.clearCellIndex();
+    lookups.clear();
+    areaTables.clear();
+    exprtk.clear();
+    snapshot.load(*source);
+    dependenciesBuilt = false;
+    dirtyCells.clear();
+}
+
+size_t TreeFormulaEvaluator::compileAll() {
+    buildDependencies();
+    return dependencies.formulaCount();
+}
+
+size_t TreeFormulaEvaluator::memoryBytes() const {
+    // Node-based map: key, value and about two pointers of overhead each
+    size_t results = resultCache.size() * (sizeof(CellKey) + sizeof(Value) + 2 * sizeof(void*));
+    return snapshot.memoryBytes() + formulaCache.getStats().memoryBytes + subexpressions.getStats().memoryBytes +
+        lookups.getStats().memoryBytes + areaTables.getStats().memoryBytes + results;
+}
+
+CacheStats TreeFormulaEvaluator::cacheStats() const {
+    CacheStats current = stats;
+    current.entries = resultCache.size();
+    return current;
+}
+
+void TreeFormulaEvaluator::resetCacheStats() {
+    stats = CacheStats();
+    subexpressions.resetCounters();
+}
+
+void TreeFormulaEvaluator::setBackend(EvaluationBackend selected) {
+    backend = selected;
+}
+
+LookupStats TreeFormulaEvaluator::lookupStats() const {
+    return lookups.getStats();
+}
+
+SummedAreaStats TreeFormulaEvaluator::areaTableStats() const {
+    return areaTables.getStats();
+}
+
+void TreeFormulaEvaluator::setAreaTableLimit(size_t maxBytes) {
+    areaTables.setMemoryLimit(maxBytes);
+}
+
+void TreeFormulaEvaluator::setAreaTableCheck(bool enabled) {
+    areaTables.setCheck(enabled);
+}
+
+ExprtkStats TreeFormulaEvaluator::exprtkStats() const {
+    return exprtk.getStats();
+}
+
+void TreeFormulaEvaluator::setOptimizerCheck(bool enabled) {
+    checkOptimizer = enabled;
+}
+
+OptimizerStats TreeFormulaEvaluator::getOptimizerStats() const {
+    return optimizerStats;
+}
+
+SubexpressionStats TreeFormulaEvaluator::subexpressionStats() const {
+    return subexpressions.getStats();
+}
+
+FormulaCacheStats TreeFormulaEvaluator::formulaCacheStats() const {
+    return formulaCache.getStats();
+}
+
+void TreeFormulaEvaluator::setFormulaCacheLimits(size_t maxBytes, size_t maxCells) {
+    formulaCache.setLimits(maxBytes, maxCells);
+}
+
+// Helper to print tree structure (for debugging puspose only )
+void TreeFormulaEvaluator::printTree(std::shared_ptr<FormulaNode> node, int depth)  {
+    if (!node) return;
+
+    std::string indent(depth * 2, ' ');
+    std::cout << indent << node->toString() << " (" <<
+        (node->type == FormulaNode::OPERATOR ? "OP" :
+            node->type == FormulaNode::FUNCTION ? "FUNC" :
+            node->type == FormulaNode::CELL_REF ? "CELL" :
+            node->type == FormulaNode::CONSTANT ? "CONST" : "RANGE")
+        << ")" << std::endl;
+
+    for (auto& child : node->children) {
+        printTree(child, depth + 1);
+    }
+}
+
+// Same layout as printTree, one warning event per node
+void TreeFormulaEvaluator::traceTree(std::shared_ptr<FormulaNode> node, TraceKind kind, int depth) {
+    if (!node) return;
+
+    std::string line(depth * 2, ' ');
+    line += node->toString();
+    line += node->type == FormulaNode::OPERATOR ? " (OP)" :
+        node->type == FormulaNode::FUNCTION ? " (FUNC)" :
+        node->type == FormulaNode::CELL_REF ? " (CELL)" :
+        node->type == FormulaNode::CONSTANT ? " (CONST)" : " (RANGE)";
+    TRACE_WARNING(kind, std::string_view(line));
+
+    for (auto& child : node->children) {
+        traceTree(child, kind, depth + 1);
+    }
+}
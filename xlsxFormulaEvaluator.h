@@ -1,130 +1,375 @@
-#pragma once
-#include "stdafx.h"
-#include "libxl.h"
-#include <iostream>
-#include <string>
-#include <vector>
-#include <sstream>
-#include <algorithm>
-#include <cctype>
-#include <map>
-#include <regex>
-#include <cmath>
-#include <set>
-#include <memory>
-#include "exprtk.hpp"
-
-using namespace libxl;
-// Token structure for parsing
-struct Token {
-    enum Type {
-        CELL_REF,     // G23, APPENDIX!C4
-        FUNCTION,     // SUM, AVERAGE
-        OPERATOR,     // +, -, *, /
-        CONSTANT,     // 12, 0.9144
-        LPAREN,       // (
-        RPAREN,       // )
-        RANGE,        // G22:L22
-        COMMA,         // ,
-        EXCLAMATION, // !
-
-    };
-
-    Type type;
-    std::string value;
-    std::string sheetName; // for cross-sheet references
-
-    Token(Type t, const std::string& v, const std::string& sheet = "")
-        : type(t), value(v), sheetName(sheet) {
-    }
-};
-
-// Formula tree node
-class FormulaNode {
-public:
-    enum Type {
-        CELL_REF,
-        FUNCTION,
-        OPERATOR,
-        CONSTANT,
-        RANGE
-    };
-
-    Type type;
-    std::string value;
-    std::string sheetName;
-    std::vector<std::shared_ptr<FormulaNode>> children;
-
-    // Evaluation state
-    mutable double cachedResult = 0.0;
-    mutable bool isEvaluated = false;
-    mutable bool isEvaluating = false;
-
-    FormulaNode(Type t, const std::string& v, const std::string& sheet = "")
-        : type(t), value(v), sheetName(sheet) {
-    }
-
-    void addChild(std::shared_ptr<FormulaNode> child) {
-        children.push_back(child);
-    }
-
-    std::string toString() const {
-        std::string result;
-        if (!sheetName.empty()) result += sheetName + "!";
-        result += value;
-        return result;
-    }
-};
-
-class TreeFormulaEvaluator {
-private:
-    Book* book;
-    std::map<std::string, Sheet*> sheets;
-
-public:
-    TreeFormulaEvaluator(Book* b);
-
-    // Tokenize formula string
-    std::vector<Token> tokenize(const std::string& formula);
-
-    // Parse tokens into expression tree
-    std::shared_ptr<FormulaNode> parse(const std::vector<Token>& tokens);
-
-private:
-    // Parse expression with operator precedence
-    std::shared_ptr<FormulaNode> parseExpression(const std::vector<Token>& tokens, size_t& index);
-
-    std::shared_ptr<FormulaNode> parseAddition(const std::vector<Token>& tokens, size_t& index);
-
-    std::shared_ptr<FormulaNode> parseMultiplication(const std::vector<Token>& tokens, size_t& index);
-
-    std::shared_ptr<FormulaNode> parseFactor(const std::vector<Token>& tokens, size_t& index);
-
-public:
-    // Evaluate the tree
-    double evaluate(std::shared_ptr<FormulaNode> node);
-
-private:
-    double evaluateCellReference(std::shared_ptr<FormulaNode> node);
-
-    double evaluateFunction(std::shared_ptr<FormulaNode> node);
-
-    double evaluateSum(std::shared_ptr<FormulaNode> node);
-
-    double evaluateRange(std::shared_ptr<FormulaNode> node);
-
-    double evaluateOperator(std::shared_ptr<FormulaNode> node);
-
-    Sheet* getSheet(const std::string& sheetName);
-
-    std::pair<int, int> parseCellAddress(const std::string& cellAddr);
-
-    std::string columnToLetter(int col);
-
-public:
-    // Main evaluation function
-    double evaluateFormula(const std::string& formula);
-
-    // Helper to print tree structure (for debugging)
-    void printTree(std::shared_ptr<FormulaNode> node, int depth = 0);
-};
+#pragma once
+#include "stdafx.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <regex>
+#include <cmath>
+#include <set>
+#include <memory>
+#include <unordered_map>
+#include "cellSource.h"
+#include "sheetSnapshot.h"
+#include "formulaTypes.h"
+#include "formulaCache.h"
+#include "formulaArena.h"
+#include "formulaLexer.h"
+#include "referenceBinder.h"
+#include "formulaOptimizer.h"
+#include "subexpressionTable.h"
+#include "dependencyGraph.h"
+#include "rangeScan.h"
+#include "lookupIndex.h"
+#include "summedAreaTables.h"
+#include "recalcPlan.h"
+#include "workStealingPool.h"
+#include "exprtkBackend.h"
+#include "formulaTrace.h"
+#include "compiledCache.h"
+#include "scenarioEngine.h"
+
+// Hit/miss counters of the cell result cache
+struct CacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t entries = 0;
+};
+
+// How formulas are evaluated on demand. Whole-workbook recalculation
+// always runs the bytecode.
+enum class EvaluationBackend {
+    TreeWalker,   // parse tree walked per evaluation, the reference
+    Bytecode,     // compiled programs run by the VM
+    Exprtk        // compiled programs translated to exprtk expressions
+};
+
+// One query of a batch: a formula, or a cell or range such as
+// Sheet1!B2:D10 whose values are wanted
+struct BatchQuery {
+    enum Kind : uint8_t {
+        FORMULA,
+        CELLS
+    };
+
+    Kind kind;
+    std::string text;
+};
+
+// Results of a batch, flat: query i owns values[offsets[i]] up to
+// values[offsets[i + 1]], one for a formula and one per cell, row by row,
+// for a range. A query that cannot be evaluated owns none and has an error.
+struct BatchResults {
+    std::vector<Value> values;
+    std::vector<CellKey> cells;         // cell of each value, sheet -1 for formulas
+    std::vector<uint32_t> offsets;
+    std::vector<std::string> errors;    // per query, empty when fine
+};
+
+// What-if inputs of a scenario run: cells such as Sheet1!B2 and, for each,
+// its value in every scenario. values[i][s] is cells[i] in scenario s.
+struct ScenarioInputs {
+    std::vector<std::string> cells;
+    std::vector<std::vector<double>> values;
+};
+
+class TreeFormulaEvaluator : public CellValueReader {
+private:
+    CellSource* source;
+    std::map<std::string, int> sheetIndices;
+
+    // All cells, read from the source once at construction
+    WorkbookSnapshot snapshot;
+
+    // Results of evaluated cells, kept across evaluateFormula calls
+    std::unordered_map<CellKey, Value, CellKeyHash> resultCache;
+    CacheStats stats;
+
+    // Parsed formulas shared by cells with the same formula text
+    FormulaCache formulaCache;
+
+    // Function calls shared by every formula containing them
+    SubexpressionTable subexpressions;
+
+    FormulaVM vm;
+
+    EvaluationBackend backend = EvaluationBackend::Bytecode;
+    ExprtkBackend exprtk;
+
+    // Built on the first setValue; formula cells needing recalculation
+    DependencyGraph dependencies;
+    bool dependenciesBuilt = false;
+    CellSet dirtyCells;
+
+    SpanBuffers spans;
+
+    // Indexes of the lines searched by lookup functions
+    LookupIndexCache lookups;
+
+    // Prefix sums of constant blocks that are aggregated often
+    SummedAreaTables areaTables;
+
+    // Whole-workbook recalculation: levelled formula cells and their results
+    RecalcPlan recalcPlan;
+    std::vector<Value> planResults;
+    std::unique_ptr<WorkStealingPool> pool;
+    IterativeCalc iteration;
+
+    // Formula cells on the current demand evaluation path
+    CellSet evaluating;
+
+    // Scratch parse tree, reused by every compile
+    AstArena parseArena;
+    SymbolTable symbols;
+    ReferenceBinder binder;
+
+    // Folding and simplification between binding and compiling; in check
+    // mode every optimized tree is compared with a copy of the original
+    OptimizerStats optimizerStats;
+    bool checkOptimizer = false;
+    AstArena checkArena;
+    std::string normalizedText;       // scratch buffer for formula cache keys
+    std::string relativeText;         // scratch buffer for R1C1 keys
+
+    // First compile of each R1C1 formula per sheet; copies of it elsewhere
+    // on the sheet are derived from it instead of being parsed again
+    struct SharedFormula {
+        std::weak_ptr<CompiledFormula> formula;
+        CellKey anchor;
+    };
+    std::unordered_map<std::string, SharedFormula> sharedFormulas;
+
+public:
+    TreeFormulaEvaluator(CellSource& cells);
+
+    // Tokenize formula string
+    std::vector<Token> tokenize(const std::string& formula);
+
+    // Parse tokens into expression tree
+    std::shared_ptr<FormulaNode> parse(const std::vector<Token>& tokens);
+
+private:
+    // Parse expression with operator precedence
+    std::shared_ptr<FormulaNode> parseExpression(const std::vector<Token>& tokens, size_t& index);
+
+    std::shared_ptr<FormulaNode> parseAddition(const std::vector<Token>& tokens, size_t& index);
+
+    std::shared_ptr<FormulaNode> parseMultiplication(const std::vector<Token>& tokens, size_t& index);
+
+    std::shared_ptr<FormulaNode> parseFactor(const std::vector<Token>& tokens, size_t& index);
+
+public:
+    // Evaluate the tree (reference implementation of the bytecode VM)
+    double evaluate(std::shared_ptr<FormulaNode> node);
+
+private:
+    double evaluateCellReference(std::shared_ptr<FormulaNode> node);
+
+    Value evaluateCell(int sheetIndex, int row, int col);
+
+    // A cell value as the tree walker computes with it: numbers only, an
+    // error boxed in the NaN payload (text that is not a number is #VALUE!),
+    // which arithmetic carries along and Value::unbox recovers
+    double treeNumber(Value value) const;
+
+    // CellValueReader, used by the VM
+    Value cellValue(const CellKey& cell) override;
+
+    void rangeAggregate(const RangeRef& range, AggregateState& state) override;
+
+    void rangeTotals(const RangeRef& range, AggregateState& state) override;
+
+    bool rangeSumProduct(const RangeRef* ranges, size_t count, Value& result) override;
+
+    Value sharedValue(uint32_t id) override;
+
+    int lookupPosition(const RangeRef& line, Value key, LookupMatch match, bool last) override;
+
+    const StringPool& strings() const override;
+
+    // Evaluate every formula cell of a range so its result is cached
+    void resolveFormulas(const RangeRef& range);
+
+    Value cachedResult(int sheet, int row, int col) const;
+
+    Value readCellValue(const CellKey& key);
+
+    Value constantValue(const CellKey& key);
+
+    std::shared_ptr<CompiledFormula> getCellFormula(const CellKey& key);
+
+    // Compile the formula of a cell, reusing an earlier compile of the same
+    // R1C1 formula on its sheet when there is one
+    std::shared_ptr<CompiledFormula> compileShared(std::wstring_view formula, const CellKey& key);
+
+    // Move the shared subexpressions of a shifted program along with it
+    bool shiftShared(Program& program, int dRow, int dCol);
+
+    // R1C1 key of a formula at key, sheet included, left in relativeText
+    void relativeKey(std::wstring_view formula, const CellKey& key);
+
+    double evaluateFunction(std::shared_ptr<FormulaNode> node);
+
+    double evaluateSum(std::shared_ptr<FormulaNode> node);
+
+    double evaluateRange(std::shared_ptr<FormulaNode> node);
+
+    double evaluateOperator(std::shared_ptr<FormulaNode> node);
+
+    int getSheetIndex(const std::string& sheetName);
+
+    std::pair<int, int> parseCellAddress(const std::string& cellAddr);
+
+    std::string columnToLetter(int col) const;
+
+    // A cell or range reference, unqualified on the first sheet
+    bool parseReference(const std::string& text, RangeRef& range, std::string& error);
+
+    // Lower a bound arena parse tree to bytecode
+    void compileNode(NodeIndex index, ProgramBuilder& builder);
+
+    // Compile every formula cell and record its precedents
+    void buildDependencies();
+
+    // Formula cells depending on inputs, each after its precedents. Cells
+    // on or between circular references, which have no such order, are
+    // order[cycleBegin, cycleEnd); the cells after them only read them.
+    std::vector<CellKey> scenarioOrder(const std::vector<CellKey>& inputs, size_t& cycleBegin, size_t& cycleEnd);
+
+    void addDependencies(const CellKey& key);
+
+    // Number the formula cells and group them into dependency levels
+    void buildRecalcPlan();
+
+    // Drop the results of everything depending on key
+    void markDependentsDirty(const CellKey& key);
+
+    // Unqualified references in formula bind to hostSheet
+    template <typename CharT>
+    std::shared_ptr<CompiledFormula> compileText(std::basic_string_view<CharT> formula, int hostSheet);
+
+public:
+    // Parse and compile a formula, or fetch it from the formula cache.
+    // Unqualified references bind to the first sheet; binding problems are
+    // listed in the result's errors.
+    std::shared_ptr<CompiledFormula> compileFormula(const std::string& formula);
+
+    // Main evaluation function. The result as a number: booleans are 0 or
+    // 1 and text reading as a number that number; errors and other text
+    // give NaN, evaluateFormulaValue tells them apart.
+    double evaluateFormula(const std::string& formula);
+
+    // Result of a formula with its type: number, boolean, text or error
+    Value evaluateFormulaValue(const std::string& formula);
+
+    // Evaluate many formulas and ranges in one pass over the shared caches;
+    // identical formulas are evaluated once however often they are asked
+    void evaluateBatch(const std::vector<BatchQuery>& queries, BatchResults& results);
+
+    // Evaluate outputs (cells, or formulas starting with =) for every
+    // scenario of inputs without touching the workbook. Only the formulas
+    // depending on the inputs run, once for all scenarios, on lanes of
+    // values. results is scenarios x outputs, one row per scenario. False,
+    // with the reason in error, if an input or output is not understood.
+    bool evaluateScenarios(const ScenarioInputs& inputs, const std::vector<std::string>& outputs,
+        std::vector<Value>& results, std::string& error);
+
+    // A value the way Excel displays it, #DIV/0! and the like for errors;
+    // text as UTF-8
+    std::string valueText(Value value) const;
+
+    // Sheet!A1 spelling of a cell
+    std::string cellAddress(const CellKey& key) const;
+
+    // Switch the backend used by evaluateFormula and the cells it reaches;
+    // cached results are kept, so invalidate to compare backends
+    void setBackend(EvaluationBackend selected);
+
+    EvaluationBackend getBackend() const { return backend; }
+
+    ExprtkStats exprtkStats() const;
+
+    // Change an input cell; only its transitive dependents become dirty.
+    // False for an unknown sheet, a cell outside Excel's sheet size, or one
+    // too far from the used area for the snapshot to store.
+    bool setValue(const std::string& sheetName, int row, int col, double value);
+
+    // Recompute the dirty formula cells, returns how many there were
+    size_t recalculate();
+
+    size_t dirtyCount() const { return dirtyCells.size(); }
+
+    // Recompute every formula cell without recursion: strongly connected
+    // components in dependency order, one level at a time with the cells of
+    // a level spread over threads (0 = one per hardware thread). Returns the
+    // number of formula cells.
+    size_t recalculateAll(size_t threads = 0);
+
+    // Circular references are iterated up to maxIterations sweeps or until
+    // no cell changes by maxChange; disabled, they evaluate to 0
+    void setIterativeCalculation(bool enabled, int maxIterations = 100, double maxChange = 0.001);
+
+    // Cyclic components found by the last recalculateAll
+    size_t cycleCount() const { return recalcPlan.cycleCount(); }
+
+    // Drop cached results and re-read the cells from the source
+    void invalidateCell(const std::string& sheetName, int row, int col);
+
+    void invalidateSheet(const std::string& sheetName);
+
+    void invalidateAll();
+
+    // Write the compiled formulas, dependency graph and cached results to
+    // path, keyed by the content of the workbook as loaded
+    bool saveCompiledCache(const std::string& path);
+
+    // Take compiled formulas, dependencies and results from a cache file
+    // written for identical workbook content, instead of compiling again.
+    // False, with nothing changed, if the file is unusable for any reason.
+    bool loadCompiledCache(const std::string& path);
+
+    // Compile every formula cell ahead of evaluation; returns how many there are
+    size_t compileAll();
+
+    // Approximate heap held by the snapshot and every cache
+    size_t memoryBytes() const;
+
+    // Result cache counters
+    CacheStats cacheStats() const;
+
+    void resetCacheStats();
+
+    FormulaCacheStats formulaCacheStats() const;
+
+    // Debug mode: compare every optimized formula against its original
+    // tree and trace both trees when their values differ
+    void setOptimizerCheck(bool enabled);
+
+    OptimizerStats getOptimizerStats() const;
+
+    // Deduplication of function calls across formulas
+    SubexpressionStats subexpressionStats() const;
+
+    // Indexes built and searched by VLOOKUP, MATCH and the like
+    LookupStats lookupStats() const;
+
+    // Summed-area tables answering SUM, COUNT, COUNTA and AVERAGE
+    SummedAreaStats areaTableStats() const;
+
+    void setAreaTableLimit(size_t maxBytes);
+
+    // Debug mode: check every sum taken from a summed-area table against a
+    // scan of its cells
+    void setAreaTableCheck(bool enabled);
+
+    void setFormulaCacheLimits(size_t maxBytes, size_t maxCells);
+
+    // Helper to print tree structure (for debugging)
+    void printTree(std::shared_ptr<FormulaNode> node, int depth = 0);
+
+    // printTree through the tracer, for the optimizer check
+    void traceTree(std::shared_ptr<FormulaNode> node, TraceKind kind, int depth = 0);
+};
@@ -0,0 +1,231 @@
+#include "stdafx.h"
+#include "xmlScanner.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "textEncoding.h"
+
+namespace {
+
+bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// -1 if text is shorter than prefix but agrees with it so far
+int startsWith(std::string_view text, std::string_view prefix) {
+    if (text.size() < prefix.size()) return (prefix.compare(0, text.size(), text) == 0) ? -1 : 0;
+    return text.compare(0, prefix.size(), prefix) == 0 ? 1 : 0;
+}
+
+}
+
+std::string_view XmlAttributes::get(std::string_view name) const {
+    auto attribute = findRaw(name);
+    if (!attribute) return std::string_view();
+    if (attribute->second.find('&') == std::string_view::npos) return attribute->second;
+
+    decoded.clear();
+    XmlScanner::decode(attribute->second, decoded);
+    return decoded;
+}
+
+bool XmlAttributes::has(std::string_view name) const {
+    return findRaw(name) != nullptr;
+}
+
+const std::pair<std::string_view, std::string_view>* XmlAttributes::findRaw(std::string_view name) const {
+    for (const auto& attribute : raw) {
+        std::string_view key = attribute.first;
+        size_t colon = key.find(':');
+        if (colon != std::string_view::npos) key = key.substr(colon + 1);
+        if (key == name) return &attribute;
+    }
+    return nullptr;
+}
+
+XmlScanner::XmlScanner(XmlHandler& handler) : handler(handler) {
+}
+
+void XmlScanner::feed(const char* data, size_t size) {
+    std::string_view input(data, size);
+
+    // Complete the tag or entity cut off by the previous chunk first
+    while (!pending.empty() && !input.empty()) {
+        size_t close = input.find(pending[0] == '<' ? '>' : ';');
+        size_t take = (close == std::string_view::npos) ? input.size() : close + 1;
+        pending.append(input.data(), take);
+        input.remove_prefix(take);
+
+        if (pending[0] != '<' || markupLength(pending) > 0) {
+            size_t used = parse(pending);
+            pending.erase(0, used);
+        }
+    }
+    if (input.empty()) return;
+
+    size_t used = parse(input);
+    pending.assign(input.data() + used, input.size() - used);
+}
+
+bool XmlScanner::finish() {
+    bool complete = pending.empty();
+    pending.clear();
+    return complete;
+}
+
+size_t XmlScanner::parse(std::string_view input) {
+    size_t pos = 0;
+    while (pos < input.size()) {
+        if (input[pos] == '<') {
+            std::string_view rest = input.substr(pos);
+            size_t length = markupLength(rest);
+            if (length == 0) break;
+
+            std::string_view markup = rest.substr(0, length);
+            if (startsWith(markup, "<![CDATA[") == 1) {
+                handler.characters(markup.substr(9, length - 12));
+            }
+            else if (markup[1] != '!' && markup[1] != '?') {
+                parseTag(markup);
+            }
+            pos += length;
+            continue;
+        }
+
+        size_t open = input.find('<', pos);
+        size_t end = (open == std::string_view::npos) ? input.size() : open;
+        if (open == std::string_view::npos) {
+            // Keep an entity cut off at the end for the next chunk
+            size_t amp = input.rfind('&', end - 1);
+            if (amp != std::string_view::npos && amp >= pos && input.find(';', amp) == std::string_view::npos) {
+                end = amp;
+            }
+        }
+
+        std::string_view piece = input.substr(pos, end - pos);
+        if (piece.find('&') == std::string_view::npos) {
+            handler.characters(piece);
+        }
+        else if (!piece.empty()) {
+            text.clear();
+            decode(piece, text);
+            handler.characters(text);
+        }
+        pos = end;
+        if (open == std::string_view::npos) break;
+    }
+    return pos;
+}
+
+size_t XmlScanner::markupLength(std::string_view text) {
+    struct Special {
+        const char* open;
+        const char* close;
+    };
+    static const Special specials[] = {
+        { "<!--", "-->" },
+        { "<![CDATA[", "]]>" },
+        { "<?", "?>" }
+    };
+
+    for (const Special& special : specials) {
+        int match = startsWith(text, special.open);
+        if (match < 0) return 0;
+        if (match > 0) {
+            size_t close = text.find(special.close, strlen(special.open));
+            return (close == std::string_view::npos) ? 0 : close + strlen(special.close);
+        }
+    }
+
+    // Tags and declarations end at the first > outside quotes
+    char quote = 0;
+    for (size_t i = 1; i < text.size(); ++i) {
+        char c = text[i];
+        if (quote) {
+            if (c == quote) quote = 0;
+        }
+        else if (c == '"' || c == '\'') {
+            quote = c;
+        }
+        else if (c == '>') {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+void XmlScanner::parseTag(std::string_view tag) {
+    if (tag[1] == '/') {
+        std::string_view name = tag.substr(2, tag.size() - 3);
+        while (!name.empty() && isSpace(name.back())) name.remove_suffix(1);
+        handler.endElement(localName(name));
+        return;
+    }
+
+    bool selfClosing = tag[tag.size() - 2] == '/';
+    std::string_view body = tag.substr(1, tag.size() - (selfClosing ? 3 : 2));
+
+    size_t pos = 0;
+    while (pos < body.size() && !isSpace(body[pos])) ++pos;
+    std::string_view name = localName(body.substr(0, pos));
+
+    attributes.raw.clear();
+    while (pos < body.size()) {
+        while (pos < body.size() && isSpace(body[pos])) ++pos;
+        size_t nameStart = pos;
+        while (pos < body.size() && body[pos] != '=' && !isSpace(body[pos])) ++pos;
+        std::string_view key = body.substr(nameStart, pos - nameStart);
+
+        while (pos < body.size() && (isSpace(body[pos]) || body[pos] == '=')) ++pos;
+        if (pos >= body.size() || (body[pos] != '"' && body[pos] != '\'')) break;
+        char quote = body[pos++];
+        size_t valueEnd = body.find(quote, pos);
+        if (valueEnd == std::string_view::npos) break;
+
+        attributes.raw.emplace_back(key, body.substr(pos, valueEnd - pos));
+        pos = valueEnd + 1;
+    }
+
+    handler.startElement(name, attributes);
+    if (selfClosing) handler.endElement(name);
+}
+
+std::string_view XmlScanner::localName(std::string_view name) {
+    size_t colon = name.find(':');
+    return (colon == std::string_view::npos) ? name : name.substr(colon + 1);
+}
+
+void XmlScanner::decode(std::string_view text, std::string& out) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t amp = text.find('&', pos);
+        if (amp == std::string_view::npos) {
+            out.append(text.data() + pos, text.size() - pos);
+            break;
+        }
+        out.append(text.data() + pos, amp - pos);
+
+        size_t semicolon = text.find(';', amp);
+        if (semicolon == std::string_view::npos) {
+            out.append(text.data() + amp, text.size() - amp);
+            break;
+        }
+
+        std::string_view entity = text.substr(amp + 1, semicolon - amp - 1);
+        if (entity == "lt") out += '<';
+        else if (entity == "gt") out += '>';
+        else if (entity == "amp") out += '&';
+        else if (entity == "quot") out += '"';
+        else if (entity == "apos") out += '\'';
+        else if (entity.size() > 1 && entity[0] == '#') {
+            std::string digits(entity.substr(entity[1] == 'x' ? 2 : 1));
+            uint32_t code = (uint32_t)std::strtoul(digits.c_str(), nullptr, entity[1] == 'x' ? 16 : 10);
+            appendUtf8(code, out);
+        }
+        else {
+            // Not one of the predefined entities; keep it as written
+            out.append(text.data() + amp, semicolon + 1 - amp);
+        }
+        pos = semicolon + 1;
+    }
+}
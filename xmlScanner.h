@@ -0,0 +1,72 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Attributes of the element being started. Views are valid only for the
+// duration of the startElement call.
+class XmlAttributes {
+public:
+    // Value with entities decoded, empty if the attribute is missing; the
+    // namespace prefix of the name is ignored
+    std::string_view get(std::string_view name) const;
+
+    bool has(std::string_view name) const;
+
+private:
+    friend class XmlScanner;
+
+    const std::pair<std::string_view, std::string_view>* findRaw(std::string_view name) const;
+
+    std::vector<std::pair<std::string_view, std::string_view>> raw;     // as written
+    mutable std::string decoded;
+};
+
+// Callbacks of XmlScanner. Element names arrive without their namespace
+// prefix.
+class XmlHandler {
+public:
+    virtual ~XmlHandler() {}
+
+    virtual void startElement(std::string_view name, const XmlAttributes& attributes) = 0;
+
+    virtual void endElement(std::string_view name) = 0;
+
+    // Decoded text between tags; may arrive in several pieces
+    virtual void characters(std::string_view text) = 0;
+};
+
+// Push parser for the subset of XML found in OOXML parts: elements,
+// attributes, character and entity references and CDATA. Comments,
+// processing instructions and the DOCTYPE are skipped, and no validation
+// is done. Input can be cut anywhere between feed calls; only an
+// unfinished tag is carried over to the next one.
+class XmlScanner {
+public:
+    explicit XmlScanner(XmlHandler& handler);
+
+    void feed(const char* data, size_t size);
+
+    // After the last feed; false if the input ended inside a tag
+    bool finish();
+
+    // Append text with entities decoded to out, as UTF-8
+    static void decode(std::string_view text, std::string& out);
+
+private:
+    // Parse as much of input as is complete; returns the bytes consumed
+    size_t parse(std::string_view input);
+
+    // Length of the complete markup at the start of text, 0 if it is cut off
+    static size_t markupLength(std::string_view text);
+
+    void parseTag(std::string_view tag);
+
+    static std::string_view localName(std::string_view name);
+
+    XmlHandler& handler;
+    std::string pending;        // unconsumed input from the previous feed
+    std::string text;           // decoded characters
+    XmlAttributes attributes;
+};
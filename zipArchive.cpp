@@ -0,0 +1,202 @@
+#include "stdafx.h"
+#include "zipArchive.h"
+#include <algorithm>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+
+const uint32_t LOCAL_HEADER = 0x04034b50;
+const uint32_t CENTRAL_HEADER = 0x02014b50;
+const uint32_t END_OF_DIRECTORY = 0x06054b50;
+const uint32_t ZIP64_END_OF_DIRECTORY = 0x06064b50;
+const uint32_t ZIP64_LOCATOR = 0x07064b50;
+
+// ZIP fields are little endian and unaligned
+uint16_t read16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+uint32_t read32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t read64(const unsigned char* p) {
+    return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+}
+
+bool ZipArchive::open(const std::string& path) {
+    close();
+    if (!file.open(path)) return false;
+    if (!readDirectory()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void ZipArchive::close() {
+    entries.clear();
+    file.close();
+}
+
+bool ZipArchive::readDirectory() {
+    const unsigned char* data = file.data();
+    size_t size = file.size();
+    if (size < 22) return false;
+
+    // The end record sits behind a comment of up to 64K
+    size_t end = size - 22;
+    size_t stop = (size > 22 + 0xFFFF) ? size - 22 - 0xFFFF : 0;
+    while (read32(data + end) != END_OF_DIRECTORY) {
+        if (end == stop) return false;
+        --end;
+    }
+
+    uint64_t count = read16(data + end + 10);
+    uint64_t directorySize = read32(data + end + 12);
+    uint64_t directoryOffset = read32(data + end + 16);
+
+    if ((count == 0xFFFF || directoryOffset == 0xFFFFFFFF) && end >= 20 && read32(data + end - 20) == ZIP64_LOCATOR) {
+        uint64_t record = read64(data + end - 20 + 8);
+        if (record > size || size - record < 56 || read32(data + record) != ZIP64_END_OF_DIRECTORY) return false;
+        count = read64(data + record + 32);
+        directorySize = read64(data + record + 40);
+        directoryOffset = read64(data + record + 48);
+    }
+    if (directoryOffset > size || directorySize > size - directoryOffset) return false;
+
+    entries.reserve((size_t)count);
+    const unsigned char* p = data + directoryOffset;
+    const unsigned char* last = p + directorySize;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (p + 46 > last || read32(p) != CENTRAL_HEADER) return false;
+
+        Entry entry;
+        entry.method = read16(p + 10);
+        entry.compressedSize = read32(p + 20);
+        entry.size = read32(p + 24);
+        uint16_t nameLength = read16(p + 28);
+        uint16_t extraLength = read16(p + 30);
+        uint16_t commentLength = read16(p + 32);
+        entry.offset = read32(p + 42);
+        if (p + 46 + nameLength + extraLength + commentLength > last) return false;
+
+        // ZIP64 extra field: the 64-bit values, in order, of the fields
+        // that did not fit
+        const unsigned char* extra = p + 46 + nameLength;
+        const unsigned char* extraEnd = extra + extraLength;
+        while (extra + 4 <= extraEnd) {
+            uint16_t id = read16(extra);
+            uint16_t length = read16(extra + 2);
+            const unsigned char* field = extra + 4;
+            if (id == 0x0001) {
+                if (entry.size == 0xFFFFFFFF && field + 8 <= extraEnd) {
+                    entry.size = read64(field);
+                    field += 8;
+                }
+                if (entry.compressedSize == 0xFFFFFFFF && field + 8 <= extraEnd) {
+                    entry.compressedSize = read64(field);
+                    field += 8;
+                }
+                if (entry.offset == 0xFFFFFFFF && field + 8 <= extraEnd) {
+                    entry.offset = read64(field);
+                }
+            }
+            extra += 4 + length;
+        }
+
+        entries.emplace(std::string((const char*)p + 46, nameLength), entry);
+        p += 46 + nameLength + extraLength + commentLength;
+    }
+    return true;
+}
+
+const ZipArchive::Entry* ZipArchive::find(std::string_view name) const {
+    auto it = entries.find(std::string(name));
+    return (it != entries.end()) ? &it->second : nullptr;
+}
+
+bool ZipArchive::read(const Entry& entry, const Consumer& consumer) const {
+    // Sizes come from the directory and are checked against the mapping
+    // before anything is read
+    const unsigned char* data = file.data();
+    uint64_t size = file.size();
+    if (entry.offset > size || size - entry.offset < 30 || read32(data + entry.offset) != LOCAL_HEADER) return false;
+
+    // The local header repeats the name and has its own extra field
+    uint64_t start = entry.offset + 30 + read16(data + entry.offset + 26) + read16(data + entry.offset + 28);
+    if (start > size || entry.compressedSize > size - start) return false;
+    const unsigned char* input = data + start;
+
+    if (entry.method == 0) {
+        // Stored: the data is the entry, so both sizes must agree
+        if (entry.size != entry.compressedSize) return false;
+        for (uint64_t done = 0; done < entry.size;) {
+            size_t length = (size_t)std::min<uint64_t>((uint64_t)CHUNK_SIZE, entry.size - done);
+            if (!consumer((const char*)input + done, length)) return true;
+            done += length;
+        }
+        return true;
+    }
+    if (entry.method != 8) return false;
+
+    z_stream stream = {};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) return false;     // raw deflate, no zlib header
+
+    std::vector<char> chunk(CHUNK_SIZE);
+    uint64_t remaining = entry.compressedSize;
+    uint64_t written = 0;
+    int status = Z_OK;
+    bool ok = true;
+    while (status != Z_STREAM_END) {
+        if (stream.avail_in == 0) {
+            if (remaining == 0) {
+                ok = false;
+                break;
+            }
+            // avail_in is 32 bits; parts over 4G are fed in slices
+            uInt slice = (uInt)std::min<uint64_t>(remaining, 1u << 30);
+            stream.next_in = (Bytef*)input;
+            stream.avail_in = slice;
+            input += slice;
+            remaining -= slice;
+        }
+
+        stream.next_out = (Bytef*)chunk.data();
+        stream.avail_out = (uInt)chunk.size();
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END) {
+            ok = false;
+            break;
+        }
+
+        // Never more than the directory promised
+        size_t produced = chunk.size() - stream.avail_out;
+        written += produced;
+        if (written > entry.size) {
+            ok = false;
+            break;
+        }
+        if (produced > 0 && !consumer(chunk.data(), produced)) break;
+    }
+    inflateEnd(&stream);
+    return ok;
+}
+
+bool ZipArchive::readAll(std::string_view name, std::string& out) const {
+    out.clear();
+    const Entry* entry = find(name);
+    if (!entry) return false;
+
+    // Deflate expands at most 1032 to 1, so a forged size cannot make this
+    // reserve more than the archive could hold
+    uint64_t limit = std::min<uint64_t>(entry->compressedSize, file.size()) * 1032;
+    out.reserve((size_t)std::min(entry->size, limit));
+    return read(*entry, [&out](const char* data, size_t size) {
+        out.append(data, size);
+        return true;
+    });
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "mappedFile.h"
+
+// Read-only view of a ZIP file, such as an XLSX package. Opening reads the
+// central directory only; a part is inflated when it is read, in chunks
+// handed to the caller, so no part is ever held in memory whole.
+class ZipArchive {
+public:
+    struct Entry {
+        uint64_t offset = 0;            // of the local header
+        uint64_t compressedSize = 0;
+        uint64_t size = 0;
+        uint16_t method = 0;            // 0 stored, 8 deflated
+    };
+
+    // Receives the bytes of a part in order; return false to stop early
+    typedef std::function<bool(const char* data, size_t size)> Consumer;
+
+    // False if the file is missing or is not a ZIP file
+    bool open(const std::string& path);
+
+    void close();
+
+    // Null if there is no such part
+    const Entry* find(std::string_view name) const;
+
+    // Stream the part through consumer; false if it is corrupt or uses a
+    // compression method other than stored or deflated
+    bool read(const Entry& entry, const Consumer& consumer) const;
+
+    // The whole part as a string, for the small ones
+    bool readAll(std::string_view name, std::string& out) const;
+
+    size_t size() const { return entries.size(); }
+
+private:
+    bool readDirectory();
+
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    MappedFile file;
+    std::unordered_map<std::string, Entry> entries;
+};